@@ -56,7 +56,7 @@ public:
     }
 };
 
-Matrix4x4 Mat4x4Translation(float x, float y, float z)
+inline Matrix4x4 Mat4x4Translation(float x, float y, float z)
 {
     Matrix4x4 result;
 
@@ -98,7 +98,7 @@ Matrix4x4 Mat4x4Translation(float x, float y, float z)
 //     return result;
 // }
 
-Matrix4x4 Mat4x4FromAxes(const Vec3 &xAxis, const Vec3 &yAxis, const Vec3 &zAxis)
+inline Matrix4x4 Mat4x4FromAxes(const Vec3 &xAxis, const Vec3 &yAxis, const Vec3 &zAxis)
 {
     Matrix4x4 result;
 
@@ -125,7 +125,7 @@ Matrix4x4 Mat4x4FromAxes(const Vec3 &xAxis, const Vec3 &yAxis, const Vec3 &zAxis
     return result;
 }
 
-Matrix4x4 mat4x4_mul(const Matrix4x4 &A, const Matrix4x4 &B)
+inline Matrix4x4 mat4x4_mul(const Matrix4x4 &A, const Matrix4x4 &B)
 {
     Matrix4x4 result;
 
@@ -1,23 +1,70 @@
 #pragma once 
+#include "bvh_cache.h"
 #include "hittable.h"
 
+#include <cstddef>
 #include <memory>
+#include <utility>
 #include <vector>
 
+class EnvironmentMap;
+
 class Scene{
   public:
     std::vector<std::shared_ptr<Hittable>> objects;
+    // Built by build_bvh(); add(), remove(), replace() and clear() drop it, so edit objects through them
+    std::shared_ptr<const WideBvh> bvh;
+    // LBVH for scenes rebuilt every frame, binned SAH when tracing cost dominates
+    BvhBuilder bvhBuilder = BvhBuilder::BinnedSah;
+    // Lights the scene when set (environment.h); otherwise rays that escape see the sky gradient
+    std::shared_ptr<const EnvironmentMap> environment;
 
     Scene() {}
     Scene(std::shared_ptr<Hittable> object) { add(object); }
 
-    void clear() { objects.clear(); }
+    void clear() {
+        objects.clear();
+        bvh.reset();
+    }
 
     void add(std::shared_ptr<Hittable> object) {
         objects.push_back(object);
+        bvh.reset();
+    }
+
+    // Later objects move down one index
+    void remove(size_t index) {
+        objects.erase(objects.begin() + static_cast<std::ptrdiff_t>(index));
+        bvh.reset();
+    }
+
+    void replace(size_t index, std::shared_ptr<Hittable> object) {
+        objects[index] = std::move(object);
+        bvh.reset();
+    }
+
+    void build_bvh() {
+        std::vector<AABB> bounds;
+        bounds.reserve(objects.size());
+        for (const auto& object : objects)
+            bounds.push_back(object->bounding_box());
+        bvh = std::make_shared<const WideBvh>(build_bvh_cached(bounds, bvhBuilder));
     }
 
     std::optional<HitRecord> hit(const Ray &r, const Range &range) const {
+        if (bvh) {
+            std::optional<HitRecord> res;
+            Range closest = range;
+            bvh->intersect(r, closest, [&](uint32_t slot, const Range& current) -> std::optional<float> {
+                auto rec = objects[bvh->primitive_index(slot)]->hit(r, current);
+                if (!rec)
+                    return std::nullopt;
+                res = rec;
+                return rec->t;
+            });
+            return res;
+        }
+
         std::optional<HitRecord> temp_rec;
         std::optional<HitRecord> res;
         bool hit_anything = false;
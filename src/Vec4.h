@@ -25,7 +25,7 @@ public:
 };
 
 
-Vec4 normalize(const Vec4& v) {
+inline Vec4 normalize(const Vec4& v) {
     float lengthSq = v.x * v.x + v.y * v.y + v.z * v.z + v.w * v.w;
     if (lengthSq > 0.0f) {
         float invLength = 1.0f / sqrt(lengthSq);
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "math.hpp"
+#include "ray.h"
+
+#include <algorithm>
+#include <limits>
+#include <optional>
+
+// Axis-aligned bounding box. Default constructed boxes are empty (min > max) so they can be grown
+// with expand().
+struct AABB
+{
+    Vec3 min{std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(),
+             std::numeric_limits<float>::infinity()};
+    Vec3 max{-std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(),
+             -std::numeric_limits<float>::infinity()};
+
+    AABB() = default;
+    AABB(const Vec3 &_min, const Vec3 &_max) : min(_min), max(_max) {}
+
+    void expand(const Vec3 &p)
+    {
+        min = Vec3(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Vec3(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+
+    // Empty boxes (+inf min, -inf max) leave the box unchanged
+    void expand(const AABB &other)
+    {
+        min = Vec3(std::min(min.x, other.min.x), std::min(min.y, other.min.y), std::min(min.z, other.min.z));
+        max = Vec3(std::max(max.x, other.max.x), std::max(max.y, other.max.y), std::max(max.z, other.max.z));
+    }
+
+    bool empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+
+    Vec3 centroid() const { return (min + max) * 0.5f; }
+
+    Vec3 extent() const { return empty() ? Vec3() : max - min; }
+
+    float surface_area() const
+    {
+        const auto d = extent();
+        return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    int largest_axis() const
+    {
+        const auto d = extent();
+        return d.x >= d.y && d.x >= d.z ? 0 : (d.y >= d.z ? 1 : 2);
+    }
+};
+
+// Distance at which the ray enters the box, if it overlaps it within [tMin, tMax]
+inline std::optional<float> intersect_box(const AABB &box, const Ray &ray, float tMin, float tMax)
+{
+    const auto origin = ray.origin();
+    const auto direction = ray.direction();
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const float inv = 1.f / direction[axis];
+        float t0 = (box.min[axis] - origin[axis]) * inv;
+        float t1 = (box.max[axis] - origin[axis]) * inv;
+        if (inv < 0.f)
+            std::swap(t0, t1);
+        // NaN (origin on a slab plane of a zero direction) keeps the previous bound
+        tMin = t0 > tMin ? t0 : tMin;
+        tMax = t1 < tMax ? t1 : tMax;
+        if (tMax < tMin)
+            return std::nullopt;
+    }
+    return tMin;
+}
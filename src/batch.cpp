@@ -0,0 +1,385 @@
+// Batch renderer: renders one scene from many cameras in a single process. The scene, its BVH and
+// the kernel are built once and the tiles of all views share one worker pool (multiview.h), so a
+// batch costs about its tracing time instead of one process launch and scene build per view.
+//
+// usage: ray_tracing_batch [--scene NAME] [--width N] [--height N] [--spp N] [--seed S]
+//                          [--views FILE] [--turntable N] [--cubemap 0|1] [--stereo D]
+//                          [--out PREFIX] [--format png|exr|ppm] [--environment FILE]
+//                          [--environment-scale S] [--threads N] [--pin 0|1] [--replicate 0|1]
+//                          [--per-view 0|1] [--storage auto|float|half|rgb9e5] [--memory-budget-mb N]
+//
+// Views come from --views FILE, one per line ('#' starts a comment):
+//   name  px py pz  tx ty tz  [fov]      camera at p looking at t, fov in degrees (default: scene's)
+// and from the generators, which start from the scene's camera:
+//   --turntable N   N views orbiting the target about the y axis
+//   --cubemap 1     six 90 degree faces (+x -x +y -y +z -z) around the camera position, square
+//   --stereo D      left and right eyes D apart, parallel axes
+// Without any, the scene's camera alone is rendered. Each view is written to PREFIX + name + the
+// --format extension; exr stores linear radiance. --per-view 1 renders the views one after another
+// with a scene build each, the way separate processes would, and reports both timings.
+//
+// --storage picks the framebuffer format (compact_image.h): float radiance sums, or the running
+// mean in half or RGB9E5 at a half or a third of the memory. auto, the default, takes the most
+// precise format in which the framebuffers of all views fit --memory-budget-mb (no limit when 0).
+
+#include "compact_image.h"
+#include "image.h"
+#include "image_io.h"
+#include "kernel.h"
+#include "multiview.h"
+#include "render.h"
+#include "scenes.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct BatchOptions
+{
+    std::string scene = "random_spheres";
+    int width = 640;
+    int height = 360;
+    int spp = 64;
+    uint64_t seed = default_seed;
+    std::string views;
+    int turntable = 0;
+    bool cubemap = false;
+    float stereo = 0.f;
+    std::string out = "view_";
+    std::string format = "png";
+    std::string environment;
+    float environmentScale = 1.f;
+    RenderSettings render;
+    bool perView = false;
+    std::string storage = "auto";
+    size_t memoryBudget = 0; // bytes of framebuffer over all views, 0 for no limit
+};
+
+struct ViewDefinition
+{
+    std::string name;
+    Vec3 position;
+    Vec3 target;
+    Vec3 up = Vec3(0.f, 1.f, 0.f);
+    float fov;
+    int width;
+    int height;
+};
+
+bool parse_options(int argc, char** argv, BatchOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            std::cerr << "usage: ray_tracing_batch [--option value]... (options: see the top of src/batch.cpp)"
+                      << std::endl;
+            return false;
+        }
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        const std::string value = argv[++i];
+        try
+        {
+            if (arg == "--scene")
+                options.scene = value;
+            else if (arg == "--width")
+                options.width = std::stoi(value);
+            else if (arg == "--height")
+                options.height = std::stoi(value);
+            else if (arg == "--spp")
+                options.spp = std::stoi(value);
+            else if (arg == "--seed")
+                options.seed = std::stoull(value, nullptr, 0);
+            else if (arg == "--views")
+                options.views = value;
+            else if (arg == "--turntable")
+                options.turntable = std::stoi(value);
+            else if (arg == "--cubemap")
+                options.cubemap = value != "0";
+            else if (arg == "--stereo")
+                options.stereo = std::stof(value);
+            else if (arg == "--out")
+                options.out = value;
+            else if (arg == "--format")
+                options.format = value;
+            else if (arg == "--environment")
+                options.environment = value;
+            else if (arg == "--environment-scale")
+                options.environmentScale = std::stof(value);
+            else if (arg == "--threads")
+                options.render.threads = static_cast<unsigned>(std::max(1, std::stoi(value)));
+            else if (arg == "--pin")
+                options.render.pinThreads = value != "0";
+            else if (arg == "--replicate")
+                options.render.replicateScene = value != "0";
+            else if (arg == "--per-view")
+                options.perView = value != "0";
+            else if (arg == "--storage")
+                options.storage = value;
+            else if (arg == "--memory-budget-mb")
+                options.memoryBudget = static_cast<size_t>(std::max(0, std::stoi(value))) << 20;
+            else
+            {
+                std::cerr << "Unknown option " << arg << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception&)
+        {
+            std::cerr << "Bad value for " << arg << ": " << value << std::endl;
+            return false;
+        }
+    }
+    if (options.format != "png" && options.format != "exr" && options.format != "ppm")
+    {
+        std::cerr << "Unknown format " << options.format << std::endl;
+        return false;
+    }
+    if (options.storage != "auto" && !pixel_storage_from_string(options.storage))
+    {
+        std::cerr << "Unknown storage " << options.storage << std::endl;
+        return false;
+    }
+    return options.width > 0 && options.height > 0 && options.spp > 0 && options.turntable >= 0 && options.stereo >= 0.f;
+}
+
+bool read_views(const std::string& filename, const Camera& camera, const BatchOptions& options, std::vector<ViewDefinition>& views)
+{
+    std::ifstream in(filename);
+    if (!in)
+    {
+        std::cerr << "Cannot open " << filename << std::endl;
+        return false;
+    }
+    int lineNumber = 0;
+    for (std::string line; std::getline(in, line);)
+    {
+        ++lineNumber;
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        ViewDefinition view{};
+        if (!(fields >> view.name))
+            continue;
+        if (!(fields >> view.position.x >> view.position.y >> view.position.z >> view.target.x >> view.target.y >> view.target.z))
+        {
+            std::cerr << filename << ":" << lineNumber << ": expected name px py pz tx ty tz [fov]" << std::endl;
+            return false;
+        }
+        if (!(fields >> view.fov))
+            view.fov = camera.get_fov();
+        view.width = options.width;
+        view.height = options.height;
+        views.push_back(view);
+    }
+    return true;
+}
+
+// Views the generators in options derive from the scene's camera
+void generate_views(const Camera& camera, const BatchOptions& options, std::vector<ViewDefinition>& views)
+{
+    const Vec3 position = camera.get_position();
+    const Vec3 target = camera.get_target();
+    const Vec3 up(0.f, 1.f, 0.f);
+    char name[32];
+
+    for (int i = 0; i < options.turntable; ++i)
+    {
+        const float angle = 2.f * 3.14159265f * i / options.turntable;
+        const Vec3 offset = position - target;
+        const Vec3 rotated(offset.x * std::cos(angle) - offset.z * std::sin(angle), offset.y,
+                           offset.x * std::sin(angle) + offset.z * std::cos(angle));
+        std::snprintf(name, sizeof(name), "turntable_%03d", i);
+        views.push_back({name, target + rotated, target, up, camera.get_fov(), options.width, options.height});
+    }
+
+    if (options.cubemap)
+    {
+        struct Face
+        {
+            const char *name;
+            Vec3 direction;
+            Vec3 up;
+        };
+        const Face faces[] = {
+            {"cube_px", Vec3(1.f, 0.f, 0.f), up},  {"cube_nx", Vec3(-1.f, 0.f, 0.f), up},
+            {"cube_py", Vec3(0.f, 1.f, 0.f), Vec3(0.f, 0.f, 1.f)}, {"cube_ny", Vec3(0.f, -1.f, 0.f), Vec3(0.f, 0.f, -1.f)},
+            {"cube_pz", Vec3(0.f, 0.f, 1.f), up},  {"cube_nz", Vec3(0.f, 0.f, -1.f), up},
+        };
+        const int size = options.height;
+        for (const auto &face : faces)
+            views.push_back({face.name, position, position + face.direction, face.up, 90.f, size, size});
+    }
+
+    if (options.stereo > 0.f)
+    {
+        const Vec3 right = unit_vector(cross(target - position, up));
+        const Vec3 half = right * (0.5f * options.stereo);
+        views.push_back({"stereo_left", position - half, target - half, up, camera.get_fov(), options.width, options.height});
+        views.push_back({"stereo_right", position + half, target + half, up, camera.get_fov(), options.width, options.height});
+    }
+}
+
+bool write_view(Image<float, 3>& accum, int spp, const std::string& filename, const std::string& format)
+{
+    if (format == "exr")
+    {
+        average_samples(accum, spp);
+        return save_exr(accum, filename);
+    }
+    Image<char, 3> img(accum.width, accum.height);
+    resolve(accum, spp, img);
+    if (format == "png")
+        return save_png(img, filename);
+    save_ppm(img, filename);
+    return true;
+}
+
+bool write_view(const CompactFramebuffer& framebuffer, const std::string& filename, const std::string& format)
+{
+    if (format == "exr")
+        return save_exr(to_float_image(framebuffer), filename);
+    Image<char, 3> img(framebuffer.width, framebuffer.height);
+    resolve(framebuffer, img);
+    if (format == "png")
+        return save_png(img, filename);
+    save_ppm(img, filename);
+    return true;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class Kernel>
+RenderStats render_batch(const std::vector<RenderView>& views, const Kernel& kernel, const BatchOptions& options)
+{
+    return render_views(views, kernel, 0, options.spp, options.seed, options.render);
+}
+
+int main(int argc, char** argv)
+{
+    BatchOptions options;
+    if (!parse_options(argc, argv, options))
+        return 1;
+
+    const auto setupStart = std::chrono::steady_clock::now();
+    auto description = make_scene(options.scene, float(options.width) / options.height);
+    if (!description)
+    {
+        std::cerr << "Unknown scene " << options.scene << std::endl;
+        return 1;
+    }
+    auto &scene = description->scene;
+
+    TextureCache textureCache(size_t(64) << 20);
+    if (!options.environment.empty())
+    {
+        auto texture = load_tiled_texture(options.environment, textureCache, TextureWrap::Repeat, TextureWrap::Clamp);
+        if (!texture)
+        {
+            std::cerr << "Cannot open environment map " << options.environment << std::endl;
+            return 1;
+        }
+        scene.environment = std::make_shared<const EnvironmentMap>(std::move(*texture), options.environmentScale);
+    }
+
+    std::vector<ViewDefinition> definitions;
+    if (!options.views.empty() && !read_views(options.views, description->camera, options, definitions))
+        return 1;
+    generate_views(description->camera, options, definitions);
+    if (definitions.empty())
+        definitions.push_back({"camera", description->camera.get_position(), description->camera.get_target(),
+                               Vec3(0.f, 1.f, 0.f), description->camera.get_fov(), options.width, options.height});
+
+    size_t pixels = 0;
+    for (const auto &view : definitions)
+        pixels += static_cast<size_t>(view.width) * view.height;
+    const PixelStorage storage = options.storage == "auto" ? choose_pixel_storage(pixels, options.memoryBudget)
+                                                           : *pixel_storage_from_string(options.storage);
+
+    // Float views accumulate radiance sums as render_samples() does, compact ones the mean
+    std::vector<Camera> cameras;
+    std::vector<Image<float, 3>> accums;
+    std::vector<CompactFramebuffer> framebuffers;
+    cameras.reserve(definitions.size());
+    accums.reserve(definitions.size());
+    framebuffers.reserve(definitions.size());
+    for (const auto &view : definitions)
+    {
+        cameras.emplace_back(view.position, view.target, view.up, view.fov, float(view.width) / view.height);
+        if (storage == PixelStorage::Float)
+            accums.emplace_back(view.width, view.height);
+        else
+            framebuffers.emplace_back(view.width, view.height, storage);
+    }
+    std::vector<RenderView> views;
+    for (size_t i = 0; i < definitions.size(); ++i)
+    {
+        if (storage == PixelStorage::Float)
+            views.push_back({&cameras[i], &accums[i]});
+        else
+            views.push_back({&cameras[i], nullptr, &framebuffers[i]});
+    }
+
+    const auto staticKernel = SphereKernel::build(scene);
+    std::optional<DynamicKernel> dynamicKernel;
+    if (!staticKernel)
+        dynamicKernel.emplace(scene, 50);
+    const double setupSeconds = seconds_since(setupStart);
+
+    const auto renderStart = std::chrono::steady_clock::now();
+    const auto stats = staticKernel ? render_batch(views, *staticKernel, options) : render_batch(views, *dynamicKernel, options);
+    const double renderSeconds = seconds_since(renderStart);
+
+    std::printf("%s: %zu views, %d spp, %s kernel, %s\n", options.scene.c_str(), views.size(), options.spp,
+                staticKernel ? "static" : "dynamic", to_string(stats.isa));
+    std::printf("  scene setup %8.3f s (once)\n", setupSeconds);
+    std::printf("  render      %8.3f s, %.3f s per view, %.2f Mrays/s\n", renderSeconds, renderSeconds / views.size(),
+                stats.rays / renderSeconds * 1e-6);
+    std::printf("  framebuffer %s, %.1f MB\n", to_string(storage), double(pixels * pixel_storage_bytes(storage)) / (1 << 20));
+
+    if (options.perView)
+    {
+        // Separate runs per view: scene build, kernel and worker setup each time, tails not overlapped
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < views.size(); ++i)
+        {
+            auto separate = make_scene(options.scene, float(options.width) / options.height);
+            separate->scene.environment = scene.environment;
+            Image<float, 3> accum(definitions[i].width, definitions[i].height);
+            if (const auto kernel = SphereKernel::build(separate->scene))
+                render_samples(cameras[i], *kernel, accum, 0, options.spp, options.seed, options.render);
+            else
+                render_samples(cameras[i], DynamicKernel(separate->scene, 50), accum, 0, options.spp, options.seed, options.render);
+        }
+        const double seconds = seconds_since(start);
+        std::printf("  per view    %8.3f s, %.3f s per view (%.2fx the batch)\n", seconds, seconds / views.size(),
+                    seconds / (setupSeconds + renderSeconds));
+    }
+
+    const std::string extension = "." + options.format;
+    for (size_t i = 0; i < views.size(); ++i)
+    {
+        const std::string filename = options.out + definitions[i].name + extension;
+        const bool written = storage == PixelStorage::Float ? write_view(accums[i], options.spp, filename, options.format)
+                                                            : write_view(framebuffers[i], filename, options.format);
+        if (!written)
+        {
+            std::cerr << "Cannot write " << filename << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
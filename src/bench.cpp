@@ -0,0 +1,876 @@
+// Equal-quality benchmark: renders the canonical scenes with a fixed seed, measures error against a
+// high-spp reference after each doubling of the sample count, and reports the time needed to reach
+// a target error. Faster-but-noisier and slower-but-cleaner builds land on the same axis.
+//
+// usage: ray_tracing_bench [--scenes a,b] [--width N] [--max-spp N] [--reference-spp N]
+//                          [--reference-dir DIR] [--target-rmse E] [--seed S]
+//                          [--kernel static|dynamic] [--order scanline|morton|hilbert]
+//                          [--tile-size N] [--threads N] [--pin 0|1] [--replicate 0|1]
+//                          [--nodes a,b] [--numa-scaling 0|1] [--builder median|lbvh|sah]
+//                          [--build-bench N] [--bvh-cache DIR] [--bvh-cache-mb N]
+//                          [--out-of-core FILE] [--cache-mb N]
+//                          [--chunk-kb N] [--radiance-cache N] [--radiance-cell S]
+//                          [--guiding N] [--isa generic|avx2|avx512] [--raster-primary 0|1]
+//                          [--wavefront 0|1] [--ray-sort off|on|adaptive] [--temporal N]
+//                          [--environment FILE] [--environment-scale S] [--texture-cache-mb N]
+//                          [--incremental N] [--light-tracing off|caustics|all] [--light-paths N]
+//                          [--cost-map PREFIX] [--csv FILE]
+//
+// --build-bench N only builds BVHs over N random spheres with every builder and reports build time
+// next to tree quality (SAH cost). --bvh-cache DIR keeps built trees in DIR, at most --bvh-cache-mb
+// MiB, and maps them back on later runs (bvh_cache.h; RT_BVH_CACHE does the same for every binary). --out-of-core FILE also writes each scene as a chunk file and
+// renders it through a --cache-mb geometry cache, reporting cache statistics and the difference to
+// the in-core render. --radiance-cache N records N spp into a radiance cache first and then measures
+// the cached kernel; the record passes count towards its time. --guiding N trains a path guiding
+// field over N spp in doubling iterations before measuring the guided kernel, likewise timed.
+// --isa caps the instruction set of the hot loops (default: best the CPU supports, see RT_ISA).
+// --raster-primary 1 resolves the first hit of camera samples with the rasterizer, --wavefront 1
+// runs the bounce loop wavefront style with batched material evaluation (both static kernel only);
+// --ray-sort sets whether it reorders secondary rays by origin and direction first (ray_sort.h).
+// --temporal N renders N frames of a slow orbit with temporal reprojection and reports the samples
+// spent per frame and the last frame's error next to a plain render at the same target spp.
+// --environment FILE lights every scene with a lat-long .hdr, .pfm or tiled .rtt map, paged through a
+// --texture-cache-mb tile cache whose statistics are reported per scene.
+// --incremental N renders a frame at --max-spp, then makes N edits (material, move, remove in turn)
+// and re-renders only the tiles each one invalidates, reporting the cost next to the full frame and
+// the error against a full re-render of the edited scene.
+// --light-tracing adds --light-paths light paths per pixel and sample that splat onto the image, for
+// caustics only or for everything first seen on a diffuse surface (light_tracing.h).
+// --guiding, --radiance-cache, --light-tracing, --wavefront and --raster-primary each pick the
+// measured kernel, so at most one of them may be given.
+// --cost-map PREFIX records per-pixel cost in every pass, balances the tiles of later passes by it
+// (cost_map.h) and writes the last pass's cost per sample as PREFIX<scene>_time.png and _rays.png.
+
+#include "image.h"
+#include "bvh_cache.h"
+#include "cost_map.h"
+#include "guiding.h"
+#include "image_io.h"
+#include "incremental.h"
+#include "kernel.h"
+#include "light_tracing.h"
+#include "out_of_core.h"
+#include "perf_counters.h"
+#include "radiance_cache.h"
+#include "raster.h"
+#include "wavefront.h"
+#include "render.h"
+#include "scenes.h"
+#include "temporal.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Part of every reference file name; raised whenever the kernels or the renderer change the image a
+// scene converges to, so references rendered by an older build are not measured against
+constexpr int reference_version = 2;
+
+struct BenchOptions
+{
+    std::vector<std::string> scenes = canonical_scenes;
+    int width = 128;
+    float aspectRatio = 16.0f / 9.0f;
+    int maxSpp = 64;
+    int referenceSpp = 1024;
+    std::string referenceDir = "bench_reference";
+    float targetRmse = 0.02f;
+    uint64_t seed = default_seed;
+    bool dynamicKernel = false;
+    RenderSettings render;
+    bool numaScaling = false;
+    BvhBuilder builder = BvhBuilder::BinnedSah;
+    std::string bvhCache;
+    uint64_t bvhCacheMb = 2048;
+    size_t buildBench = 0;
+    std::string outOfCore;
+    size_t cacheMb = 64;
+    size_t chunkKb = 256;
+    int radianceCacheSpp = 0;
+    float radianceCell = 0.02f;
+    int guidingSpp = 0;
+    bool rasterPrimary = false;
+    bool wavefront = false;
+    RaySorting raySorting = RaySorting::Adaptive;
+    int temporalFrames = 0;
+    std::string environment;
+    float environmentScale = 1.f;
+    size_t textureCacheMb = 64;
+    int incrementalEdits = 0;
+    std::optional<LightPaths> lightTracing;
+    int lightPaths = 1;
+    std::string costMap;
+    std::string csv;
+};
+
+struct ConvergencePoint
+{
+    int spp = 0;
+    double seconds = 0.0;
+    double rmse = 0.0;
+    double relMse = 0.0;
+    // Cumulative over the measured passes; cache misses stay empty without perf counter access
+    uint64_t rays = 0;
+    uint64_t sortedRays = 0;
+    std::optional<uint64_t> cacheMisses = std::nullopt;
+    std::optional<uint64_t> l1dMisses = std::nullopt;
+    IsaLevel isa = IsaLevel::Generic;
+};
+
+// Errors are measured on linear radiance (sum / spp), before gamma and quantization
+ConvergencePoint measure_error(const Image<float, 3>& accum, int spp, const Image<float, 3>& reference)
+{
+    const size_t count = static_cast<size_t>(accum.width) * accum.height * accum.numChannels;
+    double squared = 0.0;
+    double relative = 0.0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const double value = accum.data[i] / spp;
+        const double expected = reference.data[i];
+        const double diff = value - expected;
+        squared += diff * diff;
+        relative += diff * diff / (expected * expected + 1e-2);
+    }
+    return {spp, 0.0, std::sqrt(squared / count), relative / count, 0, 0, std::nullopt, std::nullopt, IsaLevel::Generic};
+}
+
+// Time at which the curve crosses targetRmse, interpolating in log-log space (error ~ t^-1/2 for
+// Monte Carlo). Past the last point the final segment is extrapolated.
+double time_to_error(const std::vector<ConvergencePoint>& curve, double targetRmse, bool& extrapolated)
+{
+    extrapolated = false;
+    if (curve.empty())
+        return 0.0;
+    if (curve.front().rmse <= targetRmse)
+        return curve.front().seconds;
+
+    size_t i = 1;
+    while (i < curve.size() && curve[i].rmse > targetRmse)
+        ++i;
+    if (i == curve.size())
+    {
+        extrapolated = true;
+        if (curve.size() < 2)
+            return curve.back().seconds * std::pow(curve.back().rmse / targetRmse, 2.0);
+        i = curve.size() - 1;
+    }
+
+    const auto &a = curve[i - 1];
+    const auto &b = curve[i];
+    const double slope = (std::log(b.seconds) - std::log(a.seconds)) / (std::log(b.rmse) - std::log(a.rmse));
+    if (!std::isfinite(slope))
+        return b.seconds;
+    return std::exp(std::log(a.seconds) + slope * (std::log(targetRmse) - std::log(a.rmse)));
+}
+
+// Reports the recorded cost and the spread of tile costs it implies, and writes both heatmaps
+void write_cost_maps(const CostMap& costs, const std::string& prefix, const RenderSettings& settings)
+{
+    if (costs.width == 0)
+    {
+        std::printf("  cost map: not recorded by this renderer\n");
+        return;
+    }
+    const int tileSize = settings.tileSize > 0 ? settings.tileSize : default_tile_size();
+    double maxTile = 0.0, sumTiles = 0.0;
+    const auto tiles = make_tiles(costs.width, costs.height, tileSize, settings.order);
+    for (const auto &tile : tiles)
+    {
+        const double cost = costs.predict(tile, 1, nullptr, 0.0);
+        maxTile = std::max(maxTile, cost);
+        sumTiles += cost;
+    }
+    std::printf("  cost map: %.0f ns, %.2f rays per sample; costliest %dpx tile %.1fx the mean\n",
+                costs.mean_cost(CostMetric::Time), costs.mean_cost(CostMetric::Rays), tileSize,
+                maxTile * tiles.size() / std::max(sumTiles, 1e-9));
+
+    Image<char, 3> heatmap(costs.width, costs.height);
+    for (const auto &[metric, suffix] : {std::pair(CostMetric::Time, "_time.png"), std::pair(CostMetric::Rays, "_rays.png")})
+    {
+        cost_heatmap(costs, metric, heatmap);
+        if (!save_png(heatmap, prefix + suffix))
+            std::cerr << "Cannot write " << prefix + suffix << std::endl;
+    }
+}
+
+// The reference is always rendered with referenceKernel, so approximating kernels are measured
+// against the unbiased image. setupSeconds is added to every point of the curve.
+template <class ReferenceKernel, class Kernel>
+std::vector<ConvergencePoint> run_scene(const std::string& name, const SceneDescription& description,
+                                        const ReferenceKernel& referenceKernel, const Kernel& kernel,
+                                        const BenchOptions& options, int height, double setupSeconds = 0.0)
+{
+    namespace fs = std::filesystem;
+
+    // Reference uses an unrelated sample stream so its noise is not correlated with the measured one
+    const uint64_t referenceSeed = options.seed ^ 0x9e3779b97f4a7c15ull;
+    std::ostringstream referenceName;
+    referenceName << name;
+    if (!options.environment.empty())
+        referenceName << "_" << fs::path(options.environment).stem().string();
+    referenceName << "_" << options.width << "x" << height << "_" << options.referenceSpp << "spp_v"
+                  << reference_version << "_" << std::hex << referenceSeed << ".pfm";
+    // Stored as mean linear radiance, so it can be inspected with any PFM viewer
+    const auto referencePath = fs::path(options.referenceDir) / referenceName.str();
+
+    auto reference = load_pfm(referencePath.string());
+    if (!reference || reference->width != options.width || reference->height != height)
+    {
+        std::cout << "  rendering reference (" << options.referenceSpp << " spp) -> " << referencePath.string() << std::endl;
+        reference.emplace(options.width, height);
+        render_samples(description.camera, referenceKernel, *reference, 0, options.referenceSpp, referenceSeed, options.render);
+        average_samples(*reference, options.referenceSpp);
+        fs::create_directories(options.referenceDir);
+        save_pfm(*reference, referencePath.string());
+    }
+    else
+    {
+        std::cout << "  reference: " << referencePath.string() << std::endl;
+    }
+
+    std::vector<ConvergencePoint> curve;
+    Image<float, 3> accum(options.width, height);
+    CostMap costs;
+    RenderSettings settings = options.render;
+    if (!options.costMap.empty())
+        settings.costMap = &costs;
+    PerfCounter cacheCounter(PerfCounter::Event::CacheMisses);
+    PerfCounter l1dCounter(PerfCounter::Event::L1DReadMisses);
+    double seconds = setupSeconds;
+    uint64_t rays = 0;
+    uint64_t sortedRays = 0;
+    std::optional<uint64_t> cacheMisses = cacheCounter.available() ? std::optional<uint64_t>(0) : std::nullopt;
+    std::optional<uint64_t> l1dMisses = l1dCounter.available() ? std::optional<uint64_t>(0) : std::nullopt;
+    int spp = 0;
+    for (int target = 1; target <= options.maxSpp; target *= 2)
+    {
+        cacheCounter.start();
+        l1dCounter.start();
+        const auto start = std::chrono::steady_clock::now();
+        const auto stats = render_samples(description.camera, kernel, accum, spp, target - spp, options.seed, settings);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const auto passCacheMisses = cacheCounter.stop();
+        const auto passL1dMisses = l1dCounter.stop();
+        spp = target;
+        rays += stats.rays;
+        sortedRays += stats.sortedRays;
+        if (cacheMisses && passCacheMisses)
+            *cacheMisses += *passCacheMisses;
+        if (l1dMisses && passL1dMisses)
+            *l1dMisses += *passL1dMisses;
+
+        auto point = measure_error(accum, spp, *reference);
+        point.seconds = seconds;
+        point.rays = rays;
+        point.sortedRays = sortedRays;
+        point.cacheMisses = cacheMisses;
+        point.l1dMisses = l1dMisses;
+        point.isa = stats.isa;
+        curve.push_back(point);
+        std::printf("  %6d spp %10.3f s   rmse %.5f   relMSE %.5f\n", point.spp, point.seconds, point.rmse, point.relMse);
+    }
+
+    const auto &last = curve.back();
+    std::printf("  %llu rays, %.2f Mrays/s (%s)", static_cast<unsigned long long>(last.rays), last.rays / last.seconds * 1e-6,
+                to_string(last.isa));
+    if (last.sortedRays > 0)
+        std::printf(", %.1f%% of rays sorted", 100.0 * last.sortedRays / last.rays);
+    if (last.cacheMisses && last.l1dMisses)
+        std::printf(", %.3f LLC misses/ray, %.3f L1D misses/ray\n", double(*last.cacheMisses) / last.rays,
+                    double(*last.l1dMisses) / last.rays);
+    else
+        std::printf(", cache misses n/a (no perf_event access)\n");
+    if (!options.costMap.empty())
+        write_cost_maps(costs, options.costMap + name, settings);
+    return curve;
+}
+
+// Fills a radiance cache from options.radianceCacheSpp record passes, with their own sample stream,
+// then measures the kernel answering secondary diffuse hits from the cache
+template <class Kernel>
+std::vector<ConvergencePoint> run_scene_cached(const std::string& name, const SceneDescription& description,
+                                               const Kernel& kernel, const BenchOptions& options, int height)
+{
+    RadianceCache cache(description.camera.get_position(), size_t(16) << 20, options.radianceCell);
+    Image<float, 3> scratch(options.width, height);
+    const auto start = std::chrono::steady_clock::now();
+    render_samples(description.camera, CachedKernel<Kernel>(kernel, cache, CachedKernel<Kernel>::Mode::Record), scratch, 0,
+                   options.radianceCacheSpp, options.seed ^ 0x243f6a8885a308d3ull, options.render);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("  radiance cache: %d spp recorded in %.3f s, %zu of %zu cells used (%.1f MiB), %llu samples dropped\n",
+                options.radianceCacheSpp, seconds, cache.used(), cache.capacity(), cache.memory_bytes() / double(1 << 20),
+                static_cast<unsigned long long>(cache.dropped_samples()));
+    return run_scene(name, description, kernel, CachedKernel<Kernel>(kernel, cache, CachedKernel<Kernel>::Mode::Query),
+                     options, height, seconds);
+}
+
+// Trains a guiding field over options.guidingSpp spp in iterations of 1, 2, 4, ... spp, each one
+// sampling with the distributions learned by the previous ones, then measures the guided kernel
+template <class Kernel>
+std::vector<ConvergencePoint> run_scene_guided(const std::string& name, const SceneDescription& description,
+                                               const Kernel& kernel, const BenchOptions& options, int height)
+{
+    using Guided = GuidedKernel<Kernel>;
+    GuidingField field(description.camera.get_position());
+    Image<float, 3> scratch(options.width, height);
+    const uint64_t trainingSeed = options.seed ^ 0x13198a2e03707344ull;
+    const auto start = std::chrono::steady_clock::now();
+    for (int spp = 0, iteration = 1; spp < options.guidingSpp; spp += iteration, iteration *= 2)
+    {
+        const int count = std::min(iteration, options.guidingSpp - spp);
+        render_samples(description.camera, Guided(kernel, field, Guided::Mode::Train), scratch, spp, count, trainingSeed,
+                       options.render);
+        field.update();
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("  guiding: %d spp in %d iterations, %.3f s, %zu of %zu cells trained (%.1f MiB)\n", options.guidingSpp,
+                field.training_iterations(), seconds, field.trained_cells(), field.capacity(),
+                field.memory_bytes() / double(1 << 20));
+    return run_scene(name, description, kernel, Guided(kernel, field, Guided::Mode::Render), options, height, seconds);
+}
+
+// Throughput on the first 1..N NUMA nodes, every core of the used nodes busy. Shows how much each
+// added socket contributes, which is where remote scene reads and placement show up.
+template <class Kernel>
+void report_numa_scaling(const SceneDescription& description, const Kernel& kernel, const BenchOptions& options, int height)
+{
+    const auto &topology = numa_topology();
+    const int spp = std::max(1, options.maxSpp / 4);
+    double singleNode = 0.0;
+    std::printf("  numa scaling (%d spp, pin %s, replicate %s)\n", spp, options.render.pinThreads ? "on" : "off",
+                options.render.replicateScene ? "on" : "off");
+    for (size_t count = 1; count <= topology.size(); ++count)
+    {
+        RenderSettings settings = options.render;
+        settings.nodes.clear();
+        settings.threads = 0;
+        for (size_t node = 0; node < count; ++node)
+        {
+            settings.nodes.push_back(static_cast<int>(node));
+            settings.threads += static_cast<unsigned>(topology[node].cpus.size());
+        }
+
+        Image<float, 3> accum(options.width, height);
+        const auto start = std::chrono::steady_clock::now();
+        const auto stats = render_samples(description.camera, kernel, accum, 0, spp, options.seed, settings);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const double mrays = stats.rays / seconds * 1e-6;
+        if (count == 1)
+            singleNode = mrays;
+        std::printf("  %zu node(s), %3u threads: %8.2f Mrays/s, %.2f Mrays/s per socket, %.0f%% of linear\n", count,
+                    settings.threads, mrays, mrays / count, 100.0 * mrays / (singleNode * count));
+    }
+}
+
+// Build time and tree quality of every builder over count random spheres in a 100-unit cube
+void report_bvh_builds(size_t count, const BenchOptions& options)
+{
+    std::vector<AABB> bounds(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        Sampler sampler(options.seed, 0xfffffffeu, static_cast<uint32_t>(i));
+        const Vec3 center = random_vec3(sampler, 0.f, 100.f);
+        const float radius = random_float(sampler, 0.05f, 0.2f);
+        bounds[i] = {center - Vec3(radius, radius, radius), center + Vec3(radius, radius, radius)};
+    }
+
+    std::printf("%zu spheres, %u threads\n", count, options.render.threads);
+    std::printf("  builder   binary ms  collapse ms   SAH cost  wide KiB\n");
+    for (const auto builder : {BvhBuilder::Median, BvhBuilder::Lbvh, BvhBuilder::BinnedSah})
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const auto binary = build_binary_bvh(bounds, builder, options.render.threads);
+        const auto built = std::chrono::steady_clock::now();
+        const auto wide = WideBvh::from_binary(binary);
+        const auto collapsed = std::chrono::steady_clock::now();
+        std::printf("  %-8s %10.2f %12.2f %10.2f %9.1f\n", to_string(builder),
+                    std::chrono::duration<double, std::milli>(built - start).count(),
+                    std::chrono::duration<double, std::milli>(collapsed - built).count(), binary.sah_cost(),
+                    wide.memory_bytes() / 1024.0);
+    }
+}
+
+// Renders the scene from a chunk file through a bounded geometry cache and compares with the in-core
+// kernel; both use the same samples, so the difference should be zero up to summation order
+void report_out_of_core(const SceneDescription& description, const SphereKernel& kernel, const BenchOptions& options,
+                        int height)
+{
+    if (!write_chunked_scene(options.outOfCore, kernel, options.chunkKb << 10))
+    {
+        std::cerr << "  could not write " << options.outOfCore << std::endl;
+        return;
+    }
+    auto scene = ChunkedScene::open(options.outOfCore);
+    if (!scene)
+    {
+        std::cerr << "  could not read " << options.outOfCore << std::endl;
+        return;
+    }
+
+    const int spp = std::max(1, options.maxSpp / 4);
+    Image<float, 3> inCore(options.width, height);
+    render_samples(description.camera, kernel, inCore, 0, spp, options.seed, options.render);
+
+    ChunkCache cache(*scene, options.cacheMb << 20);
+    Image<float, 3> outOfCore(options.width, height);
+    const auto start = std::chrono::steady_clock::now();
+    const auto stats = render_samples_out_of_core(description.camera, *scene, cache, outOfCore, 0, spp, options.seed,
+                                                  options.render);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!stats)
+    {
+        std::cerr << "  could not read a chunk of " << options.outOfCore << std::endl;
+        return;
+    }
+
+    double maxDiff = 0.0;
+    const size_t count = static_cast<size_t>(options.width) * height * inCore.numChannels;
+    for (size_t i = 0; i < count; ++i)
+        maxDiff = std::max(maxDiff, std::fabs(double(inCore.data[i]) - outOfCore.data[i]) / spp);
+
+    const auto cacheStats = cache.stats();
+    std::printf("  out of core (%d spp, %zu chunks, %zu MiB cache): %.3f s, %.2f Mrays/s, max diff %.2g\n", spp,
+                scene->chunk_count(), options.cacheMb, seconds, stats->rays / seconds * 1e-6, maxDiff);
+    std::printf("  chunk cache: %.1f%% hits, %llu loads, %llu evictions, %.1f MiB read, %.1f ray tests per load\n",
+                100.0 * cacheStats.hit_rate(), static_cast<unsigned long long>(cacheStats.misses),
+                static_cast<unsigned long long>(cacheStats.evictions), cacheStats.bytesRead / double(1 << 20),
+                cacheStats.misses ? double(cacheStats.raysQueued) / cacheStats.misses : 0.0);
+}
+
+// Camera path of --temporal: the scene camera orbiting its target by 0.25 degrees per frame
+Camera orbit_camera(const Camera& camera, int frame, float aspectRatio)
+{
+    const float angle = 0.25f * frame * 3.14159265f / 180.f;
+    const Vec3 offset = camera.get_position() - camera.get_target();
+    const Vec3 rotated(offset.x * std::cos(angle) - offset.z * std::sin(angle), offset.y,
+                       offset.x * std::sin(angle) + offset.z * std::cos(angle));
+    return Camera(camera.get_target() + rotated, camera.get_target(), Vec3(0.f, 1.f, 0.f), camera.get_fov(), aspectRatio);
+}
+
+template <class Kernel>
+void report_temporal(const SceneDescription& description, const Kernel& kernel, const BenchOptions& options, int height)
+{
+    const TemporalSettings settings;
+    TemporalAccumulator temporal(options.width, height, settings);
+    std::printf("  temporal (%d frames, target %d spp)\n", options.temporalFrames, settings.targetSamples);
+    const int pixels = options.width * height;
+    double seconds = 0.0;
+    uint64_t samples = 0;
+    for (int frame = 0; frame < options.temporalFrames; ++frame)
+    {
+        const auto camera = orbit_camera(description.camera, frame, options.aspectRatio);
+        const auto start = std::chrono::steady_clock::now();
+        const auto stats = temporal.render_frame(camera, kernel, options.seed + frame * 0x9e3779b97f4a7c15ull, options.render);
+        const double frameSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        seconds += frameSeconds;
+        samples += stats.samples;
+        std::printf("  frame %3d %8.3f s  %6.2f spp  %5.1f%% reprojected  %5.1f%% disoccluded  %5.1f%% off screen\n", frame,
+                    frameSeconds, double(stats.samples) / pixels, 100.0 * stats.reprojected / pixels,
+                    100.0 * stats.disoccluded / pixels, 100.0 * stats.offscreen / pixels);
+    }
+
+    // Error of the last frame against a reference, next to a plain render with the full target
+    const auto camera = orbit_camera(description.camera, options.temporalFrames - 1, options.aspectRatio);
+    Image<float, 3> reference(options.width, height);
+    render_samples(camera, kernel, reference, 0, options.referenceSpp, options.seed ^ 0x9e3779b97f4a7c15ull, options.render);
+    average_samples(reference, options.referenceSpp);
+    Image<float, 3> plain(options.width, height);
+    render_samples(camera, kernel, plain, 0, settings.targetSamples, options.seed, options.render);
+    const auto temporalError = measure_error(temporal.radiance(), 1, reference);
+    const auto plainError = measure_error(plain, settings.targetSamples, reference);
+    std::printf("  %.3f s for %d frames, %.1f%% of the samples of %d spp per frame; last frame rmse %.5f "
+                "(%d spp per frame: %.5f)\n",
+                seconds, options.temporalFrames, 100.0 * samples / (double(pixels) * settings.targetSamples * options.temporalFrames),
+                settings.targetSamples, temporalError.rmse, settings.targetSamples, plainError.rmse);
+}
+
+// Edits the scene in place
+void report_incremental(SceneDescription& description, const BenchOptions& options, int height)
+{
+    IncrementalSettings settings;
+    settings.samples = options.maxSpp;
+    Scene &scene = description.scene;
+    IncrementalRenderer renderer(scene, description.camera, options.width, height, settings, options.seed, options.render);
+    const auto start = std::chrono::steady_clock::now();
+    renderer.render();
+    const double fullSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("  incremental (%d spp, %d px tiles): full frame %.3f s\n", settings.samples, settings.tileSize, fullSeconds);
+
+    Sampler picker(options.seed, 0xfffffffeu, 0);
+    for (int edit = 0; edit < options.incrementalEdits && scene.objects.size() > 1; ++edit)
+    {
+        // Any object but the ground
+        const size_t index = 1 + std::min(scene.objects.size() - 2, static_cast<size_t>(picker.next() * (scene.objects.size() - 1)));
+        const char *kind = "material";
+        if (edit % 3 == 0)
+        {
+            const float r = picker.next();
+            const float g = picker.next();
+            renderer.set_material(index, std::make_shared<lambertian>(Color(r, g, picker.next())));
+        }
+        else if (const auto sphere = std::dynamic_pointer_cast<Sphere>(scene.objects[index]); sphere && edit % 3 == 1)
+        {
+            kind = "move";
+            renderer.move(index, sphere->center() + Vec3(0.f, 0.3f, 0.f));
+        }
+        else
+        {
+            kind = "remove";
+            renderer.remove(index);
+        }
+
+        const auto editStart = std::chrono::steady_clock::now();
+        const auto stats = renderer.update();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - editStart).count();
+
+        // Same samples over the whole frame: the difference is what the invalidation policy missed
+        Image<float, 3> full(options.width, height);
+        if (const auto kernel = SphereKernel::build(scene))
+            render_samples(description.camera, *kernel, full, 0, settings.samples, options.seed, options.render);
+        else
+            render_samples(description.camera, DynamicKernel(scene, 50), full, 0, settings.samples, options.seed, options.render);
+        average_samples(full, settings.samples);
+        const auto error = measure_error(renderer.radiance_sums(), settings.samples, full);
+        std::printf("  edit %2d %-8s %5.1f%% of tiles, %8.3f s (%5.1f%% of the full frame), rmse to full re-render %.5f\n",
+                    edit, kind, 100.0 * stats.dirtyTiles / stats.tiles, seconds, 100.0 * seconds / fullSeconds, error.rmse);
+    }
+}
+
+bool parse_options(int argc, char** argv, BenchOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            std::cerr << "usage: ray_tracing_bench [--option value]... (options: see the top of src/bench.cpp)"
+                      << std::endl;
+            return false;
+        }
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        const std::string value = argv[++i];
+        try
+        {
+            if (arg == "--scenes")
+            {
+                options.scenes.clear();
+                std::istringstream list(value);
+                for (std::string name; std::getline(list, name, ',');)
+                    options.scenes.push_back(name);
+            }
+            else if (arg == "--width")
+                options.width = std::stoi(value);
+            else if (arg == "--max-spp")
+                options.maxSpp = std::stoi(value);
+            else if (arg == "--reference-spp")
+                options.referenceSpp = std::stoi(value);
+            else if (arg == "--reference-dir")
+                options.referenceDir = value;
+            else if (arg == "--target-rmse")
+                options.targetRmse = std::stof(value);
+            else if (arg == "--seed")
+                options.seed = std::stoull(value, nullptr, 0);
+            else if (arg == "--kernel")
+                options.dynamicKernel = value == "dynamic";
+            else if (arg == "--order")
+                options.render.order = traversal_order_from_string(value);
+            else if (arg == "--tile-size")
+                options.render.tileSize = std::stoi(value);
+            else if (arg == "--threads")
+                options.render.threads = static_cast<unsigned>(std::max(1, std::stoi(value)));
+            else if (arg == "--pin")
+                options.render.pinThreads = value != "0";
+            else if (arg == "--replicate")
+                options.render.replicateScene = value != "0";
+            else if (arg == "--nodes")
+            {
+                options.render.nodes.clear();
+                std::istringstream list(value);
+                for (std::string node; std::getline(list, node, ',');)
+                    options.render.nodes.push_back(std::stoi(node));
+            }
+            else if (arg == "--numa-scaling")
+                options.numaScaling = value != "0";
+            else if (arg == "--builder")
+                options.builder = bvh_builder_from_string(value);
+            else if (arg == "--bvh-cache")
+                options.bvhCache = value;
+            else if (arg == "--bvh-cache-mb")
+                options.bvhCacheMb = std::stoull(value);
+            else if (arg == "--build-bench")
+                options.buildBench = std::stoull(value);
+            else if (arg == "--out-of-core")
+                options.outOfCore = value;
+            else if (arg == "--cache-mb")
+                options.cacheMb = std::stoull(value);
+            else if (arg == "--chunk-kb")
+                options.chunkKb = std::max<size_t>(4, std::stoull(value));
+            else if (arg == "--radiance-cache")
+                options.radianceCacheSpp = std::stoi(value);
+            else if (arg == "--radiance-cell")
+                options.radianceCell = std::stof(value);
+            else if (arg == "--guiding")
+                options.guidingSpp = std::stoi(value);
+            else if (arg == "--isa")
+            {
+                const auto isa = isa_level_from_string(value);
+                if (!isa)
+                {
+                    std::cerr << "Unknown instruction set " << value << std::endl;
+                    return false;
+                }
+                if (set_isa(*isa) != *isa)
+                    std::cerr << "CPU lacks " << value << ", using " << to_string(active_isa()) << std::endl;
+            }
+            else if (arg == "--raster-primary")
+                options.rasterPrimary = value != "0";
+            else if (arg == "--wavefront")
+                options.wavefront = value != "0";
+            else if (arg == "--ray-sort")
+                options.raySorting = ray_sorting_from_string(value);
+            else if (arg == "--temporal")
+                options.temporalFrames = std::stoi(value);
+            else if (arg == "--environment")
+                options.environment = value;
+            else if (arg == "--environment-scale")
+                options.environmentScale = std::stof(value);
+            else if (arg == "--texture-cache-mb")
+                options.textureCacheMb = std::stoull(value);
+            else if (arg == "--incremental")
+                options.incrementalEdits = std::stoi(value);
+            else if (arg == "--light-tracing")
+            {
+                if (value == "caustics")
+                    options.lightTracing = LightPaths::Caustics;
+                else if (value == "all")
+                    options.lightTracing = LightPaths::All;
+                else if (value != "off")
+                {
+                    std::cerr << "Unknown light tracing mode " << value << std::endl;
+                    return false;
+                }
+            }
+            else if (arg == "--light-paths")
+                options.lightPaths = std::stoi(value);
+            else if (arg == "--cost-map")
+                options.costMap = value;
+            else if (arg == "--csv")
+                options.csv = value;
+            else
+            {
+                std::cerr << "Unknown option " << arg << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception&)
+        {
+            std::cerr << "Bad value for " << arg << ": " << value << std::endl;
+            return false;
+        }
+    }
+    // Each of these replaces the measured kernel; none wraps another
+    const int modes = (options.guidingSpp > 0) + (options.radianceCacheSpp > 0) + options.lightTracing.has_value() +
+                      options.wavefront + options.rasterPrimary;
+    if (modes > 1)
+    {
+        std::cerr << "--guiding, --radiance-cache, --light-tracing, --wavefront and --raster-primary cannot be combined"
+                  << std::endl;
+        return false;
+    }
+    // Chunk files hold no environment map, and its next-event estimation would need shadow rays
+    // traced through the chunks
+    if (!options.outOfCore.empty() && !options.environment.empty())
+    {
+        std::cerr << "--out-of-core does not support --environment" << std::endl;
+        return false;
+    }
+    for (const int node : options.render.nodes)
+    {
+        if (node < 0 || node >= static_cast<int>(numa_topology().size()))
+        {
+            std::cerr << "No NUMA node " << node << std::endl;
+            return false;
+        }
+    }
+    return options.width > 0 && options.maxSpp > 0 && options.referenceSpp > 0 && options.targetRmse > 0.f &&
+           options.radianceCacheSpp >= 0 && options.radianceCell > 0.f && options.guidingSpp >= 0 && options.temporalFrames >= 0 &&
+           options.incrementalEdits >= 0 && options.lightPaths > 0;
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions options;
+    if (!parse_options(argc, argv, options))
+        return 1;
+    if (!options.bvhCache.empty())
+        set_default_bvh_cache(std::make_shared<BvhCache>(options.bvhCache, options.bvhCacheMb << 20));
+
+    if (options.buildBench > 0)
+    {
+        report_bvh_builds(options.buildBench, options);
+        return 0;
+    }
+
+    const int height = std::max(1, static_cast<int>(options.width / options.aspectRatio));
+
+    std::ofstream csv;
+    if (!options.csv.empty())
+    {
+        csv.open(options.csv);
+        csv << "scene,kernel,order,tile_size,threads,spp,seconds,rmse,relmse,rays,llc_misses,l1d_misses,isa\n";
+    }
+
+    // One tile cache for every texture, so the memory bound holds however many maps are open
+    TextureCache textureCache(options.textureCacheMb << 20);
+    std::shared_ptr<const EnvironmentMap> environment;
+    if (!options.environment.empty())
+    {
+        auto texture = load_tiled_texture(options.environment, textureCache, TextureWrap::Repeat, TextureWrap::Clamp);
+        if (!texture)
+        {
+            std::cerr << "Cannot open environment map " << options.environment << std::endl;
+            return 1;
+        }
+        environment = std::make_shared<const EnvironmentMap>(std::move(*texture), options.environmentScale);
+    }
+
+    for (const auto &name : options.scenes)
+    {
+        auto description = make_scene(name, options.aspectRatio);
+        if (!description)
+        {
+            std::cerr << "Unknown scene " << name << std::endl;
+            return 1;
+        }
+        description->scene.environment = environment;
+        const auto bvhCache = default_bvh_cache();
+        const uint64_t cacheHits = bvhCache ? bvhCache->stats().hits : 0;
+        const auto buildStart = std::chrono::steady_clock::now();
+        description->scene.bvhBuilder = options.builder;
+        description->scene.build_bvh();
+        const double buildMs =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+        const char *cacheResult = !bvhCache ? "" : bvhCache->stats().hits > cacheHits ? ", cache hit" : ", cache miss";
+
+        std::vector<ConvergencePoint> curve;
+        const auto staticKernel = options.dynamicKernel ? std::nullopt : SphereKernel::build(description->scene);
+        const char *kernelName = staticKernel ? "static" : "dynamic";
+        const int tileSize = options.render.tileSize > 0 ? options.render.tileSize : default_tile_size();
+        std::cout << name << " " << options.width << "x" << height << " (" << kernelName << " kernel, "
+                  << to_string(options.render.order) << " " << tileSize << "px tiles, " << options.render.threads
+                  << " threads" << (options.render.pinThreads ? ", pinned" : "")
+                  << (options.render.replicateScene ? ", replicated" : "") << ")" << std::endl;
+        const DynamicKernel dynamicKernel(description->scene, 50);
+        if (const WideBvh *bvh = staticKernel ? &staticKernel->acceleration() : description->scene.bvh.get())
+            std::printf("  bvh (%s, %.2f ms%s): %zu primitives, %zu nodes, %.1f KiB (binary float-box BVH: %.1f KiB)\n",
+                        to_string(options.builder), buildMs, cacheResult, bvh->primitive_count(), bvh->node_count(),
+                        bvh->memory_bytes() / 1024.0, bvh->binary_memory_bytes() / 1024.0);
+        if (options.guidingSpp > 0)
+        {
+            if (staticKernel)
+                curve = run_scene_guided(name, *description, *staticKernel, options, height);
+            else
+                curve = run_scene_guided(name, *description, dynamicKernel, options, height);
+        }
+        else if (options.radianceCacheSpp > 0)
+        {
+            if (staticKernel)
+                curve = run_scene_cached(name, *description, *staticKernel, options, height);
+            else
+                curve = run_scene_cached(name, *description, dynamicKernel, options, height);
+        }
+        else if (options.lightTracing)
+        {
+            LightTracingSettings lights;
+            lights.paths = *options.lightTracing;
+            lights.lightPaths = options.lightPaths;
+            lights.focus = light_focus(description->scene, lights.paths);
+            if (staticKernel)
+                curve = run_scene(name, *description, *staticKernel, LightTracing<SphereKernel>{*staticKernel, lights},
+                                  options, height);
+            else
+                curve = run_scene(name, *description, dynamicKernel, LightTracing<DynamicKernel>{dynamicKernel, lights},
+                                  options, height);
+        }
+        else if (staticKernel && options.wavefront)
+            curve = run_scene(name, *description, *staticKernel,
+                              WavefrontShading<SphereKernel>{*staticKernel, options.raySorting}, options, height);
+        else if (staticKernel && options.rasterPrimary)
+            curve = run_scene(name, *description, *staticKernel, RasterizedPrimary<SphereKernel>{*staticKernel}, options,
+                              height);
+        else if (staticKernel)
+            curve = run_scene(name, *description, *staticKernel, *staticKernel, options, height);
+        else
+        {
+            if (options.wavefront || options.rasterPrimary)
+                std::cout << "  " << (options.wavefront ? "--wavefront" : "--raster-primary")
+                          << " needs the static kernel, measuring the dynamic kernel" << std::endl;
+            curve = run_scene(name, *description, dynamicKernel, dynamicKernel, options, height);
+        }
+
+        bool extrapolated = false;
+        const double seconds = time_to_error(curve, options.targetRmse, extrapolated);
+        std::printf("  time to rmse %.4f: %.3f s%s\n", options.targetRmse, seconds, extrapolated ? " (extrapolated)" : "");
+        if (environment)
+        {
+            const auto textureStats = textureCache.stats();
+            std::printf("  texture cache: %.2f%% hits, %llu tile loads, %llu evictions, %.1f of %.1f MiB resident\n",
+                        100.0 * textureStats.hit_rate(), static_cast<unsigned long long>(textureStats.misses),
+                        static_cast<unsigned long long>(textureStats.evictions), textureCache.resident_bytes() / 1048576.0,
+                        textureCache.capacity_bytes() / 1048576.0);
+        }
+
+        if (options.numaScaling)
+        {
+            if (staticKernel)
+                report_numa_scaling(*description, *staticKernel, options, height);
+            else
+                report_numa_scaling(*description, dynamicKernel, options, height);
+        }
+
+        if (options.temporalFrames > 0)
+        {
+            if (staticKernel)
+                report_temporal(*description, *staticKernel, options, height);
+            else
+                report_temporal(*description, dynamicKernel, options, height);
+        }
+
+        if (options.incrementalEdits > 0)
+            report_incremental(*description, options, height);
+
+        if (!options.outOfCore.empty())
+        {
+            if (staticKernel)
+                report_out_of_core(*description, *staticKernel, options, height);
+            else
+                std::cout << "  out of core needs the static kernel" << std::endl;
+        }
+
+        if (csv)
+        {
+            auto optional_count = [](const std::optional<uint64_t> &count) {
+                return count ? std::to_string(*count) : std::string();
+            };
+            for (const auto &point : curve)
+                csv << name << "," << kernelName << "," << to_string(options.render.order) << "," << tileSize << ","
+                    << options.render.threads << "," << point.spp << "," << point.seconds << "," << point.rmse << ","
+                    << point.relMse << "," << point.rays << "," << optional_count(point.cacheMisses) << ","
+                    << optional_count(point.l1dMisses) << "," << to_string(point.isa) << "\n";
+        }
+    }
+    return 0;
+}
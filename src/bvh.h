@@ -0,0 +1,479 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh_build.h"
+#include "hittable.h"
+#include "ray.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RT_BVH_SSE 1
+#endif
+
+// Bounding volume hierarchy over primitive bounds. A binary tree is built first (bvh_build.h) and then collapsed
+// into a 4-wide tree whose nodes take one cache line each: a node stores its own box as an origin
+// and a power-of-two grid step per axis, and the boxes of its four children as 8-bit grid offsets,
+// rounded outwards. Traversal decodes and slab-tests all four children at once (SSE, with a scalar
+// fallback) and pushes the hit children far-to-near so the nearest one is visited first.
+
+struct alignas(64) WideBvhNode
+{
+    float origin[3];      // minimum corner of the node box
+    int8_t exponent[3];   // grid step per axis is 2^exponent
+    uint8_t childCount;
+    uint8_t lo[3][4];     // child box minimum per axis, in grid steps from origin (rounded down)
+    uint8_t hi[3][4];     // child box maximum (rounded up)
+    uint32_t child[4];    // node index for inner children, first primitive slot for leaves
+    uint8_t leafCount[4]; // primitives in a leaf child, 0 for inner children
+};
+static_assert(sizeof(WideBvhNode) == 64, "wide BVH nodes should fill exactly one cache line");
+
+class WideBvh
+{
+public:
+    WideBvh() = default;
+    WideBvh(WideBvh &&) = default;
+    WideBvh &operator=(WideBvh &&) = default;
+
+    // A copy owns its nodes even when the source points into storage: scene replicas are copied on
+    // the NUMA node that traverses them, and sharing a mapping would leave every replica reading the
+    // pages of whichever node faulted them in first
+    WideBvh(const WideBvh &other)
+        : nodes(other.node_data().begin(), other.node_data().end()), binaryNodes(other.binaryNodes),
+          primitives(other.primitives), subtrees(other.subtrees)
+    {
+        if (other.storedOrder)
+            order.assign(other.storedOrder, other.storedOrder + other.primitives);
+        else
+            order = other.order;
+    }
+
+    WideBvh &operator=(const WideBvh &other)
+    {
+        if (this != &other)
+            *this = WideBvh(other);
+        return *this;
+    }
+
+    static WideBvh build(const std::vector<AABB> &bounds, BvhBuilder builder = BvhBuilder::BinnedSah,
+                         unsigned threads = worker_count())
+    {
+        return from_binary(build_binary_bvh(bounds, builder, threads));
+    }
+
+    static WideBvh from_binary(const BinaryBvh &binary)
+    {
+        WideBvh bvh;
+        bvh.order = binary.primitiveOrder;
+        bvh.binaryNodes = binary.nodes.size();
+        bvh.primitives = binary.primitiveOrder.size();
+        if (binary.nodes.empty())
+            return bvh;
+
+        // Primitive range under every binary node; children come after their parent, so one reverse
+        // pass sees them first
+        bvh.subtrees.resize(binary.nodes.size());
+        for (size_t i = binary.nodes.size(); i-- > 0;)
+        {
+            const auto &node = binary.nodes[i];
+            if (node.count > 0)
+                bvh.subtrees[i] = {node.first, node.count};
+            else
+                bvh.subtrees[i] = {bvh.subtrees[node.left].first,
+                                   bvh.subtrees[node.left].count + bvh.subtrees[node.right].count};
+        }
+
+        const auto &root = binary.nodes[0];
+        if (bvh.is_leaf(binary, 0))
+        {
+            // Single leaf: wrap it so traversal always starts at an inner node
+            if (bvh.subtrees[0].count > max_leaf_count)
+            {
+                bvh.split_leaf(root.bounds, bvh.subtrees[0].first, bvh.subtrees[0].count);
+            }
+            else
+            {
+                WideBvhNode node{};
+                quantize(node, root.bounds, &root.bounds, 1);
+                node.child[0] = bvh.subtrees[0].first;
+                node.leafCount[0] = static_cast<uint8_t>(bvh.subtrees[0].count);
+                bvh.nodes.push_back(node);
+            }
+        }
+        else
+        {
+            bvh.nodes.reserve(binary.nodes.size() / 4);
+            bvh.collapse(binary, 0);
+        }
+        bvh.subtrees = {};
+        return bvh;
+    }
+
+    // Whether nodes, as read back from disk, are safe to traverse over primitives slots: child counts,
+    // child indices and leaf ranges in bounds, and no deeper than the traversal stack allows. Builders
+    // place children after their parent, so requiring that also rules out cycles.
+    static bool valid_nodes(std::span<const WideBvhNode> nodes, size_t primitives)
+    {
+        std::vector<uint8_t> depth(nodes.size(), 0);
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            const auto &node = nodes[i];
+            if (node.childCount > 4)
+                return false;
+            for (int c = 0; c < node.childCount; ++c)
+            {
+                if (node.leafCount[c] > 0)
+                {
+                    if (uint64_t(node.child[c]) + node.leafCount[c] > primitives)
+                        return false;
+                    continue;
+                }
+                if (node.child[c] <= i || node.child[c] >= nodes.size() || depth[i] >= bvh_max_depth)
+                    return false;
+                depth[node.child[c]] = std::max<uint8_t>(depth[node.child[c]], depth[i] + 1);
+            }
+        }
+        return true;
+    }
+
+    // Rebuilds a tree from node_data(), e.g. after reading it back from disk; check the nodes with
+    // valid_nodes() first when they may be damaged
+    static WideBvh from_nodes(std::vector<WideBvhNode> nodes, size_t primitives)
+    {
+        WideBvh bvh;
+        bvh.nodes = std::move(nodes);
+        bvh.primitives = primitives;
+        return bvh;
+    }
+
+    // A tree whose nodes and primitive order stay in memory owned by storage, e.g. a mapped cache file
+    // (bvh_cache.h); moves keep pointing into the storage, copies get their own nodes
+    static WideBvh from_memory(std::shared_ptr<const void> storage, const WideBvhNode *nodes, size_t nodeCount,
+                               const uint32_t *order, size_t primitives, size_t binaryNodes)
+    {
+        WideBvh bvh;
+        bvh.storage = std::move(storage);
+        bvh.storedNodes = std::span<const WideBvhNode>(nodes, nodeCount);
+        bvh.storedOrder = order;
+        bvh.primitives = primitives;
+        bvh.binaryNodes = binaryNodes;
+        return bvh;
+    }
+
+    std::span<const WideBvhNode> node_data() const { return storage ? storedNodes : std::span<const WideBvhNode>(nodes); }
+    size_t node_count() const { return node_data().size(); }
+    size_t memory_bytes() const { return node_count() * sizeof(WideBvhNode); }
+    // Size of the binary tree it was collapsed from, at 32 bytes per float-box node
+    size_t binary_memory_bytes() const { return binaryNodes * 32; }
+    size_t binary_node_count() const { return binaryNodes; }
+    size_t primitive_count() const { return primitives; }
+
+    // Leaves refer to primitives by slot; slot i holds primitive primitive_index(i) of the input
+    uint32_t primitive_index(uint32_t slot) const { return storedOrder ? storedOrder[slot] : order[slot]; }
+
+    // For callers that reorder their primitives into slot order; primitive_index() is unusable after
+    std::vector<uint32_t> release_primitive_order()
+    {
+        if (storedOrder)
+        {
+            const uint32_t *stored = std::exchange(storedOrder, nullptr);
+            return std::vector<uint32_t>(stored, stored + primitives);
+        }
+        return std::move(order);
+    }
+
+    // Closest hit: hitPrimitive(slot, range) returns the hit distance within range, if any. Returns
+    // the slot of the closest hit and narrows range.end to its distance.
+    template <class F>
+    std::optional<uint32_t> intersect(const Ray &ray, Range &range, F &&hitPrimitive) const
+    {
+        const WideBvhNode *nodeData = node_data().data();
+        if (node_count() == 0)
+            return std::nullopt;
+
+        const auto origin = ray.origin();
+        const auto direction = ray.direction();
+        float rayOrigin[3] = {origin.x, origin.y, origin.z};
+        float invDirection[3];
+        bool negative[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // Keep the reciprocal finite so 0 * inf never turns a slab distance into NaN
+            float d = direction[axis];
+            if (std::fabs(d) < 1e-20f)
+                d = std::copysign(1e-20f, d);
+            invDirection[axis] = 1.f / d;
+            negative[axis] = invDirection[axis] < 0.f;
+        }
+
+        struct Entry
+        {
+            uint32_t child;
+            uint32_t leafCount;
+            float tNear;
+        };
+        Entry stack[3 * bvh_max_depth + 4];
+        int top = 0;
+        stack[top++] = {0, 0, range.start};
+
+        std::optional<uint32_t> closest;
+        while (top > 0)
+        {
+            const auto entry = stack[--top];
+            if (entry.tNear > range.end)
+                continue;
+
+            if (entry.leafCount > 0)
+            {
+                for (uint32_t slot = entry.child; slot < entry.child + entry.leafCount; ++slot)
+                {
+                    if (const auto t = hitPrimitive(slot, range))
+                    {
+                        range.end = *t;
+                        closest = slot;
+                    }
+                }
+                continue;
+            }
+
+            const auto &node = nodeData[entry.child];
+            float tNear[4];
+            const int mask = intersect_children(node, rayOrigin, invDirection, negative, range, tNear);
+
+            // Push hit children far to near so the nearest is popped first
+            int sorted[4];
+            int hits = 0;
+            for (int i = 0; i < node.childCount; ++i)
+            {
+                if (!(mask & (1 << i)))
+                    continue;
+                int j = hits++;
+                for (; j > 0 && tNear[sorted[j - 1]] < tNear[i]; --j)
+                    sorted[j] = sorted[j - 1];
+                sorted[j] = i;
+            }
+            for (int k = 0; k < hits; ++k)
+            {
+                const int i = sorted[k];
+                stack[top++] = {node.child[i], node.leafCount[i], tNear[i]};
+            }
+        }
+        return closest;
+    }
+
+private:
+    static float grid_step(int8_t exponent)
+    {
+        const uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+        float step;
+        std::memcpy(&step, &bits, sizeof(step));
+        return step;
+    }
+
+    static void quantize(WideBvhNode &node, const AABB &box, const AABB *children, int count)
+    {
+        node.childCount = static_cast<uint8_t>(count);
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const float origin = box.min[axis];
+            const float extent = box.max[axis] - origin;
+            int exponent = -126;
+            if (extent > 0.f)
+            {
+                std::frexp(extent / 255.f, &exponent);
+                exponent = std::clamp(exponent, -126, 127);
+                while (exponent < 127 && origin + 255.f * grid_step(static_cast<int8_t>(exponent)) < box.max[axis])
+                    ++exponent;
+            }
+            node.origin[axis] = origin;
+            node.exponent[axis] = static_cast<int8_t>(exponent);
+
+            const float step = grid_step(node.exponent[axis]);
+            for (int i = 0; i < 4; ++i)
+            {
+                if (i >= count)
+                {
+                    node.lo[axis][i] = 0;
+                    node.hi[axis][i] = 0;
+                    continue;
+                }
+                int lo = std::clamp(static_cast<int>(std::floor((children[i].min[axis] - origin) / step)), 0, 255);
+                while (lo > 0 && origin + lo * step > children[i].min[axis])
+                    --lo;
+                int hi = std::clamp(static_cast<int>(std::ceil((children[i].max[axis] - origin) / step)), 0, 255);
+                while (hi < 255 && origin + hi * step < children[i].max[axis])
+                    ++hi;
+                node.lo[axis][i] = static_cast<uint8_t>(lo);
+                node.hi[axis][i] = static_cast<uint8_t>(hi);
+            }
+        }
+    }
+
+    // Largest leaf a WideBvhNode can refer to
+    static constexpr uint32_t max_leaf_count = std::numeric_limits<uint8_t>::max();
+
+    // Binary leaves, whatever their size, and subtrees with at most bvh_max_leaf_size primitives
+    bool is_leaf(const BinaryBvh &binary, uint32_t index) const
+    {
+        return binary.nodes[index].count > 0 || subtrees[index].count <= bvh_max_leaf_size;
+    }
+
+    // Node over a leaf too large for one leafCount: up to four runs of its primitives, each a leaf
+    // or split again, all with the leaf's box. Builders only leave such leaves at bvh_max_depth.
+    uint32_t split_leaf(const AABB &bounds, uint32_t first, uint32_t count)
+    {
+        const auto slot = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        const uint32_t run = (count + 3) / 4;
+        const AABB boxes[4] = {bounds, bounds, bounds, bounds};
+        WideBvhNode node{};
+        const int children = static_cast<int>((count + run - 1) / run);
+        quantize(node, bounds, boxes, children);
+        for (int i = 0; i < children; ++i)
+        {
+            const uint32_t begin = first + i * run;
+            const uint32_t size = std::min(run, first + count - begin);
+            if (size > max_leaf_count)
+            {
+                node.child[i] = split_leaf(bounds, begin, size);
+            }
+            else
+            {
+                node.child[i] = begin;
+                node.leafCount[i] = static_cast<uint8_t>(size);
+            }
+        }
+        nodes[slot] = node;
+        return slot;
+    }
+
+    // Pulls in the largest grandchildren until the node has four children
+    uint32_t collapse(const BinaryBvh &binary, uint32_t index)
+    {
+        uint32_t children[4] = {binary.nodes[index].left, binary.nodes[index].right};
+        int count = 2;
+        while (count < 4)
+        {
+            int largest = -1;
+            float largestArea = -1.f;
+            for (int i = 0; i < count; ++i)
+            {
+                const auto &child = binary.nodes[children[i]];
+                if (!is_leaf(binary, children[i]) && child.bounds.surface_area() > largestArea)
+                {
+                    largest = i;
+                    largestArea = child.bounds.surface_area();
+                }
+            }
+            if (largest < 0)
+                break;
+            const auto &child = binary.nodes[children[largest]];
+            children[largest] = child.left;
+            children[count++] = child.right;
+        }
+
+        const auto slot = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        WideBvhNode node{};
+        AABB boxes[4];
+        for (int i = 0; i < count; ++i)
+            boxes[i] = binary.nodes[children[i]].bounds;
+        quantize(node, binary.nodes[index].bounds, boxes, count);
+        for (int i = 0; i < count; ++i)
+        {
+            if (is_leaf(binary, children[i]) && subtrees[children[i]].count > max_leaf_count)
+            {
+                node.child[i] = split_leaf(boxes[i], subtrees[children[i]].first, subtrees[children[i]].count);
+            }
+            else if (is_leaf(binary, children[i]))
+            {
+                node.child[i] = subtrees[children[i]].first;
+                node.leafCount[i] = static_cast<uint8_t>(subtrees[children[i]].count);
+            }
+            else
+            {
+                node.child[i] = collapse(binary, children[i]);
+            }
+        }
+        nodes[slot] = node;
+        return slot;
+    }
+
+    // Bit i of the result is set when the ray overlaps child i within range; tNear gets the entry
+    // distances. Far distances are padded by a few ulps so rounding never loses a grazing hit.
+    static int intersect_children(const WideBvhNode &node, const float *rayOrigin, const float *invDirection,
+                                  const bool *negative, const Range &range, float *tNear)
+    {
+        constexpr float farPadding = 1.f + 4.f * std::numeric_limits<float>::epsilon();
+#if defined(RT_BVH_SSE)
+        __m128 nearT = _mm_set1_ps(range.start);
+        __m128 farT = _mm_set1_ps(range.end);
+        const __m128i zero = _mm_setzero_si128();
+        auto load = [&](const uint8_t *q) {
+            int32_t packed;
+            std::memcpy(&packed, q, sizeof(packed));
+            const __m128i bytes = _mm_cvtsi32_si128(packed);
+            return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+        };
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const __m128 scale = _mm_set1_ps(grid_step(node.exponent[axis]) * invDirection[axis]);
+            const __m128 offset = _mm_set1_ps((node.origin[axis] - rayOrigin[axis]) * invDirection[axis]);
+            const __m128 t0 = _mm_add_ps(_mm_mul_ps(load(node.lo[axis]), scale), offset);
+            const __m128 t1 = _mm_add_ps(_mm_mul_ps(load(node.hi[axis]), scale), offset);
+            nearT = _mm_max_ps(nearT, negative[axis] ? t1 : t0);
+            farT = _mm_min_ps(farT, negative[axis] ? t0 : t1);
+        }
+        _mm_storeu_ps(tNear, nearT);
+        const int mask = _mm_movemask_ps(_mm_cmple_ps(nearT, _mm_mul_ps(farT, _mm_set1_ps(farPadding))));
+        return mask & ((1 << node.childCount) - 1);
+#else
+        int mask = 0;
+        for (int i = 0; i < node.childCount; ++i)
+        {
+            float nearT = range.start;
+            float farT = range.end;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                const float scale = grid_step(node.exponent[axis]) * invDirection[axis];
+                const float offset = (node.origin[axis] - rayOrigin[axis]) * invDirection[axis];
+                const float t0 = node.lo[axis][i] * scale + offset;
+                const float t1 = node.hi[axis][i] * scale + offset;
+                nearT = std::max(nearT, negative[axis] ? t1 : t0);
+                farT = std::min(farT, negative[axis] ? t0 : t1);
+            }
+            tNear[i] = nearT;
+            if (nearT <= farT * farPadding)
+                mask |= 1 << i;
+        }
+        return mask;
+#endif
+    }
+
+    std::vector<WideBvhNode> nodes;
+    std::vector<uint32_t> order;
+    std::shared_ptr<const void> storage; // owns storedNodes and storedOrder when set
+    std::span<const WideBvhNode> storedNodes;
+    const uint32_t *storedOrder = nullptr;
+    size_t binaryNodes = 0;
+    size_t primitives = 0;
+
+    struct Subtree
+    {
+        uint32_t first, count;
+    };
+    std::vector<Subtree> subtrees; // only while collapsing
+};
@@ -0,0 +1,549 @@
+#pragma once
+
+#include "aabb.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Binary BVH builders over primitive bounds. The result is collapsed into the traversal layout by
+// WideBvh (bvh.h).
+//
+// All of them produce nodes that cover contiguous ranges of primitiveOrder, with children stored
+// after their parent.
+//
+// Median: object median split on the largest centroid axis, serial. Simple reference builder.
+// Lbvh: Morton codes sorted with a parallel radix sort, split top-down at the highest differing
+//       code bit. Fastest to build; the tree follows the grid rather than the geometry.
+// BinnedSah: binned surface area heuristic, subtrees built as parallel tasks and large nodes binned
+//            in parallel. Slower to build, cheaper to trace.
+
+enum class BvhBuilder
+{
+    Median,
+    Lbvh,
+    BinnedSah,
+};
+
+inline const char *to_string(BvhBuilder builder)
+{
+    switch (builder)
+    {
+    case BvhBuilder::Median: return "median";
+    case BvhBuilder::Lbvh: return "lbvh";
+    default: return "sah";
+    }
+}
+
+inline BvhBuilder bvh_builder_from_string(const std::string &name)
+{
+    if (name == "median")
+        return BvhBuilder::Median;
+    if (name == "lbvh")
+        return BvhBuilder::Lbvh;
+    return BvhBuilder::BinnedSah;
+}
+
+constexpr int bvh_max_leaf_size = 4;
+// Builders stop splitting at this depth; bounds the traversal stack
+constexpr int bvh_max_depth = 64;
+// Bins per axis of the binned SAH builder
+constexpr int bvh_sah_bins = 16;
+// Raised whenever a builder makes a different tree from the same input; cached trees (bvh_cache.h)
+// from another version are not used
+constexpr uint32_t bvh_builder_version = 2;
+
+struct BinaryBvh
+{
+    struct Node
+    {
+        AABB bounds;
+        uint32_t left = 0, right = 0;  // inner nodes (count == 0)
+        uint32_t first = 0, count = 0; // leaves: range in primitiveOrder
+    };
+
+    std::vector<Node> nodes; // nodes[0] is the root
+    std::vector<uint32_t> primitiveOrder;
+
+    // Expected cost of tracing a ray that hits the root box, with traversal and primitive tests
+    // costing 1 each. Lower is better; comparable between builders over the same primitives.
+    double sah_cost() const
+    {
+        if (nodes.empty())
+            return 0.0;
+        const double rootArea = std::max(nodes[0].bounds.surface_area(), std::numeric_limits<float>::min());
+        double cost = 0.0;
+        for (const auto &node : nodes)
+            cost += node.bounds.surface_area() / rootArea * (node.count > 0 ? node.count : 1.0);
+        return cost;
+    }
+};
+
+namespace bvh_detail
+{
+// Subtrees with fewer primitives are built on the thread that reached them
+constexpr uint32_t fork_grain = 1u << 12;
+// Items per block in the parallel passes over all primitives
+constexpr size_t block_size = size_t(1) << 14;
+// Past this depth the task builders fall back to median splits, which keeps every tree under
+// bvh_max_depth for any primitive count that fits an uint32_t
+constexpr int median_depth = bvh_max_depth - 33;
+
+// Node storage for builders that create subtrees concurrently. A binary tree with at least one
+// primitive per leaf has at most 2n - 1 nodes, so the vector never grows while threads hold indices.
+struct NodePool
+{
+    explicit NodePool(BinaryBvh &bvh, size_t primitives) : nodes(bvh.nodes)
+    {
+        nodes.assign(std::max<size_t>(1, 2 * primitives - 1), {});
+    }
+
+    uint32_t allocate_pair() { return next.fetch_add(2, std::memory_order_relaxed); }
+
+    // Trims the unused tail once all builder threads are done
+    void finish() { nodes.resize(next.load()); }
+
+    std::vector<BinaryBvh::Node> &nodes;
+    std::atomic<uint32_t> next{1};
+};
+
+inline void make_leaf(BinaryBvh &bvh, BinaryBvh::Node &node, const std::vector<AABB> &bounds, uint32_t first,
+                      uint32_t count)
+{
+    node.first = first;
+    node.count = count;
+    node.bounds = AABB();
+    for (uint32_t i = first; i < first + count; ++i)
+        node.bounds.expand(bounds[bvh.primitiveOrder[i]]);
+}
+
+inline void median_split(BinaryBvh &bvh, const std::vector<Vec3> &centroids, uint32_t first, uint32_t count)
+{
+    AABB centroidBox;
+    for (uint32_t i = first; i < first + count; ++i)
+        centroidBox.expand(centroids[bvh.primitiveOrder[i]]);
+    const int axis = centroidBox.largest_axis();
+    auto begin = bvh.primitiveOrder.begin() + first;
+    std::nth_element(begin, begin + count / 2, begin + count,
+                     [&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+}
+
+inline std::vector<Vec3> parallel_centroids(const std::vector<AABB> &bounds, unsigned threads)
+{
+    std::vector<Vec3> centroids(bounds.size());
+    const size_t blocks = (bounds.size() + block_size - 1) / block_size;
+    parallel_for(blocks, [&](size_t block) {
+        const size_t end = std::min(bounds.size(), (block + 1) * block_size);
+        for (size_t i = block * block_size; i < end; ++i)
+            centroids[i] = bounds[i].centroid();
+    }, threads);
+    return centroids;
+}
+
+inline uint32_t spread_bits_3d(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Stable LSD radix sort on bits [32, 64) of each key, 8 bits per pass. Blocks count their digits in
+// parallel, the counts become per-block output offsets, and every block scatters into its own slots,
+// so keys with equal high halves keep their order.
+inline void radix_sort_high_bits(std::vector<uint64_t> &keys, unsigned threads)
+{
+    const size_t blocks = std::max<size_t>(1, (keys.size() + block_size - 1) / block_size);
+    std::vector<uint64_t> scratch(keys.size());
+    std::vector<std::array<size_t, 256>> offsets(blocks);
+    for (int shift = 32; shift < 64; shift += 8)
+    {
+        parallel_for(blocks, [&](size_t block) {
+            offsets[block].fill(0);
+            const size_t end = std::min(keys.size(), (block + 1) * block_size);
+            for (size_t i = block * block_size; i < end; ++i)
+                ++offsets[block][(keys[i] >> shift) & 0xff];
+        }, threads);
+
+        size_t running = 0;
+        for (size_t digit = 0; digit < 256; ++digit)
+        {
+            for (size_t block = 0; block < blocks; ++block)
+            {
+                const size_t count = offsets[block][digit];
+                offsets[block][digit] = running;
+                running += count;
+            }
+        }
+
+        parallel_for(blocks, [&](size_t block) {
+            auto &offset = offsets[block];
+            const size_t end = std::min(keys.size(), (block + 1) * block_size);
+            for (size_t i = block * block_size; i < end; ++i)
+                scratch[offset[(keys[i] >> shift) & 0xff]++] = keys[i];
+        }, threads);
+        keys.swap(scratch);
+    }
+}
+} // namespace bvh_detail
+
+// Object median split along the axis of largest centroid extent
+inline BinaryBvh build_median_bvh(const std::vector<AABB> &bounds)
+{
+    BinaryBvh bvh;
+    const auto count = static_cast<uint32_t>(bounds.size());
+    bvh.primitiveOrder.resize(count);
+    std::iota(bvh.primitiveOrder.begin(), bvh.primitiveOrder.end(), 0u);
+    if (count == 0)
+        return bvh;
+
+    std::vector<Vec3> centroids(count);
+    for (uint32_t i = 0; i < count; ++i)
+        centroids[i] = bounds[i].centroid();
+
+    bvh.nodes.reserve(2 * static_cast<size_t>(count));
+    bvh.nodes.emplace_back();
+    auto build = [&](auto &self, uint32_t index, uint32_t first, uint32_t size, int depth) -> void {
+        AABB box, centroidBox;
+        for (uint32_t i = first; i < first + size; ++i)
+        {
+            box.expand(bounds[bvh.primitiveOrder[i]]);
+            centroidBox.expand(centroids[bvh.primitiveOrder[i]]);
+        }
+        bvh.nodes[index].bounds = box;
+
+        const int axis = centroidBox.largest_axis();
+        if (size <= bvh_max_leaf_size || depth >= bvh_max_depth)
+        {
+            bvh.nodes[index].first = first;
+            bvh.nodes[index].count = size;
+            return;
+        }
+
+        // Coincident centroids split at the index median, so leaves stay at bvh_max_leaf_size
+        const uint32_t half = size / 2;
+        auto begin = bvh.primitiveOrder.begin() + first;
+        if (centroidBox.extent()[axis] > 0.f)
+            std::nth_element(begin, begin + half, begin + size,
+                             [&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+
+        const auto left = static_cast<uint32_t>(bvh.nodes.size());
+        bvh.nodes.emplace_back();
+        bvh.nodes.emplace_back();
+        bvh.nodes[index].left = left;
+        bvh.nodes[index].right = left + 1;
+        self(self, left, first, half, depth + 1);
+        self(self, left + 1, first + half, size - half, depth + 1);
+    };
+    build(build, 0, 0, count, 0);
+    return bvh;
+}
+
+inline BinaryBvh build_lbvh(const std::vector<AABB> &bounds, unsigned threads = worker_count())
+{
+    using namespace bvh_detail;
+
+    BinaryBvh bvh;
+    const auto count = static_cast<uint32_t>(bounds.size());
+    bvh.primitiveOrder.resize(count);
+    if (count == 0)
+        return bvh;
+
+    const auto centroids = parallel_centroids(bounds, threads);
+    const size_t blocks = (count + block_size - 1) / block_size;
+    std::vector<AABB> blockBoxes(blocks);
+    parallel_for(blocks, [&](size_t block) {
+        const size_t end = std::min<size_t>(count, (block + 1) * block_size);
+        for (size_t i = block * block_size; i < end; ++i)
+            blockBoxes[block].expand(centroids[i]);
+    }, threads);
+    AABB centroidBox;
+    for (const auto &box : blockBoxes)
+        centroidBox.expand(box);
+
+    // 30-bit Morton code of the centroid in the high half, primitive index in the low half
+    std::vector<uint64_t> keys(count);
+    const Vec3 extent = centroidBox.extent();
+    const Vec3 scale(extent.x > 0.f ? 1023.f / extent.x : 0.f, extent.y > 0.f ? 1023.f / extent.y : 0.f,
+                     extent.z > 0.f ? 1023.f / extent.z : 0.f);
+    parallel_for(blocks, [&](size_t block) {
+        const size_t end = std::min<size_t>(count, (block + 1) * block_size);
+        for (size_t i = block * block_size; i < end; ++i)
+        {
+            const Vec3 p = centroids[i] - centroidBox.min;
+            const uint32_t code = spread_bits_3d(static_cast<uint32_t>(p.x * scale.x)) |
+                                  (spread_bits_3d(static_cast<uint32_t>(p.y * scale.y)) << 1) |
+                                  (spread_bits_3d(static_cast<uint32_t>(p.z * scale.z)) << 2);
+            keys[i] = (static_cast<uint64_t>(code) << 32) | i;
+        }
+    }, threads);
+    radix_sort_high_bits(keys, threads);
+    for (uint32_t i = 0; i < count; ++i)
+        bvh.primitiveOrder[i] = static_cast<uint32_t>(keys[i]);
+
+    NodePool pool(bvh, count);
+    auto build = [&](auto &self, uint32_t index, uint32_t first, uint32_t size, int depth, unsigned workers) -> void {
+        auto &node = pool.nodes[index];
+        if (size <= bvh_max_leaf_size || depth >= bvh_max_depth)
+        {
+            make_leaf(bvh, node, bounds, first, size);
+            return;
+        }
+
+        // Split where the highest differing code bit flips; identical codes split at the middle
+        uint32_t split = first + size / 2;
+        const uint32_t firstCode = static_cast<uint32_t>(keys[first] >> 32);
+        const uint32_t lastCode = static_cast<uint32_t>(keys[first + size - 1] >> 32);
+        if (depth >= median_depth)
+        {
+            median_split(bvh, centroids, first, size);
+        }
+        else if (firstCode != lastCode)
+        {
+            const uint32_t bit = 1u << (31 - std::countl_zero(firstCode ^ lastCode));
+            const auto begin = keys.begin() + first;
+            split = first + static_cast<uint32_t>(std::partition_point(begin, begin + size, [&](uint64_t key) {
+                                                      return !((key >> 32) & bit);
+                                                  }) - begin);
+        }
+
+        const uint32_t left = pool.allocate_pair();
+        node.left = left;
+        node.right = left + 1;
+        const bool fork = workers > 1 && size >= fork_grain;
+        fork_join([&] { self(self, left, first, split - first, depth + 1, fork ? workers / 2 : workers); },
+                  [&] { self(self, left + 1, split, first + size - split, depth + 1, fork ? workers - workers / 2 : workers); },
+                  fork);
+        node.bounds = pool.nodes[left].bounds;
+        node.bounds.expand(pool.nodes[left + 1].bounds);
+    };
+    build(build, 0, 0, count, 0, std::max(1u, threads));
+    pool.finish();
+    return bvh;
+}
+
+inline BinaryBvh build_sah_bvh(const std::vector<AABB> &bounds, unsigned threads = worker_count())
+{
+    using namespace bvh_detail;
+    constexpr int binCount = bvh_sah_bins;
+
+    // Primitives are partitioned as compact records rather than through primitiveOrder, so every
+    // level reads its range sequentially instead of gathering bounds at random
+    struct Item
+    {
+        AABB bounds;
+        float centroid[3];
+        uint32_t index;
+    };
+
+    struct Boxes
+    {
+        AABB bounds, centroids;
+
+        void merge(const Boxes &other)
+        {
+            bounds.expand(other.bounds);
+            centroids.expand(other.centroids);
+        }
+    };
+
+    struct Bins
+    {
+        AABB bounds[3][binCount];
+        uint32_t counts[3][binCount] = {};
+
+        void merge(const Bins &other)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                for (int b = 0; b < binCount; ++b)
+                {
+                    bounds[axis][b].expand(other.bounds[axis][b]);
+                    counts[axis][b] += other.counts[axis][b];
+                }
+            }
+        }
+    };
+
+    BinaryBvh bvh;
+    const auto count = static_cast<uint32_t>(bounds.size());
+    bvh.primitiveOrder.resize(count);
+    if (count == 0)
+        return bvh;
+
+    std::vector<Item> items(count);
+    const size_t blocks = (count + block_size - 1) / block_size;
+    parallel_for(blocks, [&](size_t block) {
+        const size_t end = std::min<size_t>(count, (block + 1) * block_size);
+        for (size_t i = block * block_size; i < end; ++i)
+        {
+            const Vec3 centroid = bounds[i].centroid();
+            items[i] = {bounds[i], {centroid.x, centroid.y, centroid.z}, static_cast<uint32_t>(i)};
+        }
+    }, threads);
+    NodePool pool(bvh, count);
+
+    // Runs fn(begin, end, partial) over blocks of [first, first + size) and merges the partials into
+    // result. Large ranges near the root are split over the subtree's workers.
+    auto for_blocks = [&](uint32_t first, uint32_t size, unsigned workers, auto &&fn, auto &result) {
+        const size_t blocks = workers > 1 ? std::min<size_t>(workers * 4, size / block_size) : 1;
+        if (blocks <= 1)
+        {
+            fn(first, first + size, result);
+            return;
+        }
+        std::vector<std::decay_t<decltype(result)>> partials(blocks);
+        parallel_for(blocks, [&](size_t block) {
+            const uint32_t begin = first + static_cast<uint32_t>(size * block / blocks);
+            const uint32_t end = first + static_cast<uint32_t>(size * (block + 1) / blocks);
+            fn(begin, end, partials[block]);
+        }, workers);
+        for (const auto &partial : partials)
+            result.merge(partial);
+    };
+
+    auto build = [&](auto &self, uint32_t index, uint32_t first, uint32_t size, int depth, unsigned workers) -> void {
+        auto &node = pool.nodes[index];
+        if (size <= 1 || depth >= bvh_max_depth)
+        {
+            node.first = first;
+            node.count = size;
+            for (uint32_t i = first; i < first + size; ++i)
+                node.bounds.expand(items[i].bounds);
+            return;
+        }
+
+        Boxes boxes;
+        for_blocks(first, size, workers, [&](uint32_t begin, uint32_t end, Boxes &out) {
+            for (uint32_t i = begin; i < end; ++i)
+            {
+                out.bounds.expand(items[i].bounds);
+                out.centroids.expand(Vec3(items[i].centroid[0], items[i].centroid[1], items[i].centroid[2]));
+            }
+        }, boxes);
+        node.bounds = boxes.bounds;
+        const AABB &centroidBox = boxes.centroids;
+
+        const Vec3 extent = centroidBox.extent();
+        // Small nodes use fewer bins; the sweep below is a fixed cost per node
+        const int usedBins = static_cast<int>(std::clamp<uint32_t>(size, 2, binCount));
+        const float binScale[3] = {extent.x > 0.f ? usedBins / extent.x : 0.f, extent.y > 0.f ? usedBins / extent.y : 0.f,
+                                   extent.z > 0.f ? usedBins / extent.z : 0.f};
+        const float binOrigin[3] = {centroidBox.min.x, centroidBox.min.y, centroidBox.min.z};
+        auto bin_of = [&](const Item &item, int axis) {
+            const float offset = (item.centroid[axis] - binOrigin[axis]) * binScale[axis];
+            return std::min(usedBins - 1, static_cast<int>(offset));
+        };
+
+        Bins bins;
+        for_blocks(first, size, workers, [&](uint32_t begin, uint32_t end, Bins &out) {
+            for (uint32_t i = begin; i < end; ++i)
+            {
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    if (binScale[axis] == 0.f)
+                        continue;
+                    const int b = bin_of(items[i], axis);
+                    out.bounds[axis][b].expand(items[i].bounds);
+                    ++out.counts[axis][b];
+                }
+            }
+        }, bins);
+
+        // Cost of splitting after bin b: area-weighted primitive counts on both sides
+        int bestAxis = -1;
+        int bestSplit = 0;
+        float bestCost = std::numeric_limits<float>::max();
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (binScale[axis] == 0.f)
+                continue;
+            float rightCost[binCount] = {};
+            AABB right;
+            uint32_t rightCount = 0;
+            for (int b = usedBins - 1; b > 0; --b)
+            {
+                right.expand(bins.bounds[axis][b]);
+                rightCount += bins.counts[axis][b];
+                rightCost[b - 1] = rightCount ? right.surface_area() * rightCount : 0.f;
+            }
+            AABB left;
+            uint32_t leftCount = 0;
+            for (int b = 0; b < usedBins - 1; ++b)
+            {
+                left.expand(bins.bounds[axis][b]);
+                leftCount += bins.counts[axis][b];
+                const float cost = (leftCount ? left.surface_area() * leftCount : 0.f) + rightCost[b];
+                if (leftCount > 0 && leftCount < size && cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = b;
+                }
+            }
+        }
+
+        // Split down to single primitives: a greedy leaf-or-split test stops too early, and WideBvh
+        // packs small subtrees back into leaves anyway
+        if (size <= bvh_max_leaf_size && bestAxis < 0)
+        {
+            node.first = first;
+            node.count = size;
+            return;
+        }
+
+        const auto begin = items.begin() + first;
+        uint32_t split = first + size / 2;
+        if (bestAxis >= 0 && depth < median_depth)
+        {
+            split = first + static_cast<uint32_t>(std::partition(begin, begin + size, [&](const Item &item) {
+                                                      return bin_of(item, bestAxis) <= bestSplit;
+                                                  }) - begin);
+        }
+        else
+        {
+            const int axis = centroidBox.largest_axis();
+            std::nth_element(begin, begin + size / 2, begin + size, [&](const Item &a, const Item &b) {
+                return a.centroid[axis] < b.centroid[axis];
+            });
+        }
+
+        const uint32_t left = pool.allocate_pair();
+        node.left = left;
+        node.right = left + 1;
+        const bool fork = workers > 1 && size >= fork_grain;
+        fork_join([&] { self(self, left, first, split - first, depth + 1, fork ? workers / 2 : workers); },
+                  [&] { self(self, left + 1, split, first + size - split, depth + 1, fork ? workers - workers / 2 : workers); },
+                  fork);
+    };
+    build(build, 0, 0, count, 0, std::max(1u, threads));
+    pool.finish();
+
+    parallel_for(blocks, [&](size_t block) {
+        const size_t end = std::min<size_t>(count, (block + 1) * block_size);
+        for (size_t i = block * block_size; i < end; ++i)
+            bvh.primitiveOrder[i] = items[i].index;
+    }, threads);
+    return bvh;
+}
+
+inline BinaryBvh build_binary_bvh(const std::vector<AABB> &bounds, BvhBuilder builder = BvhBuilder::BinnedSah,
+                                  unsigned threads = worker_count())
+{
+    switch (builder)
+    {
+    case BvhBuilder::Median: return build_median_bvh(bounds);
+    case BvhBuilder::Lbvh: return build_lbvh(bounds, threads);
+    default: return build_sah_bvh(bounds, threads);
+    }
+}
@@ -0,0 +1,413 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "bvh_build.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// On-disk cache of built BVHs for repeated renders of the same static scene. A tree is stored under
+// a hash of what it was built from - the primitive bounds, the builder, its version and its
+// parameters - as one file laid out exactly as WideBvh keeps it in memory:
+//   header (64 bytes) | nodes (64 bytes each, cache-line aligned) | primitive order (uint32 each)
+// A hit maps the file read-only and the tree points straight into the mapping, with nothing copied.
+// Before a file is used one pass checks that every child index and leaf range is in bounds and that
+// the primitive order is a permutation, so a damaged file is rebuilt instead of crashing traversal.
+// A miss builds the tree and writes it to a temporary file that is renamed into place, so readers in
+// this or other processes only ever see complete files. Files carry a format version, the builder
+// version, the byte order and the node layout; anything written by an incompatible build is
+// rejected, deleted and rebuilt. When the directory grows past its size limit the least recently
+// used files go first.
+//
+// Copies of a mapped tree (NodeReplicas with RenderSettings::replicateScene) get their own nodes in
+// memory, see WideBvh's copy constructor, so every NUMA node still traverses a local tree.
+
+constexpr uint32_t bvh_cache_version = 2;
+
+struct BvhCacheHeader
+{
+    char magic[8];          // "RTBVHC" and two zero bytes
+    uint32_t version;       // bvh_cache_version
+    uint32_t byteOrder;     // 0x01020304 as the writer stores it
+    uint32_t nodeSize;      // sizeof(WideBvhNode)
+    uint32_t maxLeafSize;   // bvh_max_leaf_size
+    uint64_t key;           // bvh_content_hash() of the input
+    uint64_t nodeCount;
+    uint64_t primitiveCount;
+    uint64_t binaryNodes;   // for WideBvh::binary_memory_bytes()
+    uint32_t builderVersion; // bvh_builder_version
+    uint32_t reserved;
+};
+static_assert(sizeof(BvhCacheHeader) == 64, "nodes follow the header at a cache-line boundary");
+
+// 64-bit hash of the bounds a tree is built over, the builder that builds it and everything else
+// that shapes the tree
+inline uint64_t bvh_content_hash(const std::vector<AABB> &bounds, BvhBuilder builder)
+{
+    uint64_t hash = 0x243f6a8885a308d3ull;
+    auto add = [&](uint64_t word) {
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9ull;
+        hash ^= hash >> 31;
+    };
+    auto bits = [](float a, float b) {
+        uint32_t x, y;
+        std::memcpy(&x, &a, sizeof(x));
+        std::memcpy(&y, &b, sizeof(y));
+        return uint64_t(x) << 32 | y;
+    };
+    add(static_cast<uint64_t>(builder));
+    add(bvh_builder_version);
+    add(static_cast<uint64_t>(bvh_max_leaf_size) << 32 | static_cast<uint32_t>(bvh_max_depth));
+    add(static_cast<uint64_t>(bvh_sah_bins) << 32 | static_cast<uint32_t>(bvh_detail::median_depth));
+    add(bounds.size());
+    for (const auto &box : bounds)
+    {
+        add(bits(box.min.x, box.min.y));
+        add(bits(box.min.z, box.max.x));
+        add(bits(box.max.y, box.max.z));
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+namespace bvh_cache_detail
+{
+    // A whole file, read-only: mapped on Linux, read into an aligned buffer elsewhere
+    class FileView
+    {
+    public:
+        static std::shared_ptr<const FileView> open(const std::filesystem::path &path)
+        {
+            auto view = std::shared_ptr<FileView>(new FileView());
+#if defined(__linux__)
+            const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return nullptr;
+            struct stat info;
+            if (::fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(BvhCacheHeader)))
+            {
+                ::close(fd);
+                return nullptr;
+            }
+            void *mapping = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (mapping == MAP_FAILED)
+                return nullptr;
+            view->bytes = static_cast<const char *>(mapping);
+            view->length = static_cast<size_t>(info.st_size);
+            view->mapped = true;
+#else
+            std::ifstream file(path, std::ios::binary | std::ios::ate);
+            if (!file)
+                return nullptr;
+            view->length = static_cast<size_t>(file.tellg());
+            if (view->length < sizeof(BvhCacheHeader))
+                return nullptr;
+            view->buffer = std::make_unique<WideBvhNode[]>((view->length + sizeof(WideBvhNode) - 1) / sizeof(WideBvhNode));
+            file.seekg(0);
+            if (!file.read(reinterpret_cast<char *>(view->buffer.get()), static_cast<std::streamsize>(view->length)))
+                return nullptr;
+            view->bytes = reinterpret_cast<const char *>(view->buffer.get());
+#endif
+            return view;
+        }
+
+        ~FileView()
+        {
+#if defined(__linux__)
+            if (mapped)
+                ::munmap(const_cast<char *>(bytes), length);
+#endif
+        }
+
+        FileView(const FileView &) = delete;
+        FileView &operator=(const FileView &) = delete;
+
+        const char *data() const { return bytes; }
+        size_t size() const { return length; }
+
+    private:
+        FileView() = default;
+
+        const char *bytes = nullptr;
+        size_t length = 0;
+        bool mapped = false;
+        std::unique_ptr<WideBvhNode[]> buffer;
+    };
+} // namespace bvh_cache_detail
+
+class BvhCache
+{
+public:
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t rejected = 0; // files from an incompatible build or damaged, replaced by a fresh build
+        uint64_t evictions = 0;
+    };
+
+    BvhCache(std::filesystem::path _directory, uint64_t _maxBytes) : directory(std::move(_directory)), maxBytes(_maxBytes)
+    {
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+    }
+
+    // The tree builder makes over bounds: mapped from the cache when there, otherwise built and stored
+    WideBvh load_or_build(const std::vector<AABB> &bounds, BvhBuilder builder, unsigned threads = worker_count())
+    {
+        const uint64_t key = bvh_content_hash(bounds, builder);
+        if (auto cached = load(key, bounds.size()))
+        {
+            ++hits;
+            return std::move(*cached);
+        }
+        ++misses;
+        auto bvh = WideBvh::build(bounds, builder, threads);
+        store(key, bvh);
+        return bvh;
+    }
+
+    Stats stats() const { return {hits.load(), misses.load(), rejected.load(), evictions.load()}; }
+    const std::filesystem::path &path() const { return directory; }
+
+private:
+    static constexpr uint32_t byte_order = 0x01020304;
+    static constexpr char magic[8] = {'R', 'T', 'B', 'V', 'H', 'C', 0, 0};
+
+    std::filesystem::path file_for(uint64_t key) const
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(key));
+        return directory / name;
+    }
+
+    std::optional<WideBvh> load(uint64_t key, size_t primitives)
+    {
+        const auto file = file_for(key);
+        std::error_code error;
+        if (!std::filesystem::exists(file, error))
+            return std::nullopt;
+        const auto view = bvh_cache_detail::FileView::open(file);
+        BvhCacheHeader header{};
+        if (view)
+            std::memcpy(&header, view->data(), sizeof(header));
+        const bool valid = view && std::memcmp(header.magic, magic, sizeof(magic)) == 0 &&
+                           header.version == bvh_cache_version && header.byteOrder == byte_order &&
+                           header.nodeSize == sizeof(WideBvhNode) && header.maxLeafSize == bvh_max_leaf_size &&
+                           header.builderVersion == bvh_builder_version && header.key == key &&
+                           header.primitiveCount == primitives &&
+                           header.nodeCount <= (view->size() - sizeof(header)) / sizeof(WideBvhNode) &&
+                           view->size() == sizeof(header) + header.nodeCount * sizeof(WideBvhNode) +
+                                               header.primitiveCount * sizeof(uint32_t) &&
+                           consistent(reinterpret_cast<const WideBvhNode *>(view->data() + sizeof(header)), header.nodeCount,
+                                      reinterpret_cast<const uint32_t *>(view->data() + sizeof(header) +
+                                                                         header.nodeCount * sizeof(WideBvhNode)),
+                                      header.primitiveCount);
+        if (!valid)
+        {
+            ++rejected;
+            std::filesystem::remove(file, error);
+            return std::nullopt;
+        }
+
+        // Recently used files are the last to be evicted
+        std::filesystem::last_write_time(file, std::filesystem::file_time_type::clock::now(), error);
+        const char *nodes = view->data() + sizeof(header);
+        const char *order = nodes + header.nodeCount * sizeof(WideBvhNode);
+        return WideBvh::from_memory(view, reinterpret_cast<const WideBvhNode *>(nodes), header.nodeCount,
+                                    reinterpret_cast<const uint32_t *>(order), header.primitiveCount, header.binaryNodes);
+    }
+
+    // Nodes safe to traverse (WideBvh::valid_nodes()) and the order a permutation of [0, primitives)
+    static bool consistent(const WideBvhNode *nodes, uint64_t nodeCount, const uint32_t *order, uint64_t primitives)
+    {
+        if (!WideBvh::valid_nodes(std::span<const WideBvhNode>(nodes, nodeCount), primitives))
+            return false;
+        std::vector<bool> seen(primitives, false);
+        for (uint64_t slot = 0; slot < primitives; ++slot)
+        {
+            if (order[slot] >= primitives || seen[order[slot]])
+                return false;
+            seen[order[slot]] = true;
+        }
+        return true;
+    }
+
+    void store(uint64_t key, const WideBvh &bvh)
+    {
+        BvhCacheHeader header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = bvh_cache_version;
+        header.byteOrder = byte_order;
+        header.nodeSize = sizeof(WideBvhNode);
+        header.maxLeafSize = bvh_max_leaf_size;
+        header.builderVersion = bvh_builder_version;
+        header.key = key;
+        header.nodeCount = bvh.node_count();
+        header.primitiveCount = bvh.primitive_count();
+        header.binaryNodes = bvh.binary_node_count();
+        std::vector<uint32_t> order(bvh.primitive_count());
+        for (uint32_t slot = 0; slot < order.size(); ++slot)
+            order[slot] = bvh.primitive_index(slot);
+
+        const auto file = file_for(key);
+        const auto unique = std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+                            static_cast<size_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+        auto temporary = file;
+        temporary += ".tmp" + std::to_string(unique);
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char *>(bvh.node_data().data()),
+                      static_cast<std::streamsize>(bvh.node_count() * sizeof(WideBvhNode)));
+            out.write(reinterpret_cast<const char *>(order.data()), static_cast<std::streamsize>(order.size() * sizeof(uint32_t)));
+            if (!out.flush())
+            {
+                std::error_code error;
+                std::filesystem::remove(temporary, error);
+                return;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary, file, error);
+        if (error)
+        {
+            std::filesystem::remove(temporary, error);
+            return;
+        }
+        evict(file);
+    }
+
+    // Removes least recently used files until the directory fits maxBytes, never keep; temporary files
+    // older than an hour were left by a writer that died and go too
+    void evict(const std::filesystem::path &keep)
+    {
+        namespace fs = std::filesystem;
+        std::lock_guard<std::mutex> lock(evictMutex);
+        struct Entry
+        {
+            fs::path path;
+            fs::file_time_type time;
+            uint64_t size;
+        };
+        std::vector<Entry> entries;
+        uint64_t total = 0;
+        std::error_code error;
+        const auto now = fs::file_time_type::clock::now();
+        for (const auto &item : fs::directory_iterator(directory, error))
+        {
+            const auto time = item.last_write_time(error);
+            if (error || !item.is_regular_file(error))
+                continue;
+            const auto extension = item.path().extension().string();
+            if (extension.rfind(".tmp", 0) == 0)
+            {
+                if (now - time > std::chrono::hours(1))
+                    fs::remove(item.path(), error);
+                continue;
+            }
+            if (extension != ".bvh")
+                continue;
+            const uint64_t size = item.file_size(error);
+            entries.push_back({item.path(), time, size});
+            total += size;
+        }
+
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.time < b.time; });
+        for (const auto &entry : entries)
+        {
+            if (total <= maxBytes)
+                break;
+            if (entry.path == keep)
+                continue;
+            if (fs::remove(entry.path, error))
+            {
+                total -= entry.size;
+                ++evictions;
+            }
+        }
+    }
+
+    std::filesystem::path directory;
+    uint64_t maxBytes;
+    std::mutex evictMutex;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> evictions{0};
+};
+
+namespace bvh_cache_detail
+{
+    struct DefaultCache
+    {
+        std::mutex mutex;
+        std::shared_ptr<BvhCache> cache;
+    };
+
+    inline std::shared_ptr<BvhCache> cache_from_environment()
+    {
+        const char *directory = std::getenv("RT_BVH_CACHE");
+        if (!directory || !*directory)
+            return nullptr;
+        const char *megabytes = std::getenv("RT_BVH_CACHE_MB");
+        const uint64_t limit = megabytes ? std::strtoull(megabytes, nullptr, 10) : 2048;
+        return std::make_shared<BvhCache>(directory, limit << 20);
+    }
+
+    inline DefaultCache &default_cache()
+    {
+        static DefaultCache instance{{}, cache_from_environment()};
+        return instance;
+    }
+} // namespace bvh_cache_detail
+
+// Cache used by Scene::build_bvh() and StaticKernel::build(): set from RT_BVH_CACHE=DIR (size limit
+// RT_BVH_CACHE_MB, default 2048) in the environment, or by set_default_bvh_cache(); null for none
+inline std::shared_ptr<BvhCache> default_bvh_cache()
+{
+    auto &slot = bvh_cache_detail::default_cache();
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    return slot.cache;
+}
+
+inline void set_default_bvh_cache(std::shared_ptr<BvhCache> cache)
+{
+    auto &slot = bvh_cache_detail::default_cache();
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    slot.cache = std::move(cache);
+}
+
+// WideBvh::build() through the default cache when there is one
+inline WideBvh build_bvh_cached(const std::vector<AABB> &bounds, BvhBuilder builder)
+{
+    if (const auto cache = default_bvh_cache())
+        return cache->load_or_build(bounds, builder);
+    return WideBvh::build(bounds, builder);
+}
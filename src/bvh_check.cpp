@@ -0,0 +1,134 @@
+// Regression check for BVH construction on degenerate input: primitives with coincident centroids
+// (identical boxes, concentric spheres) and leaves too large for WideBvhNode::leafCount. Every
+// builder must produce a tree in which each primitive slot sits in exactly one leaf and a ray
+// through the cluster reaches all of them.
+//
+// usage: ray_tracing_bvh_check   (exit status 0 when every case passes)
+
+#include "bvh.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Walks the tree from the root; false on an out-of-range child or a slot seen twice or never
+bool check_structure(const WideBvh &bvh, std::string &error)
+{
+    const auto nodes = bvh.node_data();
+    std::vector<int> seen(bvh.primitive_count(), 0);
+    std::vector<uint32_t> stack = {0};
+    while (!stack.empty())
+    {
+        const uint32_t index = stack.back();
+        stack.pop_back();
+        if (index >= nodes.size())
+        {
+            error = "child index " + std::to_string(index) + " out of range";
+            return false;
+        }
+        const auto &node = nodes[index];
+        for (int i = 0; i < node.childCount; ++i)
+        {
+            if (node.leafCount[i] == 0)
+            {
+                stack.push_back(node.child[i]);
+                continue;
+            }
+            for (uint32_t slot = node.child[i]; slot < node.child[i] + node.leafCount[i]; ++slot)
+            {
+                if (slot >= seen.size())
+                {
+                    error = "slot " + std::to_string(slot) + " out of range";
+                    return false;
+                }
+                ++seen[slot];
+            }
+        }
+    }
+    for (size_t slot = 0; slot < seen.size(); ++slot)
+    {
+        if (seen[slot] != 1)
+        {
+            error = "slot " + std::to_string(slot) + " in " + std::to_string(seen[slot]) + " leaves";
+            return false;
+        }
+    }
+    return true;
+}
+
+// A ray through the common centre must test every primitive
+bool check_traversal(const WideBvh &bvh, const Vec3 &center, std::string &error)
+{
+    std::vector<int> tested(bvh.primitive_count(), 0);
+    Range range{0.f, std::numeric_limits<float>::max()};
+    bvh.intersect(Ray(center - Vec3(10.f, 0.f, 0.f), Vec3(1.f, 0.f, 0.f)), range, [&](uint32_t slot, const Range &) {
+        ++tested[slot];
+        return std::optional<float>();
+    });
+    for (size_t slot = 0; slot < tested.size(); ++slot)
+    {
+        if (tested[slot] != 1)
+        {
+            error = "slot " + std::to_string(slot) + " tested " + std::to_string(tested[slot]) + " times";
+            return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    const Vec3 center(1.f, 2.f, 3.f);
+    struct Case
+    {
+        const char *name;
+        std::vector<AABB> bounds;
+    };
+    std::vector<Case> cases;
+    for (const size_t count : {5, 300, 5000})
+    {
+        Case identical{"identical boxes", {}};
+        Case concentric{"concentric spheres", {}};
+        for (size_t i = 0; i < count; ++i)
+        {
+            identical.bounds.emplace_back(center - Vec3(0.5f, 0.5f, 0.5f), center + Vec3(0.5f, 0.5f, 0.5f));
+            const float r = 0.1f + 0.01f * i;
+            concentric.bounds.emplace_back(center - Vec3(r, r, r), center + Vec3(r, r, r));
+        }
+        cases.push_back(std::move(identical));
+        cases.push_back(std::move(concentric));
+    }
+
+    int failures = 0;
+    auto report = [&](const std::string &name, const WideBvh &bvh) {
+        std::string error;
+        bool ok = check_structure(bvh, error) && check_traversal(bvh, center, error);
+        // What loading a cached or chunked tree accepts has to include everything the builders make
+        if (ok && !WideBvh::valid_nodes(bvh.node_data(), bvh.primitive_count()))
+        {
+            ok = false;
+            error = "rejected by WideBvh::valid_nodes()";
+        }
+        std::printf("%-50s %s%s\n", name.c_str(), ok ? "ok" : "FAILED: ", error.c_str());
+        failures += !ok;
+    };
+
+    for (const auto &c : cases)
+        for (const auto builder : {BvhBuilder::Median, BvhBuilder::Lbvh, BvhBuilder::BinnedSah})
+            report(std::string(c.name) + " x" + std::to_string(c.bounds.size()) + ", " + to_string(builder),
+                   WideBvh::build(c.bounds, builder));
+
+    // One binary leaf over every primitive, as a builder stopped at bvh_max_depth would leave it
+    for (const uint32_t count : {5u, 255u, 256u, 1021u, 70000u})
+    {
+        BinaryBvh binary;
+        binary.nodes.resize(1);
+        binary.nodes[0].bounds = AABB(center - Vec3(1.f, 1.f, 1.f), center + Vec3(1.f, 1.f, 1.f));
+        binary.nodes[0].count = count;
+        for (uint32_t i = 0; i < count; ++i)
+            binary.primitiveOrder.push_back(i);
+        report("single binary leaf x" + std::to_string(count), WideBvh::from_binary(binary));
+    }
+
+    return failures ? 1 : 0;
+}
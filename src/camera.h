@@ -85,6 +85,12 @@ public:
         InverseProjection.data[14] = (n - f) / 2.f;
         InverseProjection.data[15] = (n + f) / 2.f;
 
+        // Forward direction of the above up to depth: camera space to the screen points generateRay()
+        // takes, w = -z does the perspective divide
+        Projection.data[0] = n / r;
+        Projection.data[5] = n / t;
+        Projection.data[14] = -1.f;
+
         lookAt(position, target, up);
     }
 
@@ -125,6 +131,10 @@ public:
         updateMatrices();
     }
 
+    const Vec3 &get_position() const { return position; }
+    const Vec3 &get_target() const { return target; }
+    float get_fov() const { return fov; }
+
     auto ToWorld(const Vec3 &direction) const
     {
         Vec3 rayDirectionWorld = (cameraToWorld * Vec4(direction, 0.0f)).xyz();
@@ -136,6 +146,40 @@ public:
           return (worldToCamera * Vec4(point, 1.f)).xyz();
     }
 
+    // Screen point (generateRay() parameterization) a camera-space point in front of the camera maps to
+    Vec2f CameraToScreen(const Vec3 &point) const
+    {
+        const auto clip = Projection * Vec4(point, 1.f);
+        return {clip.x / clip.w, clip.y / clip.w};
+    }
+
+    // Screen rectangle covering a world-space sphere, from the planes through the eye tangent to it.
+    // Returns false when the sphere reaches behind the eye, where the projection is unbounded.
+    bool ProjectSphere(const Vec3 &center, float radius, Vec2f &lower, Vec2f &upper) const
+    {
+        const auto c = WorldToCamera(center);
+        // Slope range x/-z (or y/-z) of the two tangent lines in the plane of one screen axis
+        auto slopes = [&](float a, float &low, float &high) {
+            const float distance = std::sqrt(a * a + c.z * c.z);
+            if (distance <= radius)
+                return false;
+            const float axis = std::atan2(a, -c.z);
+            const float spread = std::asin(radius / distance);
+            constexpr float limit = 1.5f; // just under pi / 2
+            if (axis - spread <= -limit || axis + spread >= limit)
+                return false;
+            low = std::tan(axis - spread);
+            high = std::tan(axis + spread);
+            return true;
+        };
+        float x0, x1, y0, y1;
+        if (!slopes(c.x, x0, x1) || !slopes(c.y, y0, y1))
+            return false;
+        lower = CameraToScreen(Vec3(x0, y0, -1.f));
+        upper = CameraToScreen(Vec3(x1, y1, -1.f));
+        return true;
+    }
+
     Ray generateRay(float ndcX, float ndcY) const
     {
         // // Convert NDC coordinates to camera space
@@ -185,4 +229,5 @@ private:
     Matrix4x4 worldToCamera;
 
     Matrix4x4 InverseProjection;
+    Matrix4x4 Projection;
 };
@@ -0,0 +1,295 @@
+#pragma once
+
+#include "camera.h"
+#include "cpu_dispatch.h"
+#include "half.h"
+#include "image.h"
+#include "render.h"
+#include "tiles.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <variant>
+
+// Reduced-precision framebuffers for resolutions where float radiance sums do not fit in memory:
+// 16K x 16K RGB is 3 GB in float, 1.5 GB in half and 1 GB in RGB9E5. Compact storage would lose
+// samples if it accumulated sums (a half sum stops growing once it is 2048 times the sample), so
+// a CompactFramebuffer holds the running mean instead. Tiles are still rendered into each worker's
+// float tile buffer; flushing a finished tile decodes the stored mean, blends in the tile's sums
+// in float and encodes the result again, so a pass rounds each pixel once whatever its sample
+// count. The flush and the decoding loops are branch-free and run on the active_isa() copy.
+//
+// Rounding per pass: half keeps 11 significant bits per channel, RGB9E5 9 bits relative to the
+// brightest channel of the pixel (darker channels of a saturated colour lose more). Rendering in
+// a few large passes keeps the error at about one rounding step.
+
+enum class PixelStorage
+{
+    Float,  // 12 bytes per pixel
+    Half,   // 6 bytes per pixel
+    Rgb9e5, // 4 bytes per pixel, 9-bit mantissas sharing a 5-bit exponent, no negative values
+};
+
+inline const char *to_string(PixelStorage storage)
+{
+    switch (storage)
+    {
+    case PixelStorage::Half: return "half";
+    case PixelStorage::Rgb9e5: return "rgb9e5";
+    default: return "float";
+    }
+}
+
+inline std::optional<PixelStorage> pixel_storage_from_string(const std::string &name)
+{
+    if (name == "float")
+        return PixelStorage::Float;
+    if (name == "half")
+        return PixelStorage::Half;
+    if (name == "rgb9e5")
+        return PixelStorage::Rgb9e5;
+    return std::nullopt;
+}
+
+inline size_t pixel_storage_bytes(PixelStorage storage)
+{
+    switch (storage)
+    {
+    case PixelStorage::Half: return 3 * sizeof(uint16_t);
+    case PixelStorage::Rgb9e5: return sizeof(uint32_t);
+    default: return 3 * sizeof(float);
+    }
+}
+
+// Most precise storage in which a framebuffer of pixels pixels fits budgetBytes (0 for no limit);
+// Rgb9e5 when none does
+inline PixelStorage choose_pixel_storage(size_t pixels, size_t budgetBytes)
+{
+    for (const auto storage : {PixelStorage::Float, PixelStorage::Half})
+        if (budgetBytes == 0 || pixels * pixel_storage_bytes(storage) <= budgetBytes)
+            return storage;
+    return PixelStorage::Rgb9e5;
+}
+
+// Shared-exponent RGB (EXT_texture_shared_exponent): three 9-bit mantissas in bits 0-26 and a
+// 5-bit exponent with bias 15 in bits 27-31
+struct Rgb9e5
+{
+    uint32_t bits = 0;
+};
+
+// Rounds to nearest; negative values and NaN become 0, values above 65408 are clamped
+inline uint32_t rgb_to_rgb9e5_bits(float r, float g, float b)
+{
+    constexpr float max_value = 65408.f; // (2^9 - 1) / 2^9 * 2^16
+
+    const float rc = r > 0.f ? std::min(r, max_value) : 0.f;
+    const float gc = g > 0.f ? std::min(g, max_value) : 0.f;
+    const float bc = b > 0.f ? std::min(b, max_value) : 0.f;
+    const float maxc = std::max(rc, std::max(gc, bc));
+
+    // floor(log2(maxc)) + 16, at least 0; maxc is below 2^16 so it is at most 31
+    const int exponent = static_cast<int>(std::bit_cast<uint32_t>(maxc) >> 23) - 127;
+    int shared = std::max(exponent, -16) + 16;
+    // Mantissas are value / 2^(shared - 24); one more step when maxc rounds up to 512
+    float scale = std::bit_cast<float>(static_cast<uint32_t>(24 - shared + 127) << 23);
+    const bool carry = static_cast<uint32_t>(maxc * scale + 0.5f) == 512u;
+    shared += carry ? 1 : 0;
+    scale *= carry ? 0.5f : 1.f;
+
+    const auto rm = static_cast<uint32_t>(rc * scale + 0.5f);
+    const auto gm = static_cast<uint32_t>(gc * scale + 0.5f);
+    const auto bm = static_cast<uint32_t>(bc * scale + 0.5f);
+    return rm | (gm << 9) | (bm << 18) | (static_cast<uint32_t>(shared) << 27);
+}
+
+inline void rgb9e5_bits_to_rgb(uint32_t bits, float *rgb)
+{
+    const float scale = std::bit_cast<float>(((bits >> 27) + 127u - 24u) << 23);
+    rgb[0] = static_cast<float>(bits & 0x1ffu) * scale;
+    rgb[1] = static_cast<float>((bits >> 9) & 0x1ffu) * scale;
+    rgb[2] = static_cast<float>((bits >> 18) & 0x1ffu) * scale;
+}
+
+namespace compact_detail
+{
+    // One channel of the per-channel layouts
+    RT_ALWAYS_INLINE float load_channel(const float *value) { return *value; }
+    RT_ALWAYS_INLINE float load_channel(const half *value) { return half_bits_to_float(value->bits); }
+    RT_ALWAYS_INLINE void store_channel(float rgb, float *value) { *value = rgb; }
+    RT_ALWAYS_INLINE void store_channel(float rgb, half *value) { value->bits = float_to_half_bits(rgb); }
+
+    // mean = (mean * firstSample + sums) / (firstSample + numSamples) over the tile. Float and half
+    // rows are blended as flat channel arrays, RGB9E5 a pixel at a time.
+    template <class T, size_t Channels>
+    RT_ALWAYS_INLINE void add_tile_body(Image<T, Channels> &pixels, const Tile &tile, const Image<float, 3> &local,
+                                        int firstSample, int numSamples)
+    {
+        const float keep = float(firstSample) / float(firstSample + numSamples);
+        const float scale = 1.f / float(firstSample + numSamples);
+        const int tileWidth = tile.x1 - tile.x0;
+        for (int y = tile.y0; y < tile.y1; ++y)
+        {
+            const float *sums = &local[y - tile.y0][0];
+            T *row = &pixels[y][tile.x0];
+            if constexpr (Channels == 3)
+            {
+                if (firstSample == 0)
+                    for (int i = 0; i < tileWidth * 3; ++i)
+                        store_channel(sums[i] * scale, row + i);
+                else
+                    for (int i = 0; i < tileWidth * 3; ++i)
+                        store_channel(load_channel(row + i) * keep + sums[i] * scale, row + i);
+            }
+            else
+            {
+                for (int x = 0; x < tileWidth; ++x)
+                {
+                    float rgb[3];
+                    rgb9e5_bits_to_rgb(firstSample > 0 ? row[x].bits : 0u, rgb);
+                    row[x].bits = rgb_to_rgb9e5_bits(rgb[0] * keep + sums[x * 3] * scale, rgb[1] * keep + sums[x * 3 + 1] * scale,
+                                                     rgb[2] * keep + sums[x * 3 + 2] * scale);
+                }
+            }
+        }
+    }
+
+    template <class T, size_t Channels>
+    void add_tile_generic(Image<T, Channels> &pixels, const Tile &tile, const Image<float, 3> &local, int firstSample, int numSamples)
+    {
+        add_tile_body(pixels, tile, local, firstSample, numSamples);
+    }
+    template <class T, size_t Channels>
+    RT_TARGET_AVX2 void add_tile_avx2(Image<T, Channels> &pixels, const Tile &tile, const Image<float, 3> &local, int firstSample, int numSamples)
+    {
+        add_tile_body(pixels, tile, local, firstSample, numSamples);
+    }
+    template <class T, size_t Channels>
+    RT_TARGET_AVX512 void add_tile_avx512(Image<T, Channels> &pixels, const Tile &tile, const Image<float, 3> &local, int firstSample, int numSamples)
+    {
+        add_tile_body(pixels, tile, local, firstSample, numSamples);
+    }
+
+    // Decodes rows [y0, y0 + rows.height) into rows
+    template <class T, size_t Channels>
+    RT_ALWAYS_INLINE void decode_rows_body(const Image<T, Channels> &pixels, int y0, Image<float, 3> &rows)
+    {
+        for (int y = 0; y < rows.height; ++y)
+        {
+            const T *row = &pixels[y0 + y][0];
+            float *out = &rows[y][0];
+            if constexpr (Channels == 3)
+                for (int i = 0; i < rows.width * 3; ++i)
+                    out[i] = load_channel(row + i);
+            else
+                for (int x = 0; x < rows.width; ++x)
+                    rgb9e5_bits_to_rgb(row[x].bits, out + x * 3);
+        }
+    }
+
+    template <class T, size_t Channels>
+    void decode_rows_generic(const Image<T, Channels> &pixels, int y0, Image<float, 3> &rows) { decode_rows_body(pixels, y0, rows); }
+    template <class T, size_t Channels>
+    RT_TARGET_AVX2 void decode_rows_avx2(const Image<T, Channels> &pixels, int y0, Image<float, 3> &rows) { decode_rows_body(pixels, y0, rows); }
+    template <class T, size_t Channels>
+    RT_TARGET_AVX512 void decode_rows_avx512(const Image<T, Channels> &pixels, int y0, Image<float, 3> &rows) { decode_rows_body(pixels, y0, rows); }
+} // namespace compact_detail
+
+// Mean linear radiance per pixel in the chosen storage. Disjoint tiles can be added concurrently.
+class CompactFramebuffer
+{
+public:
+    CompactFramebuffer(int _width, int _height, PixelStorage _storage) : width(_width), height(_height), storage(_storage)
+    {
+        if (storage == PixelStorage::Half)
+            pixels.emplace<Image<half, 3>>(width, height);
+        else if (storage == PixelStorage::Rgb9e5)
+            pixels.emplace<Image<Rgb9e5, 1>>(width, height);
+        else
+            pixels.emplace<Image<float, 3>>(width, height);
+    }
+
+    PixelStorage pixel_storage() const { return storage; }
+
+    size_t memory_bytes() const { return static_cast<size_t>(width) * height * pixel_storage_bytes(storage); }
+
+    // Blends the radiance sums of samples [firstSample, firstSample + numSamples) of tile, held in
+    // local in tile-local coordinates, into the mean of the samples before firstSample
+    void add_tile(const Tile &tile, const Image<float, 3> &local, int firstSample, int numSamples)
+    {
+        const IsaLevel isa = active_isa();
+        std::visit(
+            [&](auto &image) {
+                if (isa == IsaLevel::Avx512)
+                    compact_detail::add_tile_avx512(image, tile, local, firstSample, numSamples);
+                else if (isa == IsaLevel::Avx2)
+                    compact_detail::add_tile_avx2(image, tile, local, firstSample, numSamples);
+                else
+                    compact_detail::add_tile_generic(image, tile, local, firstSample, numSamples);
+            },
+            pixels);
+    }
+
+    // Mean radiance of rows [y0, y0 + rows.height), rows.width must be width
+    void decode_rows(int y0, Image<float, 3> &rows) const
+    {
+        const IsaLevel isa = active_isa();
+        std::visit(
+            [&](const auto &image) {
+                if (isa == IsaLevel::Avx512)
+                    compact_detail::decode_rows_avx512(image, y0, rows);
+                else if (isa == IsaLevel::Avx2)
+                    compact_detail::decode_rows_avx2(image, y0, rows);
+                else
+                    compact_detail::decode_rows_generic(image, y0, rows);
+            },
+            pixels);
+    }
+
+    int width;
+    int height;
+
+private:
+    PixelStorage storage;
+    std::variant<Image<float, 3>, Image<half, 3>, Image<Rgb9e5, 1>> pixels{std::in_place_index<0>, 0, 0};
+};
+
+// Gamma-corrects and quantizes to 8 bits like resolve(), a band of rows at a time so no float
+// copy of the whole image is made
+inline void resolve(const CompactFramebuffer &framebuffer, Image<char, 3> &img)
+{
+    constexpr int band_rows = 16;
+    for (int y0 = 0; y0 < framebuffer.height; y0 += band_rows)
+    {
+        Image<float, 3> rows(framebuffer.width, std::min(band_rows, framebuffer.height - y0));
+        framebuffer.decode_rows(y0, rows);
+        Image<char, 3> out(framebuffer.width, rows.height);
+        resolve(rows, 1, out);
+        std::copy_n(out.data.get(), static_cast<size_t>(out.width) * out.height * 3, &img[y0][0]);
+    }
+}
+
+// Mean linear radiance as a float image, for writers that take one (save_exr())
+inline Image<float, 3> to_float_image(const CompactFramebuffer &framebuffer)
+{
+    Image<float, 3> mean(framebuffer.width, framebuffer.height);
+    framebuffer.decode_rows(0, mean);
+    return mean;
+}
+
+// As render_samples() into radiance sums, but into a CompactFramebuffer holding the mean of
+// samples [0, firstSample): afterwards it holds the mean of [0, firstSample + numSamples). Tiles
+// are rendered in float and flushed into the framebuffer as they finish.
+template <class Kernel>
+RenderStats render_samples(const Camera& camera, const Kernel& kernel, CompactFramebuffer& framebuffer, int firstSample,
+                           int numSamples, uint64_t seed = default_seed, const RenderSettings& settings = {})
+{
+    return render_detail::render_tiles(camera, kernel, framebuffer.width, framebuffer.height, firstSample, numSamples,
+                                       nullptr, seed, settings, [&](const Tile &tile, const Image<float, 3> &local) {
+                                           framebuffer.add_tile(tile, local, firstSample, numSamples);
+                                       });
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "image.h"
+#include "tiles.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Per-pixel render cost. Cost varies by orders of magnitude across a frame: a sky pixel is done after
+// one missed ray while a pixel behind glass bounces to the depth limit, so equal-sized tiles take
+// very different times. A CostMap records what each pixel cost per sample in the passes that rendered
+// it, in wall time and traced rays, for diagnostics (cost_heatmap()) and for the scheduler:
+// partition_by_cost() splits the tile grid until no tile carries more than a small share of the
+// predicted pass time and hands tiles out most expensive first, so no worker is left with one
+// heavy tile while the others idle at the end of a pass.
+
+enum class CostMetric
+{
+    Time,
+    Rays,
+};
+
+class CostMap
+{
+public:
+    CostMap() = default;
+    CostMap(int _width, int _height) { resize(_width, _height); }
+
+    // Clears the map when the size changes
+    void resize(int _width, int _height)
+    {
+        if (_width == width && _height == height)
+            return;
+        width = _width;
+        height = _height;
+        nanoseconds.assign(static_cast<size_t>(width) * height, -1.f);
+        rays.assign(static_cast<size_t>(width) * height, 0.f);
+    }
+
+    // Cost of one pixel over samples samples; a later pass replaces the pixel's earlier cost
+    void record(uint32_t pixelIndex, double seconds, uint64_t pixelRays, int samples)
+    {
+        nanoseconds[pixelIndex] = static_cast<float>(seconds * 1e9 / samples);
+        rays[pixelIndex] = static_cast<float>(double(pixelRays) / samples);
+    }
+
+    bool recorded(uint32_t pixelIndex) const { return nanoseconds[pixelIndex] >= 0.f; }
+
+    // Per sample, 0 for pixels not recorded yet
+    float cost(uint32_t pixelIndex, CostMetric metric = CostMetric::Time) const
+    {
+        if (!recorded(pixelIndex))
+            return 0.f;
+        return metric == CostMetric::Time ? nanoseconds[pixelIndex] : rays[pixelIndex];
+    }
+
+    // Mean per-sample cost of the recorded pixels, 0 if there are none
+    double mean_cost(CostMetric metric = CostMetric::Time) const
+    {
+        double sum = 0.0;
+        size_t count = 0;
+        for (uint32_t i = 0; i < nanoseconds.size(); ++i)
+        {
+            if (recorded(i))
+            {
+                sum += cost(i, metric);
+                ++count;
+            }
+        }
+        return count ? sum / count : 0.0;
+    }
+
+    // Predicted nanoseconds of rendering tile with numSamples, or sampleCounts per pixel when set;
+    // pixels not recorded yet count as fallback per sample
+    double predict(const Tile &tile, int numSamples, const int *sampleCounts, double fallback) const
+    {
+        double sum = 0.0;
+        for (int y = tile.y0; y < tile.y1; ++y)
+        {
+            for (int x = tile.x0; x < tile.x1; ++x)
+            {
+                const auto index = static_cast<uint32_t>(y * width + x);
+                const int samples = sampleCounts ? sampleCounts[index] : numSamples;
+                sum += samples * (recorded(index) ? nanoseconds[index] : fallback);
+            }
+        }
+        return sum;
+    }
+
+    int width = 0;
+    int height = 0;
+
+private:
+    std::vector<float> nanoseconds; // per sample, negative where not recorded
+    std::vector<float> rays;        // per sample
+};
+
+// Splits tiles into quadrants while one carries more than 1 / (workers * tiles_per_worker) of the
+// predicted pass and is wider than min_tile_edge, and orders the result by predicted cost, highest
+// first. The tiles still cover every pixel exactly once, so the image is unchanged. Returns tiles
+// as they are when there is nothing to balance: one worker or no recorded cost.
+inline std::vector<Tile> partition_by_cost(const std::vector<Tile> &tiles, const CostMap &costs, int numSamples,
+                                           const int *sampleCounts, unsigned workers)
+{
+    constexpr unsigned tiles_per_worker = 8;
+    constexpr int min_tile_edge = 8;
+
+    const double fallback = costs.mean_cost();
+    if (workers < 2 || fallback <= 0.0)
+        return tiles;
+
+    struct Weighted
+    {
+        Tile tile;
+        double cost;
+    };
+    std::vector<Weighted> pending;
+    double total = 0.0;
+    for (const auto &tile : tiles)
+    {
+        pending.push_back({tile, costs.predict(tile, numSamples, sampleCounts, fallback)});
+        total += pending.back().cost;
+    }
+    if (total <= 0.0)
+        return tiles;
+    const double limit = total / (workers * tiles_per_worker);
+
+    std::vector<Weighted> result;
+    while (!pending.empty())
+    {
+        const Weighted current = pending.back();
+        pending.pop_back();
+        const Tile &t = current.tile;
+        if (current.cost <= limit || std::max(t.x1 - t.x0, t.y1 - t.y0) <= min_tile_edge)
+        {
+            result.push_back(current);
+            continue;
+        }
+        const int xm = t.x1 - t.x0 > min_tile_edge ? (t.x0 + t.x1) / 2 : t.x1;
+        const int ym = t.y1 - t.y0 > min_tile_edge ? (t.y0 + t.y1) / 2 : t.y1;
+        for (const Tile &part : {Tile{t.x0, t.y0, xm, ym}, Tile{xm, t.y0, t.x1, ym}, Tile{t.x0, ym, xm, t.y1},
+                                 Tile{xm, ym, t.x1, t.y1}})
+            if (part.x0 < part.x1 && part.y0 < part.y1)
+                pending.push_back({part, costs.predict(part, numSamples, sampleCounts, fallback)});
+    }
+
+    std::stable_sort(result.begin(), result.end(), [](const Weighted &a, const Weighted &b) { return a.cost > b.cost; });
+    std::vector<Tile> ordered;
+    ordered.reserve(result.size());
+    for (const auto &weighted : result)
+        ordered.push_back(weighted.tile);
+    return ordered;
+}
+
+// Log-scaled false-colour image of the per-sample cost, black (cheapest) through purple and orange
+// to pale yellow at the 99.5th percentile and above; pixels not recorded are black
+inline void cost_heatmap(const CostMap &costs, CostMetric metric, Image<char, 3> &img)
+{
+    std::vector<float> values;
+    for (uint32_t i = 0; i < static_cast<uint32_t>(costs.width * costs.height); ++i)
+        if (costs.recorded(i) && costs.cost(i, metric) > 0.f)
+            values.push_back(costs.cost(i, metric));
+    float lo = 1.f, hi = 1.f;
+    if (!values.empty())
+    {
+        lo = *std::min_element(values.begin(), values.end());
+        auto top = values.begin() + static_cast<std::ptrdiff_t>((values.size() - 1) * 0.995);
+        std::nth_element(values.begin(), top, values.end());
+        hi = std::max(*top, lo * 1.0001f);
+    }
+
+    static constexpr std::array<std::array<float, 3>, 5> stops{{
+        {0.f, 0.f, 4.f}, {87.f, 16.f, 110.f}, {188.f, 55.f, 84.f}, {249.f, 142.f, 9.f}, {252.f, 255.f, 164.f},
+    }};
+    for (int y = 0; y < img.height; ++y)
+    {
+        for (int x = 0; x < img.width; ++x)
+        {
+            const auto index = static_cast<uint32_t>(y * costs.width + x);
+            const float value = costs.cost(index, metric);
+            const float t = value > 0.f ? std::clamp(std::log(value / lo) / std::log(hi / lo), 0.f, 1.f) : 0.f;
+            const float position = t * (stops.size() - 1);
+            const size_t stop = std::min(static_cast<size_t>(position), stops.size() - 2);
+            const float f = position - stop;
+            auto *pixel = &img[y][x];
+            for (int c = 0; c < 3; ++c)
+                pixel[c] = static_cast<char>(static_cast<int>(stops[stop][c] + (stops[stop + 1][c] - stops[stop][c]) * f + 0.5f));
+        }
+    }
+}
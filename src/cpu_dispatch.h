@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdlib>
+#include <optional>
+#include <string>
+
+// Runtime selection of the instruction set the hot loops run with. The build itself targets the
+// generic x86-64 baseline (SSE2), so the binary starts on every machine; the functions marked with
+// RT_TARGET_AVX2 / RT_TARGET_AVX512 are additional copies compiled for those levels, and callers
+// branch once per tile or row on active_isa(). The pick is the best level the CPU reports through
+// CPUID, lowered by RT_ISA=generic|avx2|avx512 in the environment or set_isa() for testing.
+//
+// Floating-point contraction is disabled for the whole build (CMakeLists.txt), so every level
+// computes bit-identical images and a render farm can mix machines without visible seams.
+
+enum class IsaLevel
+{
+    Generic, // x86-64 baseline (SSE2), or whatever the compiler targets elsewhere
+    Avx2,    // AVX2 + FMA + BMI2 (x86-64-v3)
+    Avx512,  // AVX-512 F/BW/VL on top of AVX2
+};
+
+inline const char *to_string(IsaLevel isa)
+{
+    switch (isa)
+    {
+    case IsaLevel::Avx2:
+        return "avx2";
+    case IsaLevel::Avx512:
+        return "avx512";
+    default:
+        return "generic";
+    }
+}
+
+inline std::optional<IsaLevel> isa_level_from_string(const std::string &name)
+{
+    if (name == "generic")
+        return IsaLevel::Generic;
+    if (name == "avx2")
+        return IsaLevel::Avx2;
+    if (name == "avx512")
+        return IsaLevel::Avx512;
+    return std::nullopt;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define RT_HAVE_ISA_DISPATCH 1
+#define RT_TARGET_AVX2 __attribute__((target("avx2,fma,bmi,bmi2,lzcnt,movbe,popcnt"), flatten))
+#define RT_TARGET_AVX512 __attribute__((target("avx2,fma,bmi,bmi2,lzcnt,movbe,popcnt,avx512f,avx512bw,avx512vl,avx512dq,avx512cd"), flatten))
+#else
+#define RT_HAVE_ISA_DISPATCH 0
+#define RT_TARGET_AVX2
+#define RT_TARGET_AVX512
+#endif
+
+// For the shared body of the per-ISA copies, so it is compiled once into each of them
+#if defined(__GNUC__)
+#define RT_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define RT_ALWAYS_INLINE inline
+#endif
+
+// Best level the CPU (and OS, which CPUID-based checks of the compiler runtime include) supports
+inline IsaLevel detect_isa()
+{
+#if RT_HAVE_ISA_DISPATCH
+    __builtin_cpu_init();
+    const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("bmi2");
+    if (avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512cd"))
+        return IsaLevel::Avx512;
+    if (avx2)
+        return IsaLevel::Avx2;
+#endif
+    return IsaLevel::Generic;
+}
+
+namespace isa_detail
+{
+    inline IsaLevel &selected()
+    {
+        static IsaLevel isa = [] {
+            IsaLevel best = detect_isa();
+            if (const char *env = std::getenv("RT_ISA"))
+                if (const auto requested = isa_level_from_string(env); requested && *requested < best)
+                    best = *requested;
+            return best;
+        }();
+        return isa;
+    }
+} // namespace isa_detail
+
+inline IsaLevel active_isa() { return isa_detail::selected(); }
+
+// Selects isa, capped at what the CPU supports; returns the level actually in use
+inline IsaLevel set_isa(IsaLevel isa)
+{
+    const IsaLevel best = detect_isa();
+    isa_detail::selected() = isa < best ? isa : best;
+    return isa_detail::selected();
+}
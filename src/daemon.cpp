@@ -0,0 +1,284 @@
+// Render daemon: keeps scenes and acceleration structures warm between jobs and serves a line
+// protocol on a Unix domain socket.
+//
+// usage: ray_tracing_daemon [--socket PATH] [--threads N] [--scene-cache N] [--kept-results N]
+//                           [--max-pass N]
+//
+// Requests, one per line; every response starts with "ok" or "error <message>":
+//   submit key=value ...        -> ok <id>            (keys: see parse_job in render_service.h)
+//   status <id>                 -> ok <state> <samples done> <spp> <seconds>
+//   wait <id>                   -> same as status, once the job has finished
+//   cancel <id>                 -> ok
+//   result <id> [float|rgb8]    -> ok <width> <height> <format> <bytes>, then the raw pixels:
+//                                  float: mean linear radiance, 3 little-endian float32 per pixel
+//                                  rgb8: gamma-corrected 8-bit RGB; rows top to bottom
+//   stats                       -> ok <queued jobs> <cached scenes> <scene cache hits> <misses>
+//   shutdown                    -> ok, then the daemon exits
+
+#include "render_service.h"
+
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+    bool write_all(int fd, const void *data, size_t size)
+    {
+        const auto *bytes = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            const ssize_t written = ::send(fd, bytes, size, MSG_NOSIGNAL);
+            if (written <= 0)
+                return false;
+            bytes += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    bool write_line(int fd, const std::string &line)
+    {
+        const std::string text = line + "\n";
+        return write_all(fd, text.data(), text.size());
+    }
+
+    // Buffered reader for newline-terminated requests
+    class LineReader
+    {
+    public:
+        explicit LineReader(int _fd) : fd(_fd) {}
+
+        bool next(std::string &line)
+        {
+            for (;;)
+            {
+                const auto newline = buffer.find('\n');
+                if (newline != std::string::npos)
+                {
+                    line = buffer.substr(0, newline);
+                    buffer.erase(0, newline + 1);
+                    if (!line.empty() && line.back() == '\r')
+                        line.pop_back();
+                    return true;
+                }
+                char chunk[4096];
+                const ssize_t received = ::recv(fd, chunk, sizeof(chunk), 0);
+                if (received <= 0)
+                    return false;
+                buffer.append(chunk, static_cast<size_t>(received));
+            }
+        }
+
+    private:
+        int fd;
+        std::string buffer;
+    };
+
+    std::string status_line(const JobStatus &status)
+    {
+        std::ostringstream line;
+        line << "ok " << to_string(status.state) << " " << status.samplesDone << " " << status.spp << " " << status.seconds;
+        return line.str();
+    }
+
+    // Serves one connection until the client closes it; returns true when it asked for shutdown
+    bool serve(int fd, RenderService &service)
+    {
+        LineReader reader(fd);
+        for (std::string line; reader.next(line);)
+        {
+            std::istringstream request(line);
+            std::string command;
+            request >> command;
+            uint64_t id = 0;
+
+            if (command == "submit")
+            {
+                std::string rest, error;
+                std::getline(request, rest);
+                const auto job = parse_job(rest, error);
+                write_line(fd, job ? "ok " + std::to_string(service.submit(*job)) : "error " + error);
+            }
+            else if (command == "status" || command == "wait")
+            {
+                request >> id;
+                const auto status = command == "wait" ? service.wait(id) : service.status(id);
+                write_line(fd, status ? status_line(*status) : "error unknown job");
+            }
+            else if (command == "cancel")
+            {
+                request >> id;
+                write_line(fd, service.cancel(id) ? "ok" : "error job not pending");
+            }
+            else if (command == "result")
+            {
+                std::string format = "float";
+                request >> id >> format;
+                const auto image = service.result(id);
+                if (!image || (format != "float" && format != "rgb8"))
+                {
+                    write_line(fd, image ? "error unknown format" : "error no result");
+                    continue;
+                }
+
+                const size_t pixels = static_cast<size_t>(image->width) * image->height;
+                std::ostringstream header;
+                header << "ok " << image->width << " " << image->height << " " << format << " ";
+                if (format == "float")
+                {
+                    header << pixels * 3 * sizeof(float);
+                    write_line(fd, header.str());
+                    write_all(fd, image->data.get(), pixels * 3 * sizeof(float));
+                }
+                else
+                {
+                    // resolve() expects radiance sums; the stored image is already the mean
+                    Image<char, 3> rgb(image->width, image->height);
+                    resolve(*image, 1, rgb);
+                    header << pixels * 3;
+                    write_line(fd, header.str());
+                    write_all(fd, rgb.data.get(), pixels * 3);
+                }
+            }
+            else if (command == "stats")
+            {
+                const auto &scenes = service.scene_cache();
+                std::ostringstream response;
+                response << "ok " << service.queued() << " " << scenes.size() << " " << scenes.hits() << " " << scenes.misses();
+                write_line(fd, response.str());
+            }
+            else if (command == "shutdown")
+            {
+                write_line(fd, "ok");
+                return true;
+            }
+            else if (!command.empty())
+            {
+                write_line(fd, "error unknown command " + command);
+            }
+        }
+        return false;
+    }
+} // namespace
+
+int main(int argc, char** argv)
+{
+    std::string socketPath = "/tmp/ray_tracing.sock";
+    RenderServiceSettings settings;
+    for (int i = 1; i < argc; i += 2)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            std::cerr << "usage: ray_tracing_daemon [--option value]... (options: see the top of src/daemon.cpp)"
+                      << std::endl;
+            return 1;
+        }
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return 1;
+        }
+        const std::string value = argv[i + 1];
+        try
+        {
+            if (arg == "--socket")
+                socketPath = value;
+            else if (arg == "--threads")
+                settings.threads = static_cast<unsigned>(std::max(1, std::stoi(value)));
+            else if (arg == "--scene-cache")
+                settings.sceneCacheSize = std::stoull(value);
+            else if (arg == "--kept-results")
+                settings.keptResults = std::stoull(value);
+            else if (arg == "--max-pass")
+                settings.maxPassSamples = std::stoi(value);
+            else
+            {
+                std::cerr << "Unknown option " << arg << std::endl;
+                return 1;
+            }
+        }
+        catch (const std::exception&)
+        {
+            std::cerr << "Bad value for " << arg << ": " << value << std::endl;
+            return 1;
+        }
+    }
+
+    const int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (listener < 0 || socketPath.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "Cannot create socket " << socketPath << std::endl;
+        return 1;
+    }
+    socketPath.copy(address.sun_path, socketPath.size());
+    ::unlink(socketPath.c_str());
+    if (::bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 || ::listen(listener, 64) != 0)
+    {
+        std::cerr << "Cannot listen on " << socketPath << std::endl;
+        return 1;
+    }
+    std::cout << "Listening on " << socketPath << std::endl;
+
+    RenderService service(settings);
+    struct Connection
+    {
+        int fd;
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+    std::vector<Connection> connections;
+    std::atomic<bool> stopping{false};
+    for (;;)
+    {
+        const int client = ::accept(listener, nullptr, nullptr);
+        if (client < 0)
+            break;
+
+        // Reap finished connections
+        for (auto it = connections.begin(); it != connections.end();)
+        {
+            if (*it->done)
+            {
+                it->thread.join();
+                ::close(it->fd);
+                it = connections.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        // One thread per connection, so a blocking "wait" only holds up its own client
+        auto done = std::make_shared<std::atomic<bool>>(false);
+        std::thread thread([client, done, &service, &stopping, listener] {
+            if (serve(client, service) && !stopping.exchange(true))
+                ::shutdown(listener, SHUT_RDWR); // wakes accept() in the main thread
+            *done = true;
+        });
+        connections.push_back({client, std::move(thread), done});
+    }
+
+    // Release waiting clients and close every connection before the service goes away
+    service.stop();
+    for (auto &connection : connections)
+    {
+        ::shutdown(connection.fd, SHUT_RDWR);
+        connection.thread.join();
+        ::close(connection.fd);
+    }
+    ::close(listener);
+    ::unlink(socketPath.c_str());
+    return 0;
+}
@@ -0,0 +1,524 @@
+#pragma once
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <queue>
+#include <vector>
+
+// Self-contained zlib (RFC 1950/1951) encoder for the image writers: greedy LZ77 over hash chains
+// and dynamic Huffman blocks.
+//
+// Large buffers are split into independent chunks that are compressed on separate threads. Every
+// chunk except the last ends in an empty stored block (a "sync flush"), which leaves the stream
+// byte aligned, so the compressed chunks can simply be concatenated. The Adler-32 checksums of the
+// chunks are combined without touching the data again.
+
+namespace deflate
+{
+    constexpr int window_size = 32768;
+    constexpr int min_match = 3;
+    constexpr int max_match = 258;
+    constexpr int hash_bits = 15;
+    constexpr int max_chain = 48;
+    constexpr size_t block_tokens = 1 << 16;
+
+    constexpr std::array<uint16_t, 29> length_base = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+                                                      31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    constexpr std::array<uint8_t, 29> length_extra = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                                      2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    constexpr std::array<uint16_t, 30> dist_base = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                                    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+                                                    6145, 8193, 12289, 16385, 24577};
+    constexpr std::array<uint8_t, 30> dist_extra = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                                    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    constexpr std::array<uint8_t, 19> code_length_order = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+    // A literal when dist == 0, otherwise a back reference of length litlen
+    struct Token
+    {
+        uint16_t litlen;
+        uint16_t dist;
+    };
+
+    inline int length_code(int length)
+    {
+        static const auto table = [] {
+            std::array<uint8_t, max_match + 1> codes{};
+            for (int code = 0, len = min_match; len <= max_match; ++len)
+            {
+                while (code + 1 < 29 && length_base[code + 1] <= len)
+                    ++code;
+                codes[len] = static_cast<uint8_t>(code);
+            }
+            return codes;
+        }();
+        return table[length];
+    }
+
+    inline int dist_code(int dist)
+    {
+        int code = 0;
+        while (code + 1 < 30 && dist_base[code + 1] <= dist)
+            ++code;
+        return code;
+    }
+
+    class BitWriter
+    {
+    public:
+        std::vector<uint8_t> bytes;
+
+        void put(uint32_t value, int count)
+        {
+            buffer |= uint64_t(value) << used;
+            used += count;
+            while (used >= 8)
+            {
+                bytes.push_back(static_cast<uint8_t>(buffer));
+                buffer >>= 8;
+                used -= 8;
+            }
+        }
+
+        void align()
+        {
+            if (used > 0)
+                bytes.push_back(static_cast<uint8_t>(buffer));
+            buffer = 0;
+            used = 0;
+        }
+
+    private:
+        uint64_t buffer = 0;
+        int used = 0;
+    };
+
+    // Huffman code lengths limited to maxLength bits. Lengths come from a regular Huffman tree; if the
+    // tree is too deep the length histogram is rebalanced (as in miniz) and lengths are handed out to
+    // symbols in order of frequency.
+    inline std::vector<uint8_t> code_lengths(const std::vector<uint32_t> &freq, int maxLength)
+    {
+        std::vector<uint8_t> lengths(freq.size(), 0);
+        std::vector<int> symbols;
+        for (size_t i = 0; i < freq.size(); ++i)
+            if (freq[i])
+                symbols.push_back(static_cast<int>(i));
+
+        // A complete code needs two symbols; pad with unused ones
+        for (int i = 0; symbols.size() < 2 && i < static_cast<int>(freq.size()); ++i)
+            if (!freq[i])
+                symbols.push_back(i);
+        if (symbols.size() < 2)
+        {
+            for (auto symbol : symbols)
+                lengths[symbol] = 1;
+            return lengths;
+        }
+
+        struct Node
+        {
+            uint64_t weight;
+            int parent;
+        };
+        std::vector<Node> nodes;
+        nodes.reserve(symbols.size() * 2);
+        using Entry = std::pair<uint64_t, int>;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<>> queue;
+        for (auto symbol : symbols)
+        {
+            queue.emplace(std::max<uint64_t>(freq[symbol], 1), static_cast<int>(nodes.size()));
+            nodes.push_back({std::max<uint64_t>(freq[symbol], 1), -1});
+        }
+        while (queue.size() > 1)
+        {
+            const auto [wa, a] = queue.top();
+            queue.pop();
+            const auto [wb, b] = queue.top();
+            queue.pop();
+            const int parent = static_cast<int>(nodes.size());
+            nodes.push_back({wa + wb, -1});
+            nodes[a].parent = parent;
+            nodes[b].parent = parent;
+            queue.emplace(wa + wb, parent);
+        }
+
+        std::vector<int> histogram(64, 0);
+        for (size_t i = 0; i < symbols.size(); ++i)
+        {
+            int depth = 0;
+            for (int n = static_cast<int>(i); nodes[n].parent >= 0; n = nodes[n].parent)
+                ++depth;
+            ++histogram[std::min(depth, 63)];
+        }
+
+        for (int len = maxLength + 1; len < 64; ++len)
+        {
+            histogram[maxLength] += histogram[len];
+            histogram[len] = 0;
+        }
+        uint64_t kraft = 0;
+        for (int len = 1; len <= maxLength; ++len)
+            kraft += uint64_t(histogram[len]) << (maxLength - len);
+        while (kraft != (uint64_t(1) << maxLength))
+        {
+            --histogram[maxLength];
+            for (int len = maxLength - 1; len > 0; --len)
+            {
+                if (histogram[len])
+                {
+                    --histogram[len];
+                    histogram[len + 1] += 2;
+                    break;
+                }
+            }
+            --kraft;
+        }
+
+        std::stable_sort(symbols.begin(), symbols.end(), [&](int a, int b) { return freq[a] > freq[b]; });
+        size_t next = 0;
+        for (int len = 1; len <= maxLength; ++len)
+            for (int count = 0; count < histogram[len]; ++count)
+                lengths[symbols[next++]] = static_cast<uint8_t>(len);
+        return lengths;
+    }
+
+    // Canonical codes, bit-reversed because deflate emits Huffman codes starting from the MSB
+    inline std::vector<uint16_t> canonical_codes(const std::vector<uint8_t> &lengths)
+    {
+        std::array<uint16_t, 16> count{};
+        for (auto len : lengths)
+            ++count[len];
+        count[0] = 0;
+
+        std::array<uint16_t, 16> next{};
+        uint16_t code = 0;
+        for (int bits = 1; bits < 16; ++bits)
+        {
+            code = static_cast<uint16_t>((code + count[bits - 1]) << 1);
+            next[bits] = code;
+        }
+
+        std::vector<uint16_t> codes(lengths.size(), 0);
+        for (size_t i = 0; i < lengths.size(); ++i)
+        {
+            const int len = lengths[i];
+            if (!len)
+                continue;
+            uint16_t value = next[len]++;
+            uint16_t reversed = 0;
+            for (int b = 0; b < len; ++b)
+            {
+                reversed = static_cast<uint16_t>((reversed << 1) | (value & 1));
+                value >>= 1;
+            }
+            codes[i] = reversed;
+        }
+        return codes;
+    }
+
+    inline void write_block(BitWriter &out, const std::vector<Token> &tokens, bool final)
+    {
+        std::vector<uint32_t> litFreq(286, 0), distFreq(30, 0);
+        for (const auto &token : tokens)
+        {
+            if (token.dist == 0)
+            {
+                ++litFreq[token.litlen];
+            }
+            else
+            {
+                ++litFreq[257 + length_code(token.litlen)];
+                ++distFreq[dist_code(token.dist)];
+            }
+        }
+        litFreq[256] = 1;
+
+        const auto litLengths = code_lengths(litFreq, 15);
+        const auto distLengths = code_lengths(distFreq, 15);
+        const auto litCodes = canonical_codes(litLengths);
+        const auto distCodes = canonical_codes(distLengths);
+
+        int hlit = 286;
+        while (hlit > 257 && litLengths[hlit - 1] == 0)
+            --hlit;
+        int hdist = 30;
+        while (hdist > 1 && distLengths[hdist - 1] == 0)
+            --hdist;
+
+        // Run-length encode the concatenated code lengths with symbols 16/17/18
+        std::vector<uint8_t> all(litLengths.begin(), litLengths.begin() + hlit);
+        all.insert(all.end(), distLengths.begin(), distLengths.begin() + hdist);
+        struct Run
+        {
+            uint8_t symbol;
+            uint8_t extra;
+        };
+        std::vector<Run> runs;
+        std::vector<uint32_t> clFreq(19, 0);
+        for (size_t i = 0; i < all.size();)
+        {
+            const uint8_t len = all[i];
+            size_t run = 1;
+            while (i + run < all.size() && all[i + run] == len)
+                ++run;
+
+            if (len == 0 && run >= 3)
+            {
+                const size_t take = std::min<size_t>(run, 138);
+                if (take >= 11)
+                    runs.push_back({18, static_cast<uint8_t>(take - 11)});
+                else
+                    runs.push_back({17, static_cast<uint8_t>(take - 3)});
+                ++clFreq[runs.back().symbol];
+                i += take;
+            }
+            else if (len != 0 && run >= 4)
+            {
+                runs.push_back({len, 0});
+                ++clFreq[len];
+                const size_t take = std::min<size_t>(run - 1, 6);
+                runs.push_back({16, static_cast<uint8_t>(take - 3)});
+                ++clFreq[16];
+                i += 1 + take;
+            }
+            else
+            {
+                runs.push_back({len, 0});
+                ++clFreq[len];
+                ++i;
+            }
+        }
+
+        const auto clLengths = code_lengths(clFreq, 7);
+        const auto clCodes = canonical_codes(clLengths);
+        int hclen = 19;
+        while (hclen > 4 && clLengths[code_length_order[hclen - 1]] == 0)
+            --hclen;
+
+        out.put(final ? 1 : 0, 1);
+        out.put(2, 2);
+        out.put(hlit - 257, 5);
+        out.put(hdist - 1, 5);
+        out.put(hclen - 4, 4);
+        for (int i = 0; i < hclen; ++i)
+            out.put(clLengths[code_length_order[i]], 3);
+        for (const auto &run : runs)
+        {
+            out.put(clCodes[run.symbol], clLengths[run.symbol]);
+            if (run.symbol == 16)
+                out.put(run.extra, 2);
+            else if (run.symbol == 17)
+                out.put(run.extra, 3);
+            else if (run.symbol == 18)
+                out.put(run.extra, 7);
+        }
+
+        for (const auto &token : tokens)
+        {
+            if (token.dist == 0)
+            {
+                out.put(litCodes[token.litlen], litLengths[token.litlen]);
+                continue;
+            }
+            const int lc = length_code(token.litlen);
+            out.put(litCodes[257 + lc], litLengths[257 + lc]);
+            out.put(token.litlen - length_base[lc], length_extra[lc]);
+            const int dc = dist_code(token.dist);
+            out.put(distCodes[dc], distLengths[dc]);
+            out.put(token.dist - dist_base[dc], dist_extra[dc]);
+        }
+        out.put(litCodes[256], litLengths[256]);
+    }
+
+    // Raw deflate data for one chunk. A non-final chunk ends byte aligned after a sync flush.
+    inline std::vector<uint8_t> compress_chunk(const uint8_t *data, size_t size, bool final)
+    {
+        BitWriter out;
+        std::vector<int32_t> head(size_t(1) << hash_bits, -1);
+        std::vector<int32_t> prev(window_size, -1);
+        auto hash = [&](size_t pos) {
+            const uint32_t v = data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16);
+            return (v * 2654435761u) >> (32 - hash_bits);
+        };
+        auto insert = [&](size_t pos) {
+            if (pos + min_match > size)
+                return;
+            const auto h = hash(pos);
+            prev[pos & (window_size - 1)] = head[h];
+            head[h] = static_cast<int32_t>(pos);
+        };
+
+        std::vector<Token> tokens;
+        tokens.reserve(std::min(size, block_tokens) + 1);
+        size_t pos = 0;
+        while (pos < size)
+        {
+            int bestLength = 0;
+            int bestDist = 0;
+            if (pos + min_match <= size)
+            {
+                const size_t limit = std::min<size_t>(max_match, size - pos);
+                int32_t candidate = head[hash(pos)];
+                for (int chain = max_chain; candidate >= 0 && chain > 0; --chain)
+                {
+                    const size_t dist = pos - candidate;
+                    if (dist > window_size)
+                        break;
+                    if (data[candidate + bestLength] == data[pos + bestLength])
+                    {
+                        size_t len = 0;
+                        while (len < limit && data[candidate + len] == data[pos + len])
+                            ++len;
+                        if (static_cast<int>(len) > bestLength)
+                        {
+                            bestLength = static_cast<int>(len);
+                            bestDist = static_cast<int>(dist);
+                            if (len == limit)
+                                break;
+                        }
+                    }
+                    const int32_t next = prev[candidate & (window_size - 1)];
+                    if (next >= candidate)
+                        break;
+                    candidate = next;
+                }
+            }
+
+            if (bestLength >= min_match)
+            {
+                tokens.push_back({static_cast<uint16_t>(bestLength), static_cast<uint16_t>(bestDist)});
+                for (int i = 0; i < bestLength; ++i)
+                    insert(pos + i);
+                pos += bestLength;
+            }
+            else
+            {
+                tokens.push_back({data[pos], 0});
+                insert(pos);
+                ++pos;
+            }
+
+            if (tokens.size() >= block_tokens && pos < size)
+            {
+                write_block(out, tokens, false);
+                tokens.clear();
+            }
+        }
+
+        write_block(out, tokens, final);
+        if (!final)
+        {
+            // Empty stored block: re-aligns the stream to a byte boundary
+            out.put(0, 3);
+            out.align();
+            const uint8_t marker[] = {0x00, 0x00, 0xff, 0xff};
+            out.bytes.insert(out.bytes.end(), std::begin(marker), std::end(marker));
+        }
+        out.align();
+        return std::move(out.bytes);
+    }
+
+    constexpr uint32_t adler_base = 65521;
+
+    inline uint32_t adler32(const uint8_t *data, size_t size, uint32_t adler = 1)
+    {
+        uint32_t a = adler & 0xffff;
+        uint32_t b = adler >> 16;
+        while (size > 0)
+        {
+            const size_t n = std::min<size_t>(size, 5552);
+            for (size_t i = 0; i < n; ++i)
+            {
+                a += data[i];
+                b += a;
+            }
+            a %= adler_base;
+            b %= adler_base;
+            data += n;
+            size -= n;
+        }
+        return (b << 16) | a;
+    }
+
+    // Checksum of A followed by B, from the checksums of A and B and the length of B (zlib's adler32_combine)
+    inline uint32_t adler32_combine(uint32_t adlerA, uint32_t adlerB, size_t sizeB)
+    {
+        const uint32_t rem = static_cast<uint32_t>(sizeB % adler_base);
+        uint32_t sum1 = adlerA & 0xffff;
+        uint32_t sum2 = static_cast<uint32_t>((uint64_t(rem) * sum1) % adler_base);
+        sum1 += (adlerB & 0xffff) + adler_base - 1;
+        sum2 += (adlerA >> 16) + (adlerB >> 16) + adler_base - rem;
+        if (sum1 >= adler_base)
+            sum1 -= adler_base;
+        if (sum1 >= adler_base)
+            sum1 -= adler_base;
+        if (sum2 >= (adler_base << 1))
+            sum2 -= (adler_base << 1);
+        if (sum2 >= adler_base)
+            sum2 -= adler_base;
+        return sum1 | (sum2 << 16);
+    }
+
+    inline uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0)
+    {
+        static const auto table = [] {
+            std::array<uint32_t, 256> entries{};
+            for (uint32_t n = 0; n < 256; ++n)
+            {
+                uint32_t c = n;
+                for (int k = 0; k < 8; ++k)
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                entries[n] = c;
+            }
+            return entries;
+        }();
+
+        crc = ~crc;
+        for (size_t i = 0; i < size; ++i)
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    // zlib stream split into pieces: the first piece starts with the zlib header and the last ends
+    // with the Adler-32 trailer. Concatenated, the pieces form one valid stream; they are kept
+    // apart so container formats (PNG IDAT) can wrap and checksum them in parallel as well.
+    inline std::vector<std::vector<uint8_t>> zlib_compress_chunks(const uint8_t *data, size_t size,
+                                                                  size_t chunkSize = size_t(256) << 10)
+    {
+        const size_t chunkCount = std::max<size_t>(1, (size + chunkSize - 1) / chunkSize);
+        std::vector<std::vector<uint8_t>> pieces(chunkCount);
+        std::vector<uint32_t> checksums(chunkCount);
+        parallel_for(chunkCount, [&](size_t i) {
+            const size_t begin = i * chunkSize;
+            const size_t length = std::min(chunkSize, size - std::min(size, begin));
+            pieces[i] = compress_chunk(data + begin, length, i + 1 == chunkCount);
+            checksums[i] = adler32(data + begin, length);
+        });
+
+        uint32_t adler = checksums[0];
+        for (size_t i = 1; i < chunkCount; ++i)
+            adler = adler32_combine(adler, checksums[i], std::min(chunkSize, size - i * chunkSize));
+
+        // CMF: deflate with a 32K window; FLG: default level, FCHECK makes the pair a multiple of 31
+        pieces.front().insert(pieces.front().begin(), {0x78, 0x9c});
+        const uint8_t trailer[] = {uint8_t(adler >> 24), uint8_t(adler >> 16), uint8_t(adler >> 8), uint8_t(adler)};
+        pieces.back().insert(pieces.back().end(), std::begin(trailer), std::end(trailer));
+        return pieces;
+    }
+
+    // Single-threaded zlib stream, for callers that already parallelize over independent buffers
+    inline std::vector<uint8_t> zlib_compress(const uint8_t *data, size_t size)
+    {
+        std::vector<uint8_t> out = {0x78, 0x9c};
+        const auto body = compress_chunk(data, size, true);
+        out.insert(out.end(), body.begin(), body.end());
+        const uint32_t adler = adler32(data, size);
+        const uint8_t trailer[] = {uint8_t(adler >> 24), uint8_t(adler >> 16), uint8_t(adler >> 8), uint8_t(adler)};
+        out.insert(out.end(), std::begin(trailer), std::end(trailer));
+        return out;
+    }
+} // namespace deflate
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "hittable.h"
+#include "math.hpp"
+#include "ray.h"
+#include "rng.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+// Image-based lighting from a lat-long environment map. The map is a tiled texture (texture.h), so
+// only the tiles that rays actually look at are resident. For next-event estimation the map carries
+// a piecewise-constant 2D distribution proportional to luminance times sin(theta), the marginal CDF
+// over rows and one conditional CDF per row (PBRT's Distribution2D). It is built from the finest mip
+// level no wider than distributionWidth, so building it pages in a bounded part of a large map.
+//
+// Lat-long convention: u wraps around the y axis with u = 0.5 looking down -z, and v = 0 is +y.
+
+class EnvironmentMap
+{
+public:
+    struct Sample
+    {
+        Vec3 direction; // unit length
+        Vec3 radiance;
+        float pdf = 0.f; // per steradian
+    };
+
+    EnvironmentMap(Texture _texture, float _scale = 1.f, int distributionWidth = 1024)
+        : texture(std::move(_texture)), scale(_scale)
+    {
+        level = 0;
+        while (level + 1 < texture.level_count() && texture.width(level) > distributionWidth)
+            ++level;
+        width = texture.width(level);
+        height = texture.height(level);
+
+        std::vector<float> luminance(static_cast<size_t>(width) * height);
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                const Vec3 c = texture.texel(x, y, level);
+                luminance[static_cast<size_t>(y) * width + x] = std::max(0.f, 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z);
+            }
+        }
+
+        func.resize(static_cast<size_t>(width) * height);
+        rowCdf.resize(static_cast<size_t>(width + 1) * height);
+        marginalCdf.resize(height + 1);
+        for (int y = 0; y < height; ++y)
+        {
+            const float sinTheta = std::sin(pi * (y + 0.5f) / height);
+            float *cdf = &rowCdf[static_cast<size_t>(y) * (width + 1)];
+            cdf[0] = 0.f;
+            for (int x = 0; x < width; ++x)
+            {
+                // Bilinear lookups inside a texel read its 3x3 neighbourhood; taking the brightest keeps
+                // radiance / pdf bounded next to a small bright source such as the sun
+                float brightest = 0.f;
+                for (int dy = -1; dy <= 1; ++dy)
+                {
+                    const int ny = std::clamp(y + dy, 0, height - 1);
+                    for (int dx = -1; dx <= 1; ++dx)
+                        brightest = std::max(brightest, luminance[static_cast<size_t>(ny) * width + (x + dx + width) % width]);
+                }
+                const float value = brightest * sinTheta;
+                func[static_cast<size_t>(y) * width + x] = value;
+                cdf[x + 1] = cdf[x] + value;
+            }
+            marginalCdf[y + 1] = marginalCdf[y] + cdf[width];
+        }
+        total = marginalCdf[height];
+        for (int y = 0; y < height; ++y)
+            normalize(&rowCdf[static_cast<size_t>(y) * (width + 1)], width);
+        normalize(marginalCdf.data(), height);
+    }
+
+    Vec3 radiance(const Vec3 &direction) const
+    {
+        const auto [u, v] = to_uv(direction);
+        return texture.lookup(u, v) * scale;
+    }
+
+    // Direction drawn proportionally to the distribution, with its radiance and solid-angle pdf
+    Sample sample(float u0, float u1) const
+    {
+        if (total <= 0.f)
+            return {};
+        int y = 0, x = 0;
+        const float v = sample_continuous(marginalCdf.data(), height, u1, y);
+        const float u = sample_continuous(&rowCdf[static_cast<size_t>(y) * (width + 1)], width, u0, x);
+
+        const float theta = pi * v;
+        const float phi = 2.f * pi * (u - 0.5f);
+        const float sinTheta = std::sin(theta);
+        if (sinTheta <= 0.f)
+            return {};
+        const Vec3 direction(sinTheta * std::sin(phi), std::cos(theta), -sinTheta * std::cos(phi));
+        // pdf() of the direction rather than of the bucket: both strategies of the MIS weights have
+        // to agree on samples that round into a neighbouring texel
+        return {direction, texture.lookup(u, v) * scale, pdf(direction)};
+    }
+
+    // Solid-angle pdf of sample() producing the unit vector direction
+    float pdf(const Vec3 &direction) const
+    {
+        if (total <= 0.f)
+            return 0.f;
+        const auto [u, v] = to_uv(direction);
+        const float sinTheta = std::sqrt(std::max(0.f, 1.f - direction.y * direction.y));
+        if (sinTheta <= 0.f)
+            return 0.f;
+        const int x = std::clamp(static_cast<int>(u * width), 0, width - 1);
+        const int y = std::clamp(static_cast<int>(v * height), 0, height - 1);
+        const float pdfUv = func[static_cast<size_t>(y) * width + x] * width * height / total;
+        return pdfUv / (2.f * pi * pi * sinTheta);
+    }
+
+    const Texture &map() const { return texture; }
+    int distribution_level() const { return level; }
+
+private:
+    static constexpr float pi = 3.14159265358979f;
+
+    static std::pair<float, float> to_uv(const Vec3 &direction)
+    {
+        const float u = 0.5f + std::atan2(direction.x, -direction.z) / (2.f * pi);
+        const float v = std::acos(std::clamp(direction.y, -1.f, 1.f)) / pi;
+        return {u, v};
+    }
+
+    static void normalize(float *cdf, int n)
+    {
+        const float sum = cdf[n];
+        for (int i = 1; i <= n; ++i)
+            cdf[i] = sum > 0.f ? cdf[i] / sum : static_cast<float>(i) / n;
+    }
+
+    // Inverts a piecewise-constant CDF of n buckets; offset receives the bucket
+    static float sample_continuous(const float *cdf, int n, float u, int &offset)
+    {
+        offset = std::clamp(static_cast<int>(std::upper_bound(cdf, cdf + n + 1, u) - cdf) - 1, 0, n - 1);
+        const float width = cdf[offset + 1] - cdf[offset];
+        const float du = width > 0.f ? (u - cdf[offset]) / width : 0.f;
+        return (offset + du) / n;
+    }
+
+    Texture texture;
+    float scale;
+    int level = 0;
+    int width = 0;
+    int height = 0;
+    std::vector<float> func;        // luminance * sin(theta) per texel of the distribution level
+    std::vector<float> rowCdf;      // width + 1 entries per row
+    std::vector<float> marginalCdf; // height + 1 entries
+    float total = 0.f;
+};
+
+// Environment light reaching a diffuse hit, sampled from the map and weighted against cosine-weighted
+// scattering with the balance heuristic. The caller multiplies by the path throughput including the
+// albedo. Draws two numbers from sampler and traces one shadow ray through kernel.
+template <class Kernel>
+Vec3 environment_light(const Kernel &kernel, const EnvironmentMap &environment, const HitRecord &rec, Sampler &sampler)
+{
+    const float u0 = sampler.next();
+    const auto light = environment.sample(u0, sampler.next());
+    const float cosine = dot(light.direction, rec.normal);
+    if (light.pdf <= 0.f || cosine <= 0.f)
+        return {0.f, 0.f, 0.f};
+    if (kernel.intersect(Ray(rec.p, light.direction)))
+        return {0.f, 0.f, 0.f};
+    // f * cos / pdf_light * w_light with f = albedo / pi; the albedo is in the throughput
+    const float scatterPdf = cosine / 3.14159265358979f;
+    return light.radiance * (scatterPdf / (light.pdf + scatterPdf));
+}
+
+// Balance-heuristic weight of the environment seen by a ray scattered off a diffuse surface
+inline float scattered_environment_weight(const EnvironmentMap &environment, const Vec3 &normal, const Vec3 &direction)
+{
+    const Vec3 unit = unit_vector(direction);
+    const float scatterPdf = std::max(0.f, dot(unit, normal)) / 3.14159265358979f;
+    const float lightPdf = environment.pdf(unit);
+    return scatterPdf + lightPdf > 0.f ? scatterPdf / (scatterPdf + lightPdf) : 0.f;
+}
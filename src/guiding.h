@@ -0,0 +1,273 @@
+#pragma once
+
+#include "hittable.h"
+#include "kernel.h"
+#include "math.hpp"
+#include "radiance_cache.h"
+#include "rng.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Orthonormal basis around a unit normal (Duff et al. 2017, "Building an Orthonormal Basis, Revisited")
+inline void tangent_frame(const Vec3 &n, Vec3 &tangent, Vec3 &bitangent)
+{
+    const float sign = std::copysign(1.f, n.z);
+    const float a = -1.f / (sign + n.z);
+    const float b = n.x * n.y * a;
+    tangent = Vec3(1.f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    bitangent = Vec3(b, sign + n.y * n.y * a, -n.y);
+}
+
+// Path guiding for diffuse surfaces. GuidingField is a hashed grid of spatial cells (the cells of
+// spatial_cell_key()), each with a histogram over the hemisphere around the surface normal of how
+// much light arrives from each direction. The hemisphere is binned on the projected unit disk, 8
+// bins in sin^2(theta) times 16 in phi: every bin has the same share of a cosine-weighted sample,
+// and within a bin directions are cosine distributed. A uniform histogram therefore samples exactly
+// like the lambertian BSDF, and the guided density is the cosine density times bins * p(bin).
+//
+// Training is iterative: render threads add samples to the training histograms with atomic
+// fixed-point adds (no locks, and a cell's totals do not depend on thread interleaving), while
+// sampling reads the distributions frozen by the last update(). update() runs between iterations.
+// Cells claim slots in the order threads first reach them, so once the table is full the set of
+// cells that get trained, and with it the result, can change with the thread count and scheduling;
+// training is only reproducible while every cell the paths reach fits in capacity().
+class GuidingField
+{
+public:
+    static constexpr int theta_bins = 8;
+    static constexpr int phi_bins = 16;
+    static constexpr int bins = theta_bins * phi_bins;
+
+    // Cells are spatial_cell_key() cells; one is used for sampling after it has minSamples samples
+    GuidingField(const Vec3 &_viewpoint, size_t _capacity = 8192, float _cellSize = 0.05f, uint32_t _minSamples = 256)
+        : viewpoint(_viewpoint), cellSize(_cellSize), minSamples(_minSamples)
+    {
+        size_t capacity = 64;
+        while (capacity * 2 <= _capacity)
+            capacity *= 2;
+        mask = capacity - 1;
+        keys = std::make_unique<std::atomic<uint64_t>[]>(capacity);
+        counts = std::make_unique<std::atomic<uint32_t>[]>(capacity);
+        training = std::make_unique<std::atomic<uint64_t>[]>(capacity * bins);
+        cdfs.assign(capacity * bins, 0.f);
+        trained.assign(capacity, 0);
+    }
+
+    // Adds one incident radiance estimate for a direction in the local frame of normal (tangent_frame());
+    // weight is the luminance divided by the sample's density relative to cosine sampling
+    void record(const Vec3 &p, const Vec3 &normal, const Vec3 &local, float weight)
+    {
+        bool claimed = false;
+        const auto slot = find(spatial_cell_key(p, normal, viewpoint, cellSize), &claimed);
+        if (slot < 0)
+            return;
+        const auto fixed = static_cast<uint64_t>(std::clamp(weight, 0.f, fixed_max) * fixed_one + 0.5f);
+        training[slot * bins + direction_bin(local)].fetch_add(fixed, std::memory_order_relaxed);
+        counts[slot].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Rebuilds the sampling distributions from everything recorded so far. Not thread-safe with
+    // respect to sampling; call it between render passes.
+    void update()
+    {
+        for (size_t slot = 0; slot <= mask; ++slot)
+        {
+            trained[slot] = counts[slot].load(std::memory_order_relaxed) >= minSamples;
+            if (!trained[slot])
+                continue;
+            double total = 0.0;
+            for (int b = 0; b < bins; ++b)
+                total += static_cast<double>(training[slot * bins + b].load(std::memory_order_relaxed));
+            if (total <= 0.0)
+            {
+                trained[slot] = 0;
+                continue;
+            }
+            // Blend with a uniform prior worth prior_samples samples per bin: sparse histograms stay
+            // close to cosine sampling, and directions not seen yet remain reachable
+            const double count = counts[slot].load(std::memory_order_relaxed);
+            const double histogramWeight = count / (count + prior_samples * bins);
+            double running = 0.0;
+            for (int b = 0; b < bins; ++b)
+            {
+                const double share = static_cast<double>(training[slot * bins + b].load(std::memory_order_relaxed)) / total;
+                running += histogramWeight * share + (1.0 - histogramWeight) / bins;
+                cdfs[slot * bins + b] = static_cast<float>(running);
+            }
+            cdfs[slot * bins + bins - 1] = 1.f;
+        }
+        ++iterations;
+    }
+
+    // Cumulative bin distribution of the cell around p, or nullptr while the cell is untrained
+    const float *distribution(const Vec3 &p, const Vec3 &normal) const
+    {
+        const auto slot = find(spatial_cell_key(p, normal, viewpoint, cellSize), nullptr);
+        return slot >= 0 && trained[slot] ? &cdfs[slot * bins] : nullptr;
+    }
+
+    // Local direction (z along the normal) drawn from the cell's distribution
+    static Vec3 sample(const float *cdf, float u, const Vec2f &uv)
+    {
+        const int b = std::min(static_cast<int>(std::upper_bound(cdf, cdf + bins, u) - cdf), bins - 1);
+        const float sin2 = ((b / phi_bins) + uv.x) / theta_bins;
+        const float phi = 2.f * pi * ((b % phi_bins) + uv.y) / phi_bins;
+        const float r = std::sqrt(sin2);
+        return {r * std::cos(phi), r * std::sin(phi), std::sqrt(std::max(0.f, 1.f - sin2))};
+    }
+
+    // Density of sample() for a local direction, relative to the cosine density cos(theta) / pi
+    static float cosine_ratio(const float *cdf, const Vec3 &local)
+    {
+        const int b = direction_bin(local);
+        return (b == 0 ? cdf[0] : cdf[b] - cdf[b - 1]) * bins;
+    }
+
+    static int direction_bin(const Vec3 &local)
+    {
+        const float sin2 = std::max(0.f, 1.f - local.z * local.z);
+        const int itheta = std::clamp(static_cast<int>(sin2 * theta_bins), 0, theta_bins - 1);
+        float phi = std::atan2(local.y, local.x);
+        if (phi < 0.f)
+            phi += 2.f * pi;
+        const int iphi = std::clamp(static_cast<int>(phi * phi_bins / (2.f * pi)), 0, phi_bins - 1);
+        return itheta * phi_bins + iphi;
+    }
+
+    size_t capacity() const { return mask + 1; }
+    size_t memory_bytes() const
+    {
+        return capacity() * (sizeof(uint64_t) + sizeof(uint32_t) + 1 + bins * (sizeof(uint64_t) + sizeof(float)));
+    }
+    size_t trained_cells() const { return static_cast<size_t>(std::count(trained.begin(), trained.end(), 1)); }
+    int training_iterations() const { return iterations; }
+
+private:
+    static constexpr float pi = 3.14159265358979f;
+    static constexpr double prior_samples = 4.0;
+    static constexpr float fixed_one = float(1 << 20);
+    static constexpr float fixed_max = 4096.f;
+
+    int64_t find(uint64_t key, bool *claimed) const
+    {
+        return find_cell_slot(mask, key, claimed, [&](size_t i) -> std::atomic<uint64_t> & { return keys[i]; });
+    }
+
+    Vec3 viewpoint;
+    float cellSize;
+    uint32_t minSamples;
+    size_t mask = 0;
+    std::unique_ptr<std::atomic<uint64_t>[]> keys;
+    std::unique_ptr<std::atomic<uint32_t>[]> counts;
+    std::unique_ptr<std::atomic<uint64_t>[]> training; // bins per cell, fixed point
+    std::vector<float> cdfs;                           // bins per cell, frozen by update()
+    std::vector<uint8_t> trained;
+    int iterations = 0;
+};
+
+// Wraps a kernel with guided sampling at diffuse hits. The material's own (cosine) sample is kept
+// with probability 1 - guideFraction, otherwise the direction is drawn from the cell's histogram;
+// either way the sample is weighted by the mixture density, so the estimate stays unbiased.
+// Train passes also feed the incident radiance of each diffuse vertex back into the field.
+template <class Kernel>
+class GuidedKernel
+{
+public:
+    enum class Mode
+    {
+        Train,
+        Render,
+    };
+
+    GuidedKernel(const Kernel &_kernel, GuidingField &_field, Mode _mode, int _max_depth = 50, float _guideFraction = 0.5f)
+        : kernel(_kernel), field(_field), mode(_mode), max_depth(_max_depth), guideFraction(_guideFraction)
+    {
+    }
+
+    Vec3 trace(const Ray &primary, Sampler &sampler) const
+    {
+        // Diffuse vertices of a train pass and the throughput gathered after each of them
+        struct Vertex
+        {
+            Vec3 p;
+            Vec3 normal;
+            Vec3 local;
+            float invRatio; // cosine density over sample density
+            Vec3 throughput;
+        };
+        std::array<Vertex, 8> vertices;
+        int vertexCount = 0;
+
+        auto finish = [&](const Vec3 &throughput, const Vec3 &radiance) {
+            for (int i = 0; i < vertexCount; ++i)
+            {
+                const Vec3 incident = vertices[i].throughput * radiance;
+                const float luminance = 0.2126f * incident.x + 0.7152f * incident.y + 0.0722f * incident.z;
+                field.record(vertices[i].p, vertices[i].normal, vertices[i].local, luminance * vertices[i].invRatio);
+            }
+            return throughput * radiance;
+        };
+
+        Ray ray = primary;
+        Vec3 throughput(1.f, 1.f, 1.f);
+        for (int depth = 0; depth < max_depth; ++depth)
+        {
+            const auto hit = kernel.intersect(ray);
+            if (!hit)
+                return finish(throughput, kernel.escape_radiance(ray));
+
+            Ray scattered;
+            Vec3 attenuation;
+            sampler.start_bounce(depth + 1);
+            if (!kernel.scatter(ray, *hit, attenuation, scattered, sampler))
+                return finish(throughput, {0.f, 0.f, 0.f});
+
+            const HitRecord &rec = kernel.hit_record(*hit);
+            const bool diffuse = kernel.diffuse(*hit);
+            Vec3 local;
+            float invRatio = 1.f;
+            if (diffuse)
+            {
+                // Lambertian: attenuation is the albedo and the material sampled cos / pi
+                Vec3 tangent, bitangent;
+                tangent_frame(rec.normal, tangent, bitangent);
+                const Vec3 direction = unit_vector(scattered.direction());
+                local = Vec3(dot(direction, tangent), dot(direction, bitangent), dot(direction, rec.normal));
+                if (const float *cdf = field.distribution(rec.p, rec.normal))
+                {
+                    if (sampler.next() < guideFraction)
+                    {
+                        local = GuidingField::sample(cdf, sampler.next(), sampler.next_2d());
+                        scattered = Ray(rec.p, local.x * tangent + local.y * bitangent + local.z * rec.normal);
+                    }
+                    invRatio = 1.f / (guideFraction * GuidingField::cosine_ratio(cdf, local) + (1.f - guideFraction));
+                    attenuation = attenuation * invRatio;
+                }
+            }
+
+            if (mode == Mode::Train)
+            {
+                for (int i = 0; i < vertexCount; ++i)
+                    vertices[i].throughput = vertices[i].throughput * attenuation;
+                if (diffuse && vertexCount < static_cast<int>(vertices.size()))
+                    vertices[vertexCount++] = {rec.p, rec.normal, local, invRatio, {1.f, 1.f, 1.f}};
+            }
+            throughput = throughput * attenuation;
+            ray = scattered;
+        }
+        return finish(throughput, {0.f, 0.f, 0.f});
+    }
+
+private:
+    const Kernel &kernel;
+    GuidingField &field;
+    Mode mode;
+    int max_depth;
+    float guideFraction;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+
+// IEEE 754 binary16 storage type. Conversions round to nearest even and keep Inf/NaN
+// (F. Giesen, "half_to_float / float_to_half_fast3_rtne").
+struct half
+{
+    uint16_t bits = 0;
+};
+
+// Both conversions compute every case and select the result instead of branching, so loops over
+// pixels vectorize (the framebuffer conversions in compact_image.h rely on it)
+inline uint16_t float_to_half_bits(float value)
+{
+    constexpr uint32_t f32infty = 255u << 23;
+    constexpr uint32_t f16max = (127u + 16u) << 23;
+    constexpr uint32_t denorm_magic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+    uint32_t f = std::bit_cast<uint32_t>(value);
+    const uint32_t sign = f & 0x80000000u;
+    f ^= sign;
+
+    const uint32_t infNan = f > f32infty ? 0x7e00u : 0x7c00u;
+    // Subnormal result: let the FPU do the rounding by adding a magic number
+    const float rounded = std::bit_cast<float>(f) + std::bit_cast<float>(denorm_magic);
+    const uint32_t subnormal = std::bit_cast<uint32_t>(rounded) - denorm_magic;
+    const uint32_t mant_odd = (f >> 13) & 1;
+    const uint32_t normal = (f + ((15u - 127u) << 23) + 0xfff + mant_odd) >> 13;
+
+    const uint32_t out = f >= f16max ? infNan : (f < (113u << 23) ? subnormal : normal);
+    return static_cast<uint16_t>(out | (sign >> 16));
+}
+
+inline float half_bits_to_float(uint16_t value)
+{
+    constexpr uint32_t shifted_exp = 0x7c00u << 13;
+    const float magic = std::bit_cast<float>(113u << 23);
+
+    const uint32_t bits = (value & 0x7fffu) << 13;
+    const uint32_t exp = shifted_exp & bits;
+    const uint32_t normal = bits + ((127u - 15u) << 23);
+    const uint32_t infNan = normal + ((128u - 16u) << 23);
+    const uint32_t subnormal = std::bit_cast<uint32_t>(std::bit_cast<float>(normal + (1u << 23)) - magic);
+
+    uint32_t out = exp == shifted_exp ? infNan : (exp == 0 ? subnormal : normal);
+    out |= (value & 0x8000u) << 16;
+    return std::bit_cast<float>(out);
+}
+
+inline half to_half(float value)
+{
+    return {float_to_half_bits(value)};
+}
+
+inline float to_float(half value)
+{
+    return half_bits_to_float(value.bits);
+}
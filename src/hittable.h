@@ -1,8 +1,11 @@
 #pragma once
 
+#include "aabb.h"
 #include "math.hpp"
 #include "ray.h"
 
+#include <memory>
+
 #include <optional>
 
 class material;
@@ -13,7 +16,7 @@ struct HitRecord
   Vec3 normal;
   float t;
   bool front_face;
-  std::shared_ptr<material> mat;
+  const material *mat; // owned by the scene
 
   void set_face_normal(const Ray &r, const Vec3 &normal)
   {
@@ -36,4 +39,6 @@ class Hittable {
     virtual ~Hittable() = default;
 
     virtual std::optional<HitRecord> hit(const Ray &r, const Range &range) const = 0;
+
+    virtual AABB bounding_box() const = 0;
 };
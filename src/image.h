@@ -1,5 +1,7 @@
 #pragma once
 
+#include "math.hpp"
+
 #include <span>
 #include <memory>
 
@@ -38,12 +40,12 @@ struct Image
         }
 
         auto operator()() {
-            return std::span<T>(rowData, width * numChannels, * sizeof(T));
+            return std::span<T>(rowData, width * numChannels);
         }
     };
 
     RowProxy operator[](int rowIndex) {
-        T* rowData = data.get() + (rowIndex * width * numChannels * sizeof(T));
+        T* rowData = data.get() + (rowIndex * width * numChannels);
         return RowProxy(width, numChannels, rowData);
     }
 
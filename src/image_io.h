@@ -0,0 +1,458 @@
+#pragma once
+
+#include "deflate.h"
+#include "half.h"
+#include "image.h"
+#include "math.hpp"
+#include "parallel.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+inline void write_color(std::ostream &out, Color pixel_color) {
+    auto r = std::sqrt(pixel_color.x);
+    auto g = std::sqrt(pixel_color.y);
+    auto b = std::sqrt(pixel_color.z);
+
+    // Write the translated [0,255] value of each color component.
+    out << static_cast<int>(256 * std::clamp(r, 0.000f, 0.999f)) << ' '
+        << static_cast<int>(256 * std::clamp(g, 0.000f, 0.999f)) << ' '
+        << static_cast<int>(256 * std::clamp(b, 0.000f, 0.999f)) << '\n';
+}
+
+inline void save_ppm(const Image<char, 3>& img, const std::string& filename) {
+    std::ofstream ppmFile(filename, std::ios::binary);
+    if (!ppmFile) {
+        std::cerr << "Error opening file for writing: " << filename << std::endl;
+        return;
+    }
+
+    ppmFile << "P6\n";
+    ppmFile << img.width << " " << img.height << "\n";
+    ppmFile << "255\n";
+
+    for (int y = 0; y < img.size().y; ++y) {
+        for (int x = 0; x < img.size().x; ++x) {
+            auto row = img[y];
+            const char* pixelData = &row[x];
+
+            ppmFile.write(pixelData, img.numChannels);
+        }
+    }
+
+    std::cout << "Image saved to " << filename << std::endl;
+}
+
+// Portable float map: linear radiance, little-endian, rows stored bottom to top
+inline bool save_pfm(const Image<float, 3>& img, const std::string& filename) {
+    std::ofstream pfmFile(filename, std::ios::binary);
+    if (!pfmFile) {
+        std::cerr << "Error opening file for writing: " << filename << std::endl;
+        return false;
+    }
+
+    pfmFile << "PF\n" << img.width << " " << img.height << "\n-1.0\n";
+    for (int y = img.height - 1; y >= 0; --y) {
+        const auto row = img[y];
+        pfmFile.write(reinterpret_cast<const char *>(&row[0]), sizeof(float) * img.width * img.numChannels);
+    }
+    return static_cast<bool>(pfmFile);
+}
+
+inline std::optional<Image<float, 3>> load_pfm(const std::string& filename) {
+    std::ifstream pfmFile(filename, std::ios::binary);
+    if (!pfmFile)
+        return std::nullopt;
+
+    std::string magic;
+    int width = 0, height = 0;
+    float scale = 0.f;
+    pfmFile >> magic >> width >> height >> scale;
+    pfmFile.get();
+    if (magic != "PF" || width <= 0 || height <= 0 || scale >= 0.f) {
+        std::cerr << "Unsupported PFM file: " << filename << std::endl;
+        return std::nullopt;
+    }
+
+    Image<float, 3> img(width, height);
+    for (int y = height - 1; y >= 0; --y) {
+        auto row = img[y];
+        pfmFile.read(reinterpret_cast<char *>(&row[0]), sizeof(float) * width * img.numChannels);
+    }
+    if (!pfmFile)
+        return std::nullopt;
+    return img;
+}
+
+// Radiance RGBE (.hdr) with flat or run-length encoded scanlines, top row first
+inline std::optional<Image<float, 3>> load_hdr(const std::string& filename) {
+    std::ifstream hdrFile(filename, std::ios::binary);
+    if (!hdrFile)
+        return std::nullopt;
+
+    std::string line;
+    std::getline(hdrFile, line);
+    if (line.rfind("#?", 0) != 0) {
+        std::cerr << "Unsupported HDR file: " << filename << std::endl;
+        return std::nullopt;
+    }
+    while (std::getline(hdrFile, line) && !line.empty()) {
+        if (line.rfind("FORMAT=", 0) == 0 && line != "FORMAT=32-bit_rle_rgbe") {
+            std::cerr << "Unsupported HDR format " << line << ": " << filename << std::endl;
+            return std::nullopt;
+        }
+    }
+    std::string yAxis, xAxis;
+    int width = 0, height = 0;
+    hdrFile >> yAxis >> height >> xAxis >> width;
+    hdrFile.get();
+    if (!hdrFile || yAxis != "-Y" || xAxis != "+X" || width <= 0 || height <= 0) {
+        std::cerr << "Unsupported HDR orientation: " << filename << std::endl;
+        return std::nullopt;
+    }
+
+    Image<float, 3> img(width, height);
+    std::vector<uint8_t> rgbe(static_cast<size_t>(width) * 4);
+    for (int y = 0; y < height; ++y) {
+        uint8_t start[4];
+        hdrFile.read(reinterpret_cast<char *>(start), 4);
+        if (width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 && ((start[2] << 8) | start[3]) == width) {
+            // Each of the four components as its own run-length encoded stream
+            for (int channel = 0; channel < 4 && hdrFile; ++channel) {
+                for (int x = 0; x < width;) {
+                    const int count = hdrFile.get();
+                    if (count <= 0 || count == 128 || x + (count & 127) > width) {
+                        std::cerr << "Corrupt HDR scanline: " << filename << std::endl;
+                        return std::nullopt;
+                    }
+                    if (count > 128) {
+                        const auto value = static_cast<uint8_t>(hdrFile.get());
+                        for (int i = 0; i < count - 128; ++i)
+                            rgbe[(x++) * 4 + channel] = value;
+                    } else {
+                        for (int i = 0; i < count; ++i)
+                            rgbe[(x++) * 4 + channel] = static_cast<uint8_t>(hdrFile.get());
+                    }
+                }
+            }
+        } else {
+            std::copy(start, start + 4, rgbe.begin());
+            hdrFile.read(reinterpret_cast<char *>(rgbe.data() + 4), (static_cast<std::streamsize>(width) - 1) * 4);
+        }
+        if (!hdrFile)
+            return std::nullopt;
+
+        auto row = img[y];
+        for (int x = 0; x < width; ++x) {
+            const uint8_t *texel = &rgbe[static_cast<size_t>(x) * 4];
+            const float scale = texel[3] ? std::ldexp(1.f, texel[3] - (128 + 8)) : 0.f;
+            float *pixel = &row[x];
+            pixel[0] = texel[0] * scale;
+            pixel[1] = texel[1] * scale;
+            pixel[2] = texel[2] * scale;
+        }
+    }
+    return img;
+}
+
+namespace image_io_detail
+{
+    inline void put_be32(std::vector<uint8_t> &out, uint32_t value)
+    {
+        const uint8_t bytes[] = {uint8_t(value >> 24), uint8_t(value >> 16), uint8_t(value >> 8), uint8_t(value)};
+        out.insert(out.end(), std::begin(bytes), std::end(bytes));
+    }
+
+    template <class T>
+    void put_le(std::vector<uint8_t> &out, T value)
+    {
+        uint8_t bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        out.insert(out.end(), std::begin(bytes), std::end(bytes));
+    }
+
+    inline void put_string(std::vector<uint8_t> &out, const char *text)
+    {
+        out.insert(out.end(), text, text + std::strlen(text) + 1);
+    }
+
+    // Length, type, data and CRC of one PNG chunk; the CRC covers type and data
+    inline std::vector<uint8_t> png_chunk(const char *type, const uint8_t *data, size_t size)
+    {
+        std::vector<uint8_t> chunk;
+        chunk.reserve(size + 12);
+        put_be32(chunk, static_cast<uint32_t>(size));
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data, data + size);
+        put_be32(chunk, deflate::crc32(chunk.data() + 4, size + 4));
+        return chunk;
+    }
+
+    // Picks the PNG row filter with the smallest sum of absolute residuals (libpng's heuristic)
+    inline void png_filter_row(const uint8_t *row, const uint8_t *above, size_t size, int bpp, uint8_t *out)
+    {
+        auto paeth = [](int a, int b, int c) {
+            const int p = a + b - c;
+            const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+            return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+        };
+        auto predict = [&](int filter, size_t i) -> int {
+            const int a = i >= size_t(bpp) ? row[i - bpp] : 0;
+            const int b = above ? above[i] : 0;
+            const int c = (above && i >= size_t(bpp)) ? above[i - bpp] : 0;
+            switch (filter)
+            {
+            case 1: return a;
+            case 2: return b;
+            case 3: return (a + b) / 2;
+            case 4: return paeth(a, b, c);
+            default: return 0;
+            }
+        };
+
+        int bestFilter = 0;
+        uint64_t bestCost = UINT64_MAX;
+        for (int filter = 0; filter < 5; ++filter)
+        {
+            uint64_t cost = 0;
+            for (size_t i = 0; i < size && cost < bestCost; ++i)
+                cost += std::abs(static_cast<int8_t>(row[i] - predict(filter, i)));
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestFilter = filter;
+            }
+        }
+
+        out[0] = static_cast<uint8_t>(bestFilter);
+        for (size_t i = 0; i < size; ++i)
+            out[i + 1] = static_cast<uint8_t>(row[i] - predict(bestFilter, i));
+    }
+
+    // OpenEXR ZIP preprocessing: split even and odd bytes, then delta-encode
+    inline void exr_zip_predict(const uint8_t *in, size_t size, uint8_t *out)
+    {
+        uint8_t *t1 = out;
+        uint8_t *t2 = out + (size + 1) / 2;
+        for (size_t i = 0; i < size; ++i)
+            *((i & 1) ? t2++ : t1++) = in[i];
+
+        int previous = out[0];
+        for (size_t i = 1; i < size; ++i)
+        {
+            const int value = out[i];
+            out[i] = static_cast<uint8_t>(value - previous + (128 + 256));
+            previous = value;
+        }
+    }
+} // namespace image_io_detail
+
+// 8-bit RGB PNG. Rows are filtered and the filtered stream is deflated in independent chunks on all
+// threads; each chunk becomes its own IDAT, so checksumming is parallel too.
+inline bool save_png(const Image<char, 3>& img, const std::string& filename) {
+    using namespace image_io_detail;
+
+    const size_t rowSize = static_cast<size_t>(img.width) * img.numChannels;
+    std::vector<uint8_t> filtered((rowSize + 1) * img.height);
+    parallel_for(static_cast<size_t>(img.height), [&](size_t y) {
+        const auto *row = reinterpret_cast<const uint8_t *>(&img[static_cast<int>(y)][0]);
+        const auto *above = y > 0 ? reinterpret_cast<const uint8_t *>(&img[static_cast<int>(y) - 1][0]) : nullptr;
+        png_filter_row(row, above, rowSize, img.numChannels, filtered.data() + y * (rowSize + 1));
+    });
+
+    const auto pieces = deflate::zlib_compress_chunks(filtered.data(), filtered.size());
+    std::vector<std::vector<uint8_t>> chunks(pieces.size());
+    parallel_for(pieces.size(), [&](size_t i) { chunks[i] = png_chunk("IDAT", pieces[i].data(), pieces[i].size()); });
+
+    std::ofstream pngFile(filename, std::ios::binary);
+    if (!pngFile) {
+        std::cerr << "Error opening file for writing: " << filename << std::endl;
+        return false;
+    }
+
+    const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    pngFile.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+
+    std::vector<uint8_t> header;
+    put_be32(header, img.width);
+    put_be32(header, img.height);
+    header.insert(header.end(), {8, 2, 0, 0, 0}); // 8 bit, truecolor, deflate, adaptive filters, no interlace
+    const auto ihdr = png_chunk("IHDR", header.data(), header.size());
+    pngFile.write(reinterpret_cast<const char *>(ihdr.data()), ihdr.size());
+    for (const auto &chunk : chunks)
+        pngFile.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+    const auto iend = png_chunk("IEND", nullptr, 0);
+    pngFile.write(reinterpret_cast<const char *>(iend.data()), iend.size());
+
+    if (!pngFile)
+        return false;
+    std::cout << "Image saved to " << filename << std::endl;
+    return true;
+}
+
+enum class ExrPixelType
+{
+    Half = 1,
+    Float = 2,
+};
+
+// Scanline OpenEXR with ZIP compression (blocks of 16 scanlines). Every block is converted and
+// deflated independently on the worker threads; blocks that do not shrink are stored raw.
+inline bool save_exr(const Image<float, 3>& img, const std::string& filename, ExrPixelType pixelType = ExrPixelType::Half) {
+    using namespace image_io_detail;
+    constexpr int linesPerBlock = 16;
+
+    std::vector<uint8_t> header = {0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0};
+    auto attribute = [&](const char *name, const char *type, const std::vector<uint8_t> &value) {
+        put_string(header, name);
+        put_string(header, type);
+        put_le<int32_t>(header, static_cast<int32_t>(value.size()));
+        header.insert(header.end(), value.begin(), value.end());
+    };
+
+    // Channels are stored in alphabetical order
+    std::vector<uint8_t> channels;
+    for (const char *name : {"B", "G", "R"}) {
+        put_string(channels, name);
+        put_le<int32_t>(channels, static_cast<int32_t>(pixelType));
+        channels.insert(channels.end(), {0, 0, 0, 0}); // pLinear + reserved
+        put_le<int32_t>(channels, 1);
+        put_le<int32_t>(channels, 1);
+    }
+    channels.push_back(0);
+
+    std::vector<uint8_t> window;
+    for (int32_t value : {0, 0, img.width - 1, img.height - 1})
+        put_le<int32_t>(window, value);
+    std::vector<uint8_t> aspect, center, width;
+    put_le<float>(aspect, 1.f);
+    put_le<float>(center, 0.f);
+    put_le<float>(center, 0.f);
+    put_le<float>(width, 1.f);
+
+    attribute("channels", "chlist", channels);
+    attribute("compression", "compression", {3}); // ZIP_COMPRESSION
+    attribute("dataWindow", "box2i", window);
+    attribute("displayWindow", "box2i", window);
+    attribute("lineOrder", "lineOrder", {0}); // INCREASING_Y
+    attribute("pixelAspectRatio", "float", aspect);
+    attribute("screenWindowCenter", "v2f", center);
+    attribute("screenWindowWidth", "float", width);
+    header.push_back(0);
+
+    const size_t blockCount = (img.height + linesPerBlock - 1) / linesPerBlock;
+    const size_t sampleSize = pixelType == ExrPixelType::Half ? 2 : 4;
+    std::vector<std::vector<uint8_t>> blocks(blockCount);
+    parallel_for(blockCount, [&](size_t block) {
+        const int firstLine = static_cast<int>(block) * linesPerBlock;
+        const int lines = std::min(linesPerBlock, img.height - firstLine);
+        std::vector<uint8_t> raw(static_cast<size_t>(lines) * img.width * img.numChannels * sampleSize);
+        uint8_t *out = raw.data();
+        for (int y = firstLine; y < firstLine + lines; ++y) {
+            const float *row = &img[y][0];
+            for (int channel = 2; channel >= 0; --channel) {
+                for (int x = 0; x < img.width; ++x) {
+                    const float value = row[x * img.numChannels + channel];
+                    if (pixelType == ExrPixelType::Half) {
+                        const uint16_t bits = float_to_half_bits(value);
+                        std::memcpy(out, &bits, 2);
+                    } else {
+                        std::memcpy(out, &value, 4);
+                    }
+                    out += sampleSize;
+                }
+            }
+        }
+
+        std::vector<uint8_t> predicted(raw.size());
+        exr_zip_predict(raw.data(), raw.size(), predicted.data());
+        auto compressed = deflate::zlib_compress(predicted.data(), predicted.size());
+        const auto &payload = compressed.size() < raw.size() ? compressed : raw;
+
+        auto &chunk = blocks[block];
+        put_le<int32_t>(chunk, firstLine);
+        put_le<int32_t>(chunk, static_cast<int32_t>(payload.size()));
+        chunk.insert(chunk.end(), payload.begin(), payload.end());
+    });
+
+    std::vector<uint8_t> offsets;
+    uint64_t offset = header.size() + blockCount * sizeof(uint64_t);
+    for (const auto &chunk : blocks) {
+        put_le<uint64_t>(offsets, offset);
+        offset += chunk.size();
+    }
+
+    std::ofstream exrFile(filename, std::ios::binary);
+    if (!exrFile) {
+        std::cerr << "Error opening file for writing: " << filename << std::endl;
+        return false;
+    }
+    exrFile.write(reinterpret_cast<const char *>(header.data()), header.size());
+    exrFile.write(reinterpret_cast<const char *>(offsets.data()), offsets.size());
+    for (const auto &chunk : blocks)
+        exrFile.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+
+    if (!exrFile)
+        return false;
+    std::cout << "Image saved to " << filename << std::endl;
+    return true;
+}
+
+inline bool has_extension(const std::string& filename, const std::string& extension) {
+    return filename.size() >= extension.size() &&
+           std::equal(extension.rbegin(), extension.rend(), filename.rbegin(),
+                      [](char a, char b) { return std::tolower(a) == std::tolower(b); });
+}
+
+// Opens filename as a tiled texture (texture.h). A .hdr or .pfm image is converted once to a tiled
+// file next to it, named filename + ".rtt", and converted again when the source is newer or the file
+// was made with other wrap modes. The conversion goes to a temporary file renamed into place, so a
+// concurrent reader never opens a half-written texture.
+inline std::optional<Texture> load_tiled_texture(const std::string& filename, TextureCache& cache, TextureWrap wrapU,
+                                                 TextureWrap wrapV) {
+    if (has_extension(filename, ".rtt"))
+        return Texture::open(filename, cache);
+
+    const std::string tiled = filename + ".rtt";
+    std::error_code error;
+    const auto sourceTime = std::filesystem::last_write_time(filename, error);
+    if (error)
+        return std::nullopt;
+    const auto tiledTime = std::filesystem::last_write_time(tiled, error);
+    if (!error && tiledTime >= sourceTime) {
+        auto texture = Texture::open(tiled, cache);
+        if (texture && texture->wrap_u() == wrapU && texture->wrap_v() == wrapV)
+            return texture;
+    }
+
+    const auto image = has_extension(filename, ".pfm") ? load_pfm(filename) : load_hdr(filename);
+    if (!image)
+        return std::nullopt;
+    const auto unique = std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+                        static_cast<size_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    const std::string temporary = tiled + ".tmp" + std::to_string(unique);
+    if (!write_tiled_texture(*image, temporary, wrapU, wrapV)) {
+        std::filesystem::remove(temporary, error);
+        return std::nullopt;
+    }
+    std::filesystem::rename(temporary, tiled, error);
+    if (error) {
+        std::filesystem::remove(temporary, error);
+        return std::nullopt;
+    }
+    return Texture::open(tiled, cache);
+}
@@ -0,0 +1,307 @@
+#pragma once
+
+#include "Scene.h"
+#include "aabb.h"
+#include "camera.h"
+#include "image.h"
+#include "kernel.h"
+#include "material.h"
+#include "parallel.h"
+#include "raster.h"
+#include "render.h"
+#include "sphere.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+// Incremental re-rendering after scene edits. IncrementalRenderer keeps the radiance sums of a frame
+// rendered at a fixed sample count over a grid of screen tiles. Edits go through the renderer, which
+// marks the tiles they may change; update() rebuilds the kernel, clears the dirty tiles and renders
+// only those again with the same samples, so a re-rendered tile is exactly what a full render of the
+// edited scene gives there. What gets marked depends on the InvalidationPolicy:
+//   Primary  tiles whose camera samples can see the edited object's bounding sphere, before or after
+//            the edit (project_footprint()). Shadows, reflections and bounced light elsewhere go stale.
+//   Local    Primary, plus tiles with a visible diffuse surface within influenceScale bounding radii
+//            of the object, where its shadow and bounced light are strong, or a visible mirror or
+//            glass surface within reflectionScale radii, since a sharp reflection stays visible
+//            further out. The object's effect on a surface falls off with its solid angle, (r / d)^2,
+//            and only what reaches past those distances can go stale.
+//   Full     every tile.
+// Visible surfaces are the first hits of one ray through each pixel center, kept per pixel; the
+// pixels of re-rendered tiles are surveyed again.
+
+enum class InvalidationPolicy
+{
+    Primary,
+    Local,
+    Full,
+};
+
+struct IncrementalSettings
+{
+    int samples = 64;           // per pixel, for the full frame and every re-rendered tile
+    int tileSize = 32;          // dirty-region granularity in pixels
+    InvalidationPolicy policy = InvalidationPolicy::Local;
+    float influenceScale = 4.f;   // Local: reach of shadows and bounced light, in bounding radii
+    float reflectionScale = 16.f; // Local: reach of reflections and refractions, in bounding radii
+};
+
+struct IncrementalUpdateStats
+{
+    RenderStats render;
+    size_t dirtyTiles = 0;
+    size_t tiles = 0;
+    uint64_t samples = 0; // camera samples traced
+};
+
+class IncrementalRenderer
+{
+public:
+    // scene is edited in place and has to outlive the renderer
+    IncrementalRenderer(Scene &_scene, const Camera &_camera, int width, int height,
+                        const IncrementalSettings &_settings = {}, uint64_t _seed = default_seed,
+                        const RenderSettings &_renderSettings = {})
+        : scene(_scene), camera(_camera), settings(_settings), seed(_seed), renderSettings(_renderSettings),
+          accum(width, height), tilesX((width + _settings.tileSize - 1) / _settings.tileSize),
+          tilesY((height + _settings.tileSize - 1) / _settings.tileSize)
+    {
+        tiles.resize(static_cast<size_t>(tilesX) * tilesY);
+        surfaces.resize(static_cast<size_t>(width) * height);
+    }
+
+    // Renders the whole frame
+    RenderStats render()
+    {
+        rebuild();
+        std::fill(accum.data.get(), accum.data.get() + static_cast<size_t>(accum.width) * accum.height * 3, 0.f);
+        const auto stats = with_kernel([&](const auto &kernel) {
+            return render_samples(camera, kernel, accum, 0, settings.samples, seed, renderSettings);
+        });
+        for (auto &tile : tiles)
+            tile.dirty = true;
+        survey();
+        return stats;
+    }
+
+    // Edits take effect in the scene right away and in the image at update(). Indices are those of
+    // scene.objects; an edit with an index out of range returns false and changes nothing.
+    size_t add(std::shared_ptr<Hittable> object)
+    {
+        invalidate(object->bounding_box());
+        scene.add(std::move(object));
+        return scene.objects.size() - 1;
+    }
+
+    bool remove(size_t index)
+    {
+        if (index >= scene.objects.size())
+            return false;
+        invalidate(scene.objects[index]->bounding_box());
+        scene.remove(index);
+        return true;
+    }
+
+    // Spheres only; false for other objects
+    bool move(size_t index, const Vec3 &center)
+    {
+        if (index >= scene.objects.size())
+            return false;
+        const auto sphere = std::dynamic_pointer_cast<Sphere>(scene.objects[index]);
+        if (!sphere)
+            return false;
+        auto moved = std::make_shared<Sphere>(center, sphere->radius(), sphere->get_material());
+        invalidate(sphere->bounding_box());
+        invalidate(moved->bounding_box());
+        scene.replace(index, std::move(moved));
+        return true;
+    }
+
+    bool set_material(size_t index, std::shared_ptr<material> mat)
+    {
+        if (index >= scene.objects.size())
+            return false;
+        const auto sphere = std::dynamic_pointer_cast<Sphere>(scene.objects[index]);
+        if (!sphere)
+            return false;
+        invalidate(sphere->bounding_box());
+        scene.replace(index, std::make_shared<Sphere>(sphere->center(), sphere->radius(), std::move(mat)));
+        return true;
+    }
+
+    // Re-renders the tiles marked since the last render() or update()
+    IncrementalUpdateStats update()
+    {
+        IncrementalUpdateStats stats;
+        stats.tiles = tiles.size();
+        std::vector<int> counts(static_cast<size_t>(accum.width) * accum.height, 0);
+        for (size_t index = 0; index < tiles.size(); ++index)
+        {
+            if (!tiles[index].dirty)
+                continue;
+            ++stats.dirtyTiles;
+            const Tile pixels = tile_pixels(index);
+            for (int y = pixels.y0; y < pixels.y1; ++y)
+            {
+                for (int x = pixels.x0; x < pixels.x1; ++x)
+                {
+                    counts[static_cast<size_t>(y) * accum.width + x] = settings.samples;
+                    auto *sum = &accum[y][x];
+                    sum[0] = sum[1] = sum[2] = 0.f;
+                }
+            }
+            stats.samples += static_cast<uint64_t>(pixels.x1 - pixels.x0) * (pixels.y1 - pixels.y0) * settings.samples;
+        }
+        if (stats.dirtyTiles == 0)
+            return stats;
+
+        rebuild();
+        stats.render = with_kernel([&](const auto &kernel) {
+            return render_samples(camera, kernel, accum, 0, counts, seed, renderSettings);
+        });
+        survey();
+        return stats;
+    }
+
+    // Radiance sums over samples() samples per pixel
+    const Image<float, 3> &radiance_sums() const { return accum; }
+    int samples() const { return settings.samples; }
+    size_t tile_count() const { return tiles.size(); }
+    size_t dirty_tile_count() const
+    {
+        return static_cast<size_t>(std::count_if(tiles.begin(), tiles.end(), [](const TileState &t) { return t.dirty; }));
+    }
+
+private:
+    struct TileState
+    {
+        bool dirty = false;
+    };
+
+    // First hit through a pixel center
+    struct Surface
+    {
+        enum class Kind : uint8_t
+        {
+            Miss,
+            Diffuse,
+            Specular,
+        };
+        Vec3 p;
+        Kind kind = Kind::Miss;
+    };
+
+    Tile tile_pixels(size_t index) const
+    {
+        const int x0 = static_cast<int>(index % tilesX) * settings.tileSize;
+        const int y0 = static_cast<int>(index / tilesX) * settings.tileSize;
+        return {x0, y0, std::min(accum.width, x0 + settings.tileSize), std::min(accum.height, y0 + settings.tileSize)};
+    }
+
+    static float squared_distance(const AABB &box, const Vec3 &p)
+    {
+        const Vec3 gap(std::max({0.f, box.min.x - p.x, p.x - box.max.x}), std::max({0.f, box.min.y - p.y, p.y - box.max.y}),
+                       std::max({0.f, box.min.z - p.z, p.z - box.max.z}));
+        return gap.length_squared();
+    }
+
+    void invalidate(const AABB &box)
+    {
+        if (settings.policy == InvalidationPolicy::Full)
+        {
+            for (auto &tile : tiles)
+                tile.dirty = true;
+            return;
+        }
+
+        const Vec3 center = box.centroid();
+        const float radius = 0.5f * (box.max - box.min).length() * 1.0001f;
+        const Tile pixels = project_footprint(camera, center, radius, accum.width, accum.height).pixels;
+        if (pixels.x0 < pixels.x1 && pixels.y0 < pixels.y1)
+        {
+            for (int ty = pixels.y0 / settings.tileSize; ty <= (pixels.y1 - 1) / settings.tileSize; ++ty)
+                for (int tx = pixels.x0 / settings.tileSize; tx <= (pixels.x1 - 1) / settings.tileSize; ++tx)
+                    tiles[static_cast<size_t>(ty) * tilesX + tx].dirty = true;
+        }
+
+        if (settings.policy != InvalidationPolicy::Local)
+            return;
+        const float diffuseReach = settings.influenceScale * radius;
+        const float specularReach = settings.reflectionScale * radius;
+        for (size_t index = 0; index < tiles.size(); ++index)
+        {
+            auto &tile = tiles[index];
+            const Tile pixels = tile_pixels(index);
+            for (int y = pixels.y0; y < pixels.y1 && !tile.dirty; ++y)
+            {
+                for (int x = pixels.x0; x < pixels.x1 && !tile.dirty; ++x)
+                {
+                    const auto &surface = surfaces[static_cast<size_t>(y) * accum.width + x];
+                    if (surface.kind == Surface::Kind::Miss)
+                        continue;
+                    const float reach = surface.kind == Surface::Kind::Diffuse ? diffuseReach : specularReach;
+                    tile.dirty = squared_distance(box, surface.p) <= reach * reach;
+                }
+            }
+        }
+    }
+
+    void rebuild()
+    {
+        scene.build_bvh();
+        staticKernel = SphereKernel::build(scene);
+        if (!staticKernel)
+            dynamicKernel.emplace(scene, 50);
+    }
+
+    template <class F>
+    std::invoke_result_t<F, const SphereKernel &> with_kernel(F &&f)
+    {
+        if (staticKernel)
+            return f(*staticKernel);
+        return f(*dynamicKernel);
+    }
+
+    // Visible surfaces of the dirty tiles, which it marks clean
+    void survey()
+    {
+        with_kernel([&](const auto &kernel) {
+            parallel_for(tiles.size(), [&](size_t index) {
+                auto &tile = tiles[index];
+                if (!tile.dirty)
+                    return;
+                tile.dirty = false;
+                const Tile pixels = tile_pixels(index);
+                for (int y = pixels.y0; y < pixels.y1; ++y)
+                {
+                    for (int x = pixels.x0; x < pixels.x1; ++x)
+                    {
+                        const auto ray = camera.generateWorldRay(NDC_to_screen_space(raster_to_NDC(Vec2i{x, y}, accum.width, accum.height)));
+                        auto &surface = surfaces[static_cast<size_t>(y) * accum.width + x];
+                        surface = {};
+                        if (const auto hit = kernel.intersect(ray))
+                            surface = {kernel.hit_record(*hit).p, kernel.diffuse(*hit) ? Surface::Kind::Diffuse : Surface::Kind::Specular};
+                    }
+                }
+            }, renderSettings.threads);
+        });
+    }
+
+    Scene &scene;
+    Camera camera;
+    IncrementalSettings settings;
+    uint64_t seed;
+    RenderSettings renderSettings;
+    Image<float, 3> accum;
+    int tilesX;
+    int tilesY;
+    std::vector<TileState> tiles;
+    std::vector<Surface> surfaces; // per pixel
+    std::optional<SphereKernel> staticKernel;
+    std::optional<DynamicKernel> dynamicKernel;
+};
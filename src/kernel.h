@@ -0,0 +1,317 @@
+#pragma once
+
+#include "Scene.h"
+#include "bvh.h"
+#include "bvh_cache.h"
+#include "environment.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+// Rendering kernels. A kernel owns everything trace() needs to follow one path through the scene:
+// intersect() finds the closest hit, scatter() evaluates the material at that hit.
+//
+// DynamicKernel is the general fallback: it goes through Scene::hit (the scene BVH when built) and calls
+// Hittable::hit and material::scatter through the vtable, so any Hittable/material subclass works.
+//
+// StaticKernel is specialized at compile time on a closed set of primitive and material types and
+// a fixed bounce limit. Primitives and materials are stored by value in std::variant, so dispatch
+// is a jump on the variant index and Sphere::intersect / lambertian::scatter can be inlined into
+// the bounce loop. Primitives are stored in the slot order of the kernel's own wide BVH.
+//
+// With an environment map on the scene both kernels light diffuse hits by next-event estimation
+// (environment_light()) and weight the environment seen by the scattered ray to match.
+
+template <class... Ts>
+struct type_list {};
+
+inline Vec3 background(const Ray &ray)
+{
+    Vec3 unit_direction = unit_vector(ray.direction());
+    auto a = 0.5f * (unit_direction.y + 1.f);
+    return (1.f - a) * Vec3(1.f, 1.f, 1.f) + a * Vec3(0.5f, 0.7f, 1.0f);
+}
+
+constexpr Range hit_range{0.001f, std::numeric_limits<float>::max()};
+
+// Rays intersected by kernels on the calling thread; the renderer reads it around each tile
+inline thread_local uint64_t traced_rays = 0;
+
+class DynamicKernel
+{
+public:
+    using Hit = HitRecord;
+
+    DynamicKernel(const Scene &_scene, int _max_depth) : scene(_scene), max_depth(_max_depth) {}
+
+    std::optional<Hit> intersect(const Ray &ray) const
+    {
+        ++traced_rays;
+        return scene.hit(ray, hit_range);
+    }
+
+    bool scatter(const Ray &ray, const Hit &hit, Vec3 &attenuation, Ray &scattered, Sampler &sampler) const
+    {
+        return hit.mat->scatter(ray, hit, attenuation, scattered, sampler);
+    }
+
+    static const HitRecord &hit_record(const Hit &hit) { return hit; }
+    // Scatters the same radiance in every direction (radiance_cache.h)
+    bool diffuse(const Hit &hit) const { return dynamic_cast<const lambertian *>(hit.mat) != nullptr; }
+
+    const EnvironmentMap *environment_map() const { return scene.environment.get(); }
+    // Radiance along a ray that left the scene
+    Vec3 escape_radiance(const Ray &ray) const
+    {
+        return scene.environment ? scene.environment->radiance(unit_vector(ray.direction())) : background(ray);
+    }
+
+    Vec3 trace(const Ray &primary, Sampler &sampler) const
+    {
+        const EnvironmentMap *environment = environment_map();
+        Ray ray = primary;
+        Vec3 throughput(1.f, 1.f, 1.f);
+        Vec3 radiance(0.f, 0.f, 0.f);
+        // Normal of the last hit when it was lit by environment_light()
+        Vec3 diffuseNormal(0.f, 0.f, 0.f);
+        bool diffuseLit = false;
+        for (int depth = 0; depth < max_depth; ++depth)
+        {
+            const auto hit = intersect(ray);
+            if (!hit)
+            {
+                if (diffuseLit)
+                    return radiance + throughput * escape_radiance(ray) *
+                                          scattered_environment_weight(*environment, diffuseNormal, ray.direction());
+                return radiance + throughput * escape_radiance(ray);
+            }
+
+            Ray scattered;
+            Vec3 attenuation;
+            sampler.start_bounce(depth + 1);
+            if (!scatter(ray, *hit, attenuation, scattered, sampler))
+                return radiance;
+            throughput = throughput * attenuation;
+            diffuseLit = environment && diffuse(*hit);
+            if (diffuseLit)
+            {
+                radiance += throughput * environment_light(*this, *environment, *hit, sampler);
+                diffuseNormal = hit->normal;
+            }
+            ray = scattered;
+        }
+        return radiance;
+    }
+
+private:
+    const Scene &scene;
+    int max_depth;
+};
+
+template <class Primitives, class Materials, int MaxDepth>
+class StaticKernel;
+
+template <class... Primitives, class... Materials, int MaxDepth>
+class StaticKernel<type_list<Primitives...>, type_list<Materials...>, MaxDepth>
+{
+public:
+    using Primitive = std::variant<Primitives...>;
+    using Material = std::variant<Materials...>;
+    static constexpr int max_depth = MaxDepth;
+
+    struct Hit
+    {
+        HitRecord rec;
+        uint32_t material_id;
+    };
+
+    // Copies the scene into typed storage. Returns nullopt when the scene holds a primitive or a
+    // material outside the kernel's type sets, in which case the caller falls back to DynamicKernel.
+    static std::optional<StaticKernel> build(const Scene &scene)
+    {
+        StaticKernel kernel;
+        std::unordered_map<const material *, uint32_t> material_ids;
+        kernel.primitives.reserve(scene.objects.size());
+        kernel.material_ids.reserve(scene.objects.size());
+
+        for (const auto &object : scene.objects)
+        {
+            std::optional<Primitive> primitive;
+            ((!primitive && downcast<Primitives>(object.get(), primitive)), ...);
+            if (!primitive)
+                return std::nullopt;
+
+            const auto &mat = std::visit([](const auto &p) -> const auto & { return p.get_material(); }, *primitive);
+            auto it = material_ids.find(mat.get());
+            if (it == material_ids.end())
+            {
+                std::optional<Material> typed;
+                ((!typed && downcast<Materials>(mat.get(), typed)), ...);
+                if (!typed)
+                    return std::nullopt;
+
+                it = material_ids.emplace(mat.get(), static_cast<uint32_t>(kernel.materials.size())).first;
+                kernel.materials.push_back(std::move(*typed));
+            }
+
+            kernel.primitives.push_back(std::move(*primitive));
+            kernel.material_ids.push_back(it->second);
+        }
+
+        // Reuse the scene's tree when it is current: primitives were added in object order
+        if (scene.bvh && scene.bvh->primitive_count() == kernel.primitives.size())
+        {
+            kernel.bvh = *scene.bvh;
+        }
+        else
+        {
+            std::vector<AABB> bounds;
+            bounds.reserve(kernel.primitives.size());
+            for (const auto &primitive : kernel.primitives)
+                bounds.push_back(std::visit([](const auto &p) { return p.bounding_box(); }, primitive));
+            kernel.bvh = build_bvh_cached(bounds, scene.bvhBuilder);
+        }
+        kernel.reorder(kernel.bvh.release_primitive_order());
+        kernel.environment = scene.environment;
+        return kernel;
+    }
+
+    const WideBvh &acceleration() const { return bvh; }
+    // Typed scene data in BVH slot order, e.g. for writing it out (out_of_core.h)
+    const std::vector<Primitive> &primitive_table() const { return primitives; }
+    const std::vector<uint32_t> &material_id_table() const { return material_ids; }
+    const std::vector<Material> &material_table() const { return materials; }
+
+    std::optional<Hit> intersect(const Ray &ray) const
+    {
+        ++traced_rays;
+        Range range = hit_range;
+        const auto closest = bvh.intersect(ray, range, [&](uint32_t slot, const Range &current) {
+            return std::visit([&](const auto &p) { return p.intersect(ray, current); }, primitives[slot]);
+        });
+        if (!closest)
+            return std::nullopt;
+
+        return hit_at(ray, *closest, range.end);
+    }
+
+    bool scatter(const Ray &ray, const Hit &hit, Vec3 &attenuation, Ray &scattered, Sampler &sampler) const
+    {
+        return std::visit([&](const auto &m) { return m.scatter(ray, hit.rec, attenuation, scattered, sampler); },
+                          materials[hit.material_id]);
+    }
+
+    static const HitRecord &hit_record(const Hit &hit) { return hit.rec; }
+    bool diffuse(const Hit &hit) const
+    {
+        return std::visit([](const auto &m) { return std::is_same_v<std::decay_t<decltype(m)>, lambertian>; },
+                          materials[hit.material_id]);
+    }
+
+    // Single primitive test for callers that find the closest hit themselves (raster.h)
+    std::optional<float> intersect_primitive(uint32_t slot, const Ray &ray, const Range &range) const
+    {
+        return std::visit([&](const auto &p) { return p.intersect(ray, range); }, primitives[slot]);
+    }
+
+    Hit hit_at(const Ray &ray, uint32_t slot, float t) const
+    {
+        return Hit{std::visit([&](const auto &p) { return p.record(ray, t); }, primitives[slot]), material_ids[slot]};
+    }
+
+    const EnvironmentMap *environment_map() const { return environment.get(); }
+    // Radiance along a ray that left the scene
+    Vec3 escape_radiance(const Ray &ray) const
+    {
+        return environment ? environment->radiance(unit_vector(ray.direction())) : background(ray);
+    }
+
+    Vec3 trace(const Ray &primary, Sampler &sampler) const
+    {
+        const auto hit = intersect(primary);
+        if (!hit)
+            return escape_radiance(primary);
+        return trace_from(primary, *hit, sampler);
+    }
+
+    // Continues a path whose first hit is already known
+    Vec3 trace_from(const Ray &primary, const Hit &first, Sampler &sampler) const
+    {
+        Ray ray = primary;
+        Hit hit = first;
+        Vec3 throughput(1.f, 1.f, 1.f);
+        Vec3 radiance(0.f, 0.f, 0.f);
+        for (int depth = 0; depth < MaxDepth; ++depth)
+        {
+            Ray scattered;
+            Vec3 attenuation;
+            sampler.start_bounce(depth + 1);
+            if (!scatter(ray, hit, attenuation, scattered, sampler))
+                return radiance;
+            throughput = throughput * attenuation;
+            const bool lit = environment && diffuse(hit);
+            if (lit)
+                radiance += throughput * environment_light(*this, *environment, hit.rec, sampler);
+            ray = scattered;
+            if (depth + 1 == MaxDepth)
+                break;
+
+            const auto next = intersect(ray);
+            if (!next)
+            {
+                if (lit)
+                    return radiance + throughput * escape_radiance(ray) *
+                                          scattered_environment_weight(*environment, hit.rec.normal, ray.direction());
+                return radiance + throughput * escape_radiance(ray);
+            }
+            hit = *next;
+        }
+        return radiance;
+    }
+
+private:
+    StaticKernel() = default;
+
+    template <class T, class Base, class Variant>
+    static bool downcast(const Base *object, std::optional<Variant> &out)
+    {
+        if (const auto *typed = dynamic_cast<const T *>(object))
+        {
+            out.emplace(std::in_place_type<T>, *typed);
+            return true;
+        }
+        return false;
+    }
+
+    void reorder(const std::vector<uint32_t> &order)
+    {
+        std::vector<Primitive> sortedPrimitives;
+        std::vector<uint32_t> sortedMaterialIds;
+        sortedPrimitives.reserve(order.size());
+        sortedMaterialIds.reserve(order.size());
+        for (const auto index : order)
+        {
+            sortedPrimitives.push_back(std::move(primitives[index]));
+            sortedMaterialIds.push_back(material_ids[index]);
+        }
+        primitives = std::move(sortedPrimitives);
+        material_ids = std::move(sortedMaterialIds);
+    }
+
+    std::vector<Primitive> primitives;
+    std::vector<uint32_t> material_ids;
+    std::vector<Material> materials;
+    WideBvh bvh;
+    std::shared_ptr<const EnvironmentMap> environment;
+};
+
+// Every primitive and material type the renderer ships with, at the default bounce limit
+using SphereKernel = StaticKernel<type_list<Sphere>, type_list<lambertian, metal, dielectric>, 50>;
@@ -0,0 +1,460 @@
+#pragma once
+
+#include "Scene.h"
+#include "aabb.h"
+#include "camera.h"
+#include "cpu_dispatch.h"
+#include "environment.h"
+#include "guiding.h"
+#include "image.h"
+#include "kernel.h"
+#include "material.h"
+#include "parallel.h"
+#include "render.h"
+#include "rng.h"
+#include "sphere.h"
+#include "splat.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+
+// Light tracing and bidirectional connections on top of camera paths. Light subpaths start at the sky
+// (the environment map, sampled by its luminance distribution, or the background gradient) and are
+// followed through the scene with the kernel's own intersect() and scatter(). They reach caustics,
+// diffuse surfaces lit through mirrors and glass, which camera paths only find by scattering into a
+// small bright light through the specular chain. A light vertex on a diffuse surface joins the camera
+// side in two ways:
+//   - connected to the pinhole camera with a shadow ray and splatted onto whichever pixel it projects
+//     to (SplatFramebuffer); render_samples() traces these light paths on its own, lightPaths per
+//     pixel and sample, and splats from all threads at once;
+//   - connected with a shadow ray to the diffuse vertices of a camera path; every camera sample
+//     traces one light subpath for this.
+//
+// Lambertian is the only non-delta scatterer and the sky the only light, so those connections are the
+// only ones a bidirectional tracer can make, and instead of weighting strategies against each other
+// the two sides split path space so that every path is counted by exactly one of them:
+//   Caustics  light subpaths cover paths ending sky -> mirror/glass hits -> diffuse surface, when the
+//             vertex before that surface is the camera or another diffuse surface; camera paths drop
+//             exactly those and keep the rest (direct and indirect diffuse light, caustics seen
+//             through glass).
+//   All       splatted light paths cover every path whose first camera hit is diffuse; camera paths
+//             only render the sky and what is seen in mirrors and glass.
+// Light is aimed at LightFocus, a sphere around the geometry light has to reach first (light_focus()).
+// Splats land on the pixel the point projects to, while camera samples are jittered over
+// sample_window(), so the splatted part is marginally sharper.
+
+enum class LightPaths
+{
+    Caustics,
+    All,
+};
+
+// Emitted light crosses a disk of radius radius around center facing the sky direction, starting reach
+// from center, outside the scene
+struct LightFocus
+{
+    Vec3 center;
+    float radius = 0.f;
+    float reach = 0.f;
+};
+
+// Focus on every object for All, on everything but lambertian spheres for Caustics
+inline LightFocus light_focus(const Scene &scene, LightPaths paths)
+{
+    AABB bounds;
+    AABB target;
+    for (const auto &object : scene.objects)
+    {
+        const AABB box = object->bounding_box();
+        bounds.expand(box);
+        const auto *sphere = dynamic_cast<const Sphere *>(object.get());
+        if (paths == LightPaths::All || !sphere || !dynamic_cast<const lambertian *>(sphere->get_material().get()))
+            target.expand(box);
+    }
+    if (target.empty())
+        return {};
+
+    LightFocus focus;
+    focus.center = target.centroid();
+    focus.radius = 0.5f * target.extent().length();
+    const Vec3 far(std::max(std::abs(bounds.min.x - focus.center.x), std::abs(bounds.max.x - focus.center.x)),
+                   std::max(std::abs(bounds.min.y - focus.center.y), std::abs(bounds.max.y - focus.center.y)),
+                   std::max(std::abs(bounds.min.z - focus.center.z), std::abs(bounds.max.z - focus.center.z)));
+    focus.reach = far.length() * 1.01f + focus.radius;
+    return focus;
+}
+
+struct LightTracingSettings
+{
+    LightPaths paths = LightPaths::Caustics;
+    int lightPaths = 1; // per pixel and camera sample
+    LightFocus focus;   // see light_focus()
+    int maxDepth = 50;
+};
+
+namespace light_tracing_detail
+{
+    constexpr float pi = 3.14159265358979f;
+    // Light paths splatted by render_samples() use their own sample stream, uncorrelated with the
+    // camera samples; the subpath of a camera sample uses that sample's stream from this bounce on
+    constexpr uint64_t light_stream = 0x5bd1e9955bd1e995ull;
+    constexpr uint32_t subpath_bounce = 0x10000;
+
+    // Diffuse hit of a light subpath; weight is the light arriving there times the BRDF, as the
+    // particle weight of the subpath
+    struct LightVertex
+    {
+        Vec3 p;
+        Vec3 normal;
+        Vec3 weight;
+    };
+
+    // Starts a light path at the sky; throughput is the emitted radiance over the ray's pdf
+    template <class Kernel>
+    RT_ALWAYS_INLINE bool emit(const Kernel &kernel, const LightTracingSettings &settings, Sampler &sampler, Ray &ray,
+                               Vec3 &throughput)
+    {
+        // Direction towards the sky the light comes from, with its radiance and solid-angle pdf
+        const float u0 = sampler.next();
+        const float u1 = sampler.next();
+        Vec3 toSky;
+        Vec3 radiance;
+        float pdf;
+        if (const EnvironmentMap *environment = kernel.environment_map())
+        {
+            const auto light = environment->sample(u0, u1);
+            toSky = light.direction;
+            radiance = light.radiance;
+            pdf = light.pdf;
+        }
+        else
+        {
+            const float z = 1.f - 2.f * u0;
+            const float r = std::sqrt(std::max(0.f, 1.f - z * z));
+            toSky = Vec3(r * std::cos(2.f * pi * u1), r * std::sin(2.f * pi * u1), z);
+            radiance = kernel.escape_radiance(Ray(Vec3(0.f, 0.f, 0.f), toSky));
+            pdf = 1.f / (4.f * pi);
+        }
+        if (pdf <= 0.f || settings.focus.radius <= 0.f)
+            return false;
+
+        // Uniform point on the focus disk facing the sky, moved out past the scene
+        Vec3 tangent, bitangent;
+        tangent_frame(toSky, tangent, bitangent);
+        const float radius = settings.focus.radius * std::sqrt(sampler.next());
+        const float phi = 2.f * pi * sampler.next();
+        const Vec3 origin = settings.focus.center + toSky * settings.focus.reach +
+                            (tangent * std::cos(phi) + bitangent * std::sin(phi)) * radius;
+        const float diskArea = pi * settings.focus.radius * settings.focus.radius;
+
+        ray = Ray(origin, -toSky);
+        throughput = radiance * (diskArea / pdf);
+        return true;
+    }
+
+    // Follows a light path from the sky, drawing bounce firstBounce + depth, and calls
+    // onDiffuse(rec, weight) at the diffuse vertices the mode connects: every one for All, the first
+    // one after a mirror or glass hit for Caustics, which then ends the path
+    template <class Kernel, class F>
+    RT_ALWAYS_INLINE void follow_light_path(const Kernel &kernel, const LightTracingSettings &settings, Sampler &sampler,
+                                            uint32_t firstBounce, F &&onDiffuse)
+    {
+        sampler.start_bounce(firstBounce);
+        Ray ray;
+        Vec3 throughput;
+        if (!emit(kernel, settings, sampler, ray, throughput))
+            return;
+
+        int specular = 0;
+        for (int depth = 0; depth < settings.maxDepth; ++depth)
+        {
+            const auto hit = kernel.intersect(ray);
+            if (!hit)
+                return;
+
+            const bool diffuse = kernel.diffuse(*hit);
+            if (diffuse && specular == 0 && settings.paths == LightPaths::Caustics)
+                return;
+            Ray scattered;
+            Vec3 attenuation;
+            sampler.start_bounce(firstBounce + depth + 1);
+            if (!kernel.scatter(ray, *hit, attenuation, scattered, sampler))
+                return;
+            if (diffuse)
+            {
+                onDiffuse(kernel.hit_record(*hit), throughput * attenuation * (1.f / pi));
+                if (settings.paths == LightPaths::Caustics)
+                    return;
+            }
+            else
+            {
+                ++specular;
+            }
+            throughput = throughput * attenuation;
+            ray = scattered;
+        }
+    }
+
+    // The caustic vertex of one light subpath drawn from the camera sample's own stream, if it has one
+    template <class Kernel>
+    std::optional<LightVertex> caustic_vertex(const Kernel &kernel, const LightTracingSettings &settings, Sampler &sampler)
+    {
+        std::optional<LightVertex> vertex;
+        follow_light_path(kernel, settings, sampler, subpath_bounce, [&](const HitRecord &rec, const Vec3 &weight) {
+            vertex = LightVertex{rec.p, rec.normal, weight};
+        });
+        return vertex;
+    }
+
+    // Light a light vertex sends to a diffuse camera hit, before the camera hit's BRDF: the vertex
+    // weight times the geometry term, or zero when the two do not face each other or are occluded
+    template <class Kernel>
+    Vec3 connect_vertices(const Kernel &kernel, const HitRecord &rec, const LightVertex &vertex)
+    {
+        const Vec3 offset = vertex.p - rec.p;
+        const float distanceSquared = offset.length_squared();
+        const float distance = std::sqrt(distanceSquared);
+        const Vec3 direction = offset / distance;
+        const float cosCamera = dot(rec.normal, direction);
+        const float cosLight = -dot(vertex.normal, direction);
+        if (cosCamera <= 0.f || cosLight <= 0.f)
+            return {0.f, 0.f, 0.f};
+        if (const auto blocker = kernel.intersect(Ray(rec.p, direction)))
+            if (kernel.hit_record(*blocker).t < distance * (1.f - 1e-4f))
+                return {0.f, 0.f, 0.f};
+        return vertex.weight * (cosCamera * cosLight / distanceSquared);
+    }
+} // namespace light_tracing_detail
+
+// Selects the light tracing overload of render_samples() for kernel
+template <class Kernel>
+struct LightTracing
+{
+    const Kernel &kernel;
+    LightTracingSettings settings;
+
+    // Camera path estimate without the paths the splatted light paths cover, plus connections to one
+    // caustic light subpath in Caustics mode
+    Vec3 trace(const Ray &primary, Sampler &sampler) const
+    {
+        using namespace light_tracing_detail;
+        const EnvironmentMap *environment = kernel.environment_map();
+        const bool caustics = settings.paths == LightPaths::Caustics;
+        Ray ray = primary;
+        Vec3 throughput(1.f, 1.f, 1.f);
+        Vec3 radiance(0.f, 0.f, 0.f);
+        // Normal of the last hit when it was lit by environment_light()
+        Vec3 diffuseNormal(0.f, 0.f, 0.f);
+        bool diffuseLit = false;
+        std::optional<LightVertex> light;
+        bool lightTraced = false;
+        // Tail of the path so far: specular hits since the last diffuse one, and whether a light
+        // subpath can reach that diffuse hit (it is the first hit or follows a diffuse one)
+        int specularRun = -1;
+        bool connectable = false;
+        bool previousDiffuse = false;
+        for (int depth = 0; depth < settings.maxDepth; ++depth)
+        {
+            const auto hit = kernel.intersect(ray);
+            if (!hit)
+            {
+                if (caustics && specularRun > 0 && connectable)
+                    return radiance;
+                if (diffuseLit)
+                    return radiance + throughput * kernel.escape_radiance(ray) *
+                                          scattered_environment_weight(*environment, diffuseNormal, ray.direction());
+                return radiance + throughput * kernel.escape_radiance(ray);
+            }
+
+            const bool diffuse = kernel.diffuse(*hit);
+            if (depth == 0 && diffuse && !caustics)
+                return radiance;
+            if (diffuse)
+            {
+                connectable = depth == 0 || previousDiffuse;
+                specularRun = 0;
+            }
+            else if (specularRun >= 0)
+            {
+                ++specularRun;
+            }
+            previousDiffuse = diffuse;
+
+            Ray scattered;
+            Vec3 attenuation;
+            sampler.start_bounce(depth + 1);
+            if (!kernel.scatter(ray, *hit, attenuation, scattered, sampler))
+                return radiance;
+            throughput = throughput * attenuation;
+            diffuseLit = environment && diffuse;
+            if (diffuseLit)
+            {
+                radiance += throughput * environment_light(kernel, *environment, kernel.hit_record(*hit), sampler);
+                diffuseNormal = kernel.hit_record(*hit).normal;
+            }
+            if (caustics && diffuse)
+            {
+                if (!lightTraced)
+                {
+                    light = caustic_vertex(kernel, settings, sampler);
+                    lightTraced = true;
+                }
+                // The BRDF here is albedo / pi; the albedo is in the throughput
+                if (light)
+                    radiance += throughput * connect_vertices(kernel, kernel.hit_record(*hit), *light) * (1.f / pi);
+            }
+            ray = scattered;
+        }
+        return radiance;
+    }
+};
+
+namespace light_tracing_detail
+{
+    // Pinhole camera as seen from the scene
+    struct CameraView
+    {
+        const Camera &camera;
+        Vec3 position;
+        int width;
+        int height;
+        float imagePlaneArea; // of the image at unit distance in front of the eye
+    };
+
+    // Splats a diffuse vertex's light towards the camera; weight is the light arriving at it times the
+    // BRDF (albedo / pi), per unit area, as the particle weight of the light path
+    template <class Kernel>
+    RT_ALWAYS_INLINE void connect(const Kernel &kernel, const CameraView &view, const HitRecord &rec, const Vec3 &weight,
+                                  SplatFramebuffer &splats)
+    {
+        const Vec3 toCamera = view.position - rec.p;
+        const float distance = toCamera.length();
+        const Vec3 direction = toCamera / distance;
+        const float cosSurface = dot(rec.normal, direction);
+        if (cosSurface <= 0.f)
+            return;
+
+        const Vec3 local = view.camera.WorldToCamera(rec.p);
+        if (local.z >= 0.f)
+            return;
+        const Vec2f screen = view.camera.CameraToScreen(local);
+        const float px = (screen.x + 1.f) * 0.5f * view.width;
+        const float py = (1.f - screen.y) * 0.5f * view.height;
+        if (!(px >= 0.f && px < view.width && py >= 0.f && py < view.height))
+            return;
+
+        if (const auto blocker = kernel.intersect(Ray(rec.p, direction)))
+            if (kernel.hit_record(*blocker).t < distance * (1.f - 1e-4f))
+                return;
+
+        // Importance of the pinhole per unit image area is 1 / (A cos^4); changing from image area to
+        // surface area leaves cosSurface / (cos^3 distance^2)
+        const float cosCamera = -local.z / local.length();
+        const float g = cosSurface / (view.imagePlaneArea * cosCamera * cosCamera * cosCamera * distance * distance);
+        splats.add(std::min(static_cast<int>(px), view.width - 1), std::min(static_cast<int>(py), view.height - 1), weight * g);
+    }
+
+    template <class Kernel>
+    RT_ALWAYS_INLINE void trace_light_path(const Kernel &kernel, const LightTracingSettings &settings, const CameraView &view,
+                                           Sampler &sampler, SplatFramebuffer &splats)
+    {
+        follow_light_path(kernel, settings, sampler, 0, [&](const HitRecord &rec, const Vec3 &weight) {
+            connect(kernel, view, rec, weight, splats);
+        });
+    }
+
+    // Light paths [begin, end) of a pass: path i is path i % pathsPerSample of sample firstSample + i / pathsPerSample
+    struct LightBatch
+    {
+        size_t begin;
+        size_t end;
+        size_t pathsPerSample;
+        int firstSample;
+        uint64_t seed;
+    };
+
+    template <class Kernel>
+    RT_ALWAYS_INLINE void trace_light_paths_body(const Kernel &kernel, const LightTracingSettings &settings, const CameraView &view,
+                                                 const LightBatch &batch, SplatFramebuffer &splats)
+    {
+        for (size_t i = batch.begin; i < batch.end; ++i)
+        {
+            Sampler sampler(batch.seed, static_cast<uint32_t>(i % batch.pathsPerSample),
+                            static_cast<uint32_t>(batch.firstSample + i / batch.pathsPerSample));
+            trace_light_path(kernel, settings, view, sampler, splats);
+        }
+    }
+
+    template <class Kernel>
+    void trace_light_paths_generic(const Kernel &kernel, const LightTracingSettings &settings, const CameraView &view,
+                                   const LightBatch &batch, SplatFramebuffer &splats)
+    {
+        trace_light_paths_body(kernel, settings, view, batch, splats);
+    }
+    template <class Kernel>
+    RT_TARGET_AVX2 void trace_light_paths_avx2(const Kernel &kernel, const LightTracingSettings &settings, const CameraView &view,
+                                               const LightBatch &batch, SplatFramebuffer &splats)
+    {
+        trace_light_paths_body(kernel, settings, view, batch, splats);
+    }
+    template <class Kernel>
+    RT_TARGET_AVX512 void trace_light_paths_avx512(const Kernel &kernel, const LightTracingSettings &settings, const CameraView &view,
+                                                   const LightBatch &batch, SplatFramebuffer &splats)
+    {
+        trace_light_paths_body(kernel, settings, view, batch, splats);
+    }
+
+    template <class Kernel>
+    void trace_light_paths(IsaLevel isa, const Kernel &kernel, const LightTracingSettings &settings, const CameraView &view,
+                           const LightBatch &batch, SplatFramebuffer &splats)
+    {
+        if (isa == IsaLevel::Avx512)
+            trace_light_paths_avx512(kernel, settings, view, batch, splats);
+        else if (isa == IsaLevel::Avx2)
+            trace_light_paths_avx2(kernel, settings, view, batch, splats);
+        else
+            trace_light_paths_generic(kernel, settings, view, batch, splats);
+    }
+} // namespace light_tracing_detail
+
+// render_samples() with camera paths and settings.lightPaths light paths per pixel and sample. The
+// light paths of a call splat into one SplatFramebuffer from all threads at once, which is added to
+// accum scaled to the camera sample count when they are done. A cancelled call adds no splats, since
+// a partial light pass would darken the caustics it carries.
+template <class Kernel>
+RenderStats render_samples(const Camera& camera, const LightTracing<Kernel>& tracing, Image<float, 3>& accum,
+                           int firstSample, int numSamples, uint64_t seed = default_seed, const RenderSettings& settings = {})
+{
+    using namespace light_tracing_detail;
+    auto stats = render_detail::render_tiles(camera, tracing, accum, firstSample, numSamples, nullptr, seed, settings);
+    const auto &lights = tracing.settings;
+    if (lights.lightPaths <= 0 || lights.focus.radius <= 0.f || numSamples <= 0 || settings.cancelled())
+        return stats;
+
+    const float tanHalfFov = std::tan(0.5f * camera.get_fov() * pi / 180.f);
+    const CameraView view{camera, camera.get_position(), accum.width, accum.height,
+                          4.f * tanHalfFov * tanHalfFov * accum.width / accum.height};
+    SplatFramebuffer splats(accum.width, accum.height);
+    const size_t pathsPerSample = static_cast<size_t>(accum.width) * accum.height * lights.lightPaths;
+    const size_t count = pathsPerSample * numSamples;
+    constexpr size_t batchSize = 4096;
+
+    std::atomic<uint64_t> rays{0};
+    parallel_for((count + batchSize - 1) / batchSize, [&](size_t index) {
+        if (settings.cancelled())
+            return;
+        const auto raysBefore = traced_rays;
+        const LightBatch batch{index * batchSize, std::min(count, (index + 1) * batchSize), pathsPerSample, firstSample,
+                               seed ^ light_stream};
+        trace_light_paths(stats.isa, tracing.kernel, lights, view, batch, splats);
+        rays.fetch_add(traced_rays - raysBefore, std::memory_order_relaxed);
+    }, settings.threads);
+
+    stats.rays += rays.load();
+    if (!settings.cancelled())
+        splats.add_to(accum, 1.f / lights.lightPaths);
+    return stats;
+}
@@ -4,72 +4,203 @@
 #include "utils.h"
 #include "hittable.h"
 
+#include <cstdint>
+
+// Hits of one material type in structure-of-arrays layout, for the batched scatter entry points.
+// These loop over all lanes with the same per-hit math as scatter() and no branches on lane data,
+// so the compiler turns them into vector code; lanes at or past count hold stale values and their
+// results are ignored.
+struct ScatterBatch
+{
+    static constexpr int lanes = 16;
+    int count = 0;
+
+    // Inputs: direction of the incoming ray, normal against it, front_face, two uniform numbers
+    alignas(64) float dx[lanes] = {}, dy[lanes] = {}, dz[lanes] = {};
+    alignas(64) float nx[lanes] = {}, ny[lanes] = {}, nz[lanes] = {};
+    alignas(64) int32_t frontFace[lanes] = {};
+    alignas(64) float u[lanes] = {}, v[lanes] = {};
+    // Material parameters of each hit, see load_lane()
+    alignas(64) float albedoR[lanes] = {}, albedoG[lanes] = {}, albedoB[lanes] = {};
+    alignas(64) float fuzz[lanes] = {};
+    alignas(64) double ir[lanes] = {};
+    // Outputs: scattered direction (the origin is the hit point), attenuation, whether the path goes on
+    alignas(64) float sx[lanes] = {}, sy[lanes] = {}, sz[lanes] = {};
+    alignas(64) float ar[lanes] = {}, ag[lanes] = {}, ab[lanes] = {};
+    alignas(64) int32_t ok[lanes] = {};
+
+    // Appends a hit and returns its lane; u and v are the hit's first two bounce dimensions
+    int add(const Ray &ray, const HitRecord &rec, float _u, float _v)
+    {
+        const int lane = count++;
+        const Vec3 direction = ray.direction();
+        dx[lane] = direction.x;
+        dy[lane] = direction.y;
+        dz[lane] = direction.z;
+        nx[lane] = rec.normal.x;
+        ny[lane] = rec.normal.y;
+        nz[lane] = rec.normal.z;
+        frontFace[lane] = rec.front_face;
+        u[lane] = _u;
+        v[lane] = _v;
+        return lane;
+    }
+
+    bool full() const { return count == lanes; }
+
+    Vec3 direction(int lane) const { return {dx[lane], dy[lane], dz[lane]}; }
+    Vec3 normal(int lane) const { return {nx[lane], ny[lane], nz[lane]}; }
+    void set_result(int lane, const Vec3 &scattered, const Vec3 &attenuation, bool continues)
+    {
+        sx[lane] = scattered.x;
+        sy[lane] = scattered.y;
+        sz[lane] = scattered.z;
+        ar[lane] = attenuation.x;
+        ag[lane] = attenuation.y;
+        ab[lane] = attenuation.z;
+        ok[lane] = continues;
+    }
+};
+
 class material
 {
 public:
     virtual ~material() = default;
 
     virtual bool scatter(
-        const Ray &r_in, const HitRecord &rec, Vec3 &attenuation, Ray &scattered) const = 0;
+        const Ray &r_in, const HitRecord &rec, Vec3 &attenuation, Ray &scattered,
+        Sampler &sampler) const = 0;
 };
 
-class lambertian : public material
+class lambertian final : public material
 {
 public:
     lambertian(const Vec3 &a) : albedo(a) {}
 
-    bool scatter(const Ray &r_in, const HitRecord &rec, Vec3 &attenuation, Ray &scattered)
-        const override
+    const Vec3 &get_albedo() const { return albedo; }
+
+    // Number of uniform numbers scatter() draws, and the math shared with scatter_batch()
+    static constexpr int random_dimensions = 2;
+    static Vec3 scatter_direction(const Vec3 &normal, float u, float v)
     {
-        auto scatter_direction = rec.normal + random_unit_vector();
-        if (near_zero(scatter_direction))
-        {
-            scatter_direction = rec.normal;
-        }
+        const auto direction = normal + unit_vector_from(u, v);
+        const bool degenerate = near_zero(direction);
+        return Vec3(degenerate ? normal.x : direction.x, degenerate ? normal.y : direction.y,
+                    degenerate ? normal.z : direction.z);
+    }
 
-        scattered = Ray(rec.p, scatter_direction);
+    bool scatter(const Ray &r_in, const HitRecord &rec, Vec3 &attenuation, Ray &scattered,
+        Sampler &sampler)
+        const override
+    {
+        const float u = sampler.next();
+        scattered = Ray(rec.p, scatter_direction(rec.normal, u, sampler.next()));
         attenuation = albedo;
         return true;
     }
 
+    void load_lane(ScatterBatch &batch, int lane) const
+    {
+        batch.albedoR[lane] = albedo.x;
+        batch.albedoG[lane] = albedo.y;
+        batch.albedoB[lane] = albedo.z;
+    }
+
+    static void scatter_batch(ScatterBatch &batch)
+    {
+        for (int i = 0; i < ScatterBatch::lanes; ++i)
+        {
+            const Vec3 albedo(batch.albedoR[i], batch.albedoG[i], batch.albedoB[i]);
+            batch.set_result(i, scatter_direction(batch.normal(i), batch.u[i], batch.v[i]), albedo, true);
+        }
+    }
+
 private:
     Vec3 albedo;
 };
 
-class metal : public material
+class metal final : public material
 {
 public:
     metal(const Vec3 &a, float fuzz_) : albedo(a), fuzz(fuzz_) {}
 
-    bool scatter(const Ray &r_in, const HitRecord &rec, Vec3 &attenuation, Ray &scattered)
+    const Vec3 &get_albedo() const { return albedo; }
+    float get_fuzz() const { return fuzz; }
+
+    static constexpr int random_dimensions = 2;
+    static Vec3 scatter_direction(const Vec3 &direction, const Vec3 &normal, float fuzz, float u, float v)
+    {
+        const Vec3 reflected = reflect(unit_vector_or_zero(direction), normal);
+        return reflected + fuzz * unit_vector_from(u, v);
+    }
+
+    bool scatter(const Ray &r_in, const HitRecord &rec, Vec3 &attenuation, Ray &scattered,
+        Sampler &sampler)
         const override
     {
-        Vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = Ray(rec.p, reflected + fuzz * random_unit_vector());
+        const float u = sampler.next();
+        scattered = Ray(rec.p, scatter_direction(r_in.direction(), rec.normal, fuzz, u, sampler.next()));
         attenuation = albedo;
         return dot(scattered.direction(), rec.normal) > 0;
     }
 
+    void load_lane(ScatterBatch &batch, int lane) const
+    {
+        batch.albedoR[lane] = albedo.x;
+        batch.albedoG[lane] = albedo.y;
+        batch.albedoB[lane] = albedo.z;
+        batch.fuzz[lane] = fuzz;
+    }
+
+    static void scatter_batch(ScatterBatch &batch)
+    {
+        for (int i = 0; i < ScatterBatch::lanes; ++i)
+        {
+            const Vec3 normal = batch.normal(i);
+            const Vec3 direction = scatter_direction(batch.direction(i), normal, batch.fuzz[i], batch.u[i], batch.v[i]);
+            const Vec3 albedo(batch.albedoR[i], batch.albedoG[i], batch.albedoB[i]);
+            batch.set_result(i, direction, albedo, dot(direction, normal) > 0);
+        }
+    }
+
 private:
     Vec3 albedo;
     float fuzz;
 };
 
-class dielectric : public material {
+class dielectric final : public material {
   public:
     dielectric(double index_of_refraction) : ir(index_of_refraction) {}
 
-    bool scatter(const Ray &r_in, const HitRecord &rec, Vec3 &attenuation, Ray &scattered)
+    double get_ir() const { return ir; }
+
+    static constexpr int random_dimensions = 0;
+    static Vec3 scatter_direction(const Vec3 &direction, const Vec3 &normal, bool front_face, double ir)
+    {
+        double refraction_ratio = front_face ? (1.0 / ir) : ir;
+
+        Vec3 unit_direction = unit_vector_or_zero(direction);
+        return refract(unit_direction, normal, refraction_ratio);
+    }
+
+    bool scatter(const Ray &r_in, const HitRecord &rec, Vec3 &attenuation, Ray &scattered,
+        Sampler &sampler)
         const override
     {
         attenuation = Vec3(1.0, 1.0, 1.0);
-        double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
+        scattered = Ray(rec.p, scatter_direction(r_in.direction(), rec.normal, rec.front_face, ir));
+        return true;
+    }
 
-        Vec3 unit_direction = unit_vector(r_in.direction());
-        Vec3 refracted = refract(unit_direction, rec.normal, refraction_ratio);
+    void load_lane(ScatterBatch &batch, int lane) const { batch.ir[lane] = ir; }
 
-        scattered = Ray(rec.p, refracted);
-        return true;
+    static void scatter_batch(ScatterBatch &batch)
+    {
+        for (int i = 0; i < ScatterBatch::lanes; ++i)
+        {
+            const Vec3 direction = scatter_direction(batch.direction(i), batch.normal(i), batch.frontFace[i] != 0, batch.ir[i]);
+            batch.set_result(i, direction, Vec3(1.0, 1.0, 1.0), true);
+        }
     }
 
   private:
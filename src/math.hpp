@@ -55,6 +55,11 @@ struct Vec3
     Vec3() : x(0.0f), y(0.0f), z(0.0f) {}
     Vec3(float x, float y, float z) : x(x), y(y), z(z) {}
 
+    float operator[](int axis) const
+    {
+        return axis == 0 ? x : (axis == 1 ? y : z);
+    }
+
     // Define the negation operator (-)
     Vec3 operator-() const {
         return Vec3(-x, -y, -z);
@@ -109,6 +114,8 @@ struct Vec3
     }
 };
 
+using Color = Vec3;
+
 template <class V>
 inline V unit_vector(const V& v)
 {
@@ -125,7 +132,7 @@ inline V normalize(const V& v)
     return unit_vector(v);
 }
 
-float dot(const Vec3 &a, const Vec3 &b)
+inline float dot(const Vec3 &a, const Vec3 &b)
 {
     return a.x * b.x + a.y * b.y + a.z * b.z;
 }
@@ -137,11 +144,11 @@ auto dot(const TVec2<T> &a, const TVec2<T> &b)
 }
 
 
-Vec3 normalize(const Vec3 &v){
+inline Vec3 normalize(const Vec3 &v){
     return unit_vector(v);
 }
 
-Vec3 cross(const Vec3 &a, const Vec3 &b)
+inline Vec3 cross(const Vec3 &a, const Vec3 &b)
 {
     return Vec3(a.y * b.z - a.z * b.y,
                 a.z * b.x - a.x * b.z,
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "camera.h"
+#include "compact_image.h"
+#include "cpu_dispatch.h"
+#include "image.h"
+#include "kernel.h"
+#include "numa.h"
+#include "render.h"
+#include "tiles.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Multi-view rendering over one scene build. render_views() takes the tiles of every view into a
+// single work list, so one pool of workers (pinned and NUMA-replicated as for render_samples())
+// runs through all of them: a worker that finishes the last tile of one view moves straight on to the
+// next view instead of waiting at the view's tail, and threads, tile buffers and kernel replicas
+// are set up once per batch rather than once per view.
+
+// One camera of a batch and the radiance sums it renders into, or with compact set the
+// framebuffer holding the mean of the samples before firstSample (compact_image.h); views may
+// differ in size
+struct RenderView
+{
+    const Camera *camera;
+    Image<float, 3> *accum;
+    CompactFramebuffer *compact = nullptr;
+
+    Vec2i size() const { return compact ? Vec2i{compact->width, compact->height} : accum->size(); }
+};
+
+// Adds samples [firstSample, firstSample + numSamples) of every pixel of every view; each view gets
+// exactly what render_samples() gives for its camera alone
+template <class Kernel>
+RenderStats render_views(const std::vector<RenderView> &views, const Kernel &kernel, int firstSample, int numSamples,
+                         uint64_t seed = default_seed, const RenderSettings &settings = {})
+{
+    const int tileSize = settings.tileSize > 0 ? settings.tileSize : default_tile_size();
+    const auto pixelOrder = curve_order(tileSize, tileSize, settings.order);
+    const auto workers = place_workers(std::max(1u, settings.threads), settings.pinThreads, settings.nodes);
+
+    // Views in order, each in its own curve order, so neighbouring tasks share cameras and scene data
+    struct Task
+    {
+        uint32_t view;
+        Tile tile;
+    };
+    std::vector<Task> tasks;
+    for (size_t view = 0; view < views.size(); ++view)
+        for (const auto &tile : make_tiles(views[view].size().x, views[view].size().y, tileSize, settings.order))
+            tasks.push_back({static_cast<uint32_t>(view), tile});
+
+    std::optional<NodeReplicas<Kernel>> replicas;
+    if (settings.replicateScene)
+        replicas.emplace(kernel, nodes_of(workers));
+
+    struct WorkerState
+    {
+        const Kernel *kernel;
+        Image<float, 3> tile;
+        std::vector<Vec2f> samples;
+    };
+    auto makeState = [&](const WorkerPlacement &placement) {
+        WorkerState state{replicas ? replicas->get(placement.node) : &kernel, Image<float, 3>(tileSize, tileSize), {}};
+        state.samples.reserve(numSamples);
+        return state;
+    };
+
+    std::atomic<uint64_t> rays{0};
+    const IsaLevel isa = active_isa();
+    numa_parallel_for(workers, tasks.size(), makeState, [&](size_t taskIndex, WorkerState &state) {
+        if (settings.cancelled())
+            return;
+        const auto &task = tasks[taskIndex];
+        const auto &view = views[task.view];
+        const auto raysBefore = traced_rays;
+        const Vec2i size = view.size();
+        const render_detail::TileJob<Kernel> job{*view.camera, *state.kernel, task.tile, pixelOrder, size.x, size.y,
+                                                 firstSample, numSamples, nullptr, seed, state.tile, state.samples};
+        render_detail::render_tile(isa, job);
+        if (view.compact)
+            view.compact->add_tile(task.tile, state.tile, firstSample, numSamples);
+        else
+            render_detail::add_tile(task.tile, state.tile, *view.accum);
+        rays.fetch_add(traced_rays - raysBefore, std::memory_order_relaxed);
+    });
+
+    return {rays.load(), isa};
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// NUMA placement for the render workers. Topology comes from sysfs (/sys/devices/system/node); on
+// other systems, or when sysfs is missing, everything is one node. Memory is kept local through
+// the kernel's first-touch policy: data a pinned thread allocates and writes first lands on that
+// thread's node, so no libnuma is needed.
+
+struct NumaNode
+{
+    int id;
+    std::vector<int> cpus;
+};
+
+struct WorkerPlacement
+{
+    int cpu = -1; // -1: not pinned
+    int node = 0; // index into numa_topology()
+};
+
+// Parses sysfs cpu lists such as "0-3,8-11"
+inline std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::stringstream stream(list);
+    for (std::string range; std::getline(stream, range, ',');)
+    {
+        if (range.empty() || range == "\n")
+            continue;
+        const auto dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+inline const std::vector<NumaNode> &numa_topology()
+{
+    static const std::vector<NumaNode> nodes = [] {
+        namespace fs = std::filesystem;
+        std::vector<NumaNode> found;
+        std::error_code error;
+        for (const auto &entry : fs::directory_iterator("/sys/devices/system/node", error))
+        {
+            const auto name = entry.path().filename().string();
+            if (name.rfind("node", 0) != 0 || name.size() <= 4 ||
+                !std::all_of(name.begin() + 4, name.end(), [](char c) { return c >= '0' && c <= '9'; }))
+                continue;
+
+            std::ifstream cpulist(entry.path() / "cpulist");
+            std::string list;
+            std::getline(cpulist, list);
+            auto cpus = parse_cpu_list(list);
+            if (!cpus.empty())
+                found.push_back({std::stoi(name.substr(4)), std::move(cpus)});
+        }
+        std::sort(found.begin(), found.end(), [](const NumaNode &a, const NumaNode &b) { return a.id < b.id; });
+
+        if (found.empty())
+        {
+            NumaNode node{0, {}};
+            for (unsigned cpu = 0; cpu < worker_count(); ++cpu)
+                node.cpus.push_back(static_cast<int>(cpu));
+            found.push_back(std::move(node));
+        }
+        return found;
+    }();
+    return nodes;
+}
+
+inline bool pin_current_thread(int cpu)
+{
+#if defined(__linux__)
+    if (cpu < 0)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+// Places threads on the given nodes (indices into numa_topology(); empty means all), round-robin
+// across nodes so that every socket's memory controllers are used even at low thread counts.
+// Without pinning the placements still record a node, spread the same way.
+inline std::vector<WorkerPlacement> place_workers(unsigned threads, bool pin, std::vector<int> nodes = {})
+{
+    const auto &topology = numa_topology();
+    if (nodes.empty())
+        for (size_t i = 0; i < topology.size(); ++i)
+            nodes.push_back(static_cast<int>(i));
+
+    std::vector<WorkerPlacement> placements;
+    std::vector<size_t> nextCpu(topology.size(), 0);
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        const int node = nodes[t % nodes.size()];
+        const auto &cpus = topology[node].cpus;
+        const int cpu = pin ? cpus[nextCpu[node]++ % cpus.size()] : -1;
+        placements.push_back({cpu, node});
+    }
+    return placements;
+}
+
+// Runs one thread per placement, pinned where a cpu is given. Each thread first builds its private
+// state with makeState(placement) - after pinning, so the allocations are node-local - and then
+// takes items from a shared counter, calling fn(item, state). The calling thread only waits, so
+// its own affinity is left alone.
+template <class MakeState, class F>
+void numa_parallel_for(const std::vector<WorkerPlacement> &workers, size_t count, MakeState &&makeState, F &&fn)
+{
+    std::atomic<size_t> next{0};
+    auto body = [&](const WorkerPlacement &placement) {
+        pin_current_thread(placement.cpu);
+        auto state = makeState(placement);
+        for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1))
+            fn(i, state);
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(workers.size());
+    for (const auto &placement : workers)
+        pool.emplace_back(body, placement);
+    for (auto &thread : pool)
+        thread.join();
+}
+
+inline std::vector<int> nodes_of(const std::vector<WorkerPlacement> &workers)
+{
+    std::vector<int> nodes;
+    for (const auto &placement : workers)
+        if (std::find(nodes.begin(), nodes.end(), placement.node) == nodes.end())
+            nodes.push_back(placement.node);
+    return nodes;
+}
+
+// One copy of a read-only object per NUMA node, each copy constructed by a thread pinned to that
+// node so its heap allocations are local. Used to replicate the render kernel (scene primitives,
+// acceleration data and material table).
+template <class T>
+class NodeReplicas
+{
+public:
+    NodeReplicas(const T &source, const std::vector<int> &nodes)
+        : replicas(numa_topology().size())
+    {
+        std::vector<std::thread> builders;
+        for (const int node : nodes)
+        {
+            builders.emplace_back([&, node] {
+                pin_current_thread(numa_topology()[node].cpus.front());
+                replicas[node] = std::make_unique<T>(source);
+            });
+        }
+        for (auto &thread : builders)
+            thread.join();
+    }
+
+    const T *get(int node) const { return replicas[node].get(); }
+
+private:
+    std::vector<std::unique_ptr<T>> replicas;
+};
@@ -0,0 +1,608 @@
+#pragma once
+
+#include "bvh.h"
+#include "camera.h"
+#include "image.h"
+#include "kernel.h"
+#include "parallel.h"
+#include "render.h"
+#include "rng.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Out-of-core sphere scenes. The geometry is written to a file in page-aligned chunks; each chunk
+// holds a run of spheres that are neighbours in BVH order together with its own wide BVH. Only the
+// chunk directory, a top-level BVH over the chunk bounds and the material table stay in memory.
+// Chunks are paged in on demand through ChunkCache, a bounded LRU.
+//
+// render_samples_out_of_core() traces in waves: every ray of a wave is queued on the nearest chunk
+// it has not tested yet, and a chunk is tested against its whole queue at once, resident chunks
+// first and then the longest queue. Each read is shared by as many rays as possible.
+//
+// File layout, all offsets in bytes:
+//   0            ChunkFileHeader
+//   page-aligned chunks: WideBvhNode[nodeCount] then SphereRecord[sphereCount]
+//   directory    ChunkEntry[chunkCount] then MaterialRecord[materialCount]
+
+constexpr size_t chunk_page_size = 4096;
+
+struct ChunkFileHeader
+{
+    char magic[8] = {'R', 'T', 'C', 'H', 'U', 'N', 'K', '\0'};
+    uint32_t version = 1;
+    uint32_t chunkCount = 0;
+    uint32_t materialCount = 0;
+    uint32_t reserved = 0;
+    uint64_t primitiveCount = 0;
+    uint64_t directoryOffset = 0;
+};
+
+struct ChunkEntry
+{
+    float boundsMin[3];
+    float boundsMax[3];
+    uint64_t offset;
+    uint32_t bytes;
+    uint32_t nodeCount;
+    uint32_t sphereCount;
+    uint32_t reserved;
+};
+
+struct SphereRecord
+{
+    float center[3];
+    float radius;
+    uint32_t material;
+};
+
+struct MaterialRecord
+{
+    uint32_t kind; // 0 lambertian, 1 metal, 2 dielectric
+    float params[4];
+};
+
+// Writes the scene of kernel as a chunk file. Spheres are taken in the kernel's BVH slot order, so
+// every chunk covers a compact region; chunkBytes is the target chunk size before page padding.
+inline bool write_chunked_scene(const std::string &filename, const SphereKernel &kernel,
+                                size_t chunkBytes = size_t(256) << 10)
+{
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+
+    const auto &primitives = kernel.primitive_table();
+    const auto &materialIds = kernel.material_id_table();
+    // Roughly one wide node per two spheres on top of the records themselves
+    const size_t perChunk = std::max<size_t>(1, chunkBytes / (sizeof(SphereRecord) + sizeof(WideBvhNode) / 2));
+
+    ChunkFileHeader header;
+    header.primitiveCount = primitives.size();
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    std::vector<ChunkEntry> directory;
+    uint64_t offset = chunk_page_size;
+    for (size_t first = 0; first < primitives.size(); first += perChunk)
+    {
+        const size_t count = std::min(perChunk, primitives.size() - first);
+        std::vector<SphereRecord> records(count);
+        std::vector<AABB> bounds(count);
+        AABB chunkBounds;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const auto &sphere = std::get<Sphere>(primitives[first + i]);
+            const auto center = sphere.center();
+            records[i] = {{center.x, center.y, center.z}, sphere.radius(), materialIds[first + i]};
+            bounds[i] = sphere.bounding_box();
+            chunkBounds.expand(bounds[i]);
+        }
+
+        auto bvh = WideBvh::build(bounds, BvhBuilder::BinnedSah, 1);
+        std::vector<SphereRecord> sorted;
+        sorted.reserve(count);
+        for (const auto index : bvh.release_primitive_order())
+            sorted.push_back(records[index]);
+
+        const auto &nodes = bvh.node_data();
+        ChunkEntry entry{};
+        entry.boundsMin[0] = chunkBounds.min.x;
+        entry.boundsMin[1] = chunkBounds.min.y;
+        entry.boundsMin[2] = chunkBounds.min.z;
+        entry.boundsMax[0] = chunkBounds.max.x;
+        entry.boundsMax[1] = chunkBounds.max.y;
+        entry.boundsMax[2] = chunkBounds.max.z;
+        entry.offset = offset;
+        entry.nodeCount = static_cast<uint32_t>(nodes.size());
+        entry.sphereCount = static_cast<uint32_t>(count);
+        entry.bytes = static_cast<uint32_t>(nodes.size() * sizeof(WideBvhNode) + count * sizeof(SphereRecord));
+        directory.push_back(entry);
+
+        file.seekp(static_cast<std::streamoff>(offset));
+        file.write(reinterpret_cast<const char *>(nodes.data()), nodes.size() * sizeof(WideBvhNode));
+        file.write(reinterpret_cast<const char *>(sorted.data()), sorted.size() * sizeof(SphereRecord));
+        offset += (entry.bytes + chunk_page_size - 1) / chunk_page_size * chunk_page_size;
+    }
+
+    std::vector<MaterialRecord> materials;
+    for (const auto &material : kernel.material_table())
+    {
+        materials.push_back(std::visit([](const auto &m) {
+            using T = std::decay_t<decltype(m)>;
+            MaterialRecord record{};
+            if constexpr (std::is_same_v<T, lambertian>)
+                record = {0, {m.get_albedo().x, m.get_albedo().y, m.get_albedo().z, 0.f}};
+            else if constexpr (std::is_same_v<T, metal>)
+                record = {1, {m.get_albedo().x, m.get_albedo().y, m.get_albedo().z, m.get_fuzz()}};
+            else
+                record = {2, {static_cast<float>(m.get_ir()), 0.f, 0.f, 0.f}};
+            return record;
+        }, material));
+    }
+
+    header.chunkCount = static_cast<uint32_t>(directory.size());
+    header.materialCount = static_cast<uint32_t>(materials.size());
+    header.directoryOffset = offset;
+    file.seekp(static_cast<std::streamoff>(offset));
+    file.write(reinterpret_cast<const char *>(directory.data()), directory.size() * sizeof(ChunkEntry));
+    file.write(reinterpret_cast<const char *>(materials.data()), materials.size() * sizeof(MaterialRecord));
+    file.seekp(0);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    return static_cast<bool>(file);
+}
+
+// A chunk in memory. Spheres carry no material pointer; materialIds index ChunkedScene::materials.
+struct ResidentChunk
+{
+    WideBvh bvh;
+    std::vector<Sphere> spheres;
+    std::vector<uint32_t> materialIds;
+
+    size_t memory_bytes() const
+    {
+        return bvh.memory_bytes() + spheres.size() * sizeof(Sphere) + materialIds.size() * sizeof(uint32_t);
+    }
+};
+
+class ChunkedScene
+{
+public:
+    // Nullopt for a missing, truncated or damaged file
+    static std::optional<ChunkedScene> open(const std::string &filename)
+    {
+        ChunkedScene scene;
+        scene.file.open(filename, std::ios::binary);
+        if (!scene.file)
+            return std::nullopt;
+
+        scene.file.seekg(0, std::ios::end);
+        const auto fileSize = static_cast<uint64_t>(scene.file.tellg());
+        scene.file.seekg(0);
+
+        // Every count is bounded by the file size before anything is allocated from it
+        ChunkFileHeader header;
+        scene.file.read(reinterpret_cast<char *>(&header), sizeof(header));
+        if (!scene.file || std::memcmp(header.magic, ChunkFileHeader().magic, sizeof(header.magic)) != 0 ||
+            header.version != 1 || header.directoryOffset < sizeof(header) || header.directoryOffset > fileSize ||
+            uint64_t(header.chunkCount) * sizeof(ChunkEntry) + uint64_t(header.materialCount) * sizeof(MaterialRecord) >
+                fileSize - header.directoryOffset)
+            return std::nullopt;
+
+        scene.directory.resize(header.chunkCount);
+        std::vector<MaterialRecord> materials(header.materialCount);
+        scene.file.seekg(static_cast<std::streamoff>(header.directoryOffset));
+        scene.file.read(reinterpret_cast<char *>(scene.directory.data()), scene.directory.size() * sizeof(ChunkEntry));
+        scene.file.read(reinterpret_cast<char *>(materials.data()), materials.size() * sizeof(MaterialRecord));
+        if (!scene.file)
+            return std::nullopt;
+
+        uint64_t spheres = 0;
+        for (const auto &entry : scene.directory)
+        {
+            const uint64_t bytes =
+                uint64_t(entry.nodeCount) * sizeof(WideBvhNode) + uint64_t(entry.sphereCount) * sizeof(SphereRecord);
+            if (entry.offset < sizeof(header) || entry.offset > header.directoryOffset ||
+                bytes > header.directoryOffset - entry.offset || bytes != entry.bytes)
+                return std::nullopt;
+            spheres += entry.sphereCount;
+        }
+        if (spheres != header.primitiveCount)
+            return std::nullopt;
+
+        for (const auto &record : materials)
+        {
+            if (record.kind > 2)
+                return std::nullopt;
+            const Vec3 albedo(record.params[0], record.params[1], record.params[2]);
+            if (record.kind == 0)
+                scene.materials.emplace_back(std::in_place_type<lambertian>, albedo);
+            else if (record.kind == 1)
+                scene.materials.emplace_back(std::in_place_type<metal>, albedo, record.params[3]);
+            else
+                scene.materials.emplace_back(std::in_place_type<dielectric>, record.params[0]);
+        }
+
+        std::vector<AABB> bounds;
+        for (const auto &entry : scene.directory)
+            bounds.push_back(chunk_bounds(entry));
+        scene.topLevel = WideBvh::build(bounds);
+        scene.topLevelOrder = scene.topLevel.release_primitive_order();
+        scene.primitives = header.primitiveCount;
+        return scene;
+    }
+
+    size_t chunk_count() const { return directory.size(); }
+    size_t primitive_count() const { return primitives; }
+    const ChunkEntry &chunk(uint32_t index) const { return directory[index]; }
+    const SphereKernel::Material &material(uint32_t id) const { return materials[id]; }
+
+    static AABB chunk_bounds(const ChunkEntry &entry)
+    {
+        return {Vec3(entry.boundsMin[0], entry.boundsMin[1], entry.boundsMin[2]),
+                Vec3(entry.boundsMax[0], entry.boundsMax[1], entry.boundsMax[2])};
+    }
+
+    // Nearest chunk after (afterT, afterChunk) in (entry distance, index) order whose box the ray
+    // enters before tMax. Walking chunks in this order visits each one at most once per ray.
+    std::optional<uint32_t> next_chunk(const Ray &ray, float tMin, float tMax, float afterT, int64_t afterChunk,
+                                       float &entryT) const
+    {
+        std::optional<uint32_t> best;
+        Range range{tMin, tMax};
+        topLevel.intersect(ray, range, [&](uint32_t slot, const Range &) -> std::optional<float> {
+            const uint32_t index = topLevelOrder[slot];
+            const auto t = intersect_box(chunk_bounds(directory[index]), ray, tMin, tMax);
+            if (!t || *t < afterT || (*t == afterT && index <= afterChunk))
+                return std::nullopt;
+            if (!best || *t < entryT || (*t == entryT && index < *best))
+            {
+                best = index;
+                entryT = *t;
+            }
+            return std::nullopt;
+        });
+        return best;
+    }
+
+    // Nullptr when the chunk cannot be read or its tree or material ids are out of range
+    std::unique_ptr<ResidentChunk> read_chunk(uint32_t index)
+    {
+        const auto &entry = directory[index];
+        std::vector<WideBvhNode> nodes(entry.nodeCount);
+        std::vector<SphereRecord> records(entry.sphereCount);
+        {
+            std::lock_guard<std::mutex> lock(*fileMutex);
+            file.seekg(static_cast<std::streamoff>(entry.offset));
+            file.read(reinterpret_cast<char *>(nodes.data()), nodes.size() * sizeof(WideBvhNode));
+            file.read(reinterpret_cast<char *>(records.data()), records.size() * sizeof(SphereRecord));
+            if (!file)
+            {
+                file.clear();
+                return nullptr;
+            }
+        }
+
+        if (!WideBvh::valid_nodes(nodes, records.size()))
+            return nullptr;
+        for (const auto &record : records)
+            if (record.material >= materials.size())
+                return nullptr;
+
+        auto chunk = std::make_unique<ResidentChunk>();
+        chunk->bvh = WideBvh::from_nodes(std::move(nodes), records.size());
+        chunk->spheres.reserve(records.size());
+        chunk->materialIds.reserve(records.size());
+        for (const auto &record : records)
+        {
+            chunk->spheres.emplace_back(Vec3(record.center[0], record.center[1], record.center[2]), record.radius, nullptr);
+            chunk->materialIds.push_back(record.material);
+        }
+        return chunk;
+    }
+
+private:
+    ChunkedScene() = default;
+
+    std::ifstream file;
+    std::unique_ptr<std::mutex> fileMutex = std::make_unique<std::mutex>(); // boxed so the scene stays movable
+    std::vector<ChunkEntry> directory;
+    std::vector<SphereKernel::Material> materials;
+    WideBvh topLevel;
+    std::vector<uint32_t> topLevelOrder;
+    size_t primitives = 0;
+};
+
+struct ChunkCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t bytesRead = 0;
+    uint64_t raysQueued = 0; // ray-chunk tests served, to compare against the number of loads
+
+    double hit_rate() const { return hits + misses ? double(hits) / double(hits + misses) : 0.0; }
+};
+
+// Bounded LRU of resident chunks. Chunks are shared_ptr so an evicted chunk stays valid for the
+// rays still testing it.
+class ChunkCache
+{
+public:
+    ChunkCache(ChunkedScene &_scene, size_t _capacityBytes) : scene(_scene), capacityBytes(_capacityBytes) {}
+
+    bool resident(uint32_t index) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.count(index) > 0;
+    }
+
+    std::shared_ptr<const ResidentChunk> acquire(uint32_t index)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (const auto it = entries.find(index); it != entries.end())
+        {
+            ++counters.hits;
+            lru.splice(lru.begin(), lru, it->second.position);
+            return it->second.chunk;
+        }
+
+        ++counters.misses;
+        std::shared_ptr<const ResidentChunk> chunk = scene.read_chunk(index);
+        if (!chunk)
+            return nullptr;
+        counters.bytesRead += scene.chunk(index).bytes;
+        residentBytes += chunk->memory_bytes();
+        lru.push_front(index);
+        entries[index] = {chunk, lru.begin()};
+
+        while (residentBytes > capacityBytes && lru.size() > 1)
+        {
+            const uint32_t victim = lru.back();
+            residentBytes -= entries[victim].chunk->memory_bytes();
+            entries.erase(victim);
+            lru.pop_back();
+            ++counters.evictions;
+        }
+        return chunk;
+    }
+
+    void count_rays(uint64_t rays)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.raysQueued += rays;
+    }
+
+    ChunkCacheStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counters;
+    }
+
+    size_t resident_bytes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return residentBytes;
+    }
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<const ResidentChunk> chunk;
+        std::list<uint32_t>::iterator position;
+    };
+
+    ChunkedScene &scene;
+    size_t capacityBytes;
+    size_t residentBytes = 0;
+    std::list<uint32_t> lru; // most recently used first
+    std::unordered_map<uint32_t, Entry> entries;
+    ChunkCacheStats counters;
+    mutable std::mutex mutex;
+};
+
+// Same samples and result as render_samples() with a SphereKernel over the same scene, traced in
+// waves of one sample per pixel against the chunked scene. Escaped rays see background(), so scenes
+// lit by an environment map are not supported (bench rejects --out-of-core with --environment).
+// Nullopt, with accum unchanged, when a chunk cannot be read. Once settings.cancel is set the wave
+// in flight is abandoned and only the samples of completed waves are added.
+inline std::optional<RenderStats> render_samples_out_of_core(const Camera &camera, ChunkedScene &scene, ChunkCache &cache,
+                                              Image<float, 3> &accum, int firstSample, int numSamples,
+                                              uint64_t seed = default_seed, const RenderSettings &settings = {})
+{
+    struct Path
+    {
+        Ray ray;
+        Vec3 throughput{1.f, 1.f, 1.f};
+        Sampler sampler;
+        uint32_t pixel;
+        int depth = 0;
+        bool done = false;
+        // Intersection progress within the current bounce
+        float tClosest = 0.f;
+        std::optional<HitRecord> hit = std::nullopt;
+        uint32_t materialId = 0;
+        float visitedT = 0.f;
+        int64_t visitedChunk = -1;
+    };
+
+    const int width = accum.width;
+    const int height = accum.height;
+    const size_t pixelCount = static_cast<size_t>(width) * height;
+    const unsigned threads = std::max(1u, settings.threads);
+    std::vector<Color> colors(pixelCount);
+    std::vector<Color> wave(pixelCount); // of the sample in flight, added to colors once it completes
+    std::vector<Path> paths;
+    paths.reserve(pixelCount);
+    std::vector<std::vector<uint32_t>> queues(scene.chunk_count());
+    uint64_t rays = 0;
+
+    // Queues the path on the next chunk it has to test, or finishes its intersection
+    auto advance = [&](Path &path) -> std::optional<uint32_t> {
+        float entryT = 0.f;
+        const auto next = scene.next_chunk(path.ray, hit_range.start, path.tClosest, path.visitedT, path.visitedChunk, entryT);
+        if (next)
+        {
+            path.visitedT = entryT;
+            path.visitedChunk = *next;
+        }
+        return next;
+    };
+
+    for (int sample = firstSample; sample < firstSample + numSamples && !settings.cancelled(); ++sample)
+    {
+        paths.clear();
+        std::fill(wave.begin(), wave.end(), Color(0.f, 0.f, 0.f));
+        std::vector<Vec2f> jitter;
+        for (uint32_t pixel = 0; pixel < pixelCount; ++pixel)
+        {
+            const int x = static_cast<int>(pixel % width);
+            const int y = static_cast<int>(pixel / width);
+            const auto sreenPoint = NDC_to_screen_space(raster_to_NDC(Vec2i{x, y}, width, height));
+            get_pixels(sreenPoint, sample_window(width, height), 1, seed, pixel, sample, jitter);
+            Path path{camera.generateWorldRay(jitter[0]), {1.f, 1.f, 1.f}, Sampler(seed, pixel, static_cast<uint32_t>(sample)), pixel};
+            paths.push_back(path);
+        }
+
+        std::vector<uint32_t> active(pixelCount);
+        for (uint32_t i = 0; i < pixelCount; ++i)
+            active[i] = i;
+
+        while (!active.empty() && !settings.cancelled())
+        {
+            rays += active.size();
+            std::vector<int64_t> firstChunk(active.size(), -1);
+            parallel_for(active.size(), [&](size_t i) {
+                if (settings.cancelled())
+                    return;
+                auto &path = paths[active[i]];
+                path.tClosest = hit_range.end;
+                path.hit.reset();
+                path.visitedT = -std::numeric_limits<float>::infinity();
+                path.visitedChunk = -1;
+                if (const auto next = advance(path))
+                    firstChunk[i] = *next;
+            }, threads);
+            size_t queued = 0;
+            for (size_t i = 0; i < active.size(); ++i)
+            {
+                if (firstChunk[i] >= 0)
+                {
+                    queues[firstChunk[i]].push_back(active[i]);
+                    ++queued;
+                }
+            }
+
+            // Drain the queues: resident chunks cost nothing, otherwise load the longest queue
+            while (queued > 0 && !settings.cancelled())
+            {
+                int64_t pick = -1;
+                for (uint32_t c = 0; c < queues.size(); ++c)
+                {
+                    if (queues[c].empty())
+                        continue;
+                    if (cache.resident(c))
+                    {
+                        pick = c;
+                        break;
+                    }
+                    if (pick < 0 || queues[c].size() > queues[pick].size())
+                        pick = c;
+                }
+
+                const auto chunk = cache.acquire(static_cast<uint32_t>(pick));
+                if (!chunk)
+                    return std::nullopt;
+                std::vector<uint32_t> batch;
+                batch.swap(queues[pick]);
+                queued -= batch.size();
+                cache.count_rays(batch.size());
+
+                std::vector<int64_t> nextChunk(batch.size(), -1);
+                parallel_for(batch.size(), [&](size_t i) {
+                    if (settings.cancelled())
+                        return;
+                    auto &path = paths[batch[i]];
+                    Range range{hit_range.start, path.tClosest};
+                    const auto slot = chunk->bvh.intersect(path.ray, range, [&](uint32_t s, const Range &current) {
+                        return chunk->spheres[s].intersect(path.ray, current);
+                    });
+                    if (slot)
+                    {
+                        path.tClosest = range.end;
+                        path.hit = chunk->spheres[*slot].record(path.ray, range.end);
+                        path.materialId = chunk->materialIds[*slot];
+                    }
+                    if (const auto next = advance(path))
+                        nextChunk[i] = *next;
+                }, threads);
+                for (size_t i = 0; i < batch.size(); ++i)
+                {
+                    if (nextChunk[i] >= 0)
+                    {
+                        queues[nextChunk[i]].push_back(batch[i]);
+                        ++queued;
+                    }
+                }
+            }
+
+            if (settings.cancelled())
+                break;
+
+            // Shade: same bounce loop as StaticKernel::trace
+            parallel_for(active.size(), [&](size_t i) {
+                if (settings.cancelled())
+                    return;
+                auto &path = paths[active[i]];
+                if (!path.hit)
+                {
+                    wave[path.pixel] += path.throughput * background(path.ray);
+                    path.done = true;
+                    return;
+                }
+                Ray scattered;
+                Vec3 attenuation;
+                path.sampler.start_bounce(path.depth + 1);
+                const bool scatters = std::visit([&](const auto &m) {
+                    return m.scatter(path.ray, *path.hit, attenuation, scattered, path.sampler);
+                }, scene.material(path.materialId));
+                path.depth += 1;
+                if (!scatters || path.depth >= SphereKernel::max_depth)
+                {
+                    path.done = true;
+                    return;
+                }
+                path.throughput = path.throughput * attenuation;
+                path.ray = scattered;
+            }, threads);
+
+            std::vector<uint32_t> stillActive;
+            for (const auto index : active)
+                if (!paths[index].done)
+                    stillActive.push_back(index);
+            active.swap(stillActive);
+        }
+
+        // A wave cut short by cancellation is dropped whole
+        if (!active.empty() || settings.cancelled())
+            break;
+        for (size_t pixel = 0; pixel < pixelCount; ++pixel)
+            colors[pixel] += wave[pixel];
+    }
+
+    for (size_t pixel = 0; pixel < pixelCount; ++pixel)
+    {
+        auto *pixelData = &accum[static_cast<int>(pixel / width)][static_cast<int>(pixel % width)];
+        pixelData[0] += colors[pixel].x;
+        pixelData[1] += colors[pixel].y;
+        pixelData[2] += colors[pixel].z;
+    }
+    return RenderStats{rays};
+}
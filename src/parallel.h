@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+inline unsigned worker_count()
+{
+    const auto count = std::thread::hardware_concurrency();
+    return count ? count : 1;
+}
+
+// Calls fn(i) for every i in [0, count) on up to worker_count() threads. Items are handed out one at a
+// time from a shared counter, so uneven item costs balance themselves.
+template <class F>
+void parallel_for(size_t count, F &&fn, unsigned threads = worker_count())
+{
+    threads = static_cast<unsigned>(std::min<size_t>(threads, count));
+    if (threads <= 1)
+    {
+        for (size_t i = 0; i < count; ++i)
+            fn(i);
+        return;
+    }
+
+    std::atomic<size_t> next{0};
+    auto worker = [&] {
+        for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1))
+            fn(i);
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (unsigned t = 1; t < threads; ++t)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &thread : pool)
+        thread.join();
+}
+
+// Runs a and b, a on a new thread when parallel is set. Used by recursive builders that fork only
+// near the root, where each half still has enough work for its own thread.
+template <class A, class B>
+void fork_join(A &&a, B &&b, bool parallel)
+{
+    if (!parallel)
+    {
+        a();
+        b();
+        return;
+    }
+    std::thread thread(std::forward<A>(a));
+    b();
+    thread.join();
+}
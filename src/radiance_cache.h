@@ -0,0 +1,232 @@
+#pragma once
+
+#include "hittable.h"
+#include "kernel.h"
+#include "math.hpp"
+#include "rng.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+// Hashed spatial cells shared by the radiance cache and the guiding field (guiding.h). Cells grow
+// with distance from viewpoint: cellSize is the cell edge per unit of distance, rounded up to a
+// power of two so that one level covers a range of distances. The key packs 17 bits per position
+// axis (wrapping), 5 bits of level, 2 bits per normal component and a top bit that marks it used.
+inline uint64_t spatial_cell_key(const Vec3 &p, const Vec3 &normal, const Vec3 &viewpoint, float cellSize)
+{
+    const int level = std::clamp(static_cast<int>(std::ceil(std::log2(std::max((p - viewpoint).length() * cellSize, 1e-4f)))), -15, 16);
+    const float invEdge = std::ldexp(1.f, -level);
+    auto cell = [&](float x) { return static_cast<uint64_t>(static_cast<int64_t>(std::floor(x * invEdge))) & 0x1ffff; };
+    auto bin = [](float n) { return static_cast<uint64_t>(std::clamp(static_cast<int>((n + 1.f) * 2.f), 0, 3)); };
+    return (uint64_t(1) << 63) | (cell(p.x) << 45) | (cell(p.y) << 28) | (cell(p.z) << 11) |
+           (static_cast<uint64_t>(level + 15) << 6) | (bin(normal.x) << 4) | (bin(normal.y) << 2) | bin(normal.z);
+}
+
+// Slot of key in a power-of-two table with linear probing, or -1; keyAt(slot) is the slot's atomic
+// key (0: empty). With claimed set, an empty slot is taken with a compare-exchange and *claimed
+// tells whether this call took it.
+template <class KeyAt>
+int64_t find_cell_slot(size_t mask, uint64_t key, bool *claimed, KeyAt &&keyAt)
+{
+    constexpr int max_probes = 16;
+    uint64_t h = key;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    for (int probe = 0; probe < max_probes; ++probe)
+    {
+        const size_t slot = (h + probe) & mask;
+        std::atomic<uint64_t> &slotKey = keyAt(slot);
+        uint64_t current = slotKey.load(std::memory_order_acquire);
+        if (current == key)
+            return static_cast<int64_t>(slot);
+        if (current != 0)
+            continue;
+        if (!claimed)
+            return -1;
+        if (slotKey.compare_exchange_strong(current, key, std::memory_order_acq_rel))
+        {
+            *claimed = true;
+            return static_cast<int64_t>(slot);
+        }
+        if (current == key)
+            return static_cast<int64_t>(slot);
+    }
+    return -1;
+}
+
+// World-space cache of outgoing radiance at diffuse surfaces. Lambertian surfaces scatter the same
+// radiance in every direction, so a path that reaches a diffuse point can stop there and take the
+// cached mean of the radiance earlier paths carried away from nearby points with a similar normal.
+//
+// The cache is a fixed-size open-addressing hash table keyed on a quantized position and normal.
+// Inserting never blocks: slots are claimed with a compare-exchange on the key and sums are kept in
+// fixed point, so concurrent inserts are lock-free and the totals do not depend on their order.
+// When the probe window of a key is full the sample is dropped, which bounds memory.
+class RadianceCache
+{
+public:
+    // Cells are spatial_cell_key() cells; one answers lookups once it holds minSamples samples
+    RadianceCache(const Vec3 &_viewpoint, size_t capacityBytes = size_t(16) << 20, float _cellSize = 0.02f,
+                  uint32_t _minSamples = 8)
+        : viewpoint(_viewpoint), cellSize(_cellSize), minSamples(_minSamples)
+    {
+        size_t capacity = 1024;
+        while (capacity * 2 * sizeof(Entry) <= capacityBytes)
+            capacity *= 2;
+        entries = std::make_unique<Entry[]>(capacity);
+        mask = capacity - 1;
+    }
+
+    void insert(const Vec3 &p, const Vec3 &normal, const Vec3 &radiance)
+    {
+        bool claimed = false;
+        Entry *entry = find(spatial_cell_key(p, normal, viewpoint, cellSize), &claimed);
+        if (claimed)
+            occupied.fetch_add(1, std::memory_order_relaxed);
+        if (!entry)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        entry->sum[0].fetch_add(to_fixed(radiance.x), std::memory_order_relaxed);
+        entry->sum[1].fetch_add(to_fixed(radiance.y), std::memory_order_relaxed);
+        entry->sum[2].fetch_add(to_fixed(radiance.z), std::memory_order_relaxed);
+        entry->count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Mean cached radiance, once the cell has enough samples
+    std::optional<Vec3> lookup(const Vec3 &p, const Vec3 &normal) const
+    {
+        const Entry *entry = find(spatial_cell_key(p, normal, viewpoint, cellSize), nullptr);
+        if (!entry)
+            return std::nullopt;
+        const uint32_t count = entry->count.load(std::memory_order_relaxed);
+        if (count < minSamples)
+            return std::nullopt;
+        const float scale = 1.f / (fixed_one * count);
+        return Vec3(entry->sum[0].load(std::memory_order_relaxed) * scale,
+                    entry->sum[1].load(std::memory_order_relaxed) * scale,
+                    entry->sum[2].load(std::memory_order_relaxed) * scale);
+    }
+
+    size_t capacity() const { return mask + 1; }
+    size_t memory_bytes() const { return capacity() * sizeof(Entry); }
+    size_t used() const { return occupied.load(std::memory_order_relaxed); }
+    uint64_t dropped_samples() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry
+    {
+        std::atomic<uint64_t> key{0}; // 0: empty
+        std::atomic<uint32_t> count{0};
+        std::array<std::atomic<uint64_t>, 3> sum{};
+    };
+
+    // Radiance below 2^16 with 24 fractional bits; 2^24 samples of 1.0 fit before overflow
+    static constexpr float fixed_one = float(1 << 24);
+    static constexpr float fixed_max = 65535.f;
+
+    static uint64_t to_fixed(float value)
+    {
+        return static_cast<uint64_t>(std::clamp(value, 0.f, fixed_max) * fixed_one + 0.5f);
+    }
+
+    Entry *find(uint64_t key, bool *claimed) const
+    {
+        const auto slot = find_cell_slot(mask, key, claimed, [&](size_t i) -> std::atomic<uint64_t> & { return entries[i].key; });
+        return slot < 0 ? nullptr : &entries[slot];
+    }
+
+    std::unique_ptr<Entry[]> entries;
+    size_t mask = 0;
+    Vec3 viewpoint;
+    float cellSize;
+    uint32_t minSamples;
+    std::atomic<size_t> occupied{0};
+    std::atomic<uint64_t> dropped{0};
+};
+
+// Wraps a kernel (StaticKernel or DynamicKernel) with the radiance cache. Record passes trace full
+// paths and insert, for every diffuse vertex, the radiance the rest of the path brought back. Query
+// passes trace as usual until a secondary diffuse hit with a populated cell and end the path there.
+// Queries only read the cache, so renders made after the record passes are deterministic.
+template <class Kernel>
+class CachedKernel
+{
+public:
+    enum class Mode
+    {
+        Record,
+        Query,
+    };
+
+    CachedKernel(const Kernel &_kernel, RadianceCache &_cache, Mode _mode, int _max_depth = 50)
+        : kernel(_kernel), cache(_cache), mode(_mode), max_depth(_max_depth)
+    {
+    }
+
+    Vec3 trace(const Ray &primary, Sampler &sampler) const
+    {
+        // Diffuse vertices of a record pass and the throughput gathered after each of them
+        struct Vertex
+        {
+            Vec3 p;
+            Vec3 normal;
+            Vec3 throughput;
+        };
+        std::array<Vertex, 8> vertices;
+        int vertexCount = 0;
+
+        auto finish = [&](const Vec3 &throughput, const Vec3 &radiance) {
+            for (int i = 0; i < vertexCount; ++i)
+                cache.insert(vertices[i].p, vertices[i].normal, vertices[i].throughput * radiance);
+            return throughput * radiance;
+        };
+
+        Ray ray = primary;
+        Vec3 throughput(1.f, 1.f, 1.f);
+        for (int depth = 0; depth < max_depth; ++depth)
+        {
+            const auto hit = kernel.intersect(ray);
+            if (!hit)
+                return finish(throughput, kernel.escape_radiance(ray));
+
+            const HitRecord &rec = kernel.hit_record(*hit);
+            const bool diffuse = kernel.diffuse(*hit);
+            if (diffuse && mode == Mode::Query && depth > 0)
+            {
+                if (const auto cached = cache.lookup(rec.p, rec.normal))
+                    return throughput * *cached;
+            }
+
+            Ray scattered;
+            Vec3 attenuation;
+            sampler.start_bounce(depth + 1);
+            if (!kernel.scatter(ray, *hit, attenuation, scattered, sampler))
+                return finish(throughput, {0.f, 0.f, 0.f});
+
+            if (mode == Mode::Record)
+            {
+                for (int i = 0; i < vertexCount; ++i)
+                    vertices[i].throughput = vertices[i].throughput * attenuation;
+                if (diffuse && vertexCount < static_cast<int>(vertices.size()))
+                    vertices[vertexCount++] = {rec.p, rec.normal, attenuation};
+            }
+            throughput = throughput * attenuation;
+            ray = scattered;
+        }
+        return finish(throughput, {0.f, 0.f, 0.f});
+    }
+
+private:
+    const Kernel &kernel;
+    RadianceCache &cache;
+    Mode mode;
+    int max_depth;
+};
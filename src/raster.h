@@ -0,0 +1,341 @@
+#pragma once
+
+#include "camera.h"
+#include "cpu_dispatch.h"
+#include "image.h"
+#include "kernel.h"
+#include "numa.h"
+#include "render.h"
+#include "tiles.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <optional>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+// Hybrid rendering for StaticKernel: the first hit of every camera sample comes from a software
+// rasterizer and path tracing starts at the second bounce. The bounding sphere of each primitive is
+// projected to a screen rectangle (Camera::ProjectSphere) and binned into the render tiles; a tile
+// walks its bin and runs the exact primitive test for every sample inside the rectangle, keeping
+// the nearest in a visibility buffer of primitive slot and depth. Camera rays, sample positions and
+// the primitive test are the ones render_samples() uses, so the image is the same; what goes away
+// is the BVH traversal of every primary ray.
+
+// Selects the rasterized primary visibility overload of render_samples() for kernel
+template <class Kernel>
+struct RasterizedPrimary
+{
+    const Kernel &kernel;
+
+    // For renderers without a raster path
+    Vec3 trace(const Ray &ray, Sampler &sampler) const { return kernel.trace(ray, sampler); }
+};
+
+// Screen rectangle of a world-space sphere and the pixels whose jittered camera samples can land in it
+struct ScreenFootprint
+{
+    Vec2f lower, upper; // screen rectangle
+    Tile pixels;        // empty when no camera ray reaches the sphere
+};
+
+inline ScreenFootprint project_footprint(const Camera &camera, const Vec3 &center, float radius, int width, int height)
+{
+    // Slack for rounding in the projection, in screen units (the image spans 2)
+    constexpr float pad = 1e-3f;
+    const Vec2f jitter = sample_window(width, height) * 0.5f;
+
+    ScreenFootprint footprint{};
+    // Entirely behind the eye: no camera ray reaches it
+    if (camera.WorldToCamera(center).z >= radius)
+        return footprint;
+
+    if (camera.ProjectSphere(center, radius, footprint.lower, footprint.upper))
+    {
+        footprint.lower = footprint.lower - Vec2f(pad, pad);
+        footprint.upper = footprint.upper + Vec2f(pad, pad);
+    }
+    else
+    {
+        footprint.lower = Vec2f(-2.f, -2.f);
+        footprint.upper = Vec2f(2.f, 2.f);
+    }
+
+    // Pixel centers sit at 2 (x + 0.5) / width - 1 and 1 - 2 (y + 0.5) / height
+    const float x0 = (footprint.lower.x - jitter.x + 1.f) * 0.5f * width - 0.5f;
+    const float x1 = (footprint.upper.x + jitter.x + 1.f) * 0.5f * width - 0.5f;
+    const float y0 = (1.f - footprint.upper.y - jitter.y) * 0.5f * height - 0.5f;
+    const float y1 = (1.f - footprint.lower.y + jitter.y) * 0.5f * height - 0.5f;
+    auto &pixels = footprint.pixels;
+    pixels.x0 = std::max(0, static_cast<int>(std::floor(std::max(x0, -1.f))));
+    pixels.x1 = std::min(width, static_cast<int>(std::floor(std::min(x1, float(width)))) + 1);
+    pixels.y0 = std::max(0, static_cast<int>(std::floor(std::max(y0, -1.f))));
+    pixels.y1 = std::min(height, static_cast<int>(std::floor(std::min(y1, float(height)))) + 1);
+    if (pixels.x0 >= pixels.x1 || pixels.y0 >= pixels.y1)
+        pixels = {};
+    return footprint;
+}
+
+namespace raster_detail
+{
+    // Primitive slots overlapping each cell of a tileSize grid over the image
+    struct Bins
+    {
+        int tileSize = 0;
+        int tilesX = 0;
+        std::vector<ScreenFootprint> footprints; // per slot
+        std::vector<std::vector<uint32_t>> slots;
+
+        const std::vector<uint32_t> &of(const Tile &tile) const
+        {
+            return slots[static_cast<size_t>(tile.y0 / tileSize) * tilesX + tile.x0 / tileSize];
+        }
+    };
+
+    template <class Primitive>
+    void bounding_sphere(const Primitive &primitive, Vec3 &center, float &radius)
+    {
+        if constexpr (std::is_same_v<Primitive, Sphere>)
+        {
+            center = primitive.center();
+            radius = std::fabs(primitive.radius());
+        }
+        else
+        {
+            const auto box = primitive.bounding_box();
+            center = 0.5f * (box.min + box.max);
+            radius = 0.5f * (box.max - box.min).length();
+        }
+    }
+
+    template <class Kernel>
+    Bins bin_primitives(const Camera &camera, const Kernel &kernel, int width, int height, int tileSize)
+    {
+        Bins bins;
+        bins.tileSize = tileSize;
+        bins.tilesX = (width + tileSize - 1) / tileSize;
+        const int tilesY = (height + tileSize - 1) / tileSize;
+        bins.slots.resize(static_cast<size_t>(bins.tilesX) * tilesY);
+
+        const auto &primitives = kernel.primitive_table();
+        bins.footprints.resize(primitives.size());
+        for (size_t slot = 0; slot < primitives.size(); ++slot)
+        {
+            Vec3 center;
+            float radius;
+            std::visit([&](const auto &p) { bounding_sphere(p, center, radius); }, primitives[slot]);
+            radius *= 1.0001f;
+
+            auto &footprint = bins.footprints[slot];
+            footprint = project_footprint(camera, center, radius, width, height);
+            const auto &pixels = footprint.pixels;
+            if (pixels.x0 >= pixels.x1 || pixels.y0 >= pixels.y1)
+                continue;
+
+            for (int ty = pixels.y0 / tileSize; ty <= (pixels.y1 - 1) / tileSize; ++ty)
+                for (int tx = pixels.x0 / tileSize; tx <= (pixels.x1 - 1) / tileSize; ++tx)
+                    bins.slots[static_cast<size_t>(ty) * bins.tilesX + tx].push_back(static_cast<uint32_t>(slot));
+        }
+        return bins;
+    }
+
+    // Per-worker buffers of one tile, batch samples per pixel at a time
+    struct Scratch
+    {
+        std::vector<Vec2f> samples;
+        std::vector<Vec2f> points;
+        std::vector<Ray> rays;
+        std::vector<float> depth;   // visibility buffer: nearest hit so far
+        std::vector<uint32_t> slot; // visibility buffer: primitive of that hit, or no_hit
+        std::vector<Color> colors;
+    };
+
+    constexpr int batch = 8;
+    constexpr uint32_t no_hit = ~0u;
+
+    template <class Kernel>
+    struct TileJob
+    {
+        const Camera &camera;
+        const Kernel &kernel;
+        const Bins &bins;
+        const Tile &tile;
+        int width;
+        int height;
+        int firstSample;
+        int numSamples;
+        uint64_t seed;
+        Image<float, 3> &out;
+        Scratch &scratch;
+    };
+
+    template <class Kernel>
+    RT_ALWAYS_INLINE void render_tile_body(const TileJob<Kernel> &job)
+    {
+        const auto &tile = job.tile;
+        const int tileWidth = tile.x1 - tile.x0;
+        const size_t pixels = static_cast<size_t>(tileWidth) * (tile.y1 - tile.y0);
+        auto &scratch = job.scratch;
+        scratch.points.resize(pixels * batch);
+        scratch.rays.resize(pixels * batch);
+        scratch.depth.resize(pixels * batch);
+        scratch.slot.resize(pixels * batch);
+        scratch.colors.assign(pixels, Color());
+        const auto &bin = job.bins.of(tile);
+
+        for (int batchStart = 0; batchStart < job.numSamples; batchStart += batch)
+        {
+            const int count = std::min(batch, job.numSamples - batchStart);
+
+            // Camera samples of the batch, generated exactly as render_samples() does
+            for (int y = tile.y0; y < tile.y1; ++y)
+            {
+                for (int x = tile.x0; x < tile.x1; ++x)
+                {
+                    const size_t base = (static_cast<size_t>(y - tile.y0) * tileWidth + (x - tile.x0)) * batch;
+                    const auto screenPoint = NDC_to_screen_space(raster_to_NDC(Vec2i{x, y}, job.width, job.height));
+                    get_pixels(screenPoint, sample_window(job.width, job.height), count, job.seed,
+                               static_cast<uint32_t>(y * job.width + x), job.firstSample + batchStart, scratch.samples);
+                    for (int i = 0; i < count; ++i)
+                    {
+                        scratch.points[base + i] = scratch.samples[i];
+                        scratch.rays[base + i] = job.camera.generateWorldRay(scratch.samples[i]);
+                        scratch.depth[base + i] = hit_range.end;
+                        scratch.slot[base + i] = no_hit;
+                    }
+                }
+            }
+
+            // Rasterize: each primitive of the bin against the samples inside its footprint, depth tested
+            for (const uint32_t slot : bin)
+            {
+                const auto &footprint = job.bins.footprints[slot];
+                const int x0 = std::max(tile.x0, footprint.pixels.x0), x1 = std::min(tile.x1, footprint.pixels.x1);
+                const int y0 = std::max(tile.y0, footprint.pixels.y0), y1 = std::min(tile.y1, footprint.pixels.y1);
+                for (int y = y0; y < y1; ++y)
+                {
+                    for (int x = x0; x < x1; ++x)
+                    {
+                        const size_t base = (static_cast<size_t>(y - tile.y0) * tileWidth + (x - tile.x0)) * batch;
+                        for (int i = 0; i < count; ++i)
+                        {
+                            const auto &point = scratch.points[base + i];
+                            if (point.x < footprint.lower.x || point.x > footprint.upper.x ||
+                                point.y < footprint.lower.y || point.y > footprint.upper.y)
+                                continue;
+                            const Range range{hit_range.start, scratch.depth[base + i]};
+                            if (const auto t = job.kernel.intersect_primitive(slot, scratch.rays[base + i], range))
+                            {
+                                scratch.depth[base + i] = *t;
+                                scratch.slot[base + i] = slot;
+                            }
+                        }
+                    }
+                }
+            }
+
+            // Shade from the visibility buffer; paths continue with the second bounce
+            for (int y = tile.y0; y < tile.y1; ++y)
+            {
+                for (int x = tile.x0; x < tile.x1; ++x)
+                {
+                    const size_t pixel = static_cast<size_t>(y - tile.y0) * tileWidth + (x - tile.x0);
+                    const auto pixelIndex = static_cast<uint32_t>(y * job.width + x);
+                    for (int i = 0; i < count; ++i)
+                    {
+                        const size_t sample = pixel * batch + i;
+                        const auto &ray = scratch.rays[sample];
+                        if (scratch.slot[sample] == no_hit)
+                        {
+                            scratch.colors[pixel] += job.kernel.escape_radiance(ray);
+                            continue;
+                        }
+                        Sampler sampler(job.seed, pixelIndex, static_cast<uint32_t>(job.firstSample + batchStart + i));
+                        const auto hit = job.kernel.hit_at(ray, scratch.slot[sample], scratch.depth[sample]);
+                        scratch.colors[pixel] += job.kernel.trace_from(ray, hit, sampler);
+                    }
+                }
+            }
+        }
+
+        for (int y = tile.y0; y < tile.y1; ++y)
+        {
+            for (int x = tile.x0; x < tile.x1; ++x)
+            {
+                const auto &color = scratch.colors[static_cast<size_t>(y - tile.y0) * tileWidth + (x - tile.x0)];
+                auto *pixelData = &job.out[y - tile.y0][x - tile.x0];
+                pixelData[0] = color.x;
+                pixelData[1] = color.y;
+                pixelData[2] = color.z;
+            }
+        }
+    }
+
+    template <class Kernel>
+    void render_tile_generic(const TileJob<Kernel> &job) { render_tile_body(job); }
+    template <class Kernel>
+    RT_TARGET_AVX2 void render_tile_avx2(const TileJob<Kernel> &job) { render_tile_body(job); }
+    template <class Kernel>
+    RT_TARGET_AVX512 void render_tile_avx512(const TileJob<Kernel> &job) { render_tile_body(job); }
+
+    template <class Kernel>
+    void render_tile(IsaLevel isa, const TileJob<Kernel> &job)
+    {
+        if (isa == IsaLevel::Avx512)
+            render_tile_avx512(job);
+        else if (isa == IsaLevel::Avx2)
+            render_tile_avx2(job);
+        else
+            render_tile_generic(job);
+    }
+} // namespace raster_detail
+
+// render_samples() with rasterized primary visibility; same samples, same result. The primitives are
+// binned once per call. stats.rays counts the traced rays only, stats.rasterized the primary samples.
+template <class Kernel>
+RenderStats render_samples(const Camera& camera, const RasterizedPrimary<Kernel>& raster, Image<float, 3>& accum,
+                           int firstSample, int numSamples, uint64_t seed = default_seed, const RenderSettings& settings = {})
+{
+    const int tileSize = settings.tileSize > 0 ? settings.tileSize : default_tile_size();
+    const auto tiles = make_tiles(accum.width, accum.height, tileSize, settings.order);
+    const auto workers = place_workers(std::max(1u, settings.threads), settings.pinThreads, settings.nodes);
+    const auto bins = raster_detail::bin_primitives(camera, raster.kernel, accum.width, accum.height, tileSize);
+
+    std::optional<NodeReplicas<Kernel>> replicas;
+    if (settings.replicateScene)
+        replicas.emplace(raster.kernel, nodes_of(workers));
+
+    struct WorkerState
+    {
+        const Kernel *kernel;
+        Image<float, 3> tile;
+        raster_detail::Scratch scratch;
+    };
+    auto makeState = [&](const WorkerPlacement& placement) {
+        WorkerState state{replicas ? replicas->get(placement.node) : &raster.kernel, Image<float, 3>(tileSize, tileSize), {}};
+        state.scratch.samples.reserve(raster_detail::batch);
+        return state;
+    };
+
+    std::atomic<uint64_t> rays{0};
+    const IsaLevel isa = active_isa();
+    numa_parallel_for(workers, tiles.size(), makeState, [&](size_t tileIndex, WorkerState& state) {
+        if (settings.cancelled())
+            return;
+        const auto &tile = tiles[tileIndex];
+        const auto raysBefore = traced_rays;
+        const raster_detail::TileJob<Kernel> job{camera, *state.kernel, bins, tile, accum.width, accum.height,
+                                                 firstSample, numSamples, seed, state.tile, state.scratch};
+        raster_detail::render_tile(isa, job);
+
+        render_detail::add_tile(tile, state.tile, accum);
+        rays.fetch_add(traced_rays - raysBefore, std::memory_order_relaxed);
+    });
+
+    RenderStats stats{rays.load(), isa};
+    stats.rasterized = static_cast<uint64_t>(accum.width) * accum.height * numSamples;
+    return stats;
+}
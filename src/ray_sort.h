@@ -0,0 +1,181 @@
+#pragma once
+
+#include "aabb.h"
+#include "math.hpp"
+#include "ray.h"
+#include "tiles.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Reordering of secondary rays for coherence. After a diffuse or fuzzy bounce the rays of a batch
+// leave in random directions from scattered points, so tracing them in batch order walks unrelated
+// BVH nodes ray after ray. Sorting them by a key of direction octant (high bits) and the Morton code
+// of the quantized origin (low bits) puts rays that start close together and head the same way next
+// to each other, so consecutive traversals reuse the nodes and primitives the last one pulled in.
+// Sorting is not free and only pays when the scene does not fit the cache anyway and the batch is
+// large enough to hold neighbours; RaySortPolicy decides per worker from those sizes and from the
+// measured cost per ray with and without sorting.
+
+enum class RaySorting
+{
+    Off,
+    On,
+    Adaptive,
+};
+
+inline const char *to_string(RaySorting sorting)
+{
+    switch (sorting)
+    {
+    case RaySorting::Off: return "off";
+    case RaySorting::On: return "on";
+    default: return "adaptive";
+    }
+}
+
+inline RaySorting ray_sorting_from_string(const std::string &name)
+{
+    if (name == "off")
+        return RaySorting::Off;
+    if (name == "on")
+        return RaySorting::On;
+    return RaySorting::Adaptive;
+}
+
+// Bits per axis of the origin grid; with the 3 octant bits the key fills 30 bits
+constexpr int ray_sort_origin_bits = 9;
+constexpr int ray_sort_key_bits = 3 + 3 * ray_sort_origin_bits;
+
+// Spreads the low 10 bits of v to every third bit
+inline uint32_t spread_bits_3(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Quantizes origins in bounds to the key grid
+class RaySortKey
+{
+public:
+    explicit RaySortKey(const AABB &bounds) : lower(bounds.min)
+    {
+        const Vec3 extent = bounds.max - bounds.min;
+        const float cells = float((1 << ray_sort_origin_bits) - 1);
+        scale = Vec3(extent.x > 0.f ? cells / extent.x : 0.f, extent.y > 0.f ? cells / extent.y : 0.f,
+                     extent.z > 0.f ? cells / extent.z : 0.f);
+    }
+
+    uint32_t operator()(const Ray &ray) const
+    {
+        const Vec3 d = ray.direction();
+        const uint32_t octant = (d.x < 0.f ? 4u : 0u) | (d.y < 0.f ? 2u : 0u) | (d.z < 0.f ? 1u : 0u);
+        const Vec3 cell = (ray.origin() - lower) * scale;
+        const uint32_t morton = spread_bits_3(quantize(cell.x)) | (spread_bits_3(quantize(cell.y)) << 1) |
+                                (spread_bits_3(quantize(cell.z)) << 2);
+        return (octant << (3 * ray_sort_origin_bits)) | morton;
+    }
+
+private:
+    static uint32_t quantize(float x)
+    {
+        return static_cast<uint32_t>(std::clamp(x, 0.f, float((1 << ray_sort_origin_bits) - 1)));
+    }
+
+    Vec3 lower;
+    Vec3 scale;
+};
+
+// Stable LSD radix sort of values by keys of up to keyBits bits, 10 bits per pass; passes whose
+// digit is the same for every key are skipped. The scratch vectors are resized as needed and can be
+// kept across calls to avoid allocations.
+inline void radix_sort(std::vector<uint32_t> &keys, std::vector<uint32_t> &values, std::vector<uint32_t> &keyScratch,
+                       std::vector<uint32_t> &valueScratch, int keyBits = 32)
+{
+    constexpr int digit_bits = 10;
+    constexpr uint32_t buckets = 1u << digit_bits;
+    const size_t count = keys.size();
+    if (count == 0)
+        return;
+    keyScratch.resize(count);
+    valueScratch.resize(count);
+
+    std::array<uint32_t, buckets> offsets;
+    for (int shift = 0; shift < keyBits; shift += digit_bits)
+    {
+        offsets.fill(0);
+        for (const uint32_t key : keys)
+            ++offsets[(key >> shift) & (buckets - 1)];
+        if (offsets[(keys[0] >> shift) & (buckets - 1)] == count)
+            continue;
+
+        uint32_t sum = 0;
+        for (auto &offset : offsets)
+            sum += std::exchange(offset, sum);
+        for (size_t i = 0; i < count; ++i)
+        {
+            const uint32_t slot = offsets[(keys[i] >> shift) & (buckets - 1)]++;
+            keyScratch[slot] = keys[i];
+            valueScratch[slot] = values[i];
+        }
+        keys.swap(keyScratch);
+        values.swap(valueScratch);
+    }
+}
+
+// Decides per batch whether to sort, for one worker. Off and On are fixed; Adaptive never sorts
+// batches below min_batch rays or scenes whose BVH and primitives fit half the L2, and otherwise
+// times both choices: trial_batches of each first, then the cheaper one per ray, with one batch of
+// the other every explore_interval batches so a change in the scene's cost shows up.
+class RaySortPolicy
+{
+public:
+    static constexpr size_t min_batch = 1024;
+    static constexpr int trial_batches = 2;
+    static constexpr int explore_interval = 16;
+
+    RaySortPolicy(RaySorting _mode = RaySorting::Adaptive, size_t sceneBytes = 0) : mode(_mode)
+    {
+        static const size_t l2 = l2_cache_size();
+        cacheResident = sceneBytes <= (l2 ? l2 : size_t(256) << 10) / 2;
+    }
+
+    bool sort_batch(size_t rays)
+    {
+        if (mode != RaySorting::Adaptive)
+            return mode == RaySorting::On && rays > 1;
+        measuring = rays >= min_batch && !cacheResident;
+        if (!measuring)
+            return false;
+        ++batches;
+        if (trials[0] < trial_batches || trials[1] < trial_batches)
+            return trials[1] <= trials[0];
+        const bool sortCheaper = cost[1] < cost[0];
+        return batches % explore_interval == 0 ? !sortCheaper : sortCheaper;
+    }
+
+    // Time spent on rays traced after the decision for a batch, sorting included
+    void record(bool sorted, size_t rays, double seconds)
+    {
+        if (!measuring || rays == 0)
+            return;
+        const double perRay = seconds / rays;
+        cost[sorted] = trials[sorted]++ == 0 ? perRay : 0.75 * cost[sorted] + 0.25 * perRay;
+    }
+
+private:
+    RaySorting mode;
+    bool cacheResident = false;
+    bool measuring = false; // the last decision is timed
+    uint64_t batches = 0;
+    std::array<int, 2> trials{};
+    std::array<double, 2> cost{}; // seconds per ray, unsorted and sorted
+};
@@ -0,0 +1,221 @@
+#include "ray_tracing_core.h"
+
+#include "camera.h"
+#include "environment.h"
+#include "half.h"
+#include "image.h"
+#include "image_io.h"
+#include "kernel.h"
+#include "numa.h"
+#include "render.h"
+#include "scenes.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+
+namespace core_detail
+{
+    // Same quantization as resolve()
+    inline uint8_t display_value(float radiance)
+    {
+        return static_cast<uint8_t>(static_cast<int>(256 * std::clamp(std::sqrt(radiance), 0.000f, 0.999f)));
+    }
+
+    // Writes the mean of a finished tile's radiance sums (tile-local coordinates) into the buffer
+    template <PixelFormat Format>
+    void store_tile(const PixelBuffer &target, std::ptrdiff_t stride, const Tile &tile, const Image<float, 3> &local,
+                    int samples)
+    {
+        constexpr size_t bytes = Format == PixelFormat::Rgb8      ? 3
+                                 : Format == PixelFormat::Rgb32f  ? 12
+                                 : Format == PixelFormat::Rgba32f ? 16
+                                 : Format == PixelFormat::Rgba16f ? 8
+                                                                  : 4;
+        for (int y = tile.y0; y < tile.y1; ++y)
+        {
+            auto *out = static_cast<uint8_t *>(target.data) + y * stride + tile.x0 * bytes;
+            for (int x = tile.x0; x < tile.x1; ++x, out += bytes)
+            {
+                const auto *sum = &local[y - tile.y0][x - tile.x0];
+                Color color(sum[0], sum[1], sum[2]);
+                color /= samples;
+
+                if constexpr (Format == PixelFormat::Rgb8 || Format == PixelFormat::Rgba8)
+                {
+                    out[0] = display_value(color.x);
+                    out[1] = display_value(color.y);
+                    out[2] = display_value(color.z);
+                    if constexpr (Format == PixelFormat::Rgba8)
+                        out[3] = 255;
+                }
+                else if constexpr (Format == PixelFormat::Bgra8)
+                {
+                    out[0] = display_value(color.z);
+                    out[1] = display_value(color.y);
+                    out[2] = display_value(color.x);
+                    out[3] = 255;
+                }
+                else if constexpr (Format == PixelFormat::Rgba16f)
+                {
+                    const uint16_t pixel[4] = {float_to_half_bits(color.x), float_to_half_bits(color.y),
+                                               float_to_half_bits(color.z), float_to_half_bits(1.f)};
+                    std::memcpy(out, pixel, sizeof(pixel));
+                }
+                else
+                {
+                    // The caller's buffer need not be float-aligned
+                    const float pixel[4] = {color.x, color.y, color.z, 1.f};
+                    std::memcpy(out, pixel, bytes);
+                }
+            }
+        }
+    }
+
+    inline void store_tile(const PixelBuffer &target, std::ptrdiff_t stride, const Tile &tile, const Image<float, 3> &local,
+                           int samples)
+    {
+        switch (target.format)
+        {
+        case PixelFormat::Rgb8: store_tile<PixelFormat::Rgb8>(target, stride, tile, local, samples); break;
+        case PixelFormat::Rgba8: store_tile<PixelFormat::Rgba8>(target, stride, tile, local, samples); break;
+        case PixelFormat::Bgra8: store_tile<PixelFormat::Bgra8>(target, stride, tile, local, samples); break;
+        case PixelFormat::Rgb32f: store_tile<PixelFormat::Rgb32f>(target, stride, tile, local, samples); break;
+        case PixelFormat::Rgba32f: store_tile<PixelFormat::Rgba32f>(target, stride, tile, local, samples); break;
+        case PixelFormat::Rgba16f: store_tile<PixelFormat::Rgba16f>(target, stride, tile, local, samples); break;
+        }
+    }
+} // namespace core_detail
+
+struct RenderContext::State
+{
+    std::optional<SceneDescription> description;
+    std::optional<SphereKernel> kernel; // built on the next render after the scene changes
+    bool kernelCurrent = false;
+    TextureCache textures{size_t(64) << 20};
+
+    Vec3 eye;
+    Vec3 target;
+    Vec3 up = Vec3(0.f, 1.f, 0.f);
+    float fov = 20.f;
+    uint64_t seed = default_seed;
+    unsigned threads = 0;
+    std::atomic<bool> cancelled{false};
+};
+
+RenderContext::RenderContext() : state(std::make_unique<State>()) {}
+RenderContext::~RenderContext() = default;
+RenderContext::RenderContext(RenderContext &&) noexcept = default;
+RenderContext &RenderContext::operator=(RenderContext &&) noexcept = default;
+
+const std::vector<std::string> &RenderContext::scene_names()
+{
+    return canonical_scenes;
+}
+
+bool RenderContext::build_scene(const std::string &name, uint64_t sceneSeed)
+{
+    auto description = make_scene(name, 1.f, sceneSeed);
+    if (!description)
+        return false;
+    state->description = std::move(description);
+    state->kernelCurrent = false;
+    const Camera &camera = state->description->camera;
+    set_camera(camera.get_position(), camera.get_target(), camera.get_fov());
+    return true;
+}
+
+bool RenderContext::set_environment(const std::string &filename, float scale)
+{
+    if (!state->description)
+        return false;
+    auto texture = load_tiled_texture(filename, state->textures, TextureWrap::Repeat, TextureWrap::Clamp);
+    if (!texture)
+        return false;
+    state->description->scene.environment = std::make_shared<const EnvironmentMap>(std::move(*texture), scale);
+    state->kernelCurrent = false;
+    return true;
+}
+
+void RenderContext::set_camera(const Vec3 &eye, const Vec3 &target, float fovDegrees, const Vec3 &up)
+{
+    state->eye = eye;
+    state->target = target;
+    state->fov = fovDegrees;
+    state->up = up;
+}
+
+void RenderContext::set_seed(uint64_t seed)
+{
+    state->seed = seed;
+}
+
+void RenderContext::set_threads(unsigned threads)
+{
+    state->threads = threads;
+}
+
+void RenderContext::cancel()
+{
+    state->cancelled.store(true, std::memory_order_relaxed);
+}
+
+RenderResult RenderContext::render(const PixelBuffer &target, int samples, const TileCallback &onTile)
+{
+    RenderResult result;
+    const auto rowBytes = static_cast<std::ptrdiff_t>(target.width) * static_cast<std::ptrdiff_t>(pixel_format_bytes(target.format));
+    const std::ptrdiff_t stride = target.stride ? target.stride : rowBytes;
+    if (!state->description)
+        result.error = "no scene";
+    else if (!target.data || target.width <= 0 || target.height <= 0)
+        result.error = "bad buffer";
+    else if (std::abs(stride) < rowBytes)
+        result.error = "stride shorter than a row";
+    else if (samples <= 0)
+        result.error = "bad sample count";
+    if (!result.error.empty())
+        return result;
+
+    if (!state->kernelCurrent)
+    {
+        // Closed set of types: static dispatch, otherwise the virtual-dispatch kernel per render
+        state->kernel = SphereKernel::build(state->description->scene);
+        state->kernelCurrent = true;
+    }
+
+    const Camera camera(state->eye, state->target, state->up, state->fov, float(target.width) / target.height);
+    RenderSettings settings;
+    if (state->threads)
+        settings.threads = state->threads;
+    settings.pinThreads = settings.replicateScene = numa_topology().size() > 1;
+    settings.cancel = &state->cancelled;
+
+    const size_t pixelCount = static_cast<size_t>(target.width) * target.height;
+    std::atomic<size_t> pixelsDone{0};
+    auto flush = [&](const Tile &tile, const Image<float, 3> &local) {
+        core_detail::store_tile(target, stride, tile, local, samples);
+        const size_t pixels = static_cast<size_t>(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+        const size_t done = pixelsDone.fetch_add(pixels, std::memory_order_relaxed) + pixels;
+        if (onTile)
+            onTile({tile.x0, tile.y0, tile.x1, tile.y1, done, pixelCount});
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto stats =
+        state->kernel
+            ? render_detail::render_tiles(camera, *state->kernel, target.width, target.height, 0, samples, nullptr,
+                                          state->seed, settings, flush)
+            : render_detail::render_tiles(camera, DynamicKernel(state->description->scene, 50), target.width,
+                                          target.height, 0, samples, nullptr, state->seed, settings, flush);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.rays = stats.rays;
+    result.status = pixelsDone.load() == pixelCount ? RenderStatus::Done : RenderStatus::Cancelled;
+    // Cleared here rather than on entry, so a cancel() racing the start of this render is not lost
+    state->cancelled.store(false, std::memory_order_relaxed);
+    return result;
+}
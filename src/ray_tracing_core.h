@@ -0,0 +1,135 @@
+#pragma once
+
+#include "math.hpp"
+#include "rng.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Embedding API of the ray_tracing_core library. A tool links the library and includes only this
+// header; scene setup, kernels and the tile renderer are compiled into the library once. A
+// RenderContext holds a built scene and a camera and renders straight into a buffer the caller
+// owns, in the caller's pixel format and row stride: each worker converts its finished tile into
+// the buffer, so there is no intermediate image and no file round trip.
+//
+//     RenderContext context;
+//     context.build_scene("random_spheres");
+//     std::vector<uint8_t> pixels(width * height * 4);
+//     context.render({pixels.data(), width, height, 0, PixelFormat::Rgba8}, 64);
+
+enum class PixelFormat
+{
+    Rgb8,    // display-encoded (gamma 2) as resolve() writes it
+    Rgba8,   // as Rgb8, alpha 255
+    Bgra8,   // as Rgba8 in B, G, R, A order
+    Rgb32f,  // mean linear radiance
+    Rgba32f, // as Rgb32f, alpha 1
+    Rgba16f, // as Rgba32f in IEEE half precision
+};
+
+inline const char *to_string(PixelFormat format)
+{
+    switch (format)
+    {
+    case PixelFormat::Rgb8: return "rgb8";
+    case PixelFormat::Rgba8: return "rgba8";
+    case PixelFormat::Bgra8: return "bgra8";
+    case PixelFormat::Rgb32f: return "rgb32f";
+    case PixelFormat::Rgba32f: return "rgba32f";
+    default: return "rgba16f";
+    }
+}
+
+inline size_t pixel_format_bytes(PixelFormat format)
+{
+    switch (format)
+    {
+    case PixelFormat::Rgb8: return 3;
+    case PixelFormat::Rgba8:
+    case PixelFormat::Bgra8: return 4;
+    case PixelFormat::Rgb32f: return 12;
+    case PixelFormat::Rgba32f: return 16;
+    default: return 8;
+    }
+}
+
+// Caller-owned pixels. Row y starts at data + y * stride bytes; stride 0 means rows are packed, a
+// negative stride with data at the last row in memory gives a bottom-up image.
+struct PixelBuffer
+{
+    void *data;
+    int width;
+    int height;
+    std::ptrdiff_t stride;
+    PixelFormat format;
+};
+
+// A tile whose pixels are final in the buffer
+struct TileDone
+{
+    int x0, y0, x1, y1; // pixel bounds, x1 and y1 exclusive
+    size_t pixelsDone;  // over the whole render so far, this tile included
+    size_t pixelCount;
+};
+
+// Called on the worker that rendered the tile, concurrently for different tiles
+using TileCallback = std::function<void(const TileDone &)>;
+
+enum class RenderStatus
+{
+    Done,
+    Cancelled, // pixels of tiles that were not reported are unchanged
+    Failed,    // nothing was rendered, see RenderResult::error
+};
+
+struct RenderResult
+{
+    RenderStatus status = RenderStatus::Failed;
+    uint64_t rays = 0;
+    double seconds = 0.0;
+    std::string error;
+};
+
+// One scene and camera. A context renders one image at a time; cancel() may be called from any
+// thread, tile callbacks included.
+class RenderContext
+{
+public:
+    RenderContext();
+    ~RenderContext();
+    RenderContext(RenderContext &&) noexcept;
+    RenderContext &operator=(RenderContext &&) noexcept;
+
+    // Names build_scene() accepts
+    static const std::vector<std::string> &scene_names();
+
+    // Builds a canonical scene (scenes.h) and takes over its camera; false for an unknown name
+    bool build_scene(const std::string &name, uint64_t sceneSeed = default_seed);
+
+    // Lights the scene with a lat-long map (.hdr, .pfm or .rtt); false if it cannot be loaded or
+    // there is no scene
+    bool set_environment(const std::string &filename, float scale = 1.f);
+
+    // The aspect ratio follows the buffer of each render
+    void set_camera(const Vec3 &eye, const Vec3 &target, float fovDegrees, const Vec3 &up = Vec3(0.f, 1.f, 0.f));
+
+    void set_seed(uint64_t seed);
+    // 0 uses every hardware thread
+    void set_threads(unsigned threads);
+
+    // Renders samples per pixel into target, calling onTile as tiles land in it. Multi-node
+    // machines get pinned workers and a scene copy per node, as the renderer binary does.
+    RenderResult render(const PixelBuffer &target, int samples, const TileCallback &onTile = {});
+
+    // Stops the render in progress: tiles already started finish, the rest are skipped. Called
+    // between renders it stops the next one before its first tile.
+    void cancel();
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
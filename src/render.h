@@ -0,0 +1,352 @@
+#pragma once
+
+#include "camera.h"
+#include "cost_map.h"
+#include "cpu_dispatch.h"
+#include "image.h"
+#include "kernel.h"
+#include "numa.h"
+#include "parallel.h"
+#include "rng.h"
+#include "tiles.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <optional>
+#include <vector>
+
+// Jittered sample positions; sample i uses bounce 0 of (seed, pixelIndex, i) so it can be regenerated alone.
+// Fills a caller-owned vector so the renderer can reuse per-thread scratch memory.
+inline void get_pixels(const Vec2f& pixel, const Vec2f& windowSize, int numSamples, uint64_t seed, uint32_t pixelIndex, int firstSample,
+                       std::vector<Vec2f>& sampledPixels) {
+    sampledPixels.clear();
+
+    float halfWindowSizeX = windowSize.x / 2.0f;
+    float halfWindowSizeY = windowSize.y / 2.0f;
+
+    for (int i = firstSample; i < firstSample + numSamples; ++i) {
+        Sampler sampler(seed, pixelIndex, i);
+        float offsetX = sampler.next(-1.0f, 1.0f) * halfWindowSizeX;
+        float offsetY = sampler.next(-1.0f, 1.0f) * halfWindowSizeY;
+
+        Vec2f sampledPixel(
+            std::clamp(pixel.x + offsetX, -1.0f, 1.0f),
+            std::clamp(pixel.y + offsetY, -1.0f, 1.0f)
+        );
+
+        sampledPixels.push_back(sampledPixel);
+    }
+}
+
+// Screen-space extent the samples of one pixel are jittered over
+inline Vec2f sample_window(int width, int height) {
+    return {05.f /(2.f * width), 5.f /(2.f * height)};
+}
+
+inline std::vector<Vec2f> get_pixels(const Vec2f& pixel, const Vec2f& windowSize, int numSamples, uint64_t seed, uint32_t pixelIndex, int firstSample = 0) {
+    std::vector<Vec2f> sampledPixels;
+    get_pixels(pixel, windowSize, numSamples, seed, pixelIndex, firstSample, sampledPixels);
+    return sampledPixels;
+}
+
+inline std::vector<Vec2i> get_pixels(const Vec2i& pixel, const Vec2i& windowSize, const Vec2i& imageSize) {
+    const int halfWindowSizeX = windowSize.x / 2;
+    const int halfWindowSizeY = windowSize.y / 2;
+
+    const int windowOriginX = std::max(0, pixel.x - halfWindowSizeX);
+    const int windowOriginY = std::max(0, pixel.y - halfWindowSizeY);
+
+    const int maxX = std::min(pixel.x + halfWindowSizeX, imageSize.x - 1);
+    const int maxY = std::min(pixel.y + halfWindowSizeY, imageSize.y - 1);
+
+    const int numPixels = windowSize.x * windowSize.y;
+    std::vector<Vec2i> nearestPixels;
+    nearestPixels.reserve(numPixels); // Reserve space for efficiency
+
+    for (int y = windowOriginY; y <= maxY; ++y) {
+        for (int x = windowOriginX; x <= maxX; ++x) {
+            nearestPixels.emplace_back(x, y);
+        }
+    }
+
+    return nearestPixels;
+}
+
+struct RenderSettings
+{
+    TraversalOrder order = TraversalOrder::Hilbert;
+    int tileSize = 0; // 0 picks default_tile_size()
+    unsigned threads = worker_count();
+    bool pinThreads = false;     // pin workers to cores, spread round-robin over NUMA nodes
+    bool replicateScene = false; // give every NUMA node its own copy of the kernel
+    std::vector<int> nodes;      // NUMA nodes to run on (indices into numa_topology()), empty for all
+    // Records per-pixel cost and balances tiles by it (cost_map.h). Only the tile renderer of plain
+    // kernels records it; the wavefront, rasterized-primary, multi-view and out-of-core renderers
+    // leave it untouched.
+    CostMap *costMap = nullptr;
+    // Once set, work not started yet is skipped: tiles, light-path batches (light tracing adds no
+    // splats then) and out-of-core sample waves. Honoured by every render_samples() overload and
+    // render_views().
+    const std::atomic<bool> *cancel = nullptr;
+
+    bool cancelled() const { return cancel && cancel->load(std::memory_order_relaxed); }
+};
+
+struct RenderStats
+{
+    uint64_t rays = 0;
+    IsaLevel isa = IsaLevel::Generic; // instruction set the tiles were rendered with
+    uint64_t rasterized = 0;          // primary samples resolved without a ray (raster.h)
+    uint64_t sortedRays = 0;          // secondary rays reordered before intersection (ray_sort.h)
+};
+
+namespace render_detail
+{
+    // One tile of render_samples(): traces the tile's pixels into out (tile-local coordinates)
+    template <class Kernel>
+    struct TileJob
+    {
+        const Camera &camera;
+        const Kernel &kernel;
+        const Tile &tile;
+        const std::vector<Vec2i> &pixelOrder;
+        int width;
+        int height;
+        int firstSample;
+        int numSamples;
+        const int *sampleCounts; // per image pixel, overrides numSamples when set
+        uint64_t seed;
+        Image<float, 3> &out;
+        std::vector<Vec2f> &samples;
+        CostMap *costs = nullptr; // per-pixel cost is recorded here when set
+    };
+
+    // Ray generation, traversal, intersection and shading all inline into the per-ISA copies below
+    template <class Kernel>
+    RT_ALWAYS_INLINE void render_tile_body(const TileJob<Kernel> &job)
+    {
+        for (const auto &offset : job.pixelOrder)
+        {
+            const int x = job.tile.x0 + offset.x;
+            const int y = job.tile.y0 + offset.y;
+            if (x >= job.tile.x1 || y >= job.tile.y1)
+                continue;
+
+            const auto sreenPoint = NDC_to_screen_space(raster_to_NDC(Vec2i{x, y}, job.width, job.height));
+            const auto pixelIndex = static_cast<uint32_t>(y * job.width + x);
+            get_pixels(sreenPoint, sample_window(job.width, job.height),
+                       job.sampleCounts ? job.sampleCounts[pixelIndex] : job.numSamples, job.seed, pixelIndex,
+                       job.firstSample, job.samples);
+            const auto start = job.costs ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+            const auto raysBefore = traced_rays;
+            Color color;
+            for (size_t i = 0; i < job.samples.size(); ++i)
+            {
+                const auto world_tmp_ray = job.camera.generateWorldRay(job.samples[i]);
+
+                Sampler sampler(job.seed, pixelIndex, static_cast<uint32_t>(job.firstSample + i));
+                color += job.kernel.trace(world_tmp_ray, sampler);
+            }
+            if (job.costs && !job.samples.empty())
+                job.costs->record(pixelIndex, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+                                  traced_rays - raysBefore, static_cast<int>(job.samples.size()));
+
+            auto *pixelData = &job.out[offset.y][offset.x];
+            pixelData[0] = color.x;
+            pixelData[1] = color.y;
+            pixelData[2] = color.z;
+        }
+    }
+
+    template <class Kernel>
+    void render_tile_generic(const TileJob<Kernel> &job) { render_tile_body(job); }
+    template <class Kernel>
+    RT_TARGET_AVX2 void render_tile_avx2(const TileJob<Kernel> &job) { render_tile_body(job); }
+    template <class Kernel>
+    RT_TARGET_AVX512 void render_tile_avx512(const TileJob<Kernel> &job) { render_tile_body(job); }
+
+    template <class Kernel>
+    void render_tile(IsaLevel isa, const TileJob<Kernel> &job)
+    {
+        if (isa == IsaLevel::Avx512)
+            render_tile_avx512(job);
+        else if (isa == IsaLevel::Avx2)
+            render_tile_avx2(job);
+        else
+            render_tile_generic(job);
+    }
+
+    // Adds a finished tile buffer (tile-local coordinates) into the radiance sums
+    inline void add_tile(const Tile &tile, const Image<float, 3> &local, Image<float, 3> &accum)
+    {
+        for (int y = tile.y0; y < tile.y1; ++y)
+        {
+            for (int x = tile.x0; x < tile.x1; ++x)
+            {
+                const auto *sum = &local[y - tile.y0][x - tile.x0];
+                auto *pixelData = &accum[y][x];
+                pixelData[0] += sum[0];
+                pixelData[1] += sum[1];
+                pixelData[2] += sum[2];
+            }
+        }
+    }
+} // namespace render_detail
+
+namespace render_detail
+{
+    // Renders every tile of a width x height image and hands each finished tile buffer to
+    // flush(tile, local) on the worker that rendered it; tiles never overlap
+    template <class Kernel, class Flush>
+    RenderStats render_tiles(const Camera& camera, const Kernel& kernel, int width, int height, int firstSample,
+                             int numSamples, const int *sampleCounts, uint64_t seed, const RenderSettings& settings,
+                             Flush&& flush)
+    {
+        const int tileSize = settings.tileSize > 0 ? settings.tileSize : default_tile_size();
+        auto tiles = make_tiles(width, height, tileSize, settings.order);
+        const auto pixelOrder = curve_order(tileSize, tileSize, settings.order);
+        const auto workers = place_workers(std::max(1u, settings.threads), settings.pinThreads, settings.nodes);
+        if (settings.costMap)
+        {
+            // Balanced by what earlier passes cost; this pass's cost replaces it as its tiles finish
+            settings.costMap->resize(width, height);
+            tiles = partition_by_cost(tiles, *settings.costMap, numSamples, sampleCounts, static_cast<unsigned>(workers.size()));
+        }
+
+        std::optional<NodeReplicas<Kernel>> replicas;
+        if (settings.replicateScene)
+            replicas.emplace(kernel, nodes_of(workers));
+
+        struct WorkerState
+        {
+            const Kernel *kernel;
+            Image<float, 3> tile;
+            std::vector<Vec2f> samples;
+        };
+        auto makeState = [&](const WorkerPlacement& placement) {
+            WorkerState state{replicas ? replicas->get(placement.node) : &kernel, Image<float, 3>(tileSize, tileSize), {}};
+            const int pixels = width * height;
+            state.samples.reserve(sampleCounts && pixels > 0 ? *std::max_element(sampleCounts, sampleCounts + pixels) : numSamples);
+            return state;
+        };
+
+        std::atomic<uint64_t> rays{0};
+        const IsaLevel isa = active_isa();
+        numa_parallel_for(workers, tiles.size(), makeState, [&](size_t tileIndex, WorkerState& state) {
+            if (settings.cancelled())
+                return;
+            const auto &tile = tiles[tileIndex];
+            const auto raysBefore = traced_rays;
+            const TileJob<Kernel> job{camera, *state.kernel, tile, pixelOrder, width, height,
+                                      firstSample, numSamples, sampleCounts, seed, state.tile, state.samples,
+                                      settings.costMap};
+            render_tile(isa, job);
+            flush(tile, state.tile);
+            rays.fetch_add(traced_rays - raysBefore, std::memory_order_relaxed);
+        });
+
+        return {rays.load(), isa};
+    }
+
+    template <class Kernel>
+    RenderStats render_tiles(const Camera& camera, const Kernel& kernel, Image<float, 3>& accum, int firstSample,
+                             int numSamples, const int *sampleCounts, uint64_t seed, const RenderSettings& settings)
+    {
+        return render_tiles(camera, kernel, accum.width, accum.height, firstSample, numSamples, sampleCounts, seed,
+                            settings, [&](const Tile &tile, const Image<float, 3> &local) { add_tile(tile, local, accum); });
+    }
+} // namespace render_detail
+
+// Adds samples [firstSample, firstSample + numSamples) of every pixel to the radiance sums in accum.
+// Splitting a render into several calls gives the same samples as one call with the total count, and
+// the result does not depend on tile size, traversal order, thread count or placement.
+// kernel is anything with Vec3 trace(const Ray&, Sampler&) const, see kernel.h
+//
+// Each worker renders into its own tile buffer and scratch, allocated after the worker is pinned so
+// they stay on its node, and adds the finished tile into accum. With replicateScene the kernel is
+// copied once per node per call. Tiles run on the active_isa() copy of the tile loop.
+template <class Kernel>
+RenderStats render_samples(const Camera& camera, const Kernel& kernel, Image<float, 3>& accum, int firstSample, int numSamples,
+                           uint64_t seed = default_seed, const RenderSettings& settings = {})
+{
+    return render_detail::render_tiles(camera, kernel, accum, firstSample, numSamples, nullptr, seed, settings);
+}
+
+// As above with a sample count per pixel (row-major, width * height entries): pixel i gets samples
+// [firstSample, firstSample + sampleCounts[i])
+template <class Kernel>
+RenderStats render_samples(const Camera& camera, const Kernel& kernel, Image<float, 3>& accum, int firstSample,
+                           const std::vector<int>& sampleCounts, uint64_t seed = default_seed, const RenderSettings& settings = {})
+{
+    return render_detail::render_tiles(camera, kernel, accum, firstSample, 0, sampleCounts.data(), seed, settings);
+}
+
+namespace render_detail
+{
+    RT_ALWAYS_INLINE void resolve_body(const Image<float, 3>& accum, int numSamples, auto& img)
+    {
+        for (int y = 0; y < img.height; ++y)
+        {
+            for (int x = 0; x < img.width; ++x)
+            {
+                const auto *sum = &accum[y][x];
+                Color color(sum[0], sum[1], sum[2]);
+                color /= numSamples;
+
+                auto row = img[y]; // Access the row
+                auto *pixelData = &row[x];    // Access the pixel data
+
+                auto r = std::sqrt(color.x);
+                auto g = std::sqrt(color.y);
+                auto b = std::sqrt(color.z);
+
+                // Write the translated [0,255] value of each color component.
+                pixelData[0] =  static_cast<int>(256 * std::clamp(r, 0.000f, 0.999f));
+                pixelData[1] =  static_cast<int>(256 * std::clamp(g, 0.000f, 0.999f));
+                pixelData[2] =  static_cast<int>(256 * std::clamp(b, 0.000f, 0.999f));
+            }
+        }
+    }
+
+    void resolve_generic(const Image<float, 3>& accum, int numSamples, auto& img) { resolve_body(accum, numSamples, img); }
+    RT_TARGET_AVX2 void resolve_avx2(const Image<float, 3>& accum, int numSamples, auto& img) { resolve_body(accum, numSamples, img); }
+    RT_TARGET_AVX512 void resolve_avx512(const Image<float, 3>& accum, int numSamples, auto& img) { resolve_body(accum, numSamples, img); }
+} // namespace render_detail
+
+// Averages radiance sums over numSamples, gamma-corrects and quantizes to 8 bits
+void resolve(const Image<float, 3>& accum, int numSamples, auto& img)
+{
+    const IsaLevel isa = active_isa();
+    if (isa == IsaLevel::Avx512)
+        render_detail::resolve_avx512(accum, numSamples, img);
+    else if (isa == IsaLevel::Avx2)
+        render_detail::resolve_avx2(accum, numSamples, img);
+    else
+        render_detail::resolve_generic(accum, numSamples, img);
+}
+
+// Turns radiance sums into mean linear radiance in place
+inline void average_samples(Image<float, 3>& accum, int numSamples)
+{
+    const size_t count = static_cast<size_t>(accum.width) * accum.height * accum.numChannels;
+    for (size_t i = 0; i < count; ++i)
+        accum.data[i] /= numSamples;
+}
+
+// sample pixel and store clor vaue to image
+void MSAA(const Camera& camera, const auto& kernel, auto& img, uint64_t seed = default_seed, int numSamples = 500,
+          const RenderSettings& settings = {})
+{
+    Image<float, 3> accum(img.width, img.height);
+    render_samples(camera, kernel, accum, 0, numSamples, seed, settings);
+    resolve(accum, numSamples, img);
+}
+
+void MSAA(const Camera& camera, const Scene& scene, auto& img, uint64_t seed = default_seed, int numSamples = 500,
+          const RenderSettings& settings = {})
+{
+    MSAA(camera, DynamicKernel(scene, 50), img, seed, numSamples, settings);
+}
@@ -0,0 +1,489 @@
+#pragma once
+
+#include "camera.h"
+#include "image.h"
+#include "kernel.h"
+#include "render.h"
+#include "scenes.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Long-running render service: a priority job queue in front of one scheduler thread that renders
+// each job with all render threads, and a bounded cache of built scenes (geometry, BVH and static
+// kernel) so repeated jobs on the same scene skip setup. The transport lives in daemon.cpp; this
+// header is the part that does not depend on sockets.
+//
+// Jobs render in passes of increasing sample counts, at most maxPassSamples each. Between passes the
+// scheduler publishes progress and yields to a queued job of higher priority; a preempted job keeps
+// its radiance sums and continues later with the next sample index, so the image is the same as an
+// uninterrupted render. Cancelling a running job also skips the tiles its pass has not started. Each pass records per-pixel cost (cost_map.h), and the next pass of the
+// job splits and orders its tiles by it.
+
+struct JobDescription
+{
+    std::string scene = "random_spheres";
+    uint64_t sceneSeed = default_seed;
+    int width = 320;
+    int height = 180;
+    int spp = 16;
+    int priority = 0; // higher runs first
+    uint64_t seed = default_seed;
+    // Camera overrides; unset values come from the scene's own camera
+    std::optional<Vec3> eye;
+    std::optional<Vec3> target;
+    std::optional<float> fov;
+};
+
+// Parses whitespace-separated key=value pairs: scene, scene_seed, width, height, spp, priority,
+// seed, eye=x,y,z, target=x,y,z, fov
+inline std::optional<JobDescription> parse_job(const std::string &text, std::string &error)
+{
+    JobDescription job;
+    std::istringstream tokens(text);
+    auto parse_vec3 = [](const std::string &value) -> std::optional<Vec3> {
+        float x, y, z;
+        char comma1, comma2;
+        std::istringstream in(value);
+        if (!(in >> x >> comma1 >> y >> comma2 >> z) || comma1 != ',' || comma2 != ',')
+            return std::nullopt;
+        return Vec3(x, y, z);
+    };
+
+    for (std::string token; tokens >> token;)
+    {
+        const auto equals = token.find('=');
+        if (equals == std::string::npos)
+        {
+            error = "expected key=value, got " + token;
+            return std::nullopt;
+        }
+        const std::string key = token.substr(0, equals);
+        const std::string value = token.substr(equals + 1);
+        try
+        {
+            if (key == "scene")
+                job.scene = value;
+            else if (key == "scene_seed")
+                job.sceneSeed = std::stoull(value, nullptr, 0);
+            else if (key == "width")
+                job.width = std::stoi(value);
+            else if (key == "height")
+                job.height = std::stoi(value);
+            else if (key == "spp")
+                job.spp = std::stoi(value);
+            else if (key == "priority")
+                job.priority = std::stoi(value);
+            else if (key == "seed")
+                job.seed = std::stoull(value, nullptr, 0);
+            else if (key == "fov")
+                job.fov = std::stof(value);
+            else if (key == "eye" || key == "target")
+            {
+                const auto vector = parse_vec3(value);
+                if (!vector)
+                {
+                    error = "expected x,y,z for " + key;
+                    return std::nullopt;
+                }
+                (key == "eye" ? job.eye : job.target) = *vector;
+            }
+            else
+            {
+                error = "unknown key " + key;
+                return std::nullopt;
+            }
+        }
+        catch (const std::exception &)
+        {
+            error = "bad value for " + key;
+            return std::nullopt;
+        }
+    }
+
+    if (std::find(canonical_scenes.begin(), canonical_scenes.end(), job.scene) == canonical_scenes.end())
+        error = "unknown scene " + job.scene;
+    else if (job.width <= 0 || job.height <= 0 || job.width > 16384 || job.height > 16384)
+        error = "bad resolution";
+    else if (job.spp <= 0)
+        error = "bad spp";
+    else if (job.fov && (*job.fov <= 0.f || *job.fov >= 180.f))
+        error = "bad fov";
+    else
+        return job;
+    return std::nullopt;
+}
+
+// A built scene with everything a render needs. The dynamic kernel is the fallback for scenes
+// outside the static kernel's type set.
+struct CachedScene
+{
+    SceneDescription description;
+    std::optional<SphereKernel> kernel;
+};
+
+// Most recently used scenes, keyed by name and scene seed, at most capacity of them. Entries are
+// shared_ptr so an evicted scene stays alive for the job still rendering it.
+class SceneCache
+{
+public:
+    explicit SceneCache(size_t _capacity) : capacity(std::max<size_t>(1, _capacity)) {}
+
+    std::shared_ptr<const CachedScene> acquire(const std::string &name, uint64_t seed)
+    {
+        const auto key = std::make_pair(name, seed);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = entries.begin(); it != entries.end(); ++it)
+            {
+                if (it->first == key)
+                {
+                    ++hitCount;
+                    entries.splice(entries.begin(), entries, it);
+                    return entries.front().second;
+                }
+            }
+            ++missCount;
+        }
+
+        // Built outside the lock; the camera's aspect ratio is replaced per job
+        auto description = make_scene(name, 1.f, seed);
+        if (!description)
+            return nullptr;
+        auto scene = std::make_shared<CachedScene>(CachedScene{std::move(*description), std::nullopt});
+        scene->kernel = SphereKernel::build(scene->description.scene);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.emplace_front(key, scene);
+        while (entries.size() > capacity)
+            entries.pop_back();
+        return scene;
+    }
+
+    uint64_t hits() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return hitCount;
+    }
+    uint64_t misses() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return missCount;
+    }
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+private:
+    size_t capacity;
+    std::list<std::pair<std::pair<std::string, uint64_t>, std::shared_ptr<const CachedScene>>> entries;
+    uint64_t hitCount = 0;
+    uint64_t missCount = 0;
+    mutable std::mutex mutex;
+};
+
+enum class JobState
+{
+    Queued,
+    Running,
+    Done,
+    Cancelled,
+    Failed,
+};
+
+inline const char *to_string(JobState state)
+{
+    switch (state)
+    {
+    case JobState::Queued:
+        return "queued";
+    case JobState::Running:
+        return "running";
+    case JobState::Done:
+        return "done";
+    case JobState::Cancelled:
+        return "cancelled";
+    default:
+        return "failed";
+    }
+}
+
+struct JobStatus
+{
+    JobState state;
+    int samplesDone;
+    int spp;
+    double seconds; // render time so far
+};
+
+struct RenderServiceSettings
+{
+    unsigned threads = worker_count();
+    size_t sceneCacheSize = 8;
+    size_t keptResults = 64; // finished jobs kept for status and result queries
+    int maxPassSamples = 16; // bounds how long a job of higher priority waits for the running pass
+};
+
+class RenderService
+{
+public:
+    explicit RenderService(const RenderServiceSettings &_settings = {})
+        : settings(_settings), scenes(_settings.sceneCacheSize), scheduler([this] { run(); })
+    {
+    }
+
+    ~RenderService()
+    {
+        stop();
+        scheduler.join();
+    }
+
+    // Cancels every pending job and stops taking new ones; waiters return once the running job has
+    // finished the tiles of its pass already started
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        for (const auto &job : queue)
+            finish(*job, JobState::Cancelled);
+        queue.clear();
+        for (const auto &[id, job] : jobs)
+            job->cancelRequested = true;
+        wake.notify_all();
+    }
+
+    RenderService(const RenderService &) = delete;
+    RenderService &operator=(const RenderService &) = delete;
+
+    uint64_t submit(const JobDescription &description)
+    {
+        auto job = std::make_shared<Job>();
+        job->description = description;
+        std::lock_guard<std::mutex> lock(mutex);
+        job->id = nextId++;
+        jobs[job->id] = job;
+        if (stopping)
+        {
+            finish(*job, JobState::Cancelled);
+            return job->id;
+        }
+        queue.push_back(job);
+        wake.notify_all();
+        return job->id;
+    }
+
+    std::optional<JobStatus> status(uint64_t id) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto it = jobs.find(id);
+        if (it == jobs.end())
+            return std::nullopt;
+        return status_of(*it->second);
+    }
+
+    // Blocks until the job has finished (done, cancelled or failed)
+    std::optional<JobStatus> wait(uint64_t id) const
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        const auto it = jobs.find(id);
+        if (it == jobs.end())
+            return std::nullopt;
+        const auto job = it->second;
+        finished.wait(lock, [&] { return is_final(job->state); });
+        return status_of(*job);
+    }
+
+    // Queued jobs are dropped at once, a running job stops after the tiles it has started
+    bool cancel(uint64_t id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto it = jobs.find(id);
+        if (it == jobs.end() || is_final(it->second->state))
+            return false;
+        it->second->cancelRequested = true;
+        if (it->second->state == JobState::Queued)
+        {
+            queue.erase(std::find(queue.begin(), queue.end(), it->second));
+            finish(*it->second, JobState::Cancelled);
+        }
+        return true;
+    }
+
+    // Mean linear radiance of a finished job
+    std::shared_ptr<const Image<float, 3>> result(uint64_t id) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto it = jobs.find(id);
+        if (it == jobs.end() || it->second->state != JobState::Done)
+            return nullptr;
+        return it->second->image;
+    }
+
+    size_t queued() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    const SceneCache &scene_cache() const { return scenes; }
+
+private:
+    struct Job
+    {
+        uint64_t id = 0;
+        JobDescription description;
+        JobState state = JobState::Queued;
+        int samplesDone = 0;
+        double seconds = 0.0;
+        std::atomic<bool> cancelRequested{false}; // also the cancel flag of its passes
+        std::shared_ptr<Image<float, 3>> image; // radiance sums while rendering, mean when done
+        CostMap costs;                          // per-pixel cost of the passes so far, balances the next
+    };
+
+    static bool is_final(JobState state)
+    {
+        return state == JobState::Done || state == JobState::Cancelled || state == JobState::Failed;
+    }
+
+    static JobStatus status_of(const Job &job)
+    {
+        return {job.state, job.samplesDone, job.description.spp, job.seconds};
+    }
+
+    // Highest priority first, then submission order
+    std::shared_ptr<Job> pop_next()
+    {
+        auto best = std::max_element(queue.begin(), queue.end(), [](const auto &a, const auto &b) {
+            return a->description.priority < b->description.priority ||
+                   (a->description.priority == b->description.priority && a->id > b->id);
+        });
+        auto job = *best;
+        queue.erase(best);
+        return job;
+    }
+
+    bool preempted_by_queue(const Job &job) const
+    {
+        return std::any_of(queue.begin(), queue.end(),
+                           [&](const auto &other) { return other->description.priority > job.description.priority; });
+    }
+
+    // Called with the mutex held
+    void finish(Job &job, JobState state)
+    {
+        job.state = state;
+        job.costs = CostMap();
+        if (state != JobState::Done)
+            job.image.reset();
+        finishedOrder.push_back(job.id);
+        while (finishedOrder.size() > settings.keptResults)
+        {
+            jobs.erase(finishedOrder.front());
+            finishedOrder.pop_front();
+        }
+        finished.notify_all();
+    }
+
+    void run()
+    {
+        for (;;)
+        {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (stopping)
+                    return;
+                job = pop_next();
+                job->state = JobState::Running;
+            }
+            render(job);
+        }
+    }
+
+    void render(const std::shared_ptr<Job> &jobPointer)
+    {
+        Job &job = *jobPointer;
+        const auto &description = job.description;
+        const auto scene = scenes.acquire(description.scene, description.sceneSeed);
+        if (!scene)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finish(job, JobState::Failed);
+            return;
+        }
+
+        const Camera &sceneCamera = scene->description.camera;
+        const Camera camera(description.eye.value_or(sceneCamera.get_position()),
+                            description.target.value_or(sceneCamera.get_target()), Vec3(0.f, 1.f, 0.f),
+                            description.fov.value_or(sceneCamera.get_fov()),
+                            static_cast<float>(description.width) / description.height);
+        if (!job.image)
+            job.image = std::make_shared<Image<float, 3>>(description.width, description.height);
+
+        RenderSettings renderSettings;
+        renderSettings.threads = settings.threads;
+        renderSettings.costMap = &job.costs;
+        renderSettings.cancel = &job.cancelRequested;
+        const DynamicKernel dynamicKernel(scene->description.scene, 50);
+        // First pass of one sample gives an early progress point, later passes double
+        int pass = std::max(1, job.samplesDone);
+        while (job.samplesDone < description.spp)
+        {
+            const int count = std::min({pass, std::max(1, settings.maxPassSamples), description.spp - job.samplesDone});
+            const auto start = std::chrono::steady_clock::now();
+            if (scene->kernel)
+                render_samples(camera, *scene->kernel, *job.image, job.samplesDone, count, description.seed, renderSettings);
+            else
+                render_samples(camera, dynamicKernel, *job.image, job.samplesDone, count, description.seed, renderSettings);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            pass *= 2;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            job.samplesDone += count;
+            job.seconds += seconds;
+            if (job.cancelRequested)
+            {
+                finish(job, JobState::Cancelled);
+                return;
+            }
+            if (job.samplesDone < description.spp && preempted_by_queue(job))
+            {
+                job.state = JobState::Queued;
+                queue.push_back(jobPointer);
+                return;
+            }
+        }
+
+        average_samples(*job.image, description.spp);
+        std::lock_guard<std::mutex> lock(mutex);
+        finish(job, JobState::Done);
+    }
+
+    RenderServiceSettings settings;
+    SceneCache scenes;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    mutable std::condition_variable finished;
+    std::map<uint64_t, std::shared_ptr<Job>> jobs;
+    std::vector<std::shared_ptr<Job>> queue;
+    std::deque<uint64_t> finishedOrder;
+    uint64_t nextId = 1;
+    bool stopping = false;
+    std::thread scheduler; // last, so it starts after everything it uses
+};
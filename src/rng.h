@@ -0,0 +1,86 @@
+#pragma once
+
+#include "math.hpp"
+
+#include <array>
+#include <cstdint>
+
+// Counter-based random numbers (Philox4x32-10, Salmon et al. 2011).
+// Every random value is a pure function of (seed, pixel, sample, bounce, dimension), so a sample
+// can be regenerated in isolation and the image does not depend on thread count or tile order.
+
+constexpr uint64_t default_seed = 0x5eed'2024'cafe'f00dull;
+
+namespace philox
+{
+    using Counter = std::array<uint32_t, 4>;
+    using Key = std::array<uint32_t, 2>;
+
+    inline Counter round(const Counter &c, const Key &k)
+    {
+        const uint64_t p0 = uint64_t(0xD2511F53u) * c[0];
+        const uint64_t p1 = uint64_t(0xCD9E8D57u) * c[2];
+        return {uint32_t(p1 >> 32) ^ c[1] ^ k[0], uint32_t(p1),
+                uint32_t(p0 >> 32) ^ c[3] ^ k[1], uint32_t(p0)};
+    }
+
+    inline Counter philox4x32(Counter c, Key k)
+    {
+        for (int i = 0; i < 10; ++i)
+        {
+            c = round(c, k);
+            k[0] += 0x9E3779B9u;
+            k[1] += 0xBB67AE85u;
+        }
+        return c;
+    }
+} // namespace philox
+
+// [0, 1) with 24 bits of mantissa
+inline float to_unit_float(uint32_t bits)
+{
+    return float(bits >> 8) * 0x1p-24f;
+}
+
+inline uint32_t random_bits(uint64_t seed, uint32_t pixel, uint32_t sample, uint32_t bounce, uint32_t dimension)
+{
+    return philox::philox4x32({pixel, sample, bounce, dimension}, {uint32_t(seed), uint32_t(seed >> 32)})[0];
+}
+
+// Cursor over the dimensions of one (seed, pixel, sample). Bounce 0 belongs to the camera
+// (pixel jitter); the kernels call start_bounce(depth + 1) before sampling a scatter direction.
+class Sampler
+{
+public:
+    Sampler(uint64_t _seed, uint32_t _pixel, uint32_t _sample)
+        : seed(_seed), pixel(_pixel), sample(_sample) {}
+
+    void start_bounce(uint32_t _bounce)
+    {
+        bounce = _bounce;
+        dimension = 0;
+    }
+
+    float next()
+    {
+        return to_unit_float(random_bits(seed, pixel, sample, bounce, dimension++));
+    }
+
+    float next(float min, float max)
+    {
+        return min + (max - min) * next();
+    }
+
+    Vec2f next_2d()
+    {
+        const auto u = next();
+        return Vec2f(u, next());
+    }
+
+private:
+    uint64_t seed;
+    uint32_t pixel;
+    uint32_t sample;
+    uint32_t bounce = 0;
+    uint32_t dimension = 0;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "camera.h"
+#include "material.h"
+#include "rng.h"
+#include "sphere.h"
+#include "Scene.h"
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Canonical scenes shared by the renderer and the benchmark harness. Every random choice is drawn
+// from a seeded counter stream, so a scene name plus a seed always builds the same scene.
+
+struct SceneDescription
+{
+    Scene scene;
+    Camera camera;
+};
+
+inline float random_float(Sampler& sampler, float min, float max) {
+    return sampler.next(min, max);
+}
+
+inline Vec3 random_vec3(Sampler& sampler, float min, float max)
+{
+    const auto x = random_float(sampler, min, max);
+    const auto y = random_float(sampler, min, max);
+    return Vec3(x, y, random_float(sampler, min, max));
+}
+
+inline Vec3 random_vec3(Sampler& sampler)
+{
+    return random_vec3(sampler, 0.f, 1.f);
+}
+
+// The final scene of "Ray Tracing in One Weekend": a field of small random spheres
+inline SceneDescription random_spheres_scene(float aspectRatio, uint64_t seed = default_seed)
+{
+    // Camera properties
+    Vec3 cameraPosition(13.0f, 2.0f, 3.0f);
+    // the point that the camera is looking at. It helps define the camera's orientation.
+    Vec3 target(0.f, 0.f, 0.f);
+    Vec3 up(0.0f, 1.0f, 0.0f);
+    float fov = 20.0f;
+
+    Camera camera(cameraPosition, target, up, fov, aspectRatio);
+
+    // Scene layout comes from its own counter stream so it is identical on every run
+    Sampler sceneSampler(seed, 0xffffffffu, 0);
+    Scene scene;
+    auto ground_material = std::make_shared<lambertian>(Color(0.8f, 0.8f, 0.f));
+    scene.add(std::make_shared<Sphere>(Vec3(0.f,-100.5f, -1.f), 1000.f, ground_material));
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_float(sceneSampler, 0.f, 1.f);
+            const auto offsetA = random_float(sceneSampler, 0.f, 1.f);
+            Vec3 center(a + 0.9f*offsetA, 0.2f, b + 0.9f*random_float(sceneSampler, 0.f, 1.f));
+
+            if ((center - Vec3(4.f, 0.2f, 0.f)).length() > 0.9f) {
+                std::shared_ptr<material> sphere_material;
+
+                if (choose_mat < 0.8f) {
+                    // diffuse
+                    auto albedo = random_vec3(sceneSampler) * random_vec3(sceneSampler);
+                    sphere_material = std::make_shared<lambertian>(albedo);
+                    scene.add(std::make_shared<Sphere>(center, 0.2f, sphere_material));
+                } else if (choose_mat < 0.95f) {
+                    // metal
+                    auto albedo = random_vec3(sceneSampler, 0.5f, 1.f);
+                    auto fuzz = random_float(sceneSampler, 0.f, 0.5f);
+                    sphere_material = std::make_shared<metal>(albedo, fuzz);
+                    scene.add(std::make_shared<Sphere>(center, 0.2f, sphere_material));
+                } else {
+                    // glass
+                    sphere_material = std::make_shared<dielectric>(1.5f);
+                    scene.add(std::make_shared<Sphere>(center, 0.2f, sphere_material));
+                }
+            }
+        }
+    }
+
+    scene.build_bvh();
+    return {std::move(scene), camera};
+}
+
+// Diffuse, hollow glass and polished metal side by side on a ground sphere
+inline SceneDescription three_spheres_scene(float aspectRatio)
+{
+    Camera camera(Vec3(-2.f, 2.f, 1.f), Vec3(0.f, 0.f, -1.f), Vec3(0.f, 1.f, 0.f), 40.f, aspectRatio);
+
+    auto material_ground = std::make_shared<lambertian>(Color(0.8f, 0.8f, 0.f));
+    auto material_center = std::make_shared<lambertian>(Color(0.1f, 0.2f, 0.5f));
+    auto material_left = std::make_shared<dielectric>(1.5);
+    auto material_right = std::make_shared<metal>(Color(0.8f, 0.6f, 0.2f), 0.f);
+
+    Scene scene(std::make_shared<Sphere>(Vec3(0.f, -100.5f, -1.f), 100.f, material_ground));
+    scene.add(std::make_shared<Sphere>(Vec3(0.f, 0.f, -1.f), 0.5f, material_center));
+    scene.add(std::make_shared<Sphere>(Vec3(-1.f, 0.f, -1.f), 0.5f, material_left));
+    scene.add(std::make_shared<Sphere>(Vec3(-1.f, 0.f, -1.f), -0.4f, material_left));
+    scene.add(std::make_shared<Sphere>(Vec3(1.f, 0.f, -1.f), 0.5f, material_right));
+
+    scene.build_bvh();
+    return {std::move(scene), camera};
+}
+
+inline const std::vector<std::string> canonical_scenes = {"random_spheres", "three_spheres"};
+
+inline std::optional<SceneDescription> make_scene(const std::string &name, float aspectRatio, uint64_t seed = default_seed)
+{
+    if (name == "random_spheres")
+        return random_spheres_scene(aspectRatio, seed);
+    if (name == "three_spheres")
+        return three_spheres_scene(aspectRatio);
+    return std::nullopt;
+}
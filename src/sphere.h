@@ -3,14 +3,31 @@
 #include "hittable.h"
 #include "math.hpp"
 
-class Sphere : public Hittable {
+#include <cmath>
+
+class Sphere final : public Hittable {
   public:
     Sphere(Vec3 center, float radius, std::shared_ptr<material> _material) : m_center(center), m_radius(radius), mat(_material) {}
 
     Vec3 center() const { return m_center; }
     auto radius() const { return m_radius; }
+    const std::shared_ptr<material>& get_material() const { return mat; }
 
     std::optional<HitRecord> hit(const Ray& r, const Range& range) const override {
+        const auto root = intersect(r, range);
+        if (!root)
+            return std::nullopt;
+        return std::make_optional(record(r, *root));
+    }
+
+    AABB bounding_box() const override {
+        // Radius is negative for the inner surface of hollow glass
+        const auto r = std::fabs(m_radius);
+        return {m_center - Vec3(r, r, r), m_center + Vec3(r, r, r)};
+    }
+
+    // Distance along the ray to the nearest root inside the range, without building a HitRecord
+    std::optional<float> intersect(const Ray& r, const Range& range) const {
         const Vec3 oc = r.origin() - m_center;
         const auto a = r.direction().length_squared();
         const auto half_b = dot(oc, r.direction());
@@ -21,7 +38,7 @@ class Sphere : public Hittable {
         if (discriminant < 0)
           return std::nullopt;
         
-        const auto sqrtd = sqrt(discriminant);
+        const auto sqrtd = std::sqrt(discriminant);
 
         // Find the nearest root that lies in the acceptable range.
         auto root = (-half_b - sqrtd) / a;
@@ -30,14 +47,18 @@ class Sphere : public Hittable {
             if (root <= range.start || range.end <= root)
                 return std::nullopt;
         }
+        return root;
+    }
+
+    HitRecord record(const Ray& r, float t) const {
         HitRecord rec;
-        rec.t = root;
+        rec.t = t;
         rec.p = r.at(rec.t);
-        rec.mat = mat;
+        rec.mat = mat.get();
     
         const auto normal = (rec.p - m_center) / m_radius;
         rec.set_face_normal(r, normal);
-        return std::make_optional(std::move(rec));
+        return rec;
     }
 
   private:
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "image.h"
+#include "math.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Radiance sums any thread can add to at any pixel, for estimators whose samples land on pixels other
+// than the one being rendered (light tracing splats through the camera). Channels are 64-bit fixed
+// point updated with relaxed atomic adds: a splat is three lock xadd instructions, no locks and no
+// compare-and-swap retry loops, so threads splatting onto the same pixel only share its cache line.
+// Integer sums are exact, so the totals do not depend on thread count or interleaving.
+class SplatFramebuffer
+{
+public:
+    SplatFramebuffer(int _width, int _height)
+        : width(_width), height(_height),
+          sums(std::make_unique<std::atomic<uint64_t>[]>(static_cast<size_t>(_width) * _height * 3))
+    {
+    }
+
+    // Negative and NaN channels are dropped, large ones clamped to fixed_max
+    void add(int x, int y, const Vec3 &value)
+    {
+        auto *pixel = &sums[(static_cast<size_t>(y) * width + x) * 3];
+        add_channel(pixel[0], value.x);
+        add_channel(pixel[1], value.y);
+        add_channel(pixel[2], value.z);
+    }
+
+    // Adds the splats times scale into radiance sums of the same size; call once the splatting threads are done
+    void add_to(Image<float, 3> &accum, float scale) const
+    {
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                const auto *pixel = &sums[(static_cast<size_t>(y) * width + x) * 3];
+                auto *sum = &accum[y][x];
+                for (int c = 0; c < 3; ++c)
+                    sum[c] += static_cast<float>(pixel[c].load(std::memory_order_relaxed) / fixed_one) * scale;
+            }
+        }
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < static_cast<size_t>(width) * height * 3; ++i)
+            sums[i].store(0, std::memory_order_relaxed);
+    }
+
+    const int width;
+    const int height;
+
+private:
+    static constexpr double fixed_one = double(1 << 24);
+    static constexpr float fixed_max = float(1 << 20);
+
+    static void add_channel(std::atomic<uint64_t> &sum, float value)
+    {
+        if (!(value > 0.f))
+            return;
+        sum.fetch_add(static_cast<uint64_t>(std::min(value, fixed_max) * fixed_one + 0.5), std::memory_order_relaxed);
+    }
+
+    std::unique_ptr<std::atomic<uint64_t>[]> sums;
+};
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "camera.h"
+#include "image.h"
+#include "kernel.h"
+#include "parallel.h"
+#include "render.h"
+#include "rng.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Temporal accumulation for camera moves between frames. Every frame traces one ray through each
+// pixel center for its first hit (position and normal, or a miss), then reprojects the previous
+// frame into the new view: a hit point goes through the previous camera's worldToCamera and
+// projection, a miss by its direction. The previous frame's radiance and sample counts are fetched
+// bilinearly, each tap kept only when it saw the same surface (on the tangent plane within a
+// fraction of the distance and with a similar normal) or, for misses, also a miss. New samples go
+// where the reprojected history is short of targetSamples; pixels with enough history only get
+// refreshSamples so view-dependent shading keeps up. History is capped at maxHistory samples, which
+// turns the running mean into a moving average and bounds the blur of repeated resampling.
+
+struct TemporalSettings
+{
+    int targetSamples = 16;       // samples of history (reprojected plus new) a pixel aims for
+    int refreshSamples = 1;       // new samples per frame for pixels at the target
+    int maxHistory = 64;          // history weight cap
+    float planeTolerance = 0.02f; // tangent-plane distance, relative to the distance from the eye
+    float normalTolerance = 0.9f; // minimum cosine between the normals of the two frames
+};
+
+struct TemporalFrameStats
+{
+    RenderStats render;          // the new samples, plus the first-hit rays in rays
+    uint64_t samples = 0;        // new samples this frame
+    size_t reprojected = 0;      // pixels that inherited history
+    size_t disoccluded = 0;      // pixels whose previous position was on screen but every tap was rejected
+    size_t offscreen = 0;        // pixels that were outside the previous view
+};
+
+class TemporalAccumulator
+{
+public:
+    TemporalAccumulator(int _width, int _height, const TemporalSettings &_settings = {})
+        : width(_width), height(_height), settings(_settings), mean(_width, _height), previousMean(_width, _height),
+          newSamples(_width, _height)
+    {
+        const size_t pixels = static_cast<size_t>(width) * height;
+        history.assign(pixels, 0.f);
+        surfaces.resize(pixels);
+        previousSurfaces.resize(pixels);
+        counts.resize(pixels);
+    }
+
+    // Renders the frame seen by camera and folds it into the history; radiance() holds the result.
+    // seed should differ between frames so that refresh samples are new samples.
+    template <class Kernel>
+    TemporalFrameStats render_frame(const Camera &camera, const Kernel &kernel, uint64_t seed = default_seed,
+                                    const RenderSettings &renderSettings = {})
+    {
+        TemporalFrameStats stats;
+        const size_t pixels = static_cast<size_t>(width) * height;
+
+        // First hits through the pixel centers
+        std::atomic<uint64_t> rays{0};
+        parallel_for(height, [&](size_t y) {
+            const auto raysBefore = traced_rays;
+            for (int x = 0; x < width; ++x)
+            {
+                const auto ray = camera.generateWorldRay(NDC_to_screen_space(raster_to_NDC(Vec2i{x, static_cast<int>(y)}, width, height)));
+                auto &surface = surfaces[y * width + x];
+                surface.direction = ray.direction();
+                surface.hit = false;
+                if (const auto hit = kernel.intersect(ray))
+                {
+                    const HitRecord &rec = kernel.hit_record(*hit);
+                    surface = {rec.p, rec.normal, ray.direction(), (rec.p - ray.origin()).length(), true};
+                }
+            }
+            rays.fetch_add(traced_rays - raysBefore, std::memory_order_relaxed);
+        }, renderSettings.threads);
+
+        // Reproject the previous frame and decide the sample budget
+        std::vector<Vec3> reprojected(pixels);
+        std::vector<float> reprojectedCount(pixels, 0.f);
+        for (size_t pixel = 0; pixel < pixels; ++pixel)
+        {
+            if (previousCamera)
+            {
+                switch (reproject(*previousCamera, surfaces[pixel], reprojected[pixel], reprojectedCount[pixel]))
+                {
+                case Reprojection::Valid:
+                    ++stats.reprojected;
+                    break;
+                case Reprojection::Rejected:
+                    ++stats.disoccluded;
+                    break;
+                case Reprojection::Offscreen:
+                    ++stats.offscreen;
+                    break;
+                }
+            }
+            const float have = reprojectedCount[pixel];
+            counts[pixel] = have >= settings.targetSamples
+                                ? settings.refreshSamples
+                                : std::max(settings.refreshSamples, static_cast<int>(std::ceil(settings.targetSamples - have)));
+            stats.samples += counts[pixel];
+        }
+
+        std::fill(newSamples.data.get(), newSamples.data.get() + pixels * 3, 0.f);
+        stats.render = render_samples(camera, kernel, newSamples, 0, counts, seed, renderSettings);
+        stats.render.rays += rays.load();
+
+        for (size_t pixel = 0; pixel < pixels; ++pixel)
+        {
+            const float have = reprojectedCount[pixel];
+            const float total = have + counts[pixel];
+            float *out = &mean.data[pixel * 3];
+            const float *sum = &newSamples.data[pixel * 3];
+            if (total > 0.f)
+            {
+                out[0] = (reprojected[pixel].x * have + sum[0]) / total;
+                out[1] = (reprojected[pixel].y * have + sum[1]) / total;
+                out[2] = (reprojected[pixel].z * have + sum[2]) / total;
+            }
+            else
+            {
+                out[0] = out[1] = out[2] = 0.f;
+            }
+            history[pixel] = std::min(total, static_cast<float>(settings.maxHistory));
+        }
+
+        previousCamera = camera;
+        std::swap(surfaces, previousSurfaces);
+        std::copy(mean.data.get(), mean.data.get() + pixels * 3, previousMean.data.get());
+        return stats;
+    }
+
+    // Mean linear radiance of the last frame
+    const Image<float, 3> &radiance() const { return mean; }
+    // History weight of every pixel after the last frame, row-major
+    const std::vector<float> &history_samples() const { return history; }
+    // Forgets the history, e.g. on a camera cut
+    void reset() { previousCamera.reset(); }
+
+private:
+    struct Surface
+    {
+        Vec3 p;
+        Vec3 normal;
+        Vec3 direction; // of the pixel-center ray
+        float distance = 0.f;
+        bool hit = false;
+    };
+
+    enum class Reprojection
+    {
+        Valid,
+        Rejected,
+        Offscreen,
+    };
+
+    Reprojection reproject(const Camera &previous, const Surface &surface, Vec3 &radiance, float &count) const
+    {
+        // Camera space of the previous view; misses are reprojected as directions
+        const Vec3 point = surface.hit ? surface.p : previous.get_position() + surface.direction;
+        const Vec3 local = previous.WorldToCamera(point);
+        if (local.z >= 0.f)
+            return Reprojection::Offscreen;
+        const Vec2f screen = previous.CameraToScreen(local);
+        const float px = (screen.x + 1.f) * 0.5f * width - 0.5f;
+        const float py = (1.f - screen.y) * 0.5f * height - 0.5f;
+        if (!(px > -1.f && px < width && py > -1.f && py < height))
+            return Reprojection::Offscreen;
+
+        const int x0 = static_cast<int>(std::floor(px));
+        const int y0 = static_cast<int>(std::floor(py));
+        const float fx = px - x0;
+        const float fy = py - y0;
+        float weight = 0.f;
+        Vec3 sum;
+        float countSum = 0.f;
+        for (int tap = 0; tap < 4; ++tap)
+        {
+            const int x = x0 + (tap & 1);
+            const int y = y0 + (tap >> 1);
+            if (x < 0 || x >= width || y < 0 || y >= height)
+                continue;
+            const size_t index = static_cast<size_t>(y) * width + x;
+            if (!same_surface(surface, previousSurfaces[index]))
+                continue;
+            const float w = ((tap & 1) ? fx : 1.f - fx) * ((tap >> 1) ? fy : 1.f - fy);
+            const float *value = &previousMean.data[index * 3];
+            sum += Vec3(value[0], value[1], value[2]) * w;
+            countSum += history[index] * w;
+            weight += w;
+        }
+        if (weight <= 1e-4f)
+            return Reprojection::Rejected;
+        radiance = sum / weight;
+        // Partly rejected footprints keep only the accepted share of the history
+        count = countSum;
+        return Reprojection::Valid;
+    }
+
+    bool same_surface(const Surface &current, const Surface &previous) const
+    {
+        if (current.hit != previous.hit)
+            return false;
+        if (!current.hit)
+            return true;
+        const float planeDistance = std::fabs(dot(previous.p - current.p, current.normal));
+        return planeDistance <= settings.planeTolerance * current.distance &&
+               dot(previous.normal, current.normal) >= settings.normalTolerance;
+    }
+
+    int width;
+    int height;
+    TemporalSettings settings;
+    Image<float, 3> mean;
+    Image<float, 3> previousMean;
+    Image<float, 3> newSamples;
+    std::vector<float> history;
+    std::vector<Surface> surfaces;
+    std::vector<Surface> previousSurfaces;
+    std::vector<int> counts;
+    std::optional<Camera> previousCamera;
+};
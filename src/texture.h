@@ -0,0 +1,496 @@
+#pragma once
+
+#include "half.h"
+#include "image.h"
+#include "math.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Tiled, mip-mapped textures paged in through a bounded cache. write_tiled_texture() stores every
+// mip level of an RGB image as square tiles of half-float texels. Each tile carries one extra row and
+// column copied from its right and bottom neighbours (or the wrapped or clamped edge), so a bilinear
+// lookup always reads a single tile. Texture::open() keeps only the header and the level table in
+// memory; tiles are loaded on demand by TextureCache, one bounded, sharded LRU shared by every open
+// texture.
+//
+// File layout, all offsets in bytes:
+//   0            TextureFileHeader
+//   then         TextureLevelRecord[levelCount]
+//   page-aligned tiles, level by level, row-major: uint16_t[(tileSize + 1)^2 * 3]
+
+enum class TextureWrap : uint32_t
+{
+    Clamp,
+    Repeat,
+};
+
+struct TextureFileHeader
+{
+    char magic[8] = {'R', 'T', 'T', 'E', 'X', 'T', 'R', '\0'};
+    uint32_t version = 1;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t tileSize = 0;
+    uint32_t levelCount = 0;
+    TextureWrap wrapU = TextureWrap::Clamp;
+    TextureWrap wrapV = TextureWrap::Clamp;
+    uint32_t reserved = 0;
+    uint64_t tilesOffset = 0;
+};
+
+struct TextureLevelRecord
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t tilesX;
+    uint32_t tilesY;
+    uint64_t firstTile; // index of the level's first tile in the file
+};
+
+constexpr size_t texture_page_size = 4096;
+// Limits of the format: texel coordinates are ints and tiles are read whole, so files claiming more
+// are treated as damaged
+constexpr uint32_t texture_max_size = 1u << 24;
+constexpr uint32_t texture_max_tile_size = 1024;
+
+// One tile in memory: (size + 1)^2 RGB texels, the last row and column belong to the neighbours
+struct TextureTile
+{
+    int size = 0;
+    std::vector<uint16_t> texels;
+
+    Vec3 texel(int x, int y) const
+    {
+        const uint16_t *t = &texels[(static_cast<size_t>(y) * (size + 1) + x) * 3];
+        return {half_bits_to_float(t[0]), half_bits_to_float(t[1]), half_bits_to_float(t[2])};
+    }
+
+    size_t memory_bytes() const { return sizeof(TextureTile) + texels.size() * sizeof(uint16_t); }
+};
+
+namespace texture_detail
+{
+    inline int wrap(int i, int size, TextureWrap mode)
+    {
+        if (mode == TextureWrap::Repeat)
+            return ((i % size) + size) % size;
+        return std::clamp(i, 0, size - 1);
+    }
+
+    inline size_t tile_bytes(int tileSize)
+    {
+        return static_cast<size_t>(tileSize + 1) * (tileSize + 1) * 3 * sizeof(uint16_t);
+    }
+
+    inline size_t tile_stride(int tileSize)
+    {
+        return (tile_bytes(tileSize) + texture_page_size - 1) / texture_page_size * texture_page_size;
+    }
+
+    // Levels of a width x height texture down to 1x1, each halving with odd sizes rounding up, and
+    // their tiles numbered level by level
+    inline std::vector<TextureLevelRecord> level_chain(uint32_t width, uint32_t height, uint32_t tileSize)
+    {
+        std::vector<TextureLevelRecord> levels;
+        for (uint32_t w = width, h = height;; w = std::max(1u, (w + 1) / 2), h = std::max(1u, (h + 1) / 2))
+        {
+            const uint32_t tilesX = (w + tileSize - 1) / tileSize;
+            const uint32_t tilesY = (h + tileSize - 1) / tileSize;
+            const uint64_t firstTile =
+                levels.empty() ? 0 : levels.back().firstTile + uint64_t(levels.back().tilesX) * levels.back().tilesY;
+            levels.push_back({w, h, tilesX, tilesY, firstTile});
+            if (w == 1 && h == 1)
+                break;
+        }
+        return levels;
+    }
+
+    // Box filter to the next level; odd sizes round up and average only the texels that exist
+    inline Image<float, 3> downsample(const Image<float, 3> &source)
+    {
+        Image<float, 3> level(std::max(1, (source.width + 1) / 2), std::max(1, (source.height + 1) / 2));
+        for (int y = 0; y < level.height; ++y)
+        {
+            for (int x = 0; x < level.width; ++x)
+            {
+                float sum[3] = {0.f, 0.f, 0.f};
+                int count = 0;
+                for (int sy = 2 * y; sy < std::min(2 * y + 2, source.height); ++sy)
+                {
+                    for (int sx = 2 * x; sx < std::min(2 * x + 2, source.width); ++sx)
+                    {
+                        const float *texel = &source[sy][sx];
+                        sum[0] += texel[0];
+                        sum[1] += texel[1];
+                        sum[2] += texel[2];
+                        ++count;
+                    }
+                }
+                float *out = &level[y][x];
+                out[0] = sum[0] / count;
+                out[1] = sum[1] / count;
+                out[2] = sum[2] / count;
+            }
+        }
+        return level;
+    }
+} // namespace texture_detail
+
+// Writes image and its mip chain down to 1x1 as a tiled texture file
+inline bool write_tiled_texture(const Image<float, 3> &image, const std::string &filename, TextureWrap wrapU,
+                                TextureWrap wrapV, int tileSize = 64)
+{
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file || image.width <= 0 || image.height <= 0 || tileSize <= 0 ||
+        static_cast<uint32_t>(std::max(image.width, image.height)) > texture_max_size ||
+        static_cast<uint32_t>(tileSize) > texture_max_tile_size)
+        return false;
+
+    TextureFileHeader header;
+    header.width = static_cast<uint32_t>(image.width);
+    header.height = static_cast<uint32_t>(image.height);
+    header.tileSize = static_cast<uint32_t>(tileSize);
+    header.wrapU = wrapU;
+    header.wrapV = wrapV;
+
+    const auto levels = texture_detail::level_chain(header.width, header.height, header.tileSize);
+    header.levelCount = static_cast<uint32_t>(levels.size());
+    const size_t tableEnd = sizeof(TextureFileHeader) + levels.size() * sizeof(TextureLevelRecord);
+    header.tilesOffset = (tableEnd + texture_page_size - 1) / texture_page_size * texture_page_size;
+
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(levels.data()), levels.size() * sizeof(TextureLevelRecord));
+
+    const size_t stride = texture_detail::tile_stride(tileSize);
+    std::vector<uint16_t> tile(texture_detail::tile_bytes(tileSize) / sizeof(uint16_t));
+    std::optional<Image<float, 3>> coarser;
+    for (const auto &record : levels)
+    {
+        // Level 0 is read straight from the source, every other level from the one before it
+        const Image<float, 3> &level = coarser ? *coarser : image;
+        for (uint32_t ty = 0; ty < record.tilesY; ++ty)
+        {
+            for (uint32_t tx = 0; tx < record.tilesX; ++tx)
+            {
+                for (int y = 0; y <= tileSize; ++y)
+                {
+                    const int sy = texture_detail::wrap(static_cast<int>(ty) * tileSize + y, level.height, wrapV);
+                    for (int x = 0; x <= tileSize; ++x)
+                    {
+                        const int sx = texture_detail::wrap(static_cast<int>(tx) * tileSize + x, level.width, wrapU);
+                        const float *texel = &level[sy][sx];
+                        uint16_t *out = &tile[(static_cast<size_t>(y) * (tileSize + 1) + x) * 3];
+                        out[0] = float_to_half_bits(texel[0]);
+                        out[1] = float_to_half_bits(texel[1]);
+                        out[2] = float_to_half_bits(texel[2]);
+                    }
+                }
+                const uint64_t index = record.firstTile + uint64_t(ty) * record.tilesX + tx;
+                file.seekp(static_cast<std::streamoff>(header.tilesOffset + index * stride));
+                file.write(reinterpret_cast<const char *>(tile.data()), tile.size() * sizeof(uint16_t));
+            }
+        }
+        if (record.width > 1 || record.height > 1)
+            coarser = texture_detail::downsample(level);
+    }
+    // Pad the last tile to its full stride so every tile read is in bounds
+    const uint64_t tileCount = levels.back().firstTile + 1;
+    file.seekp(static_cast<std::streamoff>(header.tilesOffset + tileCount * stride - 1));
+    file.put('\0');
+    return static_cast<bool>(file);
+}
+
+class TextureCache;
+
+// An open tiled texture file. Texels are fetched through the TextureCache given to open(), which has
+// to outlive the texture.
+class Texture
+{
+public:
+    static std::optional<Texture> open(const std::string &filename, TextureCache &cache)
+    {
+        Texture texture(cache);
+        texture.file.open(filename, std::ios::binary);
+        if (!texture.file)
+            return std::nullopt;
+
+        texture.file.seekg(0, std::ios::end);
+        const auto fileSize = static_cast<uint64_t>(texture.file.tellg());
+        texture.file.seekg(0);
+
+        // The level table has to be exactly the chain write_tiled_texture() makes for the header's
+        // size, and every tile of it inside the file; lookups rely on both
+        const auto &header = texture.header;
+        texture.file.read(reinterpret_cast<char *>(&texture.header), sizeof(TextureFileHeader));
+        if (!texture.file || std::memcmp(header.magic, TextureFileHeader().magic, sizeof(header.magic)) != 0 ||
+            header.version != 1 || header.width == 0 || header.height == 0 || header.width > texture_max_size ||
+            header.height > texture_max_size || header.tileSize == 0 || header.tileSize > texture_max_tile_size ||
+            header.wrapU > TextureWrap::Repeat || header.wrapV > TextureWrap::Repeat)
+            return std::nullopt;
+
+        const auto expected = texture_detail::level_chain(header.width, header.height, header.tileSize);
+        if (header.levelCount != expected.size())
+            return std::nullopt;
+        texture.levels.resize(header.levelCount);
+        texture.file.read(reinterpret_cast<char *>(texture.levels.data()), texture.levels.size() * sizeof(TextureLevelRecord));
+        if (!texture.file)
+            return std::nullopt;
+        for (size_t level = 0; level < expected.size(); ++level)
+        {
+            const auto &record = texture.levels[level];
+            if (record.width != expected[level].width || record.height != expected[level].height ||
+                record.tilesX != expected[level].tilesX || record.tilesY != expected[level].tilesY ||
+                record.firstTile != expected[level].firstTile)
+                return std::nullopt;
+        }
+        const uint64_t tableEnd = sizeof(TextureFileHeader) + expected.size() * sizeof(TextureLevelRecord);
+        const uint64_t tileCount = expected.back().firstTile + 1;
+        const uint64_t stride = texture_detail::tile_stride(static_cast<int>(header.tileSize));
+        if (header.tilesOffset < tableEnd || header.tilesOffset > fileSize || tileCount > (fileSize - header.tilesOffset) / stride)
+            return std::nullopt;
+        return texture;
+    }
+
+    int width(int level = 0) const { return static_cast<int>(levels[level].width); }
+    int height(int level = 0) const { return static_cast<int>(levels[level].height); }
+    int level_count() const { return static_cast<int>(levels.size()); }
+    int tile_size() const { return static_cast<int>(header.tileSize); }
+    TextureWrap wrap_u() const { return header.wrapU; }
+    TextureWrap wrap_v() const { return header.wrapV; }
+    // Unique over the process lifetime, never reused
+    uint64_t id() const { return textureId; }
+
+    // Bilinear lookup in one level; (0, 0) is the top-left corner of the image
+    Vec3 lookup(float u, float v, int level = 0) const;
+    // Texel (x, y) of a level, coordinates already inside the level
+    Vec3 texel(int x, int y, int level = 0) const;
+
+    std::unique_ptr<TextureTile> read_tile(int level, int tx, int ty) const
+    {
+        const auto &record = levels[level];
+        const int tileSize = tile_size();
+        auto tile = std::make_unique<TextureTile>();
+        tile->size = tileSize;
+        tile->texels.resize(texture_detail::tile_bytes(tileSize) / sizeof(uint16_t));
+        const uint64_t index = record.firstTile + uint64_t(ty) * record.tilesX + tx;
+        std::lock_guard<std::mutex> lock(*fileMutex);
+        file.seekg(static_cast<std::streamoff>(header.tilesOffset + index * texture_detail::tile_stride(tileSize)));
+        file.read(reinterpret_cast<char *>(tile->texels.data()), tile->texels.size() * sizeof(uint16_t));
+        if (!file)
+        {
+            file.clear();
+            return nullptr;
+        }
+        return tile;
+    }
+
+private:
+    explicit Texture(TextureCache &_cache) : cache(&_cache)
+    {
+        static std::atomic<uint64_t> nextId{0};
+        textureId = nextId.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    TextureCache *cache;
+    uint64_t textureId = 0;
+    TextureFileHeader header;
+    std::vector<TextureLevelRecord> levels;
+    mutable std::ifstream file;
+    std::unique_ptr<std::mutex> fileMutex = std::make_unique<std::mutex>(); // boxed so the texture stays movable
+};
+
+struct TextureCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t bytesRead = 0;
+
+    double hit_rate() const { return hits + misses ? double(hits) / double(hits + misses) : 0.0; }
+};
+
+// Bounded LRU of texture tiles, safe to share between threads and textures. Tiles are shared_ptr so
+// an evicted tile stays valid for the lookup still reading it. Tiles of a closed texture are not
+// dropped eagerly; they age out like any other.
+// Tiles are spread over shards by key, each an LRU with its own lock and an equal part of the
+// capacity, so concurrent lookups of different tiles rarely wait on each other. A miss reads the tile
+// with no shard lock held; when two threads miss on the same tile both read it and the first insert
+// wins.
+class TextureCache
+{
+public:
+    explicit TextureCache(size_t _capacityBytes) : capacityBytes(_capacityBytes) {}
+
+    std::shared_ptr<const TextureTile> acquire(const Texture &texture, int level, int tx, int ty)
+    {
+        const TileKey key{texture.id(), static_cast<uint32_t>(level), static_cast<uint32_t>(tx), static_cast<uint32_t>(ty)};
+        Shard &shard = shard_for(key);
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (const auto it = shard.entries.find(key); it != shard.entries.end())
+            {
+                ++shard.counters.hits;
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second.position);
+                return it->second.tile;
+            }
+            ++shard.counters.misses;
+        }
+
+        std::shared_ptr<const TextureTile> tile = texture.read_tile(level, tx, ty);
+        if (!tile)
+            return nullptr;
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.counters.bytesRead += tile->texels.size() * sizeof(uint16_t);
+        if (const auto it = shard.entries.find(key); it != shard.entries.end())
+            return it->second.tile;
+        shard.residentBytes += tile->memory_bytes();
+        shard.lru.push_front(key);
+        shard.entries[key] = {tile, shard.lru.begin()};
+
+        const size_t shardCapacity = capacityBytes / shard_count;
+        while (shard.residentBytes > shardCapacity && shard.lru.size() > 1)
+        {
+            const TileKey victim = shard.lru.back();
+            shard.residentBytes -= shard.entries[victim].tile->memory_bytes();
+            shard.entries.erase(victim);
+            shard.lru.pop_back();
+            ++shard.counters.evictions;
+        }
+        return tile;
+    }
+
+    TextureCacheStats stats() const
+    {
+        TextureCacheStats total;
+        for (const auto &shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total.hits += shard.counters.hits;
+            total.misses += shard.counters.misses;
+            total.evictions += shard.counters.evictions;
+            total.bytesRead += shard.counters.bytesRead;
+        }
+        return total;
+    }
+
+    size_t resident_bytes() const
+    {
+        size_t total = 0;
+        for (const auto &shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.residentBytes;
+        }
+        return total;
+    }
+
+    size_t capacity_bytes() const { return capacityBytes; }
+
+private:
+    static constexpr size_t shard_count = 16;
+
+    // The whole texture id: textures opened later never alias the tiles of earlier ones
+    struct TileKey
+    {
+        uint64_t texture;
+        uint32_t level, tx, ty;
+
+        bool operator==(const TileKey &) const = default;
+    };
+
+    // Neighbouring tiles of one texture differ only in tx and ty; mix every field into the hash
+    struct TileKeyHash
+    {
+        size_t operator()(const TileKey &key) const
+        {
+            uint64_t hash = key.texture * 0x9e3779b97f4a7c15ull;
+            for (const uint64_t word : {uint64_t(key.level) << 32 | key.tx, uint64_t(key.ty)})
+            {
+                hash = (hash ^ word) * 0xbf58476d1ce4e5b9ull;
+                hash ^= hash >> 29;
+            }
+            return static_cast<size_t>(hash);
+        }
+    };
+
+    struct Entry
+    {
+        std::shared_ptr<const TextureTile> tile;
+        std::list<TileKey>::iterator position;
+    };
+
+    // Own cache line each, so shards locked by different threads do not share one
+    struct alignas(64) Shard
+    {
+        size_t residentBytes = 0;
+        std::list<TileKey> lru; // most recently used first
+        std::unordered_map<TileKey, Entry, TileKeyHash> entries;
+        TextureCacheStats counters;
+        mutable std::mutex mutex;
+    };
+
+    // High bits of the hash, so the shard does not correlate with the bucket within the shard's map
+    Shard &shard_for(const TileKey &key) { return shards[(TileKeyHash()(key) >> 40) % shard_count]; }
+
+    size_t capacityBytes;
+    std::array<Shard, shard_count> shards;
+};
+
+inline Vec3 Texture::lookup(float u, float v, int level) const
+{
+    level = std::clamp(level, 0, level_count() - 1);
+    const int w = width(level);
+    const int h = height(level);
+    const float px = u * w - 0.5f;
+    const float py = v * h - 0.5f;
+    int x0 = static_cast<int>(std::floor(px));
+    int y0 = static_cast<int>(std::floor(py));
+    float fx = px - x0;
+    float fy = py - y0;
+
+    // The tile border holds texel x0 + 1, so only x0 needs addressing; clamping below the first
+    // texel keeps both taps on it
+    if (header.wrapU == TextureWrap::Repeat)
+        x0 = texture_detail::wrap(x0, w, TextureWrap::Repeat);
+    else if (x0 < 0)
+        x0 = 0, fx = 0.f;
+    else if (x0 >= w)
+        x0 = w - 1, fx = 0.f;
+    if (header.wrapV == TextureWrap::Repeat)
+        y0 = texture_detail::wrap(y0, h, TextureWrap::Repeat);
+    else if (y0 < 0)
+        y0 = 0, fy = 0.f;
+    else if (y0 >= h)
+        y0 = h - 1, fy = 0.f;
+
+    const int tileSize = tile_size();
+    const auto tile = cache->acquire(*this, level, x0 / tileSize, y0 / tileSize);
+    if (!tile)
+        return {0.f, 0.f, 0.f};
+    const int lx = x0 % tileSize;
+    const int ly = y0 % tileSize;
+    const Vec3 top = tile->texel(lx, ly) * (1.f - fx) + tile->texel(lx + 1, ly) * fx;
+    const Vec3 bottom = tile->texel(lx, ly + 1) * (1.f - fx) + tile->texel(lx + 1, ly + 1) * fx;
+    return top * (1.f - fy) + bottom * fy;
+}
+
+inline Vec3 Texture::texel(int x, int y, int level) const
+{
+    const int tileSize = tile_size();
+    const auto tile = cache->acquire(*this, level, x / tileSize, y / tileSize);
+    return tile ? tile->texel(x % tileSize, y % tileSize) : Vec3(0.f, 0.f, 0.f);
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "math.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Screen-space traversal for the tile scheduler. Tiles are handed to threads in curve order and the
+// pixels inside a tile are visited in curve order too, so rays traced close together in time start
+// from neighbouring pixels and touch the same parts of the scene.
+
+enum class TraversalOrder
+{
+    Scanline,
+    Morton,
+    Hilbert,
+};
+
+inline const char *to_string(TraversalOrder order)
+{
+    switch (order)
+    {
+    case TraversalOrder::Scanline: return "scanline";
+    case TraversalOrder::Morton: return "morton";
+    default: return "hilbert";
+    }
+}
+
+inline TraversalOrder traversal_order_from_string(const std::string &name)
+{
+    if (name == "scanline")
+        return TraversalOrder::Scanline;
+    if (name == "morton")
+        return TraversalOrder::Morton;
+    return TraversalOrder::Hilbert;
+}
+
+struct Tile
+{
+    int x0, y0; // inclusive
+    int x1, y1; // exclusive
+};
+
+inline uint32_t spread_bits(uint32_t v)
+{
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+inline uint32_t morton_index(uint32_t x, uint32_t y)
+{
+    return spread_bits(x) | (spread_bits(y) << 1);
+}
+
+// Distance of (x, y) along the Hilbert curve filling a side x side grid, side a power of two
+inline uint32_t hilbert_index(uint32_t side, uint32_t x, uint32_t y)
+{
+    uint32_t d = 0;
+    for (uint32_t s = side / 2; s > 0; s /= 2)
+    {
+        const uint32_t rx = (x & s) > 0;
+        const uint32_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// All cells of a width x height grid in traversal order. Non power-of-two grids walk the curve of
+// the enclosing power-of-two square and skip the cells outside.
+inline std::vector<Vec2i> curve_order(int width, int height, TraversalOrder order)
+{
+    std::vector<Vec2i> cells;
+    cells.reserve(static_cast<size_t>(width) * height);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+            cells.emplace_back(x, y);
+    if (order == TraversalOrder::Scanline)
+        return cells;
+
+    uint32_t side = 1;
+    while (side < static_cast<uint32_t>(std::max(width, height)))
+        side *= 2;
+
+    auto key = [&](const Vec2i &c) {
+        return order == TraversalOrder::Morton ? morton_index(c.x, c.y) : hilbert_index(side, c.x, c.y);
+    };
+    std::sort(cells.begin(), cells.end(), [&](const Vec2i &a, const Vec2i &b) { return key(a) < key(b); });
+    return cells;
+}
+
+inline std::vector<Tile> make_tiles(int width, int height, int tileSize, TraversalOrder order)
+{
+    const int tilesX = (width + tileSize - 1) / tileSize;
+    const int tilesY = (height + tileSize - 1) / tileSize;
+    std::vector<Tile> tiles;
+    tiles.reserve(static_cast<size_t>(tilesX) * tilesY);
+    for (const auto &cell : curve_order(tilesX, tilesY, order))
+    {
+        const int x0 = cell.x * tileSize;
+        const int y0 = cell.y * tileSize;
+        tiles.push_back({x0, y0, std::min(x0 + tileSize, width), std::min(y0 + tileSize, height)});
+    }
+    return tiles;
+}
+
+// Per-core L2 size in bytes from sysfs, or 0 when it is not exposed
+inline size_t l2_cache_size()
+{
+    for (int index = 0; index < 8; ++index)
+    {
+        const std::string base = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/";
+        std::ifstream levelFile(base + "level");
+        int level = 0;
+        if (!(levelFile >> level))
+            break;
+        if (level != 2)
+            continue;
+
+        std::ifstream sizeFile(base + "size");
+        size_t size = 0;
+        char unit = 0;
+        if (!(sizeFile >> size))
+            return 0;
+        sizeFile >> unit;
+        if (unit == 'K')
+            size <<= 10;
+        else if (unit == 'M')
+            size <<= 20;
+        return size;
+    }
+    return 0;
+}
+
+// Square power-of-two tile edge whose pixels fit the L2 at a budget of 256 bytes per pixel: the
+// pixel's accumulator plus its share of the scene data its rays pull in. Clamped to [8, 64].
+inline int default_tile_size()
+{
+    static const int size = [] {
+        const size_t l2 = l2_cache_size();
+        const size_t pixels = (l2 ? l2 : size_t(256) << 10) / 256;
+        int edge = 8;
+        while (edge < 64 && size_t(edge * 2) * (edge * 2) <= pixels)
+            edge *= 2;
+        return edge;
+    }();
+    return size;
+}
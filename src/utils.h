@@ -1,7 +1,11 @@
 #pragma once
 
 #include "math.hpp"
-#include <random>
+#include "rng.h"
+
+#include <algorithm>
+#include <cmath>
+
 // https://www.scratchapixel.com/lessons/
 //         Raster Space                            NDC Space                                Screen Space
 //  +----------+----------+----------+   +----------+----------+----------+   +----------+----------+----------+
@@ -15,61 +19,90 @@
 //  |   (0,2)  |          |   (2,2)  |   |   (0,1)  |          |    (1,1) |   |   (-1,-1)|          |    (1,-1)|
 //  +----------+----------+----------+   +----------+----------+----------+   +----------+----------+----------+
 
-auto raster_to_NDC(Vec2f point, int img_width, int img_height)
+inline auto raster_to_NDC(Vec2f point, int img_width, int img_height)
 {
     return Vec2f((point.x + 0.5f) / img_width, (point.x + 0.5f) / img_height);
 }
 
-auto raster_to_NDC(Vec2i point, int img_width, int img_height)
+inline auto raster_to_NDC(Vec2i point, int img_width, int img_height)
 {
     return Vec2f((point.x + 0.5f) / img_width, (point.y + 0.5f) / img_height);
 }
 
-auto NDC_to_screen_space(Vec2f point)
+inline auto NDC_to_screen_space(Vec2f point)
 {
     return Vec2f(2 * point.x - 1, 1 - 2 * point.y);
 }
 
-Vec3 generate_random_vec3(float minX, float maxX, float minY, float maxY, float minZ, float maxZ) {
-    std::random_device rd;
-    std::default_random_engine rng(rd());
-    std::uniform_real_distribution<float> distX(minX, maxX);
-    std::uniform_real_distribution<float> distY(minY, maxY);
-    std::uniform_real_distribution<float> distZ(minZ, maxZ);
-
-    float randomX = distX(rng);
-    float randomY = distY(rng);
-    float randomZ = distZ(rng);
+inline Vec3 generate_random_vec3(Sampler &sampler, float minX, float maxX, float minY, float maxY, float minZ, float maxZ) {
+    float randomX = sampler.next(minX, maxX);
+    float randomY = sampler.next(minY, maxY);
+    float randomZ = sampler.next(minZ, maxZ);
 
     return Vec3(randomX, randomY, randomZ);
 }
 
 
-inline Vec3 random_in_unit_sphere() {
+inline Vec3 random_in_unit_sphere(Sampler &sampler) {
     while (true) {
-        auto p = generate_random_vec3(-1.f, 1.f, -1.f, 1.f, -1.f, 1.f);
+        auto p = generate_random_vec3(sampler, -1.f, 1.f, -1.f, 1.f, -1.f, 1.f);
         if (p.length_squared() < 1)
             return p;
     }
 }
 
-inline Vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+// sin and cos of 2 pi t for t in [0, 1), without branches or table lookups so that loops over many
+// values vectorize; polynomials on a quarter turn, absolute error below 1e-7
+inline void sincos_turns(float t, float &s, float &c) {
+    const float x = t * 4.f;
+    const float quadrant = std::floor(x);
+    const float a = (x - quadrant) * 1.57079632679f;
+    const float a2 = a * a;
+    const float sa = a * (1.f + a2 * (-1.f / 6 + a2 * (1.f / 120 + a2 * (-1.f / 5040 + a2 * (1.f / 362880 + a2 * (-1.f / 39916800))))));
+    const float ca = 1.f + a2 * (-0.5f + a2 * (1.f / 24 + a2 * (-1.f / 720 + a2 * (1.f / 40320 + a2 * (-1.f / 3628800 + a2 * (1.f / 479001600))))));
+    // Rotate by the quadrant: (c, s) -> (-s, c) -> (-c, -s) -> (s, -c)
+    const int q = static_cast<int>(quadrant) & 3;
+    const float swapS = (q & 1) ? ca : sa;
+    const float swapC = (q & 1) ? sa : ca;
+    s = (q & 2) ? -swapS : swapS;
+    c = ((q + 1) & 2) ? -swapC : swapC;
+}
+
+// Uniform direction from two uniform numbers: z uniform in [-1, 1] and a uniform azimuth
+inline Vec3 unit_vector_from(float u, float v) {
+    const float z = 1.f - 2.f * u;
+    const float r = std::sqrt(std::max(0.f, 1.f - z * z));
+    float s, c;
+    sincos_turns(v, s, c);
+    return Vec3(r * c, r * s, z);
 }
 
-inline Vec3 random_on_hemisphere(const Vec3& normal) {
-    Vec3 on_unit_sphere = random_unit_vector();
+inline Vec3 random_unit_vector(Sampler &sampler) {
+    const float u = sampler.next();
+    return unit_vector_from(u, sampler.next());
+}
+
+inline Vec3 random_on_hemisphere(const Vec3& normal, Sampler &sampler) {
+    Vec3 on_unit_sphere = random_unit_vector(sampler);
     if (dot(on_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
         return on_unit_sphere;
     else
         return -on_unit_sphere;
 }
 
-bool near_zero(const Vec3& v, float epsilon = 1e-8) {
-    return (std::fabs(v.x) < epsilon) && (std::fabs(v.y) < epsilon) && (std::fabs(v.z) < epsilon);
+// Non-short-circuit &, so it is a plain select inside vectorized loops
+inline bool near_zero(const Vec3& v, float epsilon = 1e-8) {
+    return (std::fabs(v.x) < epsilon) & (std::fabs(v.y) < epsilon) & (std::fabs(v.z) < epsilon);
+}
+
+// unit_vector() with per-component selects instead of a branch, for loops that should vectorize
+inline Vec3 unit_vector_or_zero(const Vec3& v) {
+    const float length = v.length();
+    const bool valid = length > 0;
+    return Vec3(valid ? v.x / length : 0.f, valid ? v.y / length : 0.f, valid ? v.z / length : 0.f);
 }
 
-Vec3 reflect(const Vec3& v, const Vec3& n) {
+inline Vec3 reflect(const Vec3& v, const Vec3& n) {
     return v - 2*dot(v,n)*n;
 }
 
@@ -78,7 +111,8 @@ inline Vec3 operator*(const Vec3 &u, const Vec3 &v) {
 }
 
 inline Vec3 refract(const Vec3& uv, const Vec3& n, double etai_over_etat) {
-    auto cos_theta = fmin(dot(-uv, n), 1.f);
+    const float cosine = dot(-uv, n);
+    auto cos_theta = cosine < 1.f ? cosine : 1.f; // fmin() without the libm call
     Vec3 r_out_perp =  etai_over_etat * (uv + cos_theta*n);
     Vec3 r_out_parallel = -sqrt(fabs(1.f - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
@@ -91,7 +125,7 @@ inline auto degrees_to_radians(float degrees) {
 
 namespace gpt
 {
-    Vec2f rasterToNDC(int x, int y, int width, int height)
+    inline Vec2f rasterToNDC(int x, int y, int width, int height)
     {
         // Convert raster coordinates to NDC coordinates
         float ndcX = (2.0f * x) / (width - 1) - 1.0f;
@@ -100,13 +134,13 @@ namespace gpt
         return Vec2f(ndcX, ndcY);
     }
 
-    Vec2f rasterToNDC(const Vec2i &pixel, int width, int height)
+    inline Vec2f rasterToNDC(const Vec2i &pixel, int width, int height)
     {
         // Convert raster coordinates to NDC coordinates
         return rasterToNDC(pixel.x, pixel.y, width, height);
     }
     
-    Vec2f ndcToScreen(const Vec2f &ndc, int screenWidth, int screenHeight)
+    inline Vec2f ndcToScreen(const Vec2f &ndc, int screenWidth, int screenHeight)
     {
         // Convert NDC coordinates to screen space
         float screenX = (ndc.x + 1.0f) * 0.5f * screenWidth;
@@ -0,0 +1,340 @@
+#pragma once
+
+#include "camera.h"
+#include "cpu_dispatch.h"
+#include "image.h"
+#include "kernel.h"
+#include "material.h"
+#include "numa.h"
+#include "ray_sort.h"
+#include "render.h"
+#include "tiles.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Data-oriented bounce loop for StaticKernel. A tile advances all of its paths one bounce at a time:
+// every live path is intersected, its hit is appended to the ScatterBatch of its material type, and
+// full batches go through the material's scatter_batch() (material.h), which evaluates 16 hits with
+// vector code. Each path keeps its own samples and multiplies its throughput in the same order as
+// StaticKernel::trace(), so the image is the same as render_samples() with the kernel itself.
+// Scenes lit by an environment map take the kernel's own path, which adds next-event estimation.
+// Secondary rays can be reordered before each bounce (ray_sort.h); only the order in which paths are
+// advanced changes, so sorting leaves the image as it is.
+
+// Selects the wavefront overload of render_samples() for kernel
+template <class Kernel>
+struct WavefrontShading
+{
+    const Kernel &kernel;
+    RaySorting sorting = RaySorting::Adaptive;
+
+    // For renderers without a wavefront path
+    Vec3 trace(const Ray &ray, Sampler &sampler) const { return kernel.trace(ray, sampler); }
+};
+
+namespace wavefront_detail
+{
+    struct Path
+    {
+        Ray ray;
+        Vec3 throughput;
+        Vec3 point; // hit of the current bounce, origin of the scattered ray
+        uint32_t pixelIndex;
+        uint32_t sample;
+        uint32_t slot; // radiance entry; stays with the path when paths are reordered
+    };
+
+    template <class Kernel>
+    struct Scratch
+    {
+        static constexpr size_t material_types = std::variant_size_v<typename Kernel::Material>;
+
+        std::vector<Vec2f> samples;
+        std::vector<Path> paths;
+        std::vector<Path> sortedPaths;
+        std::vector<Color> radiance; // per path
+        std::vector<Color> colors;   // per pixel
+        std::vector<uint32_t> active;
+        std::vector<uint32_t> next;
+        std::array<ScatterBatch, material_types> batches;
+        std::array<std::array<uint32_t, ScatterBatch::lanes>, material_types> lanePaths;
+        RaySortPolicy sortPolicy;
+        std::vector<uint32_t> keys;
+        std::vector<uint32_t> keyScratch;
+        std::vector<uint32_t> indexScratch;
+        uint64_t sortedRays = 0;
+    };
+
+    template <class T, class Variant, size_t Index = 0>
+    constexpr size_t variant_index()
+    {
+        if constexpr (std::is_same_v<T, std::variant_alternative_t<Index, Variant>>)
+            return Index;
+        else
+            return variant_index<T, Variant, Index + 1>();
+    }
+
+    // Camera samples per pixel in one wave
+    constexpr int wave_samples = 8;
+
+    template <class Kernel>
+    struct TileJob
+    {
+        const Camera &camera;
+        const Kernel &kernel;
+        const Tile &tile;
+        int width;
+        int height;
+        int firstSample;
+        int numSamples;
+        uint64_t seed;
+        Image<float, 3> &out;
+        Scratch<Kernel> &scratch;
+    };
+
+    // Scatters the hits gathered for material type Index and moves the surviving paths to the next bounce
+    template <size_t Index, class Kernel>
+    RT_ALWAYS_INLINE void flush(Scratch<Kernel> &scratch)
+    {
+        using Material = std::variant_alternative_t<Index, typename Kernel::Material>;
+        auto &batch = scratch.batches[Index];
+        if (batch.count == 0)
+            return;
+        Material::scatter_batch(batch);
+        for (int lane = 0; lane < batch.count; ++lane)
+        {
+            const uint32_t index = scratch.lanePaths[Index][lane];
+            auto &path = scratch.paths[index];
+            if (!batch.ok[lane])
+                continue; // radiance stays zero
+            path.throughput = path.throughput * Vec3(batch.ar[lane], batch.ag[lane], batch.ab[lane]);
+            path.ray = Ray(path.point, Vec3(batch.sx[lane], batch.sy[lane], batch.sz[lane]));
+            scratch.next.push_back(index);
+        }
+        batch.count = 0;
+    }
+
+    template <class Kernel, size_t... Indices>
+    RT_ALWAYS_INLINE void flush_all(Scratch<Kernel> &scratch, std::index_sequence<Indices...>)
+    {
+        (flush<Indices>(scratch), ...);
+    }
+
+    // Orders the active paths by ray_sort key, with origins quantized over their own bounds, and
+    // moves them to the front of paths in that order so the bounce reads them front to back
+    template <class Kernel>
+    RT_ALWAYS_INLINE void sort_active(Scratch<Kernel> &scratch)
+    {
+        AABB bounds;
+        for (const uint32_t index : scratch.active)
+            bounds.expand(scratch.paths[index].ray.origin());
+        const RaySortKey key(bounds);
+        scratch.keys.clear();
+        for (const uint32_t index : scratch.active)
+            scratch.keys.push_back(key(scratch.paths[index].ray));
+        radix_sort(scratch.keys, scratch.active, scratch.keyScratch, scratch.indexScratch, ray_sort_key_bits);
+
+        scratch.sortedPaths.resize(scratch.paths.size());
+        for (size_t i = 0; i < scratch.active.size(); ++i)
+        {
+            scratch.sortedPaths[i] = scratch.paths[scratch.active[i]];
+            scratch.active[i] = static_cast<uint32_t>(i);
+        }
+        scratch.paths.swap(scratch.sortedPaths);
+        scratch.sortedRays += scratch.active.size();
+    }
+
+    template <class Kernel>
+    RT_ALWAYS_INLINE void render_tile_body(const TileJob<Kernel> &job)
+    {
+        using Material = typename Kernel::Material;
+        const auto &tile = job.tile;
+        const int tileWidth = tile.x1 - tile.x0;
+        const size_t pixels = static_cast<size_t>(tileWidth) * (tile.y1 - tile.y0);
+        auto &scratch = job.scratch;
+        const auto &materials = job.kernel.material_table();
+
+        auto &colors = scratch.colors;
+        colors.assign(pixels, Color());
+        for (int waveStart = 0; waveStart < job.numSamples; waveStart += wave_samples)
+        {
+            const int count = std::min(wave_samples, job.numSamples - waveStart);
+            scratch.paths.resize(pixels * count);
+            scratch.radiance.assign(pixels * count, Color());
+            scratch.active.clear();
+
+            // Camera rays, generated exactly as render_samples() does
+            for (int y = tile.y0; y < tile.y1; ++y)
+            {
+                for (int x = tile.x0; x < tile.x1; ++x)
+                {
+                    const size_t base = (static_cast<size_t>(y - tile.y0) * tileWidth + (x - tile.x0)) * count;
+                    const auto pixelIndex = static_cast<uint32_t>(y * job.width + x);
+                    const auto screenPoint = NDC_to_screen_space(raster_to_NDC(Vec2i{x, y}, job.width, job.height));
+                    get_pixels(screenPoint, sample_window(job.width, job.height), count, job.seed, pixelIndex,
+                               job.firstSample + waveStart, scratch.samples);
+                    for (int i = 0; i < count; ++i)
+                    {
+                        scratch.paths[base + i] = {job.camera.generateWorldRay(scratch.samples[i]), Vec3(1.f, 1.f, 1.f),
+                                                   Vec3(), pixelIndex, static_cast<uint32_t>(job.firstSample + waveStart + i),
+                                                   static_cast<uint32_t>(base + i)};
+                        scratch.active.push_back(static_cast<uint32_t>(base + i));
+                    }
+                }
+            }
+
+            // Camera rays are coherent already; the rays scattered from them are sorted or not as a whole
+            const bool sortWave = scratch.sortPolicy.sort_batch(scratch.active.size());
+            std::chrono::steady_clock::time_point secondaryStart;
+            size_t secondaryRays = 0;
+            for (int depth = 0; depth < Kernel::max_depth && !scratch.active.empty(); ++depth)
+            {
+                if (depth == 1)
+                    secondaryStart = std::chrono::steady_clock::now();
+                if (depth > 0)
+                {
+                    secondaryRays += scratch.active.size();
+                    if (sortWave)
+                        sort_active(scratch);
+                }
+                scratch.next.clear();
+                for (const uint32_t index : scratch.active)
+                {
+                    auto &path = scratch.paths[index];
+                    const auto hit = job.kernel.intersect(path.ray);
+                    if (!hit)
+                    {
+                        scratch.radiance[path.slot] = path.throughput * background(path.ray);
+                        continue;
+                    }
+
+                    path.point = hit->rec.p;
+                    Sampler sampler(job.seed, path.pixelIndex, path.sample);
+                    sampler.start_bounce(depth + 1);
+                    std::visit(
+                        [&](const auto &material) {
+                            using Type = std::decay_t<decltype(material)>;
+                            constexpr size_t type = variant_index<Type, Material>();
+                            auto &batch = scratch.batches[type];
+                            float u = 0.f, v = 0.f;
+                            if constexpr (Type::random_dimensions > 0)
+                            {
+                                u = sampler.next();
+                                v = sampler.next();
+                            }
+                            const int lane = batch.add(path.ray, hit->rec, u, v);
+                            material.load_lane(batch, lane);
+                            scratch.lanePaths[type][lane] = index;
+                            if (batch.full())
+                                flush<type>(scratch);
+                        },
+                        materials[hit->material_id]);
+                }
+                flush_all(scratch, std::make_index_sequence<Scratch<Kernel>::material_types>());
+                std::swap(scratch.active, scratch.next);
+            }
+            // Paths still alive after max_depth bounces carry no light, as in trace()
+            if (secondaryRays > 0)
+                scratch.sortPolicy.record(sortWave, secondaryRays,
+                                          std::chrono::duration<double>(std::chrono::steady_clock::now() - secondaryStart).count());
+
+            for (size_t pixel = 0; pixel < pixels; ++pixel)
+                for (int i = 0; i < count; ++i)
+                    colors[pixel] += scratch.radiance[pixel * count + i];
+        }
+
+        for (int y = tile.y0; y < tile.y1; ++y)
+        {
+            for (int x = tile.x0; x < tile.x1; ++x)
+            {
+                const auto &color = colors[static_cast<size_t>(y - tile.y0) * tileWidth + (x - tile.x0)];
+                auto *pixelData = &job.out[y - tile.y0][x - tile.x0];
+                pixelData[0] = color.x;
+                pixelData[1] = color.y;
+                pixelData[2] = color.z;
+            }
+        }
+    }
+
+    template <class Kernel>
+    void render_tile_generic(const TileJob<Kernel> &job) { render_tile_body(job); }
+    template <class Kernel>
+    RT_TARGET_AVX2 void render_tile_avx2(const TileJob<Kernel> &job) { render_tile_body(job); }
+    template <class Kernel>
+    RT_TARGET_AVX512 void render_tile_avx512(const TileJob<Kernel> &job) { render_tile_body(job); }
+
+    template <class Kernel>
+    void render_tile(IsaLevel isa, const TileJob<Kernel> &job)
+    {
+        if (isa == IsaLevel::Avx512)
+            render_tile_avx512(job);
+        else if (isa == IsaLevel::Avx2)
+            render_tile_avx2(job);
+        else
+            render_tile_generic(job);
+    }
+} // namespace wavefront_detail
+
+// render_samples() with the wavefront bounce loop and batched material evaluation; same result
+template <class Kernel>
+RenderStats render_samples(const Camera& camera, const WavefrontShading<Kernel>& wavefront, Image<float, 3>& accum,
+                           int firstSample, int numSamples, uint64_t seed = default_seed, const RenderSettings& settings = {})
+{
+    if (wavefront.kernel.environment_map())
+        return render_samples(camera, wavefront.kernel, accum, firstSample, numSamples, seed, settings);
+
+    const int tileSize = settings.tileSize > 0 ? settings.tileSize : default_tile_size();
+    const auto tiles = make_tiles(accum.width, accum.height, tileSize, settings.order);
+    const auto workers = place_workers(std::max(1u, settings.threads), settings.pinThreads, settings.nodes);
+
+    std::optional<NodeReplicas<Kernel>> replicas;
+    if (settings.replicateScene)
+        replicas.emplace(wavefront.kernel, nodes_of(workers));
+
+    struct WorkerState
+    {
+        const Kernel *kernel;
+        Image<float, 3> tile;
+        std::unique_ptr<wavefront_detail::Scratch<Kernel>> scratch;
+    };
+    const auto &scene = wavefront.kernel;
+    const size_t sceneBytes = scene.acceleration().memory_bytes() +
+                              scene.primitive_table().size() * sizeof(typename Kernel::Primitive);
+    auto makeState = [&](const WorkerPlacement& placement) {
+        WorkerState state{replicas ? replicas->get(placement.node) : &wavefront.kernel, Image<float, 3>(tileSize, tileSize),
+                          std::make_unique<wavefront_detail::Scratch<Kernel>>()};
+        state.scratch->samples.reserve(wavefront_detail::wave_samples);
+        state.scratch->sortPolicy = RaySortPolicy(wavefront.sorting, sceneBytes);
+        return state;
+    };
+
+    std::atomic<uint64_t> rays{0};
+    std::atomic<uint64_t> sortedRays{0};
+    const IsaLevel isa = active_isa();
+    numa_parallel_for(workers, tiles.size(), makeState, [&](size_t tileIndex, WorkerState& state) {
+        if (settings.cancelled())
+            return;
+        const auto &tile = tiles[tileIndex];
+        const auto raysBefore = traced_rays;
+        const wavefront_detail::TileJob<Kernel> job{camera, *state.kernel, tile, accum.width, accum.height,
+                                                    firstSample, numSamples, seed, state.tile, *state.scratch};
+        wavefront_detail::render_tile(isa, job);
+        render_detail::add_tile(tile, state.tile, accum);
+        rays.fetch_add(traced_rays - raysBefore, std::memory_order_relaxed);
+        sortedRays.fetch_add(std::exchange(state.scratch->sortedRays, 0), std::memory_order_relaxed);
+    });
+
+    RenderStats stats{rays.load(), isa};
+    stats.sortedRays = sortedRays.load();
+    return stats;
+}